@@ -0,0 +1,148 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Lists a session archive (Photobooth/HandLoad -archive) or turns it back
+// into the separate files a session without -archive would have written.
+//
+//   ArchiveExtract [-list] [-dir path] [-format fmt] [-fly n]
+//                  [-camera name] <archive>
+//
+// BGR frames become <dir>/<camera>NNN.png; raw frames become
+// <dir>/<camera>NNN.bayer.png plus the .yml that Debayer reads. A frame
+// cropped to the fly gets a .yml either way, saying where the crop was,
+// and thumbnails become <dir>/<camera>NNN.thumb.png.
+//
+//   -list    Print the records instead of extracting them.
+//   -dir     Where to write (default: images).
+//   -format  Output format (see ImageFormat.h); png or tiff for raw frames.
+//   -fly, -camera
+//            Only the frames of this fly / camera.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include "opencv2/core/core.hpp"
+
+#include "SessionArchive.h"
+#include "RawImage.h"
+#include "ImageFormat.h"
+
+using namespace cv;
+using namespace std;
+
+static const char *encodingName(uint32_t encoding)
+{
+  if ( encoding == ArchivePixels ) return "pixels";
+  if ( encoding >= ArchivePNG && encoding <= ArchiveQOI ) {
+    return formatExtension((ImageFormat)(encoding - 1)) + 1;
+  }
+  return "?";
+}
+
+int main(int argc, char **argv)
+{
+  bool list = false;
+  string dir = "images";
+  OutputFormat format;
+  int fly = -1;
+  const char *camera = NULL;
+  const char *path = NULL;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-list") == 0 ) {
+      list = true;
+    } else if ( strcmp(argv[i], "-dir") == 0 && i + 1 < argc ) {
+      dir = argv[++i];
+    } else if ( strcmp(argv[i], "-fly") == 0 && i + 1 < argc ) {
+      fly = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-camera") == 0 && i + 1 < argc ) {
+      camera = argv[++i];
+    } else if ( strcmp(argv[i], "-format") == 0 && i + 1 < argc &&
+                parseOutputFormat(argv[i + 1], format) ) {
+      i++;
+    } else if ( argv[i][0] != '-' && path == NULL ) {
+      path = argv[i];
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+  if ( path == NULL ) {
+    printf("Usage: %s [-list] [-dir path] [-format fmt] [-fly n] "
+           "[-camera name] <archive>\n"
+           "  fmt: %s\n", argv[0], outputFormatUsage);
+    return 1;
+  }
+
+  ArchiveReader reader;
+  if ( reader.open(path) != 0 ) return 1;
+  if ( reader.recovered() ) {
+    printf("%s wasn't closed; found %d frames by scanning it.\n", path,
+      reader.records());
+  }
+  if ( !list ) mkdir(dir.c_str(), 0755);
+
+  int written = 0, failed = 0;
+  for ( int i = 0; i < reader.records(); i++ ) {
+    const ArchiveRecord &r = reader.record(i);
+    RawMetadata meta = reader.metadata(i);
+    if ( fly >= 0 && meta.fly != fly ) continue;
+    if ( camera != NULL && meta.camera != camera ) continue;
+
+    if ( list ) {
+      printf("fly %3d  %-6s %4d  %ux%u x%u  %-8s %-6s %9.1f KB  %llu us\n",
+        meta.fly, meta.camera.c_str(), meta.frameIndex, r.width, r.height,
+        r.channels, meta.pixelFormat.c_str(), encodingName(r.encoding),
+        r.payloadBytes / 1024.0, meta.hostUs);
+      if ( meta.sharpness >= 0 ) printf("    sharpness %.1f\n", meta.sharpness);
+      if ( reader.kind(i) == ArchiveThumbnail ) {
+        printf("    thumbnail of %dx%d\n", meta.frameWidth, meta.frameHeight);
+      } else if ( meta.frameWidth > 0 ) {
+        printf("    crop at (%d, %d) of %dx%d\n", meta.cropX, meta.cropY,
+          meta.frameWidth, meta.frameHeight);
+      }
+      continue;
+    }
+
+    Mat img;
+    if ( reader.image(i, img) != 0 ) {
+      printf("Couldn't decode record %d (%s %d).\n", i, meta.camera.c_str(),
+        meta.frameIndex);
+      failed++;
+      continue;
+    }
+    char basename[300];
+    snprintf(basename, sizeof(basename), "%s/%s%03d", dir.c_str(),
+      meta.camera.c_str(), meta.frameIndex);
+    string out;
+    int status;
+    if ( reader.kind(i) == ArchiveThumbnail ) {
+      status = writeImage(string(basename) + ".thumb", img, format, out);
+    } else if ( img.channels() == 1 ) {
+      if ( !formatKeepsRaw(format.format) ) {
+        printf("Raw frames can only be stored as png or tiff.\n");
+        return 1;
+      }
+      status = writeImage(string(basename) + ".bayer", img, format, out);
+      if ( status == 0 ) status = writeRawMetadata(string(basename) + ".yml", meta);
+    } else {
+      status = writeImage(basename, img, format, out);
+      if ( status == 0 && meta.frameWidth > 0 ) {
+        status = writeRawMetadata(string(basename) + ".yml", meta);
+      }
+    }
+    if ( status != 0 ) {
+      printf("Failed to write %s.\n", basename);
+      failed++;
+    } else {
+      written++;
+    }
+  }
+
+  if ( !list ) printf("%d frames written to %s.\n", written, dir.c_str());
+  if ( failed ) printf("%d frames failed.\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,414 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <functional>
+#include <sstream>
+
+#include "BoothDaemon.h"
+#include "Trace.h"
+
+using namespace std;
+
+static const char *opNames[] = { "load", "capture", "pump" };
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+  stopRequested = 1;
+}
+
+BoothDaemon::BoothDaemon(const vector<Station *> &stations) :
+  stopping(false), startUs(monotonicUs())
+{
+  for ( size_t i = 0; i < stations.size(); i++ ) {
+    Booth *b = new Booth;
+    b->station = stations[i];
+    b->busy = NULL;
+    // The gates were reset at startup. A fly left over from before is
+    // the client's to pump out.
+    b->chamber = ChamberEmpty;
+    b->failed = false;
+    b->flies = b->frames = b->kept = 0;
+    booths.push_back(unique_ptr<Booth>(b));
+  }
+}
+
+BoothDaemon::~BoothDaemon()
+{
+  {
+    lock_guard<mutex> l(lock);
+    stopping = true;
+  }
+  queued.notify_all();
+  for ( size_t i = 0; i < booths.size(); i++ ) {
+    if ( booths[i]->worker.joinable() ) booths[i]->worker.join();
+  }
+}
+
+static const char *boothName(const Station &s)
+{
+  return s.name().empty() ? "booth" : s.name().c_str();
+}
+
+BoothDaemon::Booth *BoothDaemon::findBooth(const string &name)
+{
+  for ( size_t i = 0; i < booths.size(); i++ ) {
+    if ( name == boothName(*booths[i]->station) ) return booths[i].get();
+  }
+  return NULL;
+}
+
+// A client that has gone away just doesn't get its reply; one that stops
+// reading gets it dropped after the 2 s send timeout. Replies are never
+// sent with the daemon's lock held, so a slow client doesn't hold up the
+// stations' workers. It does hold up the poll loop, which sends errors
+// and status replies itself and needs the client's lock to queue: no
+// line from any client is read until that send gives up.
+void BoothDaemon::reply(const shared_ptr<Client> &client, const string &text)
+{
+  lock_guard<mutex> l(client->lock);
+  sendLine(*client, text);
+}
+
+// Called with client.lock held.
+void BoothDaemon::sendLine(Client &client, const string &text)
+{
+  if ( client.fd < 0 ) return;
+  string line = text + "\n";
+  if ( send(client.fd, line.data(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size() ) {
+    printf("Daemon: a client missed a reply: %s\n", text.c_str());
+  }
+}
+
+// Called with the lock held.
+void BoothDaemon::describe(const Booth &b, bool stats, string &out)
+{
+  const char *name = boothName(*b.station);
+  char line[256];
+  if ( !stats ) {
+    static const char *chambers[] = { "empty", "loaded", "imaged" };
+    snprintf(line, sizeof(line), "%s chamber=%s busy=%s queued=%d flies=%d "
+      "frames=%d kept=%d state=%s", name, chambers[b.chamber],
+      b.busy != NULL ? b.busy : "-", (int)b.queue.size(), b.flies, b.frames,
+      b.kept, b.failed ? "failed" : "ok");
+    out += line;
+    return;
+  }
+  for ( int op = 0; op < nOps; op++ ) {
+    const StageTimer &t = b.took[op], &w = b.waited[op];
+    snprintf(line, sizeof(line), "%s%s %s n=%lu avg_ms=%.1f max_ms=%.1f "
+      "queued_avg_ms=%.1f queued_max_ms=%.1f", op > 0 ? "\n" : "", name,
+      opNames[op], t.count, t.count ? t.totalUs / 1000.0 / t.count : 0.0,
+      t.maxUs / 1000.0, w.count ? w.totalUs / 1000.0 / w.count : 0.0,
+      w.maxUs / 1000.0);
+    out += line;
+  }
+}
+
+void BoothDaemon::handleLine(const shared_ptr<Client> &client, const string &line)
+{
+  istringstream in(line);
+  vector<string> words;
+  string w;
+  while ( in >> w ) words.push_back(w);
+  if ( words.empty() ) return;
+  const string &id = words[0];
+  if ( words.size() < 2 ) {
+    reply(client, id + " error expected: ID command [station]");
+    return;
+  }
+  const string &cmd = words[1];
+
+  // The station, unless there's only one to choose from.
+  size_t next = 2;
+  Booth *b = NULL;
+  if ( next < words.size() && (b = findBooth(words[next])) != NULL ) next++;
+  if ( b == NULL && booths.size() == 1 ) b = booths[0].get();
+
+  if ( cmd == "status" || cmd == "stats" ) {
+    if ( next < words.size() ) {
+      reply(client, id + " error no station " + words[next]);
+      return;
+    }
+    string out;
+    {
+      lock_guard<mutex> l(lock);
+      for ( size_t i = 0; i < booths.size(); i++ ) {
+        if ( b != NULL && b != booths[i].get() ) continue;
+        string text;
+        describe(*booths[i], cmd == "stats", text);
+        // One reply line per line of text.
+        size_t start = 0;
+        while ( start <= text.size() ) {
+          size_t end = text.find('\n', start);
+          if ( end == string::npos ) end = text.size();
+          out += id + " . " + text.substr(start, end - start) + "\n";
+          start = end + 1;
+        }
+      }
+    }
+    char uptime[64];
+    snprintf(uptime, sizeof(uptime), "ok uptime_s=%.0f",
+      (monotonicUs() - startUs) / 1e6);
+    out += id + " " + uptime;
+    reply(client, out);
+    return;
+  }
+
+  Command c;
+  c.id = id;
+  c.byHand = false;
+  c.client = client;
+  if ( cmd == "load" ) c.op = OpLoad;
+  else if ( cmd == "capture" ) c.op = OpCapture;
+  else if ( cmd == "pump" ) c.op = OpPump;
+  else {
+    reply(client, id + " error unknown command " + cmd +
+          "; use load, capture, pump, status or stats");
+    return;
+  }
+  if ( c.op == OpLoad && next < words.size() && words[next] == "hand" ) {
+    c.byHand = true;
+    next++;
+  }
+  if ( b == NULL ) {
+    reply(client, id + " error which station?");
+    return;
+  }
+  if ( next < words.size() ) {
+    reply(client, id + " error didn't expect " + words[next]);
+    return;
+  }
+  if ( c.op == OpLoad && !c.byHand && !b->station->hasDispenser() ) {
+    reply(client, id + " error no dispenser; use load hand");
+    return;
+  }
+
+  // The client's lock is taken before the command is queued and kept
+  // until the queued reply is sent, so the worker's answer, which needs
+  // it too, always comes after. It's taken before the daemon's lock, so
+  // a worker stuck sending to this client keeps only this line waiting,
+  // not every worker that needs the daemon's lock.
+  lock_guard<mutex> cl(client->lock);
+  unique_lock<mutex> l(lock);
+  if ( b->failed ) {
+    l.unlock();
+    sendLine(*client, id + " error station stopped after a hardware error");
+    return;
+  }
+  int ahead = b->queue.size() + (b->busy != NULL ? 1 : 0);
+  c.queuedUs = monotonicUs();
+  b->queue.push_back(c);
+  queued.notify_all();
+  l.unlock();
+  char text[32];
+  snprintf(text, sizeof(text), " queued %d", ahead);
+  sendLine(*client, id + text);
+}
+
+StepResult BoothDaemon::execute(Booth &b, const Command &c, string &detail)
+{
+  TraceSpan span("command", -1, opNames[c.op]);
+  switch ( c.op ) {
+  case OpLoad:    return b.station->loadFly(c.byHand, detail);
+  case OpCapture: return b.station->captureNext(detail);
+  default:        return b.station->pumpOut(detail);
+  }
+}
+
+// One station's worker: its commands one at a time, in the order they
+// came.
+void BoothDaemon::serve(Booth &b)
+{
+  traceThreadName(("daemon " + string(boothName(*b.station))).c_str());
+  unique_lock<mutex> l(lock);
+  for (;;) {
+    queued.wait(l, [this, &b]() { return stopping || !b.queue.empty(); });
+    if ( stopping ) break;
+    Command c = b.queue.front();
+    b.queue.pop_front();
+
+    // The chamber has to be ready for the command.
+    const char *why = NULL;
+    if ( b.failed ) why = "station stopped after a hardware error";
+    else if ( c.op == OpLoad && b.chamber != ChamberEmpty ) why = "chamber not empty; pump first";
+    else if ( c.op == OpCapture && b.chamber != ChamberLoaded ) why = "no new fly in the chamber";
+    if ( why != NULL ) {
+      l.unlock();
+      reply(c.client, c.id + " error " + why);
+      l.lock();
+      continue;
+    }
+
+    unsigned long long t0 = monotonicUs();
+    b.waited[c.op].add(t0 - c.queuedUs);
+    b.busy = opNames[c.op];
+    l.unlock();
+    string detail;
+    StepResult r = execute(b, c, detail);
+    l.lock();
+    b.busy = NULL;
+    b.took[c.op].add(monotonicUs() - t0);
+    b.flies = b.station->imaged();
+    b.frames = b.station->framesGrabbed();
+    b.kept = b.station->framesKept();
+
+    string text;
+    if ( r == StepFail ) {
+      b.failed = true;
+      text = c.id + " error " + detail;
+    } else if ( r == StepSkip ) {
+      text = c.id + " none " + detail;
+    } else {
+      if ( c.op == OpLoad ) b.chamber = ChamberLoaded;
+      else if ( c.op == OpCapture ) b.chamber = ChamberImaged;
+      else b.chamber = ChamberEmpty;
+      text = c.id + " ok" + (detail.empty() ? "" : " " + detail);
+    }
+    l.unlock();
+    reply(c.client, text);
+    l.lock();
+  }
+
+  // Whatever hadn't started won't now.
+  deque<Command> left;
+  left.swap(b.queue);
+  l.unlock();
+  for ( size_t i = 0; i < left.size(); i++ ) {
+    reply(left[i].client, left[i].id + " error daemon stopping");
+  }
+}
+
+int BoothDaemon::run(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen(path) >= sizeof(addr.sun_path) ) {
+    printf("Socket path %s is too long.\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ( listenFD < 0 ) {
+    perror("socket");
+    return -1;
+  }
+  // A socket left by a daemon that died can go; a live one can't.
+  if ( connect(listenFD, (struct sockaddr *)&addr, sizeof(addr)) == 0 ) {
+    printf("A daemon is already listening on %s.\n", path);
+    close(listenFD);
+    return -1;
+  }
+  unlink(path);
+  if ( bind(listenFD, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(listenFD, 8) != 0 ) {
+    perror(path);
+    close(listenFD);
+    return -1;
+  }
+
+  stopRequested = 0;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  for ( size_t i = 0; i < booths.size(); i++ ) {
+    booths[i]->worker = thread(&BoothDaemon::serve, this, ref(*booths[i]));
+  }
+  printf("Daemon listening on %s; SIGINT or SIGTERM stops it.\n", path);
+
+  vector<shared_ptr<Client> > clients;
+  while ( !stopRequested ) {
+    vector<struct pollfd> fds(1 + clients.size());
+    fds[0].fd = listenFD;
+    fds[0].events = POLLIN;
+    for ( size_t i = 0; i < clients.size(); i++ ) {
+      fds[i + 1].fd = clients[i]->fd;
+      fds[i + 1].events = POLLIN;
+    }
+    // Woken now and then to notice a signal.
+    if ( poll(&fds[0], fds.size(), 250) <= 0 ) continue;
+
+    if ( fds[0].revents & POLLIN ) {
+      int fd = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC);
+      if ( fd >= 0 ) {
+        struct timeval tv = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        shared_ptr<Client> c(new Client);
+        c->fd = fd;
+        clients.push_back(c);
+      }
+    }
+
+    for ( size_t i = 1; i < fds.size(); i++ ) {
+      if ( fds[i].revents == 0 ) continue;
+      shared_ptr<Client> c = clients[i - 1];
+      char buf[4096];
+      ssize_t n = recv(fds[i].fd, buf, sizeof(buf), 0);
+      if ( n > 0 ) {
+        c->pending.append(buf, n);
+        size_t nl;
+        while ( (nl = c->pending.find('\n')) != string::npos ) {
+          string line = c->pending.substr(0, nl);
+          c->pending.erase(0, nl + 1);
+          handleLine(c, line);
+        }
+        if ( c->pending.size() <= 4096 ) continue;
+        reply(c, "? error line too long");
+      } else if ( n < 0 && errno == EINTR ) {
+        continue;
+      }
+      // Gone (or misbehaving); replies still owed to it are dropped.
+      lock_guard<mutex> l(c->lock);
+      close(c->fd);
+      c->fd = -1;
+    }
+    for ( size_t i = clients.size(); i-- > 0; ) {
+      if ( clients[i]->fd < 0 ) clients.erase(clients.begin() + i);
+    }
+  }
+
+  printf("Daemon stopping; waiting for each station's current command.\n");
+  {
+    lock_guard<mutex> l(lock);
+    stopping = true;
+  }
+  queued.notify_all();
+  for ( size_t i = 0; i < booths.size(); i++ ) booths[i]->worker.join();
+  for ( size_t i = 0; i < clients.size(); i++ ) {
+    lock_guard<mutex> l(clients[i]->lock);
+    close(clients[i]->fd);
+    clients[i]->fd = -1;
+  }
+  close(listenFD);
+  unlink(path);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  return 0;
+}
+
+void BoothDaemon::printStats()
+{
+  lock_guard<mutex> l(lock);
+  printf("Daemon commands (time taken, then time queued):\n");
+  for ( size_t i = 0; i < booths.size(); i++ ) {
+    const Booth &b = *booths[i];
+    for ( int op = 0; op < nOps; op++ ) {
+      if ( b.took[op].count == 0 ) continue;
+      string name = string(boothName(*b.station)) + " " + opNames[op];
+      b.took[op].print(name.c_str());
+      b.waited[op].print((name + " wait").c_str());
+    }
+  }
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __BOOTHDAEMON_H__
+#define __BOOTHDAEMON_H__
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "PhotoFuncs.h"
+#include "Station.h"
+
+// Photobooth -daemon: the stations stay set up, serial ports open and
+// cameras configured, and do what they're told over a Unix domain socket
+// instead of running the fly cycle, so a scheduler can drive several
+// booths without paying for the startup each time.
+//
+// A client sends one command per line and gets lines back, each starting
+// with the ID the command was sent with (any word, so replies can be
+// matched to commands):
+//
+//   ID load [station] [hand]  shut a fly in the chamber; dispensed, or
+//                             put in through the open inlet by hand
+//   ID capture [station]      photograph the fly in the chamber
+//   ID pump [station]         pump the chamber out, ready for the next
+//   ID status [station]       what each station is doing
+//   ID stats [station]        how long each command has taken
+//
+// The station can be left out with only one. load, capture and pump
+// queue up for their station and are answered when they're done:
+//
+//   ID queued N               N commands ahead of it
+//   ID ok [key=value ...]     done
+//   ID none why               load: no fly came
+//   ID error message          not done; after a hardware error the
+//                             station takes no more commands
+//
+// Each station works through its queue on a thread of its own, so
+// stations run side by side. status and stats are answered at once, with
+// a line "ID . station key=value ..." per station and then "ID ok".
+// Commands arriving over several connections share the queues.
+//
+// Try it with e.g. socat - UNIX-CONNECT:/tmp/booth.sock. SIGINT or
+// SIGTERM stops the daemon once each station's current command is done;
+// queued commands are answered with an error.
+
+class BoothDaemon {
+public:
+  BoothDaemon(const std::vector<Station *> &stations);
+  ~BoothDaemon();
+
+  // Serve on a socket at path until stopped. Returns 0, or -1 if the
+  // socket couldn't be set up.
+  int run(const char *path);
+
+  // Per station and command: count, duration and time spent queued.
+  void printStats();
+
+private:
+  enum Op { OpLoad, OpCapture, OpPump, nOps };
+  enum Chamber { ChamberEmpty, ChamberLoaded, ChamberImaged };
+
+  struct Client {
+    int fd;
+    std::mutex lock;
+    std::string pending;   // a line still being received
+  };
+
+  struct Command {
+    std::string id;
+    Op op;
+    bool byHand;
+    std::shared_ptr<Client> client;
+    unsigned long long queuedUs;
+  };
+
+  struct Booth {
+    Station *station;
+    std::deque<Command> queue;
+    std::thread worker;
+    const char *busy;      // the command running, or NULL
+    Chamber chamber;
+    bool failed;
+    int flies, frames, kept;
+    StageTimer took[nOps], waited[nOps];
+  };
+
+  void serve(Booth &b);
+  StepResult execute(Booth &b, const Command &c, std::string &detail);
+  void handleLine(const std::shared_ptr<Client> &client, const std::string &line);
+  void describe(const Booth &b, bool stats, std::string &out);
+  Booth *findBooth(const std::string &name);
+  void reply(const std::shared_ptr<Client> &client, const std::string &text);
+  void sendLine(Client &client, const std::string &text);
+
+  std::vector<std::unique_ptr<Booth> > booths;
+  std::mutex lock;
+  std::condition_variable queued;
+  bool stopping;
+  unsigned long long startUs;
+};
+
+#endif // __BOOTHDAEMON_H__
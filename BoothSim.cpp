@@ -0,0 +1,75 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Stands in for the booth's serial devices so Photobooth and HandLoad can
+// run without the hardware attached.
+//
+//   BoothSim [-dir path] [simulator options]
+//
+// Creates <dir>/servo, <dir>/dispenser and <dir>/arduino (default
+// /tmp/booth), each a pty answering like the Maestro, the fly dispenser
+// and the Arduino, and serves them until Ctrl-C. Point the programs at
+// them with -servo, -dispenser and -arduino.
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "DeviceSim.h"
+
+using namespace std;
+
+static volatile sig_atomic_t quit = 0;
+
+static void onSignal(int)
+{
+  quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+  string dir = "/tmp/booth";
+  SimSetup setup;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-dir") == 0 && i + 1 < argc ) {
+      dir = argv[++i];
+    } else if ( !simOption(argc, argv, i, setup) ) {
+      printf("Usage: %s [-dir path] [options]\n%s", argv[0], simOptionsUsage);
+      return 1;
+    }
+  }
+
+  mkdir(dir.c_str(), 0755);
+  string servoPath = dir + "/servo";
+  string dispenserPath = dir + "/dispenser";
+  string arduinoPath = dir + "/arduino";
+
+  MaestroSim servo(setup.faults, setup.servoSpeed);
+  DispenserSim dispenser(setup.faults, setup.dispenseUs, setup.flies,
+                         setup.missRate);
+  ArduinoSim arduino(setup.faults, setup.stepUs);
+  if ( servo.start(servoPath.c_str()) != 0 ||
+       dispenser.start(dispenserPath.c_str()) != 0 ||
+       arduino.start(arduinoPath.c_str()) != 0 ) {
+    return 1;
+  }
+
+  printf("Run e.g.: ./Photobooth -servo %s -dispenser %s -arduino %s\n",
+    servoPath.c_str(), dispenserPath.c_str(), arduinoPath.c_str());
+  printf("Ctrl-C to stop.\n");
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  while ( !quit ) pause();
+
+  printf("\nSimulator stats:\n");
+  servo.printStats();
+  dispenser.printStats();
+  arduino.printStats();
+  return 0;
+}
@@ -0,0 +1,303 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PhotoFuncs.h"
+#include "PylonSource.h"
+#include "CameraSettings.h"
+
+using namespace Pylon;
+using namespace GenApi;
+using namespace std;
+
+// Features compared when the cache says a camera is already set up:
+// ones that would spoil every frame if someone had changed them.
+static const char *spotChecks[] = {
+  "PixelFormat", "Width", "Height", "ExposureTime"
+};
+
+int readCameraSettings(const char *path, CameraSettings &s)
+{
+  FILE *fp = fopen(path, "r");
+  if ( fp == NULL ) {
+    perror(path);
+    return -1;
+  }
+  s.path = path;
+  s.features.clear();
+
+  // "Name<TAB>Value" per line. The fingerprint is FNV-1a over the
+  // features only, so comments and line endings don't change it.
+  unsigned long long h = 14695981039346656037ULL;
+  char line[512], name[128], value[256];
+  while ( fgets(line, sizeof(line), fp) != NULL ) {
+    if ( line[0] == '#' ) continue;
+    if ( sscanf(line, "%127s %255[^\r\n]", name, value) != 2 ) continue;
+    CameraFeature f;
+    f.name = name;
+    f.value = value;
+    s.features.push_back(f);
+    string text = f.name + "\t" + f.value + "\n";
+    for ( size_t i = 0; i < text.size(); i++ ) {
+      h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+  }
+  fclose(fp);
+  s.fingerprint = h;
+  if ( s.features.empty() ) {
+    printf("%s: no features.\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int SettingsCache::load(const string &p)
+{
+  lock_guard<mutex> l(lock);
+  path = p;
+  entries.clear();
+  FILE *fp = fopen(path.c_str(), "r");
+  if ( fp == NULL ) return 0;
+  char line[256], serial[128];
+  Entry e;
+  while ( fgets(line, sizeof(line), fp) != NULL ) {
+    if ( line[0] == '#' ) continue;
+    if ( sscanf(line, "%127s %llx %llu %llu", serial, &e.fingerprint, &e.ticks,
+                &e.hostUs) != 4 ) {
+      continue;
+    }
+    entries[serial] = e;
+  }
+  fclose(fp);
+  return 0;
+}
+
+// The camera's clock must have advanced by the host time elapsed since
+// the record, give or take CLOCK_SLACK_US plus CLOCK_PPM of it (latch
+// latency, crystal drift). A camera powered off meanwhile is behind by at
+// least its uptime at the record, so that has to be more than the slack.
+#define CLOCK_SLACK_US  1000000.0
+#define CLOCK_PPM       100.0
+
+bool SettingsCache::current(const string &serial, unsigned long long fingerprint,
+                            unsigned long long ticks,
+                            unsigned long long ticksPerSecond,
+                            unsigned long long hostUs)
+{
+  lock_guard<mutex> l(lock);
+  map<string, Entry>::const_iterator i = entries.find(serial);
+  if ( i == entries.end() ) return false;
+  const Entry &e = i->second;
+  // A clock reading of 0 means the camera couldn't latch it, and then
+  // there's no telling whether it has been powered off.
+  if ( e.fingerprint != fingerprint || e.ticks == 0 || ticks < e.ticks ||
+       ticksPerSecond == 0 || hostUs < e.hostUs ) {
+    return false;
+  }
+  double cameraUs = (ticks - e.ticks) * 1e6 / ticksPerSecond;
+  double hostElapsedUs = hostUs - e.hostUs;
+  double slack = CLOCK_SLACK_US + hostElapsedUs * CLOCK_PPM * 1e-6;
+  double uptimeUs = e.ticks * 1e6 / ticksPerSecond;
+  return uptimeUs > slack && fabs(cameraUs - hostElapsedUs) <= slack;
+}
+
+int SettingsCache::record(const string &serial, unsigned long long fingerprint,
+                          unsigned long long ticks, unsigned long long hostUs)
+{
+  lock_guard<mutex> l(lock);
+  Entry e;
+  e.fingerprint = fingerprint;
+  e.ticks = ticks;
+  e.hostUs = hostUs;
+  entries[serial] = e;
+  return save();
+}
+
+void SettingsCache::forget(const string &serial)
+{
+  lock_guard<mutex> l(lock);
+  if ( entries.erase(serial) ) save();
+}
+
+// Called with the lock held. It's only a cache, so a crash halfway
+// costs a full comparison next time; the rename keeps it readable.
+int SettingsCache::save()
+{
+  if ( path.empty() ) return 0;
+  string tmp = path + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if ( fp == NULL ) {
+    perror(tmp.c_str());
+    return -1;
+  }
+  fprintf(fp, "# Camera settings applied by HandLoad/Photobooth; see CameraSettings.h.\n");
+  fprintf(fp, "# serial  fingerprint  camera clock  host clock (us since 1970)\n");
+  map<string, Entry>::const_iterator i;
+  for ( i = entries.begin(); i != entries.end(); ++i ) {
+    fprintf(fp, "%s %016llx %llu %llu\n", i->first.c_str(),
+      i->second.fingerprint, i->second.ticks, i->second.hostUs);
+  }
+  if ( fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0 ) {
+    perror(path.c_str());
+    unlink(tmp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+SettingsReport::SettingsReport() :
+  cached(false), checked(0), written(0), failed(0), missing(0), us(0) { }
+
+// Numbers as the file writes them (5 decimals) and as the camera reports
+// them (rounded to its increments) are the same if they're close enough.
+static bool sameValue(const string &current, const string &wanted)
+{
+  if ( current == wanted ) return true;
+  char *end1, *end2;
+  double a = strtod(current.c_str(), &end1);
+  double b = strtod(wanted.c_str(), &end2);
+  if ( end1 == current.c_str() || *end1 != 0 || end2 == wanted.c_str() || *end2 != 0 ) {
+    return false;
+  }
+  return fabs(a - b) <= 1e-3 * fmax(1.0, fabs(b));
+}
+
+// Wall-clock time, which unlike monotonicUs() carries on across host
+// reboots, as the cache file does.
+static unsigned long long wallClockUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool isSelector(const string &name)
+{
+  return name.size() > 8 && name.compare(name.size() - 8, 8, "Selector") == 0;
+}
+
+// Compare one feature and set it if it differs; label is how to name it
+// in the report. Returns 0, 1 if it was written, 2 if the camera doesn't
+// have it (or not now), or -1.
+static int applyFeature(INodeMap &nodemap, const CameraFeature &f,
+                        const string &label, SettingsReport &r)
+{
+  try {
+    CValuePtr node(nodemap.GetNode(f.name.c_str()));
+    if ( !node || !IsReadable(node) ) return 2;
+    string current = node->ToString().c_str();
+    if ( sameValue(current, f.value) ) return 0;
+    if ( !IsWritable(node) ) {
+      r.differed.push_back(label + ": " + current + " -> " + f.value +
+                           " (read-only)");
+      return -1;
+    }
+    node->FromString(f.value.c_str());
+    // Selectors change as the file goes along; that isn't a difference.
+    if ( isSelector(f.name) ) return 0;
+    r.differed.push_back(label + ": " + current + " -> " + f.value);
+    return 1;
+  } catch (const GenericException &e) {
+    r.differed.push_back(label + ": couldn't set " + f.value + " (" +
+                         e.GetDescription() + ")");
+    return -1;
+  }
+}
+
+int applyCameraSettings(CInstantCamera &camera, const CameraSettings &s,
+                        SettingsCache *cache, bool full, SettingsReport &r)
+{
+  unsigned long long t0 = monotonicUs();
+  r = SettingsReport();
+  string serial;
+  unsigned long long ticks = 0, hostUs = 0;
+  INodeMap *nodemap;
+  try {
+    serial = camera.GetDeviceInfo().GetSerialNumber().c_str();
+    nodemap = &camera.GetNodeMap();
+  } catch (const GenericException &e) {
+    printf("Couldn't read the camera: %s\n", e.GetDescription());
+    return -1;
+  }
+  if ( cache != NULL ) {
+    if ( pylonLatchClock(camera, ticks) != 0 ) ticks = 0;
+    hostUs = wallClockUs();
+  }
+
+  if ( cache != NULL && !full && !serial.empty() &&
+       cache->current(serial, s.fingerprint, ticks, pylonClockHz(*nodemap), hostUs) ) {
+    bool match = true;
+    for ( const char *name : spotChecks ) {
+      // The value the file leaves it at is its last line for it.
+      const CameraFeature *f = NULL;
+      for ( size_t i = 0; i < s.features.size(); i++ ) {
+        if ( s.features[i].name == name ) f = &s.features[i];
+      }
+      if ( f == NULL ) continue;
+      r.checked++;
+      try {
+        CValuePtr node(nodemap->GetNode(name));
+        if ( node && IsReadable(node) &&
+             !sameValue(node->ToString().c_str(), f->value) ) {
+          match = false;
+        }
+      } catch (const GenericException &e) {
+        match = false;
+      }
+    }
+    if ( match ) {
+      r.cached = true;
+      r.us = monotonicUs() - t0;
+      return 0;
+    }
+    r.checked = 0;
+  }
+
+  for ( size_t i = 0; i < s.features.size(); i++ ) {
+    // A feature right after a selector is named with its selection,
+    // e.g. BalanceRatio[Red].
+    const CameraFeature &f = s.features[i];
+    string label = f.name;
+    if ( i > 0 && isSelector(s.features[i-1].name) ) {
+      label += "[" + s.features[i-1].value + "]";
+    }
+    r.checked++;
+    switch ( applyFeature(*nodemap, f, label, r) ) {
+    case 1:  r.written++; break;
+    case 2:  r.missing++; break;
+    case -1: r.failed++;  break;
+    default: break;
+    }
+  }
+  r.us = monotonicUs() - t0;
+
+  if ( cache != NULL && !serial.empty() ) {
+    if ( r.failed == 0 ) cache->record(serial, s.fingerprint, ticks, hostUs);
+    else cache->forget(serial);
+  }
+  return r.failed == 0 ? 0 : -1;
+}
+
+void printSettingsReport(const char *who, const char *camera,
+                         const CameraSettings &s, const SettingsReport &r)
+{
+  if ( r.cached ) {
+    printf("%s%s camera matches %s (cached; %d spot checks in %.1f ms).\n",
+      who, camera, s.path.c_str(), r.checked, r.us / 1000.0);
+    return;
+  }
+  printf("%s%s camera: %d features of %s checked, %d set, %d not available",
+    who, camera, r.checked, s.path.c_str(), r.written, r.missing);
+  if ( r.failed ) printf(", %d FAILED", r.failed);
+  printf(", in %.1f ms.\n", r.us / 1000.0);
+  for ( size_t i = 0; i < r.differed.size(); i++ ) {
+    printf("%s    %s\n", who, r.differed[i].c_str());
+  }
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __CAMERASETTINGS_H__
+#define __CAMERASETTINGS_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <pylon/PylonIncludes.h>
+
+// Puts a camera features file (.pfs, as Pylon Viewer saves it, e.g.
+// AceFlashSettings.pfs) on the cameras at startup, so both cameras always
+// match it.
+//
+// CFeaturePersistence::Load writes every feature in the file, each a
+// round trip over USB. Here each feature is read first and only written
+// if it differs; reads are cheaper, and usually only a handful differ.
+// Selector lines (GainSelector, ...) are set like any other feature, so
+// the features after them are read and written for the right selection.
+//
+// Once a camera matches, its serial number is recorded in a cache with a
+// fingerprint of the file, the camera's clock and the host's. Next time,
+// if the file is the same and the camera hasn't been powered off since,
+// a few spot checks replace the whole comparison. The camera clock starts
+// at zero at power-up, so it has only kept running if it has gone forward
+// by as much as the host clock has; after a power cycle it is behind by
+// at least the uptime it had when recorded. Something else changing
+// other features in between (Pylon Viewer) isn't noticed then;
+// -fullconfig compares everything regardless.
+
+struct CameraFeature {
+  std::string name, value;
+};
+
+struct CameraSettings {
+  std::string path;
+  std::vector<CameraFeature> features;   // in file order
+  unsigned long long fingerprint;        // of the features
+
+  CameraSettings() : fingerprint(0) { }
+};
+
+// Returns 0, or -1 if the file can't be read or has no features.
+int readCameraSettings(const char *path, CameraSettings &s);
+
+// Cameras the settings were last applied to, by serial number, kept in a
+// small text file. Shared by every camera; safe to use from several
+// threads.
+class SettingsCache {
+public:
+  // A missing file is an empty cache. Returns 0, or -1 if it can't be
+  // read.
+  int load(const std::string &path);
+
+  // Whether camera serial had settings with this fingerprint applied
+  // earlier in its current power-up, its clock (ticksPerSecond) reading
+  // ticks at wall-clock time hostUs.
+  bool current(const std::string &serial, unsigned long long fingerprint,
+               unsigned long long ticks, unsigned long long ticksPerSecond,
+               unsigned long long hostUs);
+  // Record an apply and rewrite the file. Returns 0 or -1.
+  int record(const std::string &serial, unsigned long long fingerprint,
+             unsigned long long ticks, unsigned long long hostUs);
+  // Forget a camera, e.g. after its apply failed.
+  void forget(const std::string &serial);
+
+private:
+  struct Entry {
+    unsigned long long fingerprint, ticks, hostUs;
+  };
+  int save();
+
+  std::string path;
+  std::map<std::string, Entry> entries;
+  std::mutex lock;
+};
+
+// What applying the settings to one camera found.
+struct SettingsReport {
+  bool cached;                       // spot checks only
+  int checked, written, failed, missing;
+  unsigned long long us;
+  std::vector<std::string> differed; // "Name: camera -> file" per feature
+
+  SettingsReport();
+};
+
+// Bring camera (open) in line with s, consulting and updating cache
+// unless it is NULL or full is set. Returns 0 if the camera now matches,
+// or -1 if a feature couldn't be read or set.
+int applyCameraSettings(Pylon::CInstantCamera &camera, const CameraSettings &s,
+                        SettingsCache *cache, bool full, SettingsReport &r);
+
+// One line for the camera, and a line per feature that differed.
+void printSettingsReport(const char *who, const char *camera,
+                         const CameraSettings &s, const SettingsReport &r);
+
+#endif // __CAMERASETTINGS_H__
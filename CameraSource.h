@@ -0,0 +1,73 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __CAMERASOURCE_H__
+#define __CAMERASOURCE_H__
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include "RawImage.h"
+
+// One grabbed frame, wherever it came from. The pixels stay valid for as
+// long as any copy of the Frame holds `owner` (for a Pylon camera that
+// is the grab buffer, which goes back to the camera when released).
+struct Frame {
+  const uint8_t *data;
+  int width, height;
+  int stride;                 // bytes per row
+  std::string pixelFormat;    // e.g. "BayerBG8"
+  unsigned long long cameraTicks;
+  std::shared_ptr<const void> owner;
+
+  Frame() : data(NULL), width(0), height(0), stride(0), cameraTicks(0) { }
+  void release() { owner.reset(); data = NULL; }
+};
+
+// What starts each frame: the camera's own frame rate, a command from
+// the host (fireTrigger()), or a pulse on the camera's trigger input
+// (line 1, wired to the Arduino).
+enum TriggerMode { TriggerFree, TriggerSoftware, TriggerLine };
+
+// Something that produces frames: a Basler camera (PylonSource.h) or the
+// synthetic generator (SyntheticSource.h). The grab engine and capture
+// pipeline only see this interface, so everything after the grab can run
+// without cameras attached.
+class CameraSource {
+public:
+  virtual ~CameraSource() { }
+
+  // Start delivering nFrames frames. Returns 0, or -1 on error.
+  virtual int startGrabbing(int nFrames) = 0;
+  // True until every frame of the current start has been retrieved.
+  virtual bool isGrabbing() = 0;
+  // Wait up to timeoutMs for the next frame. Returns 0 with frame filled
+  // in, 1 if a frame was lost (already reported; keep going), or -1 on a
+  // timeout or camera error.
+  virtual int retrieve(int timeoutMs, Frame &frame) = 0;
+  virtual void stopGrabbing() = 0;
+
+  // Fill in what raw frames are stored with: pixel format, white balance,
+  // exposure, gain. Returns 0, or -1 on error.
+  virtual int readSettings(RawMetadata &meta) = 0;
+
+  // Set what starts each frame; takes effect from the next start.
+  // Returns 0, or -1 if the camera can't be triggered that way.
+  virtual int setTrigger(TriggerMode mode) = 0;
+  // Software mode: wait until the camera can take a trigger, then start
+  // one frame. hostUs is set to when the trigger went (monotonicUs()).
+  // Returns 0, or -1 if the camera wasn't ready within timeoutMs.
+  virtual int fireTrigger(int timeoutMs, unsigned long long &hostUs) = 0;
+  // Line mode: n pulses were sent to the trigger input, the first at
+  // firstUs and then every intervalUs. A camera sees them for itself;
+  // the synthetic one starts its frames from this.
+  virtual void pulsesSent(int n, unsigned long long firstUs, int intervalUs) { }
+  // Read the camera's timestamp counter (same clock as
+  // Frame::cameraTicks) and how many times a second it ticks. Returns 0,
+  // or -1 if the camera can't.
+  virtual int latchClock(unsigned long long &ticks, unsigned long long &hz) = 0;
+};
+
+#endif // __CAMERASOURCE_H__
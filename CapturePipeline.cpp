@@ -0,0 +1,332 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <iostream>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "Demosaic.h"
+#include "Trace.h"
+
+using namespace cv;
+using namespace std;
+
+CapturePipeline::CapturePipeline(int nWorkers, int maxQueued) :
+  captureMode(CaptureBGR), archive(NULL), maxQueued(maxQueued), busy(0),
+  stopping(false), failed(0), noFly(0), nextSeq(0)
+{
+  if ( nWorkers < 1 ) nWorkers = 1;
+  if ( this->maxQueued < 1 ) this->maxQueued = 1;
+  for ( int i = 0; i < nWorkers; i++ ) {
+    workers.push_back(thread(&CapturePipeline::workerLoop, this));
+  }
+}
+
+CapturePipeline::~CapturePipeline()
+{
+  {
+    unique_lock<mutex> l(lock);
+    stopping = true;
+  }
+  notEmpty.notify_all();
+  for ( size_t i = 0; i < workers.size(); i++ ) {
+    workers[i].join();
+  }
+}
+
+void CapturePipeline::setMode(CaptureMode m)
+{
+  lock_guard<mutex> l(lock);
+  captureMode = m;
+}
+
+CaptureMode CapturePipeline::mode()
+{
+  lock_guard<mutex> l(lock);
+  return captureMode;
+}
+
+void CapturePipeline::setFormat(const OutputFormat &f)
+{
+  lock_guard<mutex> l(lock);
+  outputFormat = f;
+}
+
+OutputFormat CapturePipeline::format()
+{
+  lock_guard<mutex> l(lock);
+  return outputFormat;
+}
+
+void CapturePipeline::setArchive(SessionArchive *a)
+{
+  lock_guard<mutex> l(lock);
+  archive = a;
+}
+
+void CapturePipeline::setDetector(const string &camera,
+                                  const FlyDetector *detector)
+{
+  lock_guard<mutex> l(lock);
+  if ( detector != NULL ) detectors[camera] = detector;
+  else detectors.erase(camera);
+}
+
+void CapturePipeline::submit(const Frame &frame, const string &basename,
+                             const RawMetadata &meta)
+{
+  unsigned long long t0 = monotonicUs();
+
+  unique_lock<mutex> l(lock);
+  while ( (int)queue.size() >= maxQueued ) {
+    notFull.wait(l);
+  }
+
+  Job job;
+  job.frame = frame;
+  job.basename = basename;
+  job.mode = captureMode;
+  job.format = outputFormat;
+  job.archive = archive;
+  map<string, const FlyDetector *>::const_iterator d = detectors.find(meta.camera);
+  job.detector = d == detectors.end() ? NULL : d->second;
+  job.meta = meta;
+  job.queuedAt = monotonicUs();
+  job.seq = nextSeq++;
+  submitWait.add(job.queuedAt - t0);
+  queue.push_back(job);
+
+  l.unlock();
+  notEmpty.notify_one();
+}
+
+void CapturePipeline::waitIdle()
+{
+  unique_lock<mutex> l(lock);
+  while ( !queue.empty() || busy > 0 ) {
+    idle.wait(l);
+  }
+}
+
+void CapturePipeline::whenWritten(function<void()> fn)
+{
+  unique_lock<mutex> l(lock);
+  Checkpoint c;
+  c.seq = nextSeq;
+  c.fn = fn;
+  checkpoints.push_back(c);
+  runCheckpoints(l);
+}
+
+// Sequence number of the oldest job not yet finished. Call with lock held.
+unsigned long long CapturePipeline::firstPending()
+{
+  unsigned long long first = queue.empty() ? nextSeq : queue.front().seq;
+  if ( !running.empty() && *running.begin() < first ) first = *running.begin();
+  return first;
+}
+
+// Runs the checkpoints that are due. Called, and returns, with l held.
+void CapturePipeline::runCheckpoints(unique_lock<mutex> &l)
+{
+  if ( checkpoints.empty() || checkpoints.front().seq > firstPending() ) return;
+
+  // checkpointLock keeps callbacks taken by different threads in order.
+  l.unlock();
+  lock_guard<mutex> c(checkpointLock);
+  l.lock();
+  vector<Checkpoint> due;
+  unsigned long long first = firstPending();
+  while ( !checkpoints.empty() && checkpoints.front().seq <= first ) {
+    due.push_back(checkpoints.front());
+    checkpoints.pop_front();
+  }
+  l.unlock();
+  for ( size_t i = 0; i < due.size(); i++ ) {
+    due[i].fn();
+  }
+  l.lock();
+}
+
+void CapturePipeline::printStats()
+{
+  lock_guard<mutex> l(lock);
+  printf("Capture pipeline (%d workers, queue depth %d, %s):\n",
+    (int)workers.size(), maxQueued, formatName(outputFormat).c_str());
+  submitWait.print("submit wait");
+  queueWait.print("queue wait");
+  if ( detect.count ) detect.print("detect");
+  convert.print("convert");
+  encode.print("encode");
+  if ( noFly ) printf("  %d frame(s) with no fly found, stored whole.\n", noFly);
+  if ( failed ) printf("  %d frame(s) failed.\n", failed);
+}
+
+void CapturePipeline::resetStats()
+{
+  lock_guard<mutex> l(lock);
+  submitWait = StageTimer();
+  queueWait = StageTimer();
+  detect = StageTimer();
+  convert = StageTimer();
+  encode = StageTimer();
+  noFly = 0;
+  failed = 0;
+}
+
+int CapturePipeline::failures()
+{
+  lock_guard<mutex> l(lock);
+  return failed;
+}
+
+// The detector's full-frame thumbnail, if it makes one; stored the way
+// the frame will be. Returns true unless storing it failed.
+bool CapturePipeline::storeThumbnail(const Job &job)
+{
+  int width = job.detector->options().thumbWidth;
+  if ( width <= 0 ) return true;
+  const Frame &f = job.frame;
+  Mat thumb;
+  bayerThumbnail(f.data, f.stride, f.width, f.height, f.pixelFormat, width,
+                 thumb);
+  RawMetadata meta = job.meta;
+  meta.width = thumb.cols;
+  meta.height = thumb.rows;
+  meta.cropX = meta.cropY = 0;
+  meta.frameWidth = f.width;
+  meta.frameHeight = f.height;
+  if ( job.archive != NULL ) {
+    return job.archive->append(thumb, meta, job.format, ArchiveThumbnail) == 0;
+  }
+  string filename;
+  return writeImage(job.basename + ".thumb", thumb, job.format, filename) == 0;
+}
+
+void CapturePipeline::workerLoop()
+{
+  // Output images are per worker, so the buffers are reused from frame
+  // to frame without any locking. The workers already run in parallel, so
+  // each demosaics on a single thread.
+  Mat bgr;
+  DemosaicOptions opt;
+  opt.threads = 1;
+  traceThreadName("writer");
+
+  unique_lock<mutex> l(lock);
+  for (;;) {
+    while ( queue.empty() && !stopping ) {
+      notEmpty.wait(l);
+    }
+    if ( queue.empty() ) break;
+
+    Job job = queue.front();
+    queue.pop_front();
+    running.insert(job.seq);
+    busy++;
+    unsigned long long t0 = monotonicUs();
+    queueWait.add(t0 - job.queuedAt);
+    l.unlock();
+    traceRecord("queue wait", job.queuedAt, t0, job.meta.frameIndex,
+      job.meta.camera.c_str());
+    notFull.notify_one();
+
+    bool ok = true;
+    bool noFlyFound = false;
+    unsigned long long td = t0, t1 = t0, t2 = t0;
+    string filename;
+    try {
+      const Frame &f = job.frame;
+      Mat raw(f.height, f.width, CV_8UC1, (void *)f.data, f.stride);
+      job.meta.pixelFormat = f.pixelFormat;
+      Rect roi(0, 0, f.width, f.height);
+      if ( job.detector != NULL ) {
+        TraceSpan span("detect", job.meta.frameIndex, job.meta.camera.c_str());
+        if ( job.detector->detect(f.data, f.stride, f.width, f.height, roi) == 0 ) {
+          job.meta.cropX = roi.x;
+          job.meta.cropY = roi.y;
+          job.meta.frameWidth = f.width;
+          job.meta.frameHeight = f.height;
+        } else {
+          noFlyFound = true;
+          roi = Rect(0, 0, f.width, f.height);
+        }
+        ok = storeThumbnail(job);
+        td = monotonicUs();
+      }
+      // The crop is on whole Bayer blocks, so it is still a mosaic of the
+      // same pattern.
+      Mat stored = raw(roi);
+      const uint8_t *data = f.data + (size_t)roi.y * f.stride + roi.x;
+      job.meta.width = roi.width;
+      job.meta.height = roi.height;
+      if ( ok && job.mode == CaptureRaw ) {
+        // The mosaic is one byte per pixel, straight from the grab buffer.
+        TraceSpan span("imwrite", job.meta.frameIndex, "raw");
+        if ( job.archive != NULL ) {
+          ok = job.archive->append(stored, job.meta, job.format) == 0;
+        } else {
+          ok = writeImage(job.basename + ".bayer", stored, job.format, filename) == 0;
+          if ( ok ) ok = writeRawMetadata(job.basename + ".yml", job.meta) == 0;
+        }
+        t1 = td;
+      } else if ( ok ) {
+        if ( f.pixelFormat == "BayerBG8" ) {
+          bgr.create(roi.height, roi.width, CV_8UC3);
+          ok = demosaicBayerBG8(data, f.stride, bgr.data, bgr.step,
+                                roi.width, roi.height, opt) == 0;
+        } else {
+          RawMetadata meta;
+          meta.pixelFormat = f.pixelFormat;
+          ok = demosaicRaw(stored, meta, false, bgr) == 0;
+        }
+        t1 = monotonicUs();
+        traceRecord("demosaic", td, t1, job.meta.frameIndex);
+        TraceSpan span("imwrite", job.meta.frameIndex, "bgr");
+        if ( ok && job.archive != NULL ) {
+          ok = job.archive->append(bgr, job.meta, job.format) == 0;
+        } else if ( ok ) {
+          ok = writeImage(job.basename, bgr, job.format, filename) == 0;
+          // A crop needs its place in the frame kept with it.
+          if ( ok && job.meta.frameWidth > 0 ) {
+            ok = writeRawMetadata(job.basename + ".yml", job.meta) == 0;
+          }
+        }
+      }
+      t2 = monotonicUs();
+    } catch (const cv::Exception &e) {
+      cerr << "Error writing " << job.basename << ": " << e.what() << endl;
+      ok = false;
+    }
+    if ( !ok ) {
+      printf("Failed to write %s.\n", job.basename.c_str());
+    } else if ( noFlyFound ) {
+      printf("No fly found in %s; stored the whole frame.\n",
+        job.basename.c_str());
+    }
+
+    // Release the grab buffer back to the camera before taking the lock.
+    job.frame.release();
+
+    l.lock();
+    running.erase(job.seq);
+    if ( ok ) {
+      if ( job.detector != NULL ) detect.add(td - t0);
+      if ( job.mode == CaptureBGR ) convert.add(t1 - td);
+      encode.add(t2 - t1);
+      if ( noFlyFound ) noFly++;
+    } else {
+      failed++;
+    }
+    // Still counted as busy, so waitIdle() waits for these too.
+    runCheckpoints(l);
+    busy--;
+    if ( queue.empty() && busy == 0 ) {
+      idle.notify_all();
+    }
+  }
+}
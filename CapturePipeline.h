@@ -0,0 +1,142 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __CAPTUREPIPELINE_H__
+#define __CAPTUREPIPELINE_H__
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "PhotoFuncs.h"
+#include "RawImage.h"
+#include "CameraSource.h"
+#include "ImageFormat.h"
+#include "SessionArchive.h"
+#include "FlyDetector.h"
+
+// What the pipeline stores for each frame.
+//   CaptureBGR: convert to BGR and write <basename>.png
+//   CaptureRaw: write the Bayer mosaic losslessly as <basename>.bayer.png
+//               with its settings in <basename>.yml; run Debayer later to
+//               produce the BGR images.
+// The extension follows the output format (ImageFormat.h); PNG unless
+// setFormat() says otherwise. With setArchive() the same images go into
+// the session archive instead of files, and no .yml is written: the
+// archive record carries the metadata.
+//
+// With a FlyDetector for the camera only the crop around the fly is
+// stored, in either mode, with its place in the frame in the metadata
+// (a .yml is written for BGR crops too); the thumbnail, if asked for,
+// goes to <basename>.thumb.
+enum CaptureMode { CaptureBGR, CaptureRaw };
+
+// Moves conversion and image encoding off the grab loop.
+//
+// The grab loop hands each frame to submit(), which only queues it and
+// returns. A pool of worker threads demosaics the frame to BGR (or leaves
+// it raw) and writes it to disk. The queue is bounded: when it is
+// full, submit() blocks until a worker frees a slot, so a slow disk
+// throttles the grab loop instead of growing memory without limit.
+//
+// Each queued frame holds on to its buffer until it is written. Frames
+// are views into those buffers and are never copied; for a camera with
+// a FramePool, a grab waits for one to come back once the pool is used
+// up, so the pool's size caps the memory frames can hold. Without a pool
+// a Pylon camera has only MaxNumBuffer (10 by default) buffers, and
+// maxQueued + nWorkers must stay below that or it will run out.
+class CapturePipeline {
+public:
+  CapturePipeline(int nWorkers = 3, int maxQueued = 6);
+  ~CapturePipeline();
+
+  // Applies to frames submitted after the call.
+  void setMode(CaptureMode m);
+  CaptureMode mode();
+  // In raw mode only formats with formatKeepsRaw() will work.
+  void setFormat(const OutputFormat &f);
+  OutputFormat format();
+  // Store frames in archive (not owned; NULL = separate files again).
+  void setArchive(SessionArchive *archive);
+  // Crop camera's frames to the fly detector finds in them (not owned;
+  // NULL = whole frames again). A frame with no fly in it is stored whole.
+  void setDetector(const std::string &camera, const FlyDetector *detector);
+
+  // Queue a frame to be written. basename has no extension; the mode
+  // decides which file(s) get written. meta goes into the .yml in raw mode
+  // and into the record when archiving.
+  void submit(const Frame &frame, const std::string &basename,
+              const RawMetadata &meta);
+
+  // Block until every submitted frame has been written.
+  void waitIdle();
+
+  // Runs fn once every frame submitted so far has been written (or has
+  // failed), without waiting for it: on the worker that finishes the last
+  // of them, or right away if they are all done. Callbacks run one at a
+  // time, in the order they were added, and before waitIdle() returns.
+  void whenWritten(std::function<void()> fn);
+
+  // Print per-stage timing since the last resetStats().
+  void printStats();
+  void resetStats();
+
+  // Number of frames that failed to convert or write.
+  int failures();
+
+private:
+  struct Job {
+    Frame frame;
+    std::string basename;
+    CaptureMode mode;
+    OutputFormat format;
+    SessionArchive *archive;
+    const FlyDetector *detector;
+    RawMetadata meta;
+    unsigned long long queuedAt;
+    unsigned long long seq;
+  };
+  struct Checkpoint {
+    unsigned long long seq;      // due once every job before this is done
+    std::function<void()> fn;
+  };
+
+  void workerLoop();
+  bool storeThumbnail(const Job &job);
+  unsigned long long firstPending();
+  void runCheckpoints(std::unique_lock<std::mutex> &l);
+
+  std::vector<std::thread> workers;
+  std::deque<Job> queue;
+  CaptureMode captureMode;
+  OutputFormat outputFormat;
+  SessionArchive *archive;
+  std::map<std::string, const FlyDetector *> detectors;
+  int maxQueued;
+  int busy;
+  bool stopping;
+  int failed;
+  int noFly;
+  unsigned long long nextSeq;
+  std::set<unsigned long long> running;
+  std::deque<Checkpoint> checkpoints;
+
+  std::mutex lock;
+  std::mutex checkpointLock;  // held while callbacks run; taken before lock
+  std::condition_variable notEmpty, notFull, idle;
+
+  StageTimer submitWait;  // grab loop blocked on a full queue
+  StageTimer queueWait;   // frame waiting for a free worker
+  StageTimer detect;      // finding the fly, and the thumbnail
+  StageTimer convert;     // demosaic to BGR (BGR mode only)
+  StageTimer encode;      // encode + write to disk, plus metadata
+};
+
+#endif // __CAPTUREPIPELINE_H__
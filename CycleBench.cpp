@@ -0,0 +1,167 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// End-to-end fly cycle against simulated devices: the real serial code,
+// FlyCycle and its interlocks, with the Maestro, dispenser and Arduino
+// replaced by pty simulators (DeviceSim.h) and the cameras by a delay.
+//
+//   CycleBench [-n flies] [-capture ms] [-scale f] [-trace file]
+//              [simulator options]
+//
+// Runs the cycle once one step at a time and once overlapped, and
+// reports flies per hour for each. A run fails if a fly's gates were
+// reset before the previous fly had been pumped out. -scale multiplies
+// every mechanical delay (gate travel, pump, dispense, capture) to make
+// quick runs.
+// -trace writes the overlapped run as a Chrome trace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PhotoFuncs.h"
+#include "FlyCycle.h"
+#include "DeviceSim.h"
+#include "Trace.h"
+
+using namespace std;
+
+struct BenchResult {
+  int flies;
+  double secondsPerFly;
+  double seconds;
+};
+
+static int runOnce(const SimSetup &setup, CycleConfig cfg, int captureUs,
+                   int gateSpeed, BenchResult &result)
+{
+  MaestroSim servoSim(setup.faults, setup.servoSpeed);
+  DispenserSim dispenserSim(setup.faults, setup.dispenseUs, setup.flies,
+                            setup.missRate);
+  ArduinoSim arduinoSim(setup.faults, setup.stepUs);
+  if ( servoSim.start() != 0 || dispenserSim.start() != 0 ||
+       arduinoSim.start() != 0 ) {
+    return -1;
+  }
+
+  BoothPorts ports;
+  ports.servoFD = openSerialPort(servoSim.path());
+  ports.dispenserFD = openSerialPort(dispenserSim.path());
+  ports.arduinoFD = openSerialPort(arduinoSim.path());
+  if ( ports.servoFD == -1 || ports.dispenserFD == -1 || ports.arduinoFD == -1 ) {
+    return -1;
+  }
+
+  int status = -1;
+  if ( maestroSetLimits(ports.servoFD, GATE_CHANNELS, gateSpeed, GATE_ACCEL) != 0 ||
+       initDispenser(ports.dispenserFD) != 0 || enableLights(ports.arduinoFD) != 0 ) {
+    printf("Simulated devices didn't answer.\n");
+  } else {
+    // Stands in for the two grabs either side of the vane step.
+    FlyCycle cycle(ports, cfg, [&](int) -> StepResult {
+      traceSleep(captureUs / 2, "upper grab");
+      if ( stepVanes(ports.arduinoFD) != 0 ) return StepFail;
+      traceSleep(captureUs / 2, "lower grab");
+      return StepOk;
+    });
+
+    int imaged = cycle.run();
+    cycle.printReport();
+    if ( cycle.interlockBreaches() != 0 ) {
+      printf("The cycle broke its interlocks; its timing means nothing.\n");
+    } else if ( imaged >= 0 ) {
+      result.flies = imaged;
+      result.seconds = cycle.elapsedUs() / 1e6;
+      result.secondsPerFly = cycle.cycleUs() / 1e6;
+      status = 0;
+    }
+  }
+
+  printf("Simulator stats:\n");
+  servoSim.printStats();
+  dispenserSim.printStats();
+  arduinoSim.printStats();
+
+  closeSerialPort(ports.servoFD);
+  closeSerialPort(ports.dispenserFD);
+  closeSerialPort(ports.arduinoFD);
+  return status;
+}
+
+int main(int argc, char **argv)
+{
+  SimSetup setup;
+  int flies = 5;
+  int captureUs = 2000000;
+  double scale = 1.0;
+  const char *tracePath = NULL;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-n") == 0 && i + 1 < argc ) {
+      flies = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-capture") == 0 && i + 1 < argc ) {
+      captureUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-scale") == 0 && i + 1 < argc ) {
+      scale = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-trace") == 0 && i + 1 < argc ) {
+      tracePath = argv[++i];
+    } else if ( !simOption(argc, argv, i, setup) ) {
+      printf("Usage: %s [-n flies] [-capture ms] [-scale f] [-trace file] "
+        "[options]\n%s",
+        argv[0], simOptionsUsage);
+      return 1;
+    }
+  }
+  if ( flies < 2 ) flies = 2;  // need two to measure a cycle
+
+  CycleConfig cfg;
+  cfg.flies = flies;
+  cfg.gateMarginUs *= scale;
+  cfg.fallUs *= scale;
+  cfg.pumpUs *= scale;
+  setup.dispenseUs *= scale;
+  setup.stepUs *= scale;
+  captureUs *= scale;
+  int gateSpeed = scale > 0 ? GATE_SPEED / scale : 0;
+
+  BenchResult serial = BenchResult(), overlapped = BenchResult();
+
+  printf("=== One step at a time ===\n");
+  CycleConfig serialCfg = cfg;
+  serialCfg.dispenseAhead = false;
+  serialCfg.vanesDuringPump = false;
+  if ( runOnce(setup, serialCfg, captureUs, gateSpeed, serial) != 0 ) return 1;
+
+  printf("\n=== Overlapped ===\n");
+  traceEnable(tracePath != NULL);
+  traceThreadName("main");
+  if ( runOnce(setup, cfg, captureUs, gateSpeed, overlapped) != 0 ) return 1;
+  traceEnable(false);
+
+  printf("\n");
+  printSerialCmdStats();
+
+  printf("\n  %-12s %6s %10s %10s %12s\n", "cycle", "flies", "total s",
+    "s/fly", "flies/hour");
+  const char *names[] = { "serial", "overlapped" };
+  BenchResult *results[] = { &serial, &overlapped };
+  for ( int i = 0; i < 2; i++ ) {
+    BenchResult &r = *results[i];
+    printf("  %-12s %6d %10.1f %10.2f %12.0f\n", names[i], r.flies, r.seconds,
+      r.secondsPerFly, r.secondsPerFly > 0 ? 3600 / r.secondsPerFly : 0.0);
+  }
+  if ( serial.secondsPerFly > 0 && overlapped.secondsPerFly > 0 ) {
+    printf("Overlapping saves %.2f s per fly (%.0f%%).\n",
+      serial.secondsPerFly - overlapped.secondsPerFly,
+      100 * (1 - overlapped.secondsPerFly / serial.secondsPerFly));
+  }
+
+  if ( tracePath != NULL ) {
+    printf("\n");
+    tracePrintSummary();
+    traceWriteChrome(tracePath);
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Converts raw captures (Photobooth/HandLoad -raw) into BGR images.
+//
+//   Debayer [-wb] [-f] [-bilinear | -edge] [-format fmt]
+//           <file.bayer.png | file.bayer.tiff | directory> ...
+//
+// Each X.bayer.png (or .tiff) is demosaiced using the settings in X.yml
+// and written to X.png. Directories are scanned for raw frames; frames
+// that already have an output image are skipped unless -f is given, so
+// this can be left running (e.g. "nice ./Debayer images &") between or
+// during sessions.
+//
+//   -wb  Multiply in the recorded white balance ratios.
+//   -f   Overwrite existing BGR images.
+//   -bilinear, -edge
+//        Use the in-tree demosaic engine (Demosaic.h) instead of OpenCV.
+//   -format
+//        Output format (see ImageFormat.h), e.g. qoi or png:1.
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "RawImage.h"
+#include "Demosaic.h"
+#include "ImageFormat.h"
+
+using namespace cv;
+using namespace std;
+
+static const char *rawSuffixes[] = { ".bayer.png", ".bayer.tiff" };
+
+// Which demosaic to use: OpenCV's, or the in-tree engine.
+enum Engine { EngineOpenCV, EngineBilinear, EngineEdgeAware };
+
+static bool endsWith(const string &s, const char *suffix)
+{
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Length of the raw-frame suffix path ends with, or 0 if it isn't one.
+static size_t rawSuffixLength(const string &path)
+{
+  for ( size_t i = 0; i < sizeof(rawSuffixes) / sizeof(rawSuffixes[0]); i++ ) {
+    if ( endsWith(path, rawSuffixes[i]) ) return strlen(rawSuffixes[i]);
+  }
+  return 0;
+}
+
+static bool isDirectory(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void listRawFiles(const char *dir, vector<string> &files)
+{
+  DIR *d = opendir(dir);
+  if ( d == NULL ) {
+    perror(dir);
+    return;
+  }
+  struct dirent *ent;
+  while ( (ent = readdir(d)) != NULL ) {
+    string name = ent->d_name;
+    if ( rawSuffixLength(name) > 0 ) {
+      files.push_back(string(dir) + "/" + name);
+    }
+  }
+  closedir(d);
+  sort(files.begin(), files.end());
+}
+
+// Returns 0 if converted, 1 if skipped, -1 on error.
+static int debayerFile(const string &rawPath, bool applyBalance, bool force,
+                       Engine engine, const OutputFormat &format)
+{
+  string base = rawPath.substr(0, rawPath.size() - rawSuffixLength(rawPath));
+  string outPath = base + formatExtension(format.format);
+
+  if ( !force && access(outPath.c_str(), F_OK) == 0 ) return 1;
+
+  RawMetadata meta;
+  if ( readRawMetadata(base + ".yml", meta) != 0 ) return -1;
+
+  Mat raw = imread(rawPath, IMREAD_GRAYSCALE);
+  if ( raw.empty() ) {
+    printf("Couldn't read %s.\n", rawPath.c_str());
+    return -1;
+  }
+
+  Mat bgr;
+  if ( engine == EngineOpenCV || meta.pixelFormat != "BayerBG8" ) {
+    if ( demosaicRaw(raw, meta, applyBalance, bgr) != 0 ) return -1;
+  } else {
+    DemosaicOptions opt;
+    opt.method = engine == EngineEdgeAware ? DemosaicEdgeAware : DemosaicBilinear;
+    opt.applyBalance = applyBalance;
+    opt.balanceRed = meta.balanceRed;
+    opt.balanceGreen = meta.balanceGreen;
+    opt.balanceBlue = meta.balanceBlue;
+    bgr.create(raw.rows, raw.cols, CV_8UC3);
+    if ( demosaicBayerBG8(raw.data, raw.step, bgr.data, bgr.step,
+                          raw.cols, raw.rows, opt) != 0 ) {
+      printf("Couldn't demosaic %s.\n", rawPath.c_str());
+      return -1;
+    }
+  }
+
+  if ( writeImage(base, bgr, format, outPath) != 0 ) {
+    printf("Couldn't write %s.\n", outPath.c_str());
+    return -1;
+  }
+  printf("Wrote %s.\n", outPath.c_str());
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool applyBalance = false, force = false;
+  Engine engine = EngineOpenCV;
+  OutputFormat format;
+  vector<string> files;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-wb") == 0 ) {
+      applyBalance = true;
+    } else if ( strcmp(argv[i], "-f") == 0 ) {
+      force = true;
+    } else if ( strcmp(argv[i], "-bilinear") == 0 ) {
+      engine = EngineBilinear;
+    } else if ( strcmp(argv[i], "-edge") == 0 ) {
+      engine = EngineEdgeAware;
+    } else if ( strcmp(argv[i], "-format") == 0 && i + 1 < argc ) {
+      if ( !parseOutputFormat(argv[++i], format) ) {
+        printf("Unknown format '%s'; use %s.\n", argv[i], outputFormatUsage);
+        return 1;
+      }
+    } else if ( isDirectory(argv[i]) ) {
+      listRawFiles(argv[i], files);
+    } else if ( rawSuffixLength(argv[i]) > 0 ) {
+      files.push_back(argv[i]);
+    } else {
+      printf("Skipping %s (not a .bayer.png or .bayer.tiff file).\n", argv[i]);
+    }
+  }
+
+  if ( files.empty() ) {
+    printf("Usage: %s [-wb] [-f] [-bilinear | -edge] [-format fmt] "
+      "<file.bayer.png | file.bayer.tiff | directory> ...\n", argv[0]);
+    return 1;
+  }
+
+  int converted = 0, skipped = 0, failed = 0;
+  for ( size_t i = 0; i < files.size(); i++ ) {
+    int r = debayerFile(files[i], applyBalance, force, engine, format);
+    if ( r == 0 ) converted++;
+    else if ( r == 1 ) skipped++;
+    else failed++;
+  }
+
+  printf("%d converted, %d already done, %d failed.\n",
+    converted, skipped, failed);
+  return failed ? 1 : 0;
+}
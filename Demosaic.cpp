@@ -0,0 +1,393 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+
+#include "Demosaic.h"
+#include "DemosaicKernels.h"
+
+using namespace std;
+
+DemosaicOptions::DemosaicOptions() :
+  method(DemosaicBilinear), isa(DemosaicAuto), threads(0),
+  applyBalance(false), balanceRed(1.0), balanceGreen(1.0), balanceBlue(1.0)
+{
+}
+
+// Everything a band needs to know about the frame.
+struct DemosaicFrame {
+  const uint8_t *src;
+  int srcStride;
+  uint8_t *dst;
+  int dstStride;
+  int w, h;
+  DemosaicKernelSet k;
+  int balance;
+  uint16_t kB, kG, kR;
+};
+
+// Reflect about the edge without repeating it (-1 -> 1, n -> n-2), which
+// keeps the Bayer phase of the reflected sample.
+static inline int reflect(int i, int n)
+{
+  if ( i < 0 ) return -i;
+  if ( i >= n ) return 2*n - 2 - i;
+  return i;
+}
+
+static inline int px(const DemosaicFrame &f, int x, int y)
+{
+  return f.src[reflect(y, f.h) * f.srcStride + reflect(x, f.w)];
+}
+
+static inline void putBGR(uint8_t *d, int b, int g, int r, int balance,
+                          uint16_t kB, uint16_t kG, uint16_t kR)
+{
+  if ( balance ) {
+    b = dmScale(b, kB); g = dmScale(g, kG); r = dmScale(r, kR);
+  }
+  d[0] = b; d[1] = g; d[2] = r;
+}
+
+static inline void putBGR(const DemosaicFrame &f, uint8_t *d, int b, int g, int r)
+{
+  putBGR(d, b, g, r, f.balance, f.kB, f.kG, f.kR);
+}
+
+static inline void putBGR(const DemosaicRow &r, uint8_t *d, int b, int g, int rr)
+{
+  putBGR(d, b, g, rr, r.balance, r.kB, r.kG, r.kR);
+}
+
+// A red or blue sample sits where x and y have the same parity.
+static inline bool colorSite(int x, int y) { return ((x ^ y) & 1) == 0; }
+
+/* ---- Border pixels: generic, with reflection ---- */
+
+static void bilinearPixel(const DemosaicFrame &f, int x, int y, uint8_t *d)
+{
+  int c = px(f, x, y);
+  int h = dmAvg(px(f, x-1, y), px(f, x+1, y));
+  int v = dmAvg(px(f, x, y-1), px(f, x, y+1));
+  if ( colorSite(x, y) ) {
+    int diag = dmAvg(dmAvg(px(f, x-1, y-1), px(f, x+1, y-1)),
+                     dmAvg(px(f, x-1, y+1), px(f, x+1, y+1)));
+    int g = dmAvg(v, h);
+    if ( y & 1 ) putBGR(f, d, diag, g, c);
+    else         putBGR(f, d, c, g, diag);
+  } else {
+    if ( y & 1 ) putBGR(f, d, v, c, h);
+    else         putBGR(f, d, h, c, v);
+  }
+}
+
+static int greenPixel(const DemosaicFrame &f, int x, int y)
+{
+  int c = px(f, x, y);
+  if ( !colorSite(x, y) ) return c;
+  return dmGreenAt(c, px(f, x-1, y), px(f, x+1, y), px(f, x-2, y), px(f, x+2, y),
+                   px(f, x, y-1), px(f, x, y+1), px(f, x, y-2), px(f, x, y+2));
+}
+
+static void chromaPixel(const DemosaicFrame &f, int x, int y,
+                        const uint8_t *gUp, const uint8_t *gMid,
+                        const uint8_t *gDown, uint8_t *d)
+{
+  int xl = reflect(x-1, f.w), xr = reflect(x+1, f.w);
+  int c = px(f, x, y), g = gMid[x];
+  if ( colorSite(x, y) ) {
+    int dd = (px(f, x-1, y-1) - gUp[xl]) + (px(f, x+1, y-1) - gUp[xr]) +
+             (px(f, x-1, y+1) - gDown[xl]) + (px(f, x+1, y+1) - gDown[xr]);
+    int other = dmClamp(g + ((dd + 2) >> 2));
+    if ( y & 1 ) putBGR(f, d, other, g, c);
+    else         putBGR(f, d, c, g, other);
+  } else {
+    int dh = (px(f, x-1, y) - gMid[xl]) + (px(f, x+1, y) - gMid[xr]);
+    int dv = (px(f, x, y-1) - gUp[x]) + (px(f, x, y+1) - gDown[x]);
+    int hv = dmClamp(g + ((dh + 1) >> 1));
+    int vv = dmClamp(g + ((dv + 1) >> 1));
+    if ( y & 1 ) putBGR(f, d, vv, g, hv);
+    else         putBGR(f, d, hv, g, vv);
+  }
+}
+
+/* ---- Interior: scalar kernels, no clamping needed ---- */
+
+static int bilinearScalar(const DemosaicRow &r, int x0, int x1)
+{
+  const uint8_t *up = r.up, *mid = r.mid, *down = r.down;
+  for ( int x = x0; x < x1; x++ ) {
+    uint8_t *d = r.dst + 3*x;
+    int c = mid[x];
+    int h = dmAvg(mid[x-1], mid[x+1]);
+    int v = dmAvg(up[x], down[x]);
+    if ( (x & 1) == r.oddRow ) {
+      int diag = dmAvg(dmAvg(up[x-1], up[x+1]), dmAvg(down[x-1], down[x+1]));
+      int g = dmAvg(v, h);
+      if ( r.oddRow ) putBGR(r, d, diag, g, c);
+      else            putBGR(r, d, c, g, diag);
+    } else {
+      if ( r.oddRow ) putBGR(r, d, v, c, h);
+      else            putBGR(r, d, h, c, v);
+    }
+  }
+  return x1;
+}
+
+static int greenScalar(const DemosaicRow &r, int x0, int x1)
+{
+  const uint8_t *mid = r.mid;
+  for ( int x = x0; x < x1; x++ ) {
+    if ( (x & 1) == r.oddRow ) {
+      r.green[x] = dmGreenAt(mid[x], mid[x-1], mid[x+1], mid[x-2], mid[x+2],
+                             r.up[x], r.down[x], r.up2[x], r.down2[x]);
+    } else {
+      r.green[x] = mid[x];
+    }
+  }
+  return x1;
+}
+
+static int chromaScalar(const DemosaicRow &r, int x0, int x1)
+{
+  const uint8_t *up = r.up, *mid = r.mid, *down = r.down;
+  for ( int x = x0; x < x1; x++ ) {
+    uint8_t *d = r.dst + 3*x;
+    int c = mid[x], g = r.gMid[x];
+    if ( (x & 1) == r.oddRow ) {
+      int dd = (up[x-1] - r.gUp[x-1]) + (up[x+1] - r.gUp[x+1]) +
+               (down[x-1] - r.gDown[x-1]) + (down[x+1] - r.gDown[x+1]);
+      int other = dmClamp(g + ((dd + 2) >> 2));
+      if ( r.oddRow ) putBGR(r, d, other, g, c);
+      else            putBGR(r, d, c, g, other);
+    } else {
+      int dh = (mid[x-1] - r.gMid[x-1]) + (mid[x+1] - r.gMid[x+1]);
+      int dv = (up[x] - r.gUp[x]) + (down[x] - r.gDown[x]);
+      int hv = dmClamp(g + ((dh + 1) >> 1));
+      int vv = dmClamp(g + ((dv + 1) >> 1));
+      if ( r.oddRow ) putBGR(r, d, vv, g, hv);
+      else            putBGR(r, d, hv, g, vv);
+    }
+  }
+  return x1;
+}
+
+/* ---- Bands ---- */
+
+static DemosaicRow interiorRow(const DemosaicFrame &f, int y)
+{
+  DemosaicRow r;
+  memset(&r, 0, sizeof(r));
+  r.up2   = f.src + (y-2) * f.srcStride;
+  r.up    = f.src + (y-1) * f.srcStride;
+  r.mid   = f.src + y * f.srcStride;
+  r.down  = f.src + (y+1) * f.srcStride;
+  r.down2 = f.src + (y+2) * f.srcStride;
+  r.dst   = f.dst + y * f.dstStride;
+  r.oddRow = y & 1;
+  r.balance = f.balance;
+  r.kB = f.kB; r.kG = f.kG; r.kR = f.kR;
+  return r;
+}
+
+static inline bool borderRow(const DemosaicFrame &f, int y)
+{
+  return y < 2 || y >= f.h - 2;
+}
+
+static void bilinearBand(const DemosaicFrame &f, int y0, int y1)
+{
+  for ( int y = y0; y < y1; y++ ) {
+    uint8_t *d = f.dst + y * f.dstStride;
+    if ( borderRow(f, y) ) {
+      for ( int x = 0; x < f.w; x++ ) bilinearPixel(f, x, y, d + 3*x);
+      continue;
+    }
+    DemosaicRow r = interiorRow(f, y);
+    bilinearPixel(f, 0, y, d);
+    bilinearPixel(f, 1, y, d + 3);
+    int x = f.k.bilinear(r, 2, f.w - 2);
+    bilinearScalar(r, x, f.w - 2);
+    bilinearPixel(f, f.w - 2, y, d + 3*(f.w - 2));
+    bilinearPixel(f, f.w - 1, y, d + 3*(f.w - 1));
+  }
+}
+
+static void greenRow(const DemosaicFrame &f, int y, uint8_t *g)
+{
+  if ( borderRow(f, y) ) {
+    for ( int x = 0; x < f.w; x++ ) g[x] = greenPixel(f, x, y);
+    return;
+  }
+  DemosaicRow r = interiorRow(f, y);
+  r.green = g;
+  g[0] = greenPixel(f, 0, y);
+  g[1] = greenPixel(f, 1, y);
+  int x = f.k.green(r, 2, f.w - 2);
+  greenScalar(r, x, f.w - 2);
+  g[f.w - 2] = greenPixel(f, f.w - 2, y);
+  g[f.w - 1] = greenPixel(f, f.w - 1, y);
+}
+
+static void edgeAwareBand(const DemosaicFrame &f, int y0, int y1)
+{
+  // Green for the band plus one row either side. Neighbouring bands
+  // recompute each other's edge rows rather than waiting on each other.
+  int w = f.w;
+  vector<uint8_t> green((size_t)(y1 - y0 + 2) * w);
+  for ( int y = y0 - 1; y <= y1; y++ ) {
+    greenRow(f, reflect(y, f.h), &green[(size_t)(y - y0 + 1) * w]);
+  }
+
+  for ( int y = y0; y < y1; y++ ) {
+    const uint8_t *gUp   = &green[(size_t)(y - y0) * w];
+    const uint8_t *gMid  = gUp + w;
+    const uint8_t *gDown = gMid + w;
+    uint8_t *d = f.dst + y * f.dstStride;
+    if ( borderRow(f, y) ) {
+      for ( int x = 0; x < w; x++ ) {
+        chromaPixel(f, x, y, gUp, gMid, gDown, d + 3*x);
+      }
+      continue;
+    }
+    DemosaicRow r = interiorRow(f, y);
+    r.gUp = gUp; r.gMid = gMid; r.gDown = gDown;
+    chromaPixel(f, 0, y, gUp, gMid, gDown, d);
+    chromaPixel(f, 1, y, gUp, gMid, gDown, d + 3);
+    int x = f.k.chroma(r, 2, w - 2);
+    chromaScalar(r, x, w - 2);
+    chromaPixel(f, w - 2, y, gUp, gMid, gDown, d + 3*(w - 2));
+    chromaPixel(f, w - 1, y, gUp, gMid, gDown, d + 3*(w - 1));
+  }
+}
+
+/* ---- Public interface ---- */
+
+static uint16_t fixedRatio(double ratio)
+{
+  // 8.8 fixed point; capped so the SIMD paths can't overflow.
+  if ( ratio < 0.0 ) ratio = 0.0;
+  if ( ratio > 64.0 ) ratio = 64.0;
+  return (uint16_t)(ratio * 256.0 + 0.5);
+}
+
+bool demosaicIsaSupported(DemosaicIsa isa)
+{
+  DemosaicKernelSet k;
+  switch ( isa ) {
+    case DemosaicScalar:
+    case DemosaicAuto:
+      return true;
+#if defined(__x86_64__) || defined(__i386__)
+    case DemosaicSSE2:
+      return demosaicKernelsSSE2(k) && __builtin_cpu_supports("sse2");
+    case DemosaicAVX2:
+      return demosaicKernelsAVX2(k) && __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+DemosaicIsa demosaicBestIsa()
+{
+  if ( demosaicIsaSupported(DemosaicAVX2) ) return DemosaicAVX2;
+  if ( demosaicIsaSupported(DemosaicSSE2) ) return DemosaicSSE2;
+  return DemosaicScalar;
+}
+
+const char *demosaicIsaName(DemosaicIsa isa)
+{
+  switch ( isa ) {
+    case DemosaicScalar: return "scalar";
+    case DemosaicSSE2:   return "sse2";
+    case DemosaicAVX2:   return "avx2";
+    default:             return "auto";
+  }
+}
+
+int demosaicBayerBG8(const uint8_t *src, int srcStride,
+                     uint8_t *dst, int dstStride,
+                     int width, int height, const DemosaicOptions &opt)
+{
+  if ( width < 4 || height < 4 ) return -1;
+
+  DemosaicIsa isa = opt.isa == DemosaicAuto ? demosaicBestIsa() : opt.isa;
+  if ( !demosaicIsaSupported(isa) ) return -1;
+
+  DemosaicFrame f;
+  f.src = src; f.srcStride = srcStride;
+  f.dst = dst; f.dstStride = dstStride;
+  f.w = width; f.h = height;
+  f.balance = opt.applyBalance;
+  f.kB = fixedRatio(opt.balanceBlue);
+  f.kG = fixedRatio(opt.balanceGreen);
+  f.kR = fixedRatio(opt.balanceRed);
+
+  f.k.bilinear = bilinearScalar;
+  f.k.green = greenScalar;
+  f.k.chroma = chromaScalar;
+  if ( isa == DemosaicSSE2 ) demosaicKernelsSSE2(f.k);
+  if ( isa == DemosaicAVX2 ) demosaicKernelsAVX2(f.k);
+
+  void (*band)(const DemosaicFrame &, int, int) =
+    opt.method == DemosaicEdgeAware ? edgeAwareBand : bilinearBand;
+
+  int nThreads = opt.threads > 0 ? opt.threads : thread::hardware_concurrency();
+  if ( nThreads < 1 ) nThreads = 1;
+  if ( nThreads > height / 4 ) nThreads = height / 4;
+  if ( nThreads < 1 ) nThreads = 1;
+
+  if ( nThreads == 1 ) {
+    band(f, 0, height);
+    return 0;
+  }
+
+  vector<thread> workers;
+  int rows = (height + nThreads - 1) / nThreads;
+  for ( int y0 = 0; y0 < height; y0 += rows ) {
+    int y1 = y0 + rows < height ? y0 + rows : height;
+    workers.push_back(thread(band, cref(f), y0, y1));
+  }
+  for ( size_t i = 0; i < workers.size(); i++ ) workers[i].join();
+  return 0;
+}
+
+int demosaicBalanceFromPfs(const char *pfsPath, DemosaicOptions &opt)
+{
+  FILE *fp = fopen(pfsPath, "r");
+  if ( fp == NULL ) {
+    perror(pfsPath);
+    return -1;
+  }
+
+  // The file is "Feature<TAB>Value" per line; BalanceRatio applies to
+  // whichever BalanceRatioSelector line came before it.
+  char line[256], name[128], value[128], selector[128] = "";
+  int found = 0;
+  while ( fgets(line, sizeof(line), fp) != NULL ) {
+    if ( line[0] == '#' ) continue;
+    if ( sscanf(line, "%127s %127s", name, value) != 2 ) continue;
+    if ( strcmp(name, "BalanceRatioSelector") == 0 ) {
+      strcpy(selector, value);
+    } else if ( strcmp(name, "BalanceRatio") == 0 ) {
+      double v = atof(value);
+      if ( strcmp(selector, "Red") == 0 )   { opt.balanceRed = v;   found |= 1; }
+      if ( strcmp(selector, "Green") == 0 ) { opt.balanceGreen = v; found |= 2; }
+      if ( strcmp(selector, "Blue") == 0 )  { opt.balanceBlue = v;  found |= 4; }
+    }
+  }
+  fclose(fp);
+
+  if ( found != 7 ) {
+    printf("%s: no Red/Green/Blue BalanceRatio values.\n", pfsPath);
+    return -1;
+  }
+  opt.applyBalance = true;
+  return 0;
+}
@@ -0,0 +1,219 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// AVX2 inner loops for the demosaic engine. Must match the scalar code
+// in Demosaic.cpp bit for bit. Built with -mavx2 on x86 only; the
+// dispatcher checks the CPU before using them.
+
+#include "DemosaicKernels.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline __m256i sel(__m256i mask, __m256i a, __m256i b)
+{
+  return _mm256_blendv_epi8(b, a, mask);
+}
+
+// 16 B, G and R bytes -> 48 packed bytes, using byte shuffles.
+static inline void store16(uint8_t *d, __m128i b, __m128i g, __m128i r)
+{
+  const __m128i b0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i r0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i r1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i r2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  _mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(b, b0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(r, r0)));
+  _mm_storeu_si128((__m128i *)(d + 16), _mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(b, b1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(r, r1)));
+  _mm_storeu_si128((__m128i *)(d + 32), _mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(b, b2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(r, r2)));
+}
+
+// 32 B, G and R bytes -> 96 packed bytes.
+static inline void store32(uint8_t *d, __m256i b, __m256i g, __m256i r)
+{
+  store16(d, _mm256_castsi256_si128(b), _mm256_castsi256_si128(g),
+          _mm256_castsi256_si128(r));
+  store16(d + 48, _mm256_extracti128_si256(b, 1), _mm256_extracti128_si256(g, 1),
+          _mm256_extracti128_si256(r, 1));
+}
+
+// 16 16-bit values -> 16 bytes, in order.
+static inline __m128i pack16(__m256i v)
+{
+  return _mm_packus_epi16(_mm256_castsi256_si128(v),
+                          _mm256_extracti128_si256(v, 1));
+}
+
+// Balance on 32 bytes: (v<<8 | 0x80) * k >> 16, saturated.
+static inline __m256i scale8(__m256i v, __m256i k)
+{
+  const __m256i half = _mm256_set1_epi8((char)0x80);
+  __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(half, v), k);
+  __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(half, v), k);
+  return _mm256_packus_epi16(lo, hi);   // per-lane, so order is kept
+}
+
+static inline __m256i scale16(__m256i v, __m256i k)
+{
+  return _mm256_mulhi_epu16(_mm256_or_si256(_mm256_slli_epi16(v, 8),
+                                            _mm256_set1_epi16(0x80)), k);
+}
+
+static inline __m256i load16w(const uint8_t *p)
+{
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+static inline __m256i load32(const uint8_t *p)
+{
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+
+static inline __m256i clamp16(__m256i v)
+{
+  return _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()),
+                          _mm256_set1_epi16(255));
+}
+
+static int bilinearAVX2(const DemosaicRow &r, int x0, int x1)
+{
+  const __m256i site = _mm256_set1_epi16(r.oddRow ? (short)0xFF00 : 0x00FF);
+  const __m256i kB = _mm256_set1_epi16(r.kB), kG = _mm256_set1_epi16(r.kG),
+                kR = _mm256_set1_epi16(r.kR);
+  int x = x0;
+  for ( ; x + 32 <= x1; x += 32 ) {
+    __m256i c = load32(r.mid + x);
+    __m256i h = _mm256_avg_epu8(load32(r.mid + x - 1), load32(r.mid + x + 1));
+    __m256i v = _mm256_avg_epu8(load32(r.up + x), load32(r.down + x));
+    __m256i diag = _mm256_avg_epu8(
+      _mm256_avg_epu8(load32(r.up + x - 1), load32(r.up + x + 1)),
+      _mm256_avg_epu8(load32(r.down + x - 1), load32(r.down + x + 1)));
+    __m256i cross = _mm256_avg_epu8(v, h);
+
+    __m256i g = sel(site, cross, c);
+    __m256i b, red;
+    if ( r.oddRow ) {
+      red = sel(site, c, h);
+      b   = sel(site, diag, v);
+    } else {
+      b   = sel(site, c, h);
+      red = sel(site, diag, v);
+    }
+    if ( r.balance ) {
+      b = scale8(b, kB); g = scale8(g, kG); red = scale8(red, kR);
+    }
+    store32(r.dst + 3*x, b, g, red);
+  }
+  return x;
+}
+
+static int greenAVX2(const DemosaicRow &r, int x0, int x1)
+{
+  const __m256i site = r.oddRow ? _mm256_set1_epi32((int)0xFFFF0000)
+                                : _mm256_set1_epi32(0x0000FFFF);
+  const __m256i one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2);
+  int x = x0;
+  for ( ; x + 16 <= x1; x += 16 ) {
+    __m256i c  = load16w(r.mid + x);
+    __m256i w  = load16w(r.mid + x - 1), e  = load16w(r.mid + x + 1);
+    __m256i ww = load16w(r.mid + x - 2), ee = load16w(r.mid + x + 2);
+    __m256i n  = load16w(r.up + x),      s  = load16w(r.down + x);
+    __m256i nn = load16w(r.up2 + x),     ss = load16w(r.down2 + x);
+    __m256i c2 = _mm256_add_epi16(c, c);
+
+    __m256i lapH = _mm256_sub_epi16(_mm256_sub_epi16(c2, ww), ee);
+    __m256i lapV = _mm256_sub_epi16(_mm256_sub_epi16(c2, nn), ss);
+    __m256i dH = _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(w, e)),
+                                  _mm256_abs_epi16(lapH));
+    __m256i dV = _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(n, s)),
+                                  _mm256_abs_epi16(lapV));
+    __m256i eH = clamp16(_mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(
+      _mm256_slli_epi16(_mm256_add_epi16(w, e), 1), lapH), two), 2));
+    __m256i eV = clamp16(_mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(
+      _mm256_slli_epi16(_mm256_add_epi16(n, s), 1), lapV), two), 2));
+    __m256i both = _mm256_srli_epi16(
+      _mm256_add_epi16(_mm256_add_epi16(eH, eV), one), 1);
+
+    __m256i g = sel(_mm256_cmpgt_epi16(dV, dH), eH,
+                    sel(_mm256_cmpgt_epi16(dH, dV), eV, both));
+    g = sel(site, g, c);
+    _mm_storeu_si128((__m128i *)(r.green + x), pack16(g));
+  }
+  return x;
+}
+
+static inline __m256i diff(const uint8_t *a, const uint8_t *g)
+{
+  return _mm256_sub_epi16(load16w(a), load16w(g));
+}
+
+static int chromaAVX2(const DemosaicRow &r, int x0, int x1)
+{
+  const __m256i site = r.oddRow ? _mm256_set1_epi32((int)0xFFFF0000)
+                                : _mm256_set1_epi32(0x0000FFFF);
+  const __m256i one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2);
+  const __m256i kB = _mm256_set1_epi16(r.kB), kG = _mm256_set1_epi16(r.kG),
+                kR = _mm256_set1_epi16(r.kR);
+  int x = x0;
+  for ( ; x + 16 <= x1; x += 16 ) {
+    __m256i c = load16w(r.mid + x), g = load16w(r.gMid + x);
+    __m256i dh = _mm256_add_epi16(diff(r.mid + x - 1, r.gMid + x - 1),
+                                  diff(r.mid + x + 1, r.gMid + x + 1));
+    __m256i dv = _mm256_add_epi16(diff(r.up + x, r.gUp + x),
+                                  diff(r.down + x, r.gDown + x));
+    __m256i dd = _mm256_add_epi16(
+      _mm256_add_epi16(diff(r.up + x - 1, r.gUp + x - 1),
+                       diff(r.up + x + 1, r.gUp + x + 1)),
+      _mm256_add_epi16(diff(r.down + x - 1, r.gDown + x - 1),
+                       diff(r.down + x + 1, r.gDown + x + 1)));
+
+    __m256i hv = clamp16(_mm256_add_epi16(g,
+      _mm256_srai_epi16(_mm256_add_epi16(dh, one), 1)));
+    __m256i vv = clamp16(_mm256_add_epi16(g,
+      _mm256_srai_epi16(_mm256_add_epi16(dv, one), 1)));
+    __m256i dg = clamp16(_mm256_add_epi16(g,
+      _mm256_srai_epi16(_mm256_add_epi16(dd, two), 2)));
+
+    __m256i b, red;
+    if ( r.oddRow ) {
+      red = sel(site, c, hv);
+      b   = sel(site, dg, vv);
+    } else {
+      b   = sel(site, c, hv);
+      red = sel(site, dg, vv);
+    }
+    if ( r.balance ) {
+      b = scale16(b, kB); g = scale16(g, kG); red = scale16(red, kR);
+    }
+    store16(r.dst + 3*x, pack16(b), pack16(g), pack16(red));
+  }
+  return x;
+}
+
+bool demosaicKernelsAVX2(DemosaicKernelSet &k)
+{
+  k.bilinear = bilinearAVX2;
+  k.green = greenAVX2;
+  k.chroma = chromaAVX2;
+  return true;
+}
+
+#else
+
+bool demosaicKernelsAVX2(DemosaicKernelSet &k)
+{
+  (void)k;
+  return false;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Compares BayerBG8 -> BGR8 conversion paths on full-size synthetic
+// frames: the in-tree engine (each method / instruction set / thread
+// count), OpenCV's cvtColor and Pylon's CImageFormatConverter.
+//
+//   DemosaicBench [iterations] [settings.pfs]
+//
+// Reports the mean and best time per frame, and the PSNR against the
+// full-color image the mosaic was sampled from (borders excluded), so
+// speed and quality can be weighed together. With a .pfs file the
+// in-tree engine is also timed with the white balance folded in.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <pylon/PylonIncludes.h>
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "PhotoFuncs.h"
+#include "Demosaic.h"
+
+using namespace cv;
+using namespace Pylon;
+using namespace std;
+
+static const int W = 3840, H = 2748;
+
+// A vane-like background with soft gradients and stripes, a dark
+// fly-shaped blob, and a little sensor noise.
+static void makeScene(vector<uint8_t> &bgr)
+{
+  bgr.resize((size_t)W * H * 3);
+  srand(1);
+  for ( int y = 0; y < H; y++ ) {
+    for ( int x = 0; x < W; x++ ) {
+      double bg = 150 + 40 * sin(x / 90.0) * cos(y / 130.0);
+      double stripe = ((x + y) / 40) % 2 ? 12 : -12;
+      double b = bg + stripe, g = bg * 0.9 + stripe, r = bg * 0.8;
+
+      double dx = (x - W/2) / 300.0, dy = (y - H/2) / 120.0;
+      double body = dx*dx + dy*dy;
+      if ( body < 1.0 ) {
+        b = 40 + 30 * body; g = 35 + 25 * body; r = 60 + 20 * body;
+      }
+      double noise = (rand() % 9) - 4;
+      uint8_t *p = &bgr[((size_t)y * W + x) * 3];
+      p[0] = (uint8_t)min(255.0, max(0.0, b + noise));
+      p[1] = (uint8_t)min(255.0, max(0.0, g + noise));
+      p[2] = (uint8_t)min(255.0, max(0.0, r + noise));
+    }
+  }
+}
+
+// Sample the scene through a BG/GR color filter array.
+static void makeMosaic(const vector<uint8_t> &bgr, vector<uint8_t> &raw)
+{
+  raw.resize((size_t)W * H);
+  for ( int y = 0; y < H; y++ ) {
+    for ( int x = 0; x < W; x++ ) {
+      int ch = (y & 1) == 0 ? ((x & 1) == 0 ? 0 : 1) : ((x & 1) == 0 ? 1 : 2);
+      raw[(size_t)y * W + x] = bgr[((size_t)y * W + x) * 3 + ch];
+    }
+  }
+}
+
+static double psnr(const vector<uint8_t> &ref, const uint8_t *img)
+{
+  double se = 0; size_t n = 0;
+  for ( int y = 2; y < H - 2; y++ ) {
+    for ( int i = 6; i < (W - 2) * 3; i++ ) {
+      double d = (double)ref[(size_t)y * W * 3 + i] - img[(size_t)y * W * 3 + i];
+      se += d * d; n++;
+    }
+  }
+  if ( se == 0 ) return 99.0;
+  return 10.0 * log10(255.0 * 255.0 / (se / n));
+}
+
+struct Result {
+  string name;
+  double meanMs, bestMs, psnr;
+};
+
+template <class F>
+static Result timeIt(const string &name, int iterations, F convert,
+                     const vector<uint8_t> &ref, const uint8_t *out)
+{
+  convert();  // warm up caches and thread start-up
+  double total = 0, best = 1e30;
+  for ( int i = 0; i < iterations; i++ ) {
+    unsigned long long t0 = monotonicUs();
+    convert();
+    double ms = (monotonicUs() - t0) / 1000.0;
+    total += ms;
+    if ( ms < best ) best = ms;
+  }
+  Result r;
+  r.name = name;
+  r.meanMs = total / iterations;
+  r.bestMs = best;
+  r.psnr = psnr(ref, out);
+  printf("  %-32s %8.1f ms  %8.1f ms  %6.2f dB\n", r.name.c_str(), r.meanMs,
+    r.bestMs, r.psnr);
+  fflush(stdout);
+  return r;
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 10;
+  if ( iterations < 1 ) iterations = 1;
+
+  DemosaicOptions balanced;
+  bool haveBalance = argc > 2 && demosaicBalanceFromPfs(argv[2], balanced) == 0;
+
+  printf("Building %dx%d synthetic mosaic...\n", W, H);
+  vector<uint8_t> scene, raw;
+  makeScene(scene);
+  makeMosaic(scene, raw);
+  vector<uint8_t> out((size_t)W * H * 3);
+
+  int cores = thread::hardware_concurrency();
+  printf("%d iterations, %d cores.\n\n", iterations, cores);
+  printf("  %-32s %11s  %11s  %9s\n", "path", "mean", "best", "PSNR");
+
+  vector<Result> results;
+
+  const DemosaicIsa isas[] = { DemosaicScalar, DemosaicSSE2, DemosaicAVX2 };
+  const DemosaicMethod methods[] = { DemosaicBilinear, DemosaicEdgeAware };
+  for ( int m = 0; m < 2; m++ ) {
+    for ( int i = 0; i < 3; i++ ) {
+      if ( !demosaicIsaSupported(isas[i]) ) continue;
+      int threadCounts[] = { 1, cores };
+      for ( int t = 0; t < (cores > 1 ? 2 : 1); t++ ) {
+        DemosaicOptions opt;
+        opt.method = methods[m];
+        opt.isa = isas[i];
+        opt.threads = threadCounts[t];
+        char name[64];
+        snprintf(name, sizeof(name), "in-tree %s %s x%d",
+          methods[m] == DemosaicBilinear ? "bilinear" : "edge",
+          demosaicIsaName(isas[i]), opt.threads);
+        results.push_back(timeIt(name, iterations, [&]() {
+          demosaicBayerBG8(&raw[0], W, &out[0], W * 3, W, H, opt);
+        }, scene, &out[0]));
+      }
+    }
+  }
+
+  if ( haveBalance ) {
+    // PSNR is against the unbalanced scene, so it isn't comparable here.
+    for ( int m = 0; m < 2; m++ ) {
+      DemosaicOptions opt = balanced;
+      opt.method = methods[m];
+      string name = string("in-tree ") +
+        (methods[m] == DemosaicBilinear ? "bilinear" : "edge") + " +balance";
+      results.push_back(timeIt(name, iterations, [&]() {
+        demosaicBayerBG8(&raw[0], W, &out[0], W * 3, W, H, opt);
+      }, scene, &out[0]));
+    }
+  }
+
+  Mat rawMat(H, W, CV_8UC1, &raw[0]);
+  Mat outMat(H, W, CV_8UC3, &out[0]);
+  results.push_back(timeIt("cv::cvtColor bilinear", iterations, [&]() {
+    cvtColor(rawMat, outMat, COLOR_BayerRG2BGR);
+  }, scene, &out[0]));
+#if CV_MAJOR_VERSION >= 3
+  results.push_back(timeIt("cv::cvtColor edge-aware", iterations, [&]() {
+    cvtColor(rawMat, outMat, COLOR_BayerRG2BGR_EA);
+  }, scene, &out[0]));
+#endif
+
+  PylonInitialize();
+  try {
+    CImageFormatConverter fc;
+    fc.OutputPixelFormat = PixelType_BGR8packed;
+    results.push_back(timeIt("Pylon CImageFormatConverter", iterations, [&]() {
+      fc.Convert(&out[0], out.size(), &raw[0], raw.size(), PixelType_BayerBG8,
+        W, H, 0, ImageOrientation_TopDown);
+    }, scene, &out[0]));
+  } catch (const GenericException &e) {
+    cerr << "Pylon conversion failed: " << e.GetDescription() << endl;
+  }
+  PylonTerminate();
+
+  size_t fastest = 0;
+  for ( size_t i = 1; i < results.size(); i++ ) {
+    if ( results[i].meanMs < results[fastest].meanMs ) fastest = i;
+  }
+  printf("\nFastest: %s (%.1f ms/frame, %.0f frames/s).\n",
+    results[fastest].name.c_str(), results[fastest].meanMs,
+    1000.0 / results[fastest].meanMs);
+
+  return 0;
+}
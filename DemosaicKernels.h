@@ -0,0 +1,70 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Internal to the demosaic engine: the per-row interface shared by the
+// scalar, SSE2 and AVX2 inner loops. Not for use outside Demosaic*.cpp.
+
+#ifndef __DEMOSAICKERNELS_H__
+#define __DEMOSAICKERNELS_H__
+
+#include <stdint.h>
+
+// One output row. Source rows are y-2 .. y+2; the kernels are only
+// called for rows and columns at least two pixels from the border, so
+// they never need to clamp.
+struct DemosaicRow {
+  const uint8_t *up2, *up, *mid, *down, *down2;
+  const uint8_t *gUp, *gMid, *gDown;  // edge-aware green plane, rows y-1..y+1
+  uint8_t *green;                     // edge-aware green pass output
+  uint8_t *dst;                       // packed BGR output
+  int oddRow;                         // 0: B G B G ...  1: G R G R ...
+  int balance;                        // apply kB/kG/kR
+  uint16_t kB, kG, kR;                // balance ratios, 8.8 fixed point
+};
+
+// Each kernel processes columns [x0, x1) -- x0 even -- and returns the
+// first column it did not do; the caller finishes the row in scalar.
+// Vector kernels may write up to 4 bytes past the last BGR pixel they
+// produce, so the caller must fill those columns afterwards.
+typedef int (*DemosaicRowKernel)(const DemosaicRow &r, int x0, int x1);
+
+struct DemosaicKernelSet {
+  DemosaicRowKernel bilinear;
+  DemosaicRowKernel green;    // edge-aware pass 1
+  DemosaicRowKernel chroma;   // edge-aware pass 2
+};
+
+// Returns false if the instruction set wasn't compiled in.
+bool demosaicKernelsSSE2(DemosaicKernelSet &k);
+bool demosaicKernelsAVX2(DemosaicKernelSet &k);
+
+// The arithmetic every path must reproduce exactly.
+
+static inline int dmAvg(int a, int b) { return (a + b + 1) >> 1; }
+
+static inline int dmClamp(int v) { return v < 0 ? 0 : (v > 255 ? 255 : v); }
+
+static inline int dmAbs(int v) { return v < 0 ? -v : v; }
+
+// v * k / 256, rounded, saturated (matches _mm_mulhi_epu16 on v<<8|0x80).
+static inline int dmScale(int v, int k)
+{
+  int s = (int)((((unsigned)v << 8 | 0x80) * (unsigned)k) >> 16);
+  return s > 255 ? 255 : s;
+}
+
+// Hamilton-Adams green estimate at a red or blue site.
+static inline int dmGreenAt(int c, int w, int e, int ww, int ee,
+                            int n, int s, int nn, int ss)
+{
+  int dH = dmAbs(w - e) + dmAbs(2*c - ww - ee);
+  int dV = dmAbs(n - s) + dmAbs(2*c - nn - ss);
+  int eH = dmClamp((2*(w + e) + 2*c - ww - ee + 2) >> 2);
+  int eV = dmClamp((2*(n + s) + 2*c - nn - ss + 2) >> 2);
+  if ( dH < dV ) return eH;
+  if ( dV < dH ) return eV;
+  return (eH + eV + 1) >> 1;
+}
+
+#endif // __DEMOSAICKERNELS_H__
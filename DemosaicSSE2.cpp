@@ -0,0 +1,219 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// SSE2 inner loops for the demosaic engine. Must match the scalar code
+// in Demosaic.cpp bit for bit.
+
+#include "DemosaicKernels.h"
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+static inline __m128i sel(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Four 32-bit B,G,R,0 pixels -> 12 packed bytes at d. Writes 16 bytes;
+// the caller overwrites the extra 4 with the next pixels.
+static inline void store4(uint8_t *d, __m128i p)
+{
+  const __m128i lo24  = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+  const __m128i mid24 = _mm_set_epi32(0x0000FFFF, (int)0xFF000000,
+                                      0x0000FFFF, (int)0xFF000000);
+  const __m128i lo48  = _mm_set_epi32(0, 0, 0x0000FFFF, (int)0xFFFFFFFF);
+
+  // Squeeze each 64-bit lane to 6 bytes, then butt the lanes together.
+  __m128i m = _mm_or_si128(_mm_and_si128(p, lo24),
+                           _mm_and_si128(_mm_srli_epi64(p, 8), mid24));
+  __m128i r = _mm_or_si128(_mm_and_si128(m, lo48),
+                           _mm_slli_si128(_mm_unpackhi_epi64(m, m), 6));
+  _mm_storeu_si128((__m128i *)d, r);
+}
+
+// 16 B, G and R bytes -> 48 packed bytes (writes 52).
+static inline void store16(uint8_t *d, __m128i b, __m128i g, __m128i r)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i bgL = _mm_unpacklo_epi8(b, g), bgH = _mm_unpackhi_epi8(b, g);
+  __m128i rL = _mm_unpacklo_epi8(r, zero), rH = _mm_unpackhi_epi8(r, zero);
+  store4(d,      _mm_unpacklo_epi16(bgL, rL));
+  store4(d + 12, _mm_unpackhi_epi16(bgL, rL));
+  store4(d + 24, _mm_unpacklo_epi16(bgH, rH));
+  store4(d + 36, _mm_unpackhi_epi16(bgH, rH));
+}
+
+// 8 B, G and R bytes (low halves) -> 24 packed bytes (writes 28).
+static inline void store8(uint8_t *d, __m128i b, __m128i g, __m128i r)
+{
+  __m128i bg = _mm_unpacklo_epi8(b, g);
+  __m128i r0 = _mm_unpacklo_epi8(r, _mm_setzero_si128());
+  store4(d,      _mm_unpacklo_epi16(bg, r0));
+  store4(d + 12, _mm_unpackhi_epi16(bg, r0));
+}
+
+// Balance on 16 bytes: (v<<8 | 0x80) * k >> 16, saturated.
+static inline __m128i scale8(__m128i v, __m128i k)
+{
+  const __m128i half = _mm_set1_epi8((char)0x80);
+  __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(half, v), k);
+  __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(half, v), k);
+  return _mm_packus_epi16(lo, hi);
+}
+
+// Balance on 8 16-bit values in 0..255.
+static inline __m128i scale16(__m128i v, __m128i k)
+{
+  return _mm_mulhi_epu16(_mm_or_si128(_mm_slli_epi16(v, 8),
+                                      _mm_set1_epi16(0x80)), k);
+}
+
+static inline __m128i load8(const uint8_t *p)
+{
+  return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+                           _mm_setzero_si128());
+}
+
+static inline __m128i load16(const uint8_t *p)
+{
+  return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline __m128i abs16(__m128i v)
+{
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static inline __m128i clamp16(__m128i v)
+{
+  return _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()),
+                       _mm_set1_epi16(255));
+}
+
+static int bilinearSSE2(const DemosaicRow &r, int x0, int x1)
+{
+  // Red/blue sites: even bytes on B G rows, odd bytes on G R rows.
+  const __m128i site = _mm_set1_epi16(r.oddRow ? (short)0xFF00 : 0x00FF);
+  const __m128i kB = _mm_set1_epi16(r.kB), kG = _mm_set1_epi16(r.kG),
+                kR = _mm_set1_epi16(r.kR);
+  int x = x0;
+  for ( ; x + 16 <= x1; x += 16 ) {
+    __m128i c = load16(r.mid + x);
+    __m128i h = _mm_avg_epu8(load16(r.mid + x - 1), load16(r.mid + x + 1));
+    __m128i v = _mm_avg_epu8(load16(r.up + x), load16(r.down + x));
+    __m128i diag = _mm_avg_epu8(
+      _mm_avg_epu8(load16(r.up + x - 1), load16(r.up + x + 1)),
+      _mm_avg_epu8(load16(r.down + x - 1), load16(r.down + x + 1)));
+    __m128i cross = _mm_avg_epu8(v, h);
+
+    __m128i g = sel(site, cross, c);
+    __m128i b, red;
+    if ( r.oddRow ) {
+      red = sel(site, c, h);
+      b   = sel(site, diag, v);
+    } else {
+      b   = sel(site, c, h);
+      red = sel(site, diag, v);
+    }
+    if ( r.balance ) {
+      b = scale8(b, kB); g = scale8(g, kG); red = scale8(red, kR);
+    }
+    store16(r.dst + 3*x, b, g, red);
+  }
+  return x;
+}
+
+static int greenSSE2(const DemosaicRow &r, int x0, int x1)
+{
+  const __m128i site = r.oddRow ? _mm_set1_epi32((int)0xFFFF0000)
+                                : _mm_set1_epi32(0x0000FFFF);
+  const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+  int x = x0;
+  for ( ; x + 8 <= x1; x += 8 ) {
+    __m128i c  = load8(r.mid + x);
+    __m128i w  = load8(r.mid + x - 1), e  = load8(r.mid + x + 1);
+    __m128i ww = load8(r.mid + x - 2), ee = load8(r.mid + x + 2);
+    __m128i n  = load8(r.up + x),      s  = load8(r.down + x);
+    __m128i nn = load8(r.up2 + x),     ss = load8(r.down2 + x);
+    __m128i c2 = _mm_add_epi16(c, c);
+
+    __m128i lapH = _mm_sub_epi16(_mm_sub_epi16(c2, ww), ee);
+    __m128i lapV = _mm_sub_epi16(_mm_sub_epi16(c2, nn), ss);
+    __m128i dH = _mm_add_epi16(abs16(_mm_sub_epi16(w, e)), abs16(lapH));
+    __m128i dV = _mm_add_epi16(abs16(_mm_sub_epi16(n, s)), abs16(lapV));
+    __m128i eH = clamp16(_mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(
+      _mm_slli_epi16(_mm_add_epi16(w, e), 1), lapH), two), 2));
+    __m128i eV = clamp16(_mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(
+      _mm_slli_epi16(_mm_add_epi16(n, s), 1), lapV), two), 2));
+    __m128i both = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(eH, eV), one), 1);
+
+    __m128i g = sel(_mm_cmpgt_epi16(dV, dH), eH,
+                    sel(_mm_cmpgt_epi16(dH, dV), eV, both));
+    g = sel(site, g, c);
+    _mm_storel_epi64((__m128i *)(r.green + x), _mm_packus_epi16(g, g));
+  }
+  return x;
+}
+
+static int chromaSSE2(const DemosaicRow &r, int x0, int x1)
+{
+  const __m128i site = r.oddRow ? _mm_set1_epi32((int)0xFFFF0000)
+                                : _mm_set1_epi32(0x0000FFFF);
+  const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2);
+  const __m128i kB = _mm_set1_epi16(r.kB), kG = _mm_set1_epi16(r.kG),
+                kR = _mm_set1_epi16(r.kR);
+  int x = x0;
+  for ( ; x + 8 <= x1; x += 8 ) {
+    __m128i c = load8(r.mid + x), g = load8(r.gMid + x);
+    __m128i dh = _mm_add_epi16(
+      _mm_sub_epi16(load8(r.mid + x - 1), load8(r.gMid + x - 1)),
+      _mm_sub_epi16(load8(r.mid + x + 1), load8(r.gMid + x + 1)));
+    __m128i dv = _mm_add_epi16(
+      _mm_sub_epi16(load8(r.up + x), load8(r.gUp + x)),
+      _mm_sub_epi16(load8(r.down + x), load8(r.gDown + x)));
+    __m128i dd = _mm_add_epi16(
+      _mm_add_epi16(_mm_sub_epi16(load8(r.up + x - 1), load8(r.gUp + x - 1)),
+                    _mm_sub_epi16(load8(r.up + x + 1), load8(r.gUp + x + 1))),
+      _mm_add_epi16(_mm_sub_epi16(load8(r.down + x - 1), load8(r.gDown + x - 1)),
+                    _mm_sub_epi16(load8(r.down + x + 1), load8(r.gDown + x + 1))));
+
+    __m128i hv = clamp16(_mm_add_epi16(g, _mm_srai_epi16(_mm_add_epi16(dh, one), 1)));
+    __m128i vv = clamp16(_mm_add_epi16(g, _mm_srai_epi16(_mm_add_epi16(dv, one), 1)));
+    __m128i dg = clamp16(_mm_add_epi16(g, _mm_srai_epi16(_mm_add_epi16(dd, two), 2)));
+
+    __m128i b, red;
+    if ( r.oddRow ) {
+      red = sel(site, c, hv);
+      b   = sel(site, dg, vv);
+    } else {
+      b   = sel(site, c, hv);
+      red = sel(site, dg, vv);
+    }
+    if ( r.balance ) {
+      b = scale16(b, kB); g = scale16(g, kG); red = scale16(red, kR);
+    }
+    store8(r.dst + 3*x, _mm_packus_epi16(b, b), _mm_packus_epi16(g, g),
+           _mm_packus_epi16(red, red));
+  }
+  return x;
+}
+
+bool demosaicKernelsSSE2(DemosaicKernelSet &k)
+{
+  k.bilinear = bilinearSSE2;
+  k.green = greenSSE2;
+  k.chroma = chromaSSE2;
+  return true;
+}
+
+#else
+
+bool demosaicKernelsSSE2(DemosaicKernelSet &k)
+{
+  (void)k;
+  return false;
+}
+
+#endif
@@ -0,0 +1,388 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <string.h>
+
+#include "PhotoFuncs.h"
+#include "DeviceSim.h"
+
+using namespace std;
+
+SimFaults::SimFaults() :
+  latencyUs(1000), jitterUs(0), dropRate(0.0), garbleRate(0.0), seed(1) { }
+
+SimDevice::SimDevice(const char *n, const SimFaults &f) :
+  name(n), faults(f), commands(0), master(-1), slave(-1), rng(f.seed),
+  stopping(false), dropped(0), garbled(0) { }
+
+SimDevice::~SimDevice()
+{
+  stop();
+}
+
+int SimDevice::start(const char *link)
+{
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ( master == -1 || grantpt(master) != 0 || unlockpt(master) != 0 ) {
+    perror("posix_openpt");
+    return -1;
+  }
+  slavePath = ptsname(master);
+
+  // Hold the slave open ourselves, in raw mode, so nothing is echoed
+  // before the client configures it and its close doesn't hang us up.
+  slave = open(slavePath.c_str(), O_RDWR | O_NOCTTY);
+  if ( slave == -1 ) {
+    perror(slavePath.c_str());
+    return -1;
+  }
+  struct termios options;
+  tcgetattr(slave, &options);
+  cfmakeraw(&options);
+  tcsetattr(slave, TCSANOW, &options);
+
+  if ( link != NULL ) {
+    unlink(link);
+    if ( symlink(slavePath.c_str(), link) != 0 ) {
+      perror(link);
+      return -1;
+    }
+    linkPath = link;
+  }
+
+  server = thread(&SimDevice::serve, this);
+  printf("%s simulator on %s.\n", name.c_str(), path());
+  return 0;
+}
+
+void SimDevice::stop()
+{
+  stopping = true;
+  if ( server.joinable() ) server.join();
+  if ( !linkPath.empty() ) unlink(linkPath.c_str());
+  linkPath.clear();
+  if ( slave != -1 ) close(slave);
+  if ( master != -1 ) close(master);
+  slave = master = -1;
+}
+
+const char *SimDevice::path()
+{
+  return linkPath.empty() ? slavePath.c_str() : linkPath.c_str();
+}
+
+void SimDevice::printStats()
+{
+  printf("  %-10s %d commands, %d replies dropped, %d garbled\n",
+    name.c_str(), (int)commands, (int)dropped, (int)garbled);
+}
+
+bool SimDevice::chance(double p)
+{
+  return p > 0 && rand_r(&rng) < p * ((double)RAND_MAX + 1);
+}
+
+void SimDevice::sleepUs(int us)
+{
+  if ( us > 0 ) usleep(us);
+}
+
+void SimDevice::reply(const void *data, int len)
+{
+  int delay = faults.latencyUs;
+  if ( faults.jitterUs > 0 ) delay += rand_r(&rng) % (faults.jitterUs + 1);
+  sleepUs(delay);
+
+  if ( chance(faults.dropRate) ) {
+    dropped++;
+    return;
+  }
+  unsigned char out[256];
+  if ( len > (int)sizeof(out) ) len = sizeof(out);
+  memcpy(out, data, len);
+  if ( len > 0 && chance(faults.garbleRate) ) {
+    out[rand_r(&rng) % len] ^= 0x20;
+    garbled++;
+  }
+  if ( write(master, out, len) != len ) perror("simulator write");
+}
+
+void SimDevice::reply(const char *line)
+{
+  reply(line, strlen(line));
+}
+
+void SimDevice::serve()
+{
+  unsigned char buf[256];
+  int len = 0;
+  while ( !stopping ) {
+    struct pollfd pfd;
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int r = poll(&pfd, 1, 100);
+    if ( r < 0 && errno != EINTR ) break;
+    if ( r <= 0 ) continue;
+
+    int n = read(master, buf + len, sizeof(buf) - len);
+    if ( n <= 0 ) {
+      if ( n < 0 && (errno == EINTR || errno == EAGAIN || errno == EIO) ) {
+        usleep(10000);
+        continue;
+      }
+      break;
+    }
+    len += n;
+
+    int used;
+    while ( len > 0 && (used = handle(buf, len)) > 0 ) {
+      memmove(buf, buf + used, len - used);
+      len -= used;
+    }
+    if ( len == (int)sizeof(buf) ) len = 0;  // garbage; start over
+  }
+}
+
+
+MaestroSim::MaestroSim(const SimFaults &f, int s) :
+  SimDevice("Maestro", f), speed(s)
+{
+  for ( int i = 0; i < nChannels; i++ ) {
+    channels[i].from = channels[i].target = 6000;
+    channels[i].movedUs = 0;
+    channels[i].speed = channels[i].accel = 0;
+  }
+}
+
+MaestroSim::~MaestroSim()
+{
+  stop();
+}
+
+// From c.from toward c.target at perMs quarter-us per ms (0 = at once).
+unsigned short MaestroSim::travel(const Channel &c, unsigned long long now,
+                                  double perMs)
+{
+  if ( perMs <= 0 ) return c.target;
+  unsigned long long travelled = (now - c.movedUs) / 1000.0 * perMs;
+  if ( c.target > c.from ) {
+    return c.from + travelled >= c.target ? c.target : c.from + travelled;
+  }
+  return (unsigned long long)(c.from - c.target) <= travelled ? c.target :
+    c.from - travelled;
+}
+
+unsigned short MaestroSim::ramp(const Channel &c, unsigned long long now)
+{
+  return travel(c, now, c.speed / 10.0);
+}
+
+unsigned short MaestroSim::position(int channel)
+{
+  lock_guard<mutex> l(lock);
+  if ( channel < 0 || channel >= nChannels ) return 0;
+  const Channel &c = channels[channel];
+  double perMs = c.speed / 10.0;
+  if ( speed > 0 && (perMs == 0 || speed < perMs) ) perMs = speed;
+  return travel(c, monotonicUs(), perMs);
+}
+
+// Call with lock held.
+void MaestroSim::setTarget(int ch, unsigned short target, unsigned long long now)
+{
+  if ( ch >= nChannels ) return;
+  if ( target != 0 && target < 3968 ) target = 3968;
+  if ( target > 8000 ) target = 8000;
+  channels[ch].from = ramp(channels[ch], now);
+  channels[ch].target = target;
+  channels[ch].movedUs = now;
+}
+
+int MaestroSim::handle(const unsigned char *buf, int len)
+{
+  switch ( buf[0] ) {
+  case 0x84: {  // set target: channel, low 7 bits, high 7 bits
+    if ( len < 4 ) return 0;
+    commands++;
+    lock_guard<mutex> l(lock);
+    setTarget(buf[1], (buf[2] & 0x7F) | (buf[3] & 0x7F) << 7, monotonicUs());
+    return 4;
+  }
+  case 0x9F: {  // set multiple targets: count, first channel, targets
+    if ( len < 3 || len < 3 + 2 * buf[1] ) return 0;
+    commands++;
+    lock_guard<mutex> l(lock);
+    unsigned long long now = monotonicUs();
+    for ( int i = 0; i < buf[1]; i++ ) {
+      setTarget(buf[2] + i, (buf[3 + 2*i] & 0x7F) | (buf[4 + 2*i] & 0x7F) << 7,
+                now);
+    }
+    return 3 + 2 * buf[1];
+  }
+  case 0x87:    // set speed
+  case 0x89: {  // set acceleration
+    if ( len < 4 ) return 0;
+    commands++;
+    int ch = buf[1], value = (buf[2] & 0x7F) | (buf[3] & 0x7F) << 7;
+    if ( ch < nChannels ) {
+      lock_guard<mutex> l(lock);
+      unsigned long long now = monotonicUs();
+      // Carry on from where the ramp has got to at the new rate.
+      channels[ch].from = ramp(channels[ch], now);
+      channels[ch].movedUs = now;
+      if ( buf[0] == 0x87 ) channels[ch].speed = value;
+      else channels[ch].accel = value;
+    }
+    return 4;
+  }
+  case 0x90: {  // get position: two bytes, low first
+    if ( len < 2 ) return 0;
+    commands++;
+    unsigned short pos = 0;
+    if ( buf[1] < nChannels ) {
+      lock_guard<mutex> l(lock);
+      pos = ramp(channels[buf[1]], monotonicUs());
+    }
+    unsigned char out[] = { (unsigned char)(pos & 0xFF), (unsigned char)(pos >> 8) };
+    reply(out, sizeof(out));
+    return 2;
+  }
+  case 0x93: {  // get moving state: 1 if any channel is short of its target
+    commands++;
+    unsigned char moving = 0;
+    {
+      lock_guard<mutex> l(lock);
+      unsigned long long now = monotonicUs();
+      for ( int i = 0; i < nChannels; i++ ) {
+        if ( ramp(channels[i], now) != channels[i].target ) moving = 1;
+      }
+    }
+    reply(&moving, 1);
+    return 1;
+  }
+  default:      // the real Maestro flags a serial error and skips it
+    return 1;
+  }
+}
+
+
+DispenserSim::DispenserSim(const SimFaults &f, int d, int n, double m) :
+  SimDevice("Dispenser", f), dispenseUs(d), flies(n), missRate(m) { }
+
+DispenserSim::~DispenserSim()
+{
+  stop();
+}
+
+int DispenserSim::handle(const unsigned char *buf, int len)
+{
+  (void)len;
+  if ( buf[0] == 'I' ) {
+    commands++;
+    reply("ok\n");
+  } else if ( buf[0] == 'F' ) {
+    commands++;
+    reply("ok\n");
+    sleepUs(dispenseUs);
+    if ( flies == 0 ) {
+      reply("t\n");
+    } else if ( chance(missRate) ) {
+      reply("n\n");
+    } else {
+      if ( flies > 0 ) flies--;
+      reply("f\n");
+    }
+  }
+  return 1;
+}
+
+
+ArduinoSim::ArduinoSim(const SimFaults &f, int s) :
+  SimDevice("Arduino", f), stepUs(s)
+{
+  burst.pulses = burst.intervalUs = 0;
+  burst.firstUs = 0;
+}
+
+ArduinoSim::~ArduinoSim()
+{
+  stop();
+}
+
+ArduinoSim::Burst ArduinoSim::pulses()
+{
+  lock_guard<mutex> l(lock);
+  return burst;
+}
+
+int ArduinoSim::handle(const unsigned char *buf, int len)
+{
+  if ( buf[0] == 'T' ) {
+    const unsigned char *end = (const unsigned char *)memchr(buf, '\n', len);
+    if ( end == NULL ) return len < 64 ? 0 : len;
+    int n, interval, settle;
+    if ( sscanf((const char *)buf, "T%d,%d,%d", &n, &interval, &settle) == 3 ) {
+      commands++;
+      sleepUs(stepUs + settle);
+      {
+        lock_guard<mutex> l(lock);
+        burst.pulses = n;
+        burst.intervalUs = interval;
+        burst.firstUs = monotonicUs();
+      }
+      reply("T\n");
+    }
+    return end - buf + 1;
+  }
+  if ( strchr("AOPpSs", buf[0]) != NULL && buf[0] != 0 ) {
+    commands++;
+    if ( buf[0] == 'S' ) sleepUs(stepUs);
+    char line[] = { (char)buf[0], '\n', 0 };
+    reply(line);
+  }
+  return 1;
+}
+
+
+SimSetup::SimSetup() :
+  servoSpeed(0), dispenseUs(2000000), flies(-1), missRate(0.0), stepUs(50000) { }
+
+const char *simOptionsUsage =
+  "  -latency ms   reply latency (default 1)\n"
+  "  -jitter ms    extra random latency, up to this much\n"
+  "  -drop p       chance a reply is lost\n"
+  "  -garble p     chance a reply has a corrupted byte\n"
+  "  -seed n       fault random seed\n"
+  "  -speed q      servo slew rate, quarter-us per ms (0 = instant)\n"
+  "  -dispense ms  time from F to the fly status (default 2000)\n"
+  "  -stock n      flies in the dispenser (default endless)\n"
+  "  -miss p       chance the dispenser reports n\n"
+  "  -step ms      vane step time (default 50)\n";
+
+bool simOption(int argc, char **argv, int &i, SimSetup &setup)
+{
+  if ( i + 1 >= argc ) return false;
+  const char *opt = argv[i], *val = argv[i + 1];
+  if ( strcmp(opt, "-latency") == 0 ) setup.faults.latencyUs = atof(val) * 1000;
+  else if ( strcmp(opt, "-jitter") == 0 ) setup.faults.jitterUs = atof(val) * 1000;
+  else if ( strcmp(opt, "-drop") == 0 ) setup.faults.dropRate = atof(val);
+  else if ( strcmp(opt, "-garble") == 0 ) setup.faults.garbleRate = atof(val);
+  else if ( strcmp(opt, "-seed") == 0 ) setup.faults.seed = atoi(val);
+  else if ( strcmp(opt, "-speed") == 0 ) setup.servoSpeed = atoi(val);
+  else if ( strcmp(opt, "-dispense") == 0 ) setup.dispenseUs = atof(val) * 1000;
+  else if ( strcmp(opt, "-stock") == 0 ) setup.flies = atoi(val);
+  else if ( strcmp(opt, "-miss") == 0 ) setup.missRate = atof(val);
+  else if ( strcmp(opt, "-step") == 0 ) setup.stepUs = atof(val) * 1000;
+  else return false;
+  i++;
+  return true;
+}
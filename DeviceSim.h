@@ -0,0 +1,163 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __DEVICESIM_H__
+#define __DEVICESIM_H__
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+// How a simulated device misbehaves. Rates are probabilities per reply.
+struct SimFaults {
+  int latencyUs;       // before every reply
+  int jitterUs;        // plus up to this much, uniformly
+  double dropRate;     // reply never sent
+  double garbleRate;   // one byte of the reply flipped
+  unsigned seed;
+
+  SimFaults();
+};
+
+// A device on the far end of a pseudo-terminal. The slave side looks like
+// a USB serial port to openSerialPort(); a thread on the master side
+// speaks the device's protocol.
+//
+// Subclasses parse commands in handle() and answer with reply(), which
+// applies the latency and faults. They must call stop() in their
+// destructor, since the server thread calls handle().
+class SimDevice {
+public:
+  SimDevice(const char *name, const SimFaults &faults);
+  virtual ~SimDevice();
+
+  // Create the pty and start serving. If link is given, a symlink to the
+  // slave is made there (and removed by stop()). Returns 0 or -1.
+  int start(const char *link = NULL);
+  void stop();
+
+  // Path to open, e.g. /dev/pts/5 (or the link).
+  const char *path();
+
+  // Commands handled and replies dropped/garbled so far.
+  void printStats();
+
+protected:
+  // Called with everything received but not yet consumed. Returns the
+  // number of bytes used; 0 means wait for more.
+  virtual int handle(const unsigned char *buf, int len) = 0;
+
+  void reply(const void *data, int len);
+  void reply(const char *line);
+  // true with probability p, from this device's generator.
+  bool chance(double p);
+  void sleepUs(int us);
+
+  std::string name;
+  SimFaults faults;
+  std::atomic<int> commands;
+
+private:
+  void serve();
+
+  int master, slave;
+  std::string slavePath, linkPath;
+  unsigned rng;
+  std::atomic<bool> stopping;
+  std::atomic<int> dropped, garbled;
+  std::thread server;
+};
+
+// Pololu Maestro, compact protocol: 0x84 set target, 0x9F set multiple
+// targets, 0x87 / 0x89 set speed / acceleration, 0x90 get position and
+// 0x93 get moving state.
+//
+// As on the real thing, the reported position is the Maestro's ramp
+// toward the target, limited by the channel's speed setting (0 = jump at
+// once); acceleration is accepted but not modelled. Targets are clamped
+// to the Maestro's default channel range, 992 to 2000 us. The servo
+// itself follows the ramp at no more than `speed` quarter-us per ms (0 =
+// keeps up with anything); position() is where the servo actually is.
+class MaestroSim : public SimDevice {
+public:
+  MaestroSim(const SimFaults &faults, int speed = 0);
+  ~MaestroSim();
+  unsigned short position(int channel);
+
+protected:
+  virtual int handle(const unsigned char *buf, int len);
+
+  struct Channel {
+    unsigned short from, target;
+    unsigned long long movedUs;
+    int speed, accel;   // Maestro settings, (0.25 us) / (10 ms) etc.
+  };
+  unsigned short travel(const Channel &c, unsigned long long now, double perMs);
+  unsigned short ramp(const Channel &c, unsigned long long now);
+  void setTarget(int channel, unsigned short target, unsigned long long now);
+
+  static const int nChannels = 6;
+  Channel channels[nChannels];
+  int speed;
+  std::mutex lock;
+};
+
+// The fly dispenser: "I" -> "ok\n"; "F" -> "ok\n", then after dispenseUs
+// one of f (fly), t (gave up) or n (not seen at the tip).
+class DispenserSim : public SimDevice {
+public:
+  // flies: how many are in stock (-1 = endless); after that it times out.
+  DispenserSim(const SimFaults &faults, int dispenseUs = 2000000,
+               int flies = -1, double missRate = 0.0);
+  ~DispenserSim();
+
+protected:
+  virtual int handle(const unsigned char *buf, int len);
+
+  int dispenseUs, flies;
+  double missRate;
+};
+
+// The Arduino: echoes A, O, P, p, S and s back as lines. S (step the
+// vanes) answers only after stepUs. "T<n>,<interval>,<settle>" steps the
+// vanes too, and answers "T" after the settle time, as the first of the n
+// trigger pulses would go out; pulses() is the last burst asked for.
+class ArduinoSim : public SimDevice {
+public:
+  ArduinoSim(const SimFaults &faults, int stepUs = 50000);
+  ~ArduinoSim();
+
+  struct Burst {
+    int pulses, intervalUs;
+    unsigned long long firstUs;   // monotonicUs() of the first pulse
+  };
+  Burst pulses();
+
+protected:
+  virtual int handle(const unsigned char *buf, int len);
+
+  int stepUs;
+  Burst burst;
+  std::mutex lock;
+};
+
+// Settings for a whole simulated booth, shared by BoothSim and CycleBench.
+struct SimSetup {
+  SimFaults faults;
+  int servoSpeed;       // MaestroSim speed
+  int dispenseUs;       // F -> f/t/n
+  int flies;            // dispenser stock, -1 = endless
+  double missRate;      // chance of n
+  int stepUs;           // S -> echo
+
+  SimSetup();
+};
+
+// Parses one simulator option at argv[i] (advancing i past its value).
+// Returns false if argv[i] isn't one.
+bool simOption(int argc, char **argv, int &i, SimSetup &setup);
+extern const char *simOptionsUsage;
+
+#endif // __DEVICESIM_H__
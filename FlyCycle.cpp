@@ -0,0 +1,240 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PhotoFuncs.h"
+#include "FlyCycle.h"
+#include "Trace.h"
+
+using namespace std;
+
+// Devices a step can reserve.
+#define RES_DISPENSER 0x01
+#define RES_INLET     0x02
+#define RES_OUTLET    0x04
+#define RES_VANES     0x08
+#define RES_PUMP      0x10
+#define RES_UPPER     0x20
+#define RES_LOWER     0x40
+
+CycleConfig::CycleConfig() :
+  flies(1), dispenseAhead(true), vanesDuringPump(true),
+  dispenseTimeoutMs(20000), gateTimeoutMs(2000), gateMarginUs(GATE_MARGIN_US),
+  fallUs(500000), pumpUs(3000000) { }
+
+FlyCycle::FlyCycle(const BoothPorts &p, const CycleConfig &c, CaptureStep cap) :
+  ports(p), cfg(c), capture(cap), startUs(0), endUs(0) { }
+
+// The dispenser's verdict after "F":
+//   f = fly dispensed
+//   t = timeout
+//   n = didn't detect fly at tip
+int dispenseOne(int dispenserFD, int timeoutMs)
+{
+  if ( dispenseFly(dispenserFD) != 0 ) {
+    printf("error dispensing fly\n");
+    return -1;
+  }
+
+  char replyString[100];
+  int n = serialport_read_until(dispenserFD, replyString, '\n', 100, timeoutMs);
+  if ( n == -2 ) {
+    printf("No reply from dispenser within %d ms.\n", timeoutMs);
+    return -1;
+  } else if ( n != 0 ) {
+    perror("error reading from dispenser");
+    return -1;
+  }
+
+  if ( strcmp(replyString, "t\n") == 0 ) {
+    printf("Timeout waiting for dispense.\n");
+    return 1;
+  } else if ( strcmp(replyString, "n\n") == 0 ) {
+    printf("Dispensed fly but didn't see at detector.\n");
+    return 1;
+  } else if ( strcmp(replyString, "f\n") != 0 ) {
+    printf("After dispense, expected 'f' from dispenser, received: '%s'\n",
+      replyString);
+  }
+  return 0;
+}
+
+// On success the next fly is queued, so its steps can start as soon as
+// the interlocks allow.
+StepResult FlyCycle::dispenseStep(int fly)
+{
+  printf("Dispensing fly %d.\n", fly);
+  int r = dispenseOne(ports.dispenserFD, cfg.dispenseTimeoutMs);
+  if ( r < 0 ) return StepFail;
+  if ( r > 0 ) return StepSkip;
+  printf("Dispensed fly %d.\n", fly);
+
+  if ( cfg.flies == 0 || fly < cfg.flies ) addFly(fly + 1);
+  return StepOk;
+}
+
+// Wait for the gates to finish moving, plus a margin for the servos to
+// catch up with the Maestro.
+StepResult FlyCycle::gatesSettled(unsigned int channels)
+{
+  if ( maestroWaitUntilSettled(ports.servoFD, channels, cfg.gateTimeoutMs) != 0 ) {
+    printf("error waiting for gates\n");
+    return StepFail;
+  }
+  traceSleep(cfg.gateMarginUs, "gate margin");
+  return StepOk;
+}
+
+void FlyCycle::addFly(int fly)
+{
+  const Fly *prev = flies.empty() ? NULL : &flies.back();
+  Fly f;
+
+  // This runs inside the previous fly's dispense step while the graph is
+  // live; none of these steps may start before it is wired to that fly.
+  graph.hold();
+
+  // Close the outlet and open the inlet once the chamber is empty.
+  f.prepare = graph.add("prepare", fly, RES_INLET | RES_OUTLET, [this]() {
+    const unsigned short gates[] = { INLET_GATE_OPEN, OUTLET_GATE_CLOSED };
+    if ( maestroSetTargets(ports.servoFD, 0, gates, 2) != 0 ) {
+      return StepFail;
+    }
+    return gatesSettled(GATE_CHANNELS);
+  });
+  f.dispense = graph.add("dispense", fly, RES_DISPENSER, [this, fly]() {
+    return dispenseStep(fly);
+  });
+  f.closeInlet = graph.add("closeInlet", fly, RES_INLET, [this]() {
+    // A fly dispensed ahead was waiting on the gate; let it drop first.
+    if ( cfg.dispenseAhead ) traceSleep(cfg.fallUs, "fly fall");
+    if ( maestroSetTarget(ports.servoFD, 0, INLET_GATE_CLOSED) != 0 ) {
+      return StepFail;
+    }
+    return gatesSettled(1 << 0);
+  });
+  f.capture = graph.add("capture", fly, RES_UPPER | RES_LOWER | RES_VANES,
+                        [this, fly]() {
+    return capture(fly);
+  });
+  f.vanesBack = graph.add("vanesBack", fly, RES_VANES, [this]() {
+    if ( stepVanes(ports.arduinoFD) != 0 ) {
+      printf("error stepping vanes\n");
+      return StepFail;
+    }
+    return StepOk;
+  });
+  f.openOutlet = graph.add("openOutlet", fly, RES_OUTLET, [this]() {
+    if ( maestroSetTarget(ports.servoFD, 1, OUTLET_GATE_OPEN) != 0 ) {
+      return StepFail;
+    }
+    return gatesSettled(1 << 1);
+  });
+  f.pump = graph.add("pump", fly, RES_PUMP, [this]() {
+    if ( pumpOn(ports.arduinoFD) != 0 ) {
+      printf("error turning on pump\n");
+      return StepFail;
+    }
+    traceSleep(cfg.pumpUs, "pump");
+    if ( pumpOff(ports.arduinoFD) != 0 ) {
+      printf("error turning off pump\n");
+      return StepFail;
+    }
+    return StepOk;
+  });
+
+  // The interlocks. Within a fly everything is sequential except that the
+  // vanes may return while the outlet opens and the pump runs.
+  if ( prev != NULL ) graph.after(f.prepare, prev->pump);
+  if ( cfg.dispenseAhead ) {
+    // Dispense into the closed inlet once the previous fly is shut in;
+    // the gates are reset only for a fly that actually came out.
+    if ( prev != NULL ) graph.after(f.dispense, prev->closeInlet);
+    graph.after(f.prepare, f.dispense);
+  } else {
+    graph.after(f.dispense, f.prepare);
+  }
+  graph.after(f.closeInlet, f.prepare);
+  graph.after(f.closeInlet, f.dispense);
+  graph.after(f.capture, f.closeInlet);
+  if ( prev != NULL ) graph.after(f.capture, prev->vanesBack);
+  graph.after(f.vanesBack, f.capture);
+  graph.after(f.openOutlet, f.capture);
+  if ( !cfg.vanesDuringPump ) graph.after(f.openOutlet, f.vanesBack);
+  graph.after(f.pump, f.openOutlet);
+  graph.release();
+
+  flies.push_back(f);
+}
+
+int FlyCycle::run()
+{
+  startUs = monotonicUs();
+  addFly(1);
+  StepResult r = graph.run();
+  endUs = monotonicUs();
+  if ( r == StepFail ) return -1;
+
+  int imaged = 0;
+  for ( size_t i = 0; i < flies.size(); i++ ) {
+    if ( graph.result(flies[i].capture) == StepOk ) imaged++;
+  }
+  return imaged;
+}
+
+unsigned long long FlyCycle::elapsedUs()
+{
+  return endUs - startUs;
+}
+
+unsigned long long FlyCycle::cycleUs()
+{
+  unsigned long long first = 0, last = 0;
+  int n = 0;
+  for ( size_t i = 0; i < flies.size(); i++ ) {
+    if ( graph.result(flies[i].pump) != StepOk ) continue;
+    unsigned long long t = graph.finishedUs(flies[i].pump);
+    if ( n == 0 ) first = t;
+    last = t;
+    n++;
+  }
+  return n < 2 ? 0 : (last - first) / (n - 1);
+}
+
+int FlyCycle::interlockBreaches()
+{
+  int breaches = 0;
+  for ( size_t i = 1; i < flies.size(); i++ ) {
+    unsigned long long emptied = graph.finishedUs(flies[i - 1].pump);
+    const int steps[] = { flies[i].prepare, flies[i].closeInlet };
+    const char *names[] = { "prepare", "closeInlet" };
+    for ( int s = 0; s < 2; s++ ) {
+      unsigned long long started = graph.startedUs(steps[s]);
+      if ( started == 0 ) continue;
+      if ( emptied == 0 || started < emptied ) {
+        printf("Interlock broken: fly %d %s started before fly %d was "
+          "pumped out.\n", (int)i + 1, names[s], (int)i);
+        breaches++;
+      }
+    }
+  }
+  return breaches;
+}
+
+void FlyCycle::printReport()
+{
+  graph.printTimeline();
+  graph.printStats();
+
+  unsigned long long cycle = cycleUs();
+  printf("Fly cycle (%s): %.1f s total", cfg.dispenseAhead ? "overlapped" :
+    "serial", elapsedUs() / 1e6);
+  if ( cycle > 0 ) {
+    printf(", %.2f s per fly, %.0f flies/hour", cycle / 1e6, 3600e6 / cycle);
+  }
+  printf(".\n");
+}
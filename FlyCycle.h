@@ -0,0 +1,98 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __FLYCYCLE_H__
+#define __FLYCYCLE_H__
+
+#include <deque>
+#include <functional>
+
+#include "Scheduler.h"
+
+// Serial ports the cycle drives.
+struct BoothPorts {
+  int servoFD;
+  int dispenserFD;
+  int arduinoFD;
+};
+
+// Timing and interlock rules for the fly cycle. Gate moves wait for the
+// Maestro to report the gates there (see Maestro.h) rather than for a
+// fixed time; the other delays are the ones the booth has always used.
+struct CycleConfig {
+  int flies;              // flies to image; 0 = until the dispenser runs dry
+
+  // Ask the dispenser for the next fly as soon as the current one is shut
+  // in the chamber. The new fly waits on the closed inlet gate until the
+  // chamber has been pumped out.
+  bool dispenseAhead;
+  // Step the vanes back while the fly is pumped out, instead of before
+  // opening the outlet gate.
+  bool vanesDuringPump;
+
+  int dispenseTimeoutMs;  // for the f/t/n status after "F"
+  int gateTimeoutMs;      // for a gate to reach its target
+  int gateMarginUs;       // after the Maestro's ramp ends, for the servo
+  int fallUs;             // for a waiting fly to drop once the inlet opens
+  int pumpUs;             // how long the pump runs
+
+  CycleConfig();
+};
+
+// Ask the dispenser for a fly and wait up to timeoutMs for its verdict.
+// Returns 0 if a fly was dispensed, 1 if none came (the dispenser timed
+// out or didn't see it at the tip), or -1 on a serial error.
+int dispenseOne(int dispenserFD, int timeoutMs);
+
+// Photographs one fly; called with the cameras and vanes reserved. It must
+// leave the vanes stepped once (upper -> lower view); the cycle steps them
+// back afterwards.
+typedef std::function<StepResult(int fly)> CaptureStep;
+
+// Runs the dispense / image / pump-out cycle for a series of flies.
+//
+// Each fly is a set of steps on a TaskGraph, and each step reserves the
+// devices it moves, so steps of consecutive flies overlap wherever the
+// interlocks allow: with dispenseAhead the next fly is dispensed while the
+// current one is imaged and pumped out, and the gates are reset for it as
+// soon as the pump stops.
+class FlyCycle {
+public:
+  FlyCycle(const BoothPorts &ports, const CycleConfig &cfg, CaptureStep capture);
+
+  // Returns the number of flies imaged, or -1 after a hardware error.
+  int run();
+
+  // Timeline, step durations and throughput of the last run().
+  void printReport();
+
+  // Checks the last run() against the one-fly-in-the-chamber rule: no
+  // fly's prepare or closeInlet may start before the previous fly's pump
+  // has finished. Prints each breach and returns how many there were.
+  int interlockBreaches();
+
+  // Mean time between consecutive flies leaving the chamber, in us (0 if
+  // fewer than two flies were imaged), and wall time of the run.
+  unsigned long long cycleUs();
+  unsigned long long elapsedUs();
+
+private:
+  struct Fly {
+    int prepare, dispense, closeInlet, capture, vanesBack, openOutlet, pump;
+  };
+
+  void addFly(int fly);
+  StepResult dispenseStep(int fly);
+  StepResult gatesSettled(unsigned int channels);
+
+  BoothPorts ports;
+  CycleConfig cfg;
+  CaptureStep capture;
+
+  TaskGraph graph;
+  std::deque<Fly> flies;
+  unsigned long long startUs, endUs;
+};
+
+#endif // __FLYCYCLE_H__
@@ -0,0 +1,177 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <vector>
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "FlyDetector.h"
+
+using namespace cv;
+using namespace std;
+
+DetectOptions::DetectOptions() :
+  scale(4), threshold(30), minArea(4000), pad(96), thumbWidth(0)
+{
+}
+
+FlyDetector::FlyDetector() : frames(0)
+{
+}
+
+void FlyDetector::shrink(const uint8_t *mosaic, int stride, int width,
+                         int height, Mat &small) const
+{
+  int scale = opt.scale < 2 ? 2 : opt.scale & ~1;
+  Mat raw(height, width, CV_8UC1, (void *)mosaic, stride);
+  resize(raw, small, Size(width / scale, height / scale), 0, 0, INTER_AREA);
+}
+
+int FlyDetector::addBackground(const uint8_t *mosaic, int stride, int width,
+                               int height)
+{
+  Mat small;
+  shrink(mosaic, stride, width, height, small);
+  if ( frames == 0 ) {
+    sum = Mat::zeros(small.rows, small.cols, CV_32FC1);
+  } else if ( small.size() != sum.size() ) {
+    printf("Background frames differ in size.\n");
+    return -1;
+  }
+  accumulate(small, sum);
+  frames++;
+  return 0;
+}
+
+int FlyDetector::finishBackground()
+{
+  if ( frames == 0 ) {
+    printf("No background frames.\n");
+    return -1;
+  }
+  sum.convertTo(background, CV_8U, 1.0 / frames);
+  sum.release();
+  frames = 0;
+  return 0;
+}
+
+int FlyDetector::save(const string &path) const
+{
+  if ( background.empty() || !imwrite(path, background) ) {
+    printf("Couldn't write %s.\n", path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+int FlyDetector::load(const string &path)
+{
+  Mat img = imread(path, IMREAD_GRAYSCALE);
+  if ( img.empty() ) return -1;
+  background = img;
+  return 0;
+}
+
+int FlyDetector::detect(const uint8_t *mosaic, int stride, int width,
+                        int height, Rect &roi) const
+{
+  Mat small, diff, mask;
+  shrink(mosaic, stride, width, height, small);
+  if ( background.empty() || small.size() != background.size() ) return -1;
+
+  absdiff(small, background, diff);
+  threshold(diff, mask, opt.threshold, 255, THRESH_BINARY);
+  // Lose specks of noise, then join the legs and wings to the body.
+  morphologyEx(mask, mask, MORPH_OPEN, Mat());
+  dilate(mask, mask, Mat(), Point(-1, -1), 2);
+
+  vector<vector<Point> > contours;
+  findContours(mask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+  int scale = width / small.cols;
+  double minArea = opt.minArea / (double)(scale * scale);
+  Rect box;
+  bool found = false;
+  for ( size_t i = 0; i < contours.size(); i++ ) {
+    if ( contourArea(contours[i]) < minArea ) continue;
+    Rect r = boundingRect(contours[i]);
+    box = found ? (box | r) : r;
+    found = true;
+  }
+  if ( !found ) return 1;
+
+  // Back to frame pixels, padded, on whole Bayer blocks.
+  int x0 = box.x * scale - opt.pad, y0 = box.y * scale - opt.pad;
+  int x1 = (box.x + box.width) * scale + opt.pad;
+  int y1 = (box.y + box.height) * scale + opt.pad;
+  x0 = x0 < 0 ? 0 : x0 & ~1;
+  y0 = y0 < 0 ? 0 : y0 & ~1;
+  x1 = (x1 > width ? width : x1 + 1) & ~1;
+  y1 = (y1 > height ? height : y1 + 1) & ~1;
+  roi = Rect(x0, y0, x1 - x0, y1 - y0);
+  return 0;
+}
+
+int captureBackground(CameraSource &source, FlyDetector &det, int nFrames)
+{
+  if ( source.startGrabbing(nFrames) != 0 ) return -1;
+  while ( source.isGrabbing() ) {
+    Frame frame;
+    int r = source.retrieve(5000, frame);
+    if ( r == 1 ) continue;
+    if ( r != 0 ) {
+      source.stopGrabbing();
+      return -1;
+    }
+    if ( det.addBackground(frame.data, frame.stride, frame.width,
+                           frame.height) != 0 ) {
+      source.stopGrabbing();
+      return -1;
+    }
+  }
+  return det.finishBackground();
+}
+
+void bayerThumbnail(const uint8_t *mosaic, int stride, int width, int height,
+                    const string &pixelFormat, int thumbWidth, Mat &bgr)
+{
+  // Where blue and red sit in each 2x2 block (row * 2 + column); the
+  // other two are green. -1: not a Bayer format.
+  int blue = -1, red = -1;
+  if ( pixelFormat == "BayerBG8" ) { blue = 0; red = 3; }
+  else if ( pixelFormat == "BayerRG8" ) { red = 0; blue = 3; }
+  else if ( pixelFormat == "BayerGB8" ) { blue = 1; red = 2; }
+  else if ( pixelFormat == "BayerGR8" ) { red = 1; blue = 2; }
+
+  int k = thumbWidth > 0 ? (width / 2) / thumbWidth : 1;
+  if ( k < 1 ) k = 1;
+  int tw = (width / 2) / k, th = (height / 2) / k;
+  bgr.create(th, tw, CV_8UC3);
+  int n = k * k;
+  for ( int ty = 0; ty < th; ty++ ) {
+    uint8_t *out = bgr.ptr(ty);
+    for ( int tx = 0; tx < tw; tx++ ) {
+      int sums[4] = { 0, 0, 0, 0 };
+      for ( int by = 0; by < k; by++ ) {
+        const uint8_t *r0 = mosaic + (size_t)(2 * (ty * k + by)) * stride + 2 * tx * k;
+        const uint8_t *r1 = r0 + stride;
+        for ( int bx = 0; bx < 2 * k; bx += 2 ) {
+          sums[0] += r0[bx];
+          sums[1] += r0[bx + 1];
+          sums[2] += r1[bx];
+          sums[3] += r1[bx + 1];
+        }
+      }
+      if ( blue < 0 ) {
+        out[0] = out[1] = out[2] = (sums[0] + sums[1] + sums[2] + sums[3]) / (4 * n);
+      } else {
+        out[0] = sums[blue] / n;
+        out[1] = (sums[0] + sums[1] + sums[2] + sums[3] - sums[blue] - sums[red]) / (2 * n);
+        out[2] = sums[red] / n;
+      }
+      out += 3;
+    }
+  }
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __FLYDETECTOR_H__
+#define __FLYDETECTOR_H__
+
+#include <string>
+#include "opencv2/core/core.hpp"
+
+#include "CameraSource.h"
+
+// Finds the fly in a raw frame, so only the part of the frame around it
+// needs to be stored.
+//
+// The background is a few frames of the empty chamber, averaged, taken
+// with the vanes where they will be when the camera fires. A frame is
+// shrunk the same way (scale x scale pixels to one, which on a Bayer
+// mosaic also mixes the colors into a luma value), compared with the
+// background, and every blob that differs by more than threshold and
+// covers at least minArea is the fly. The crop is the box around all of
+// them plus pad pixels, on whole 2x2 Bayer blocks so the crop is still
+// a mosaic of the same pattern.
+struct DetectOptions {
+  int scale;        // detection image is 1/scale of the frame (even)
+  int threshold;    // gray levels away from the background
+  int minArea;      // smallest blob counted, in frame pixels
+  int pad;          // frame pixels added on each side of the fly
+  int thumbWidth;   // also store a full-frame thumbnail this wide; 0 = no
+
+  DetectOptions();
+};
+
+class FlyDetector {
+public:
+  FlyDetector();
+
+  void setOptions(const DetectOptions &o) { opt = o; }
+  const DetectOptions &options() const { return opt; }
+
+  // Average frames into the background. Call addBackground() for each
+  // frame of the empty chamber, then finishBackground(). Returns 0, or
+  // -1 if a frame's size differs or there were no frames.
+  int addBackground(const uint8_t *mosaic, int stride, int width, int height);
+  int finishBackground();
+  bool ready() const { return !background.empty(); }
+
+  // The background as a PNG, so a session can reuse it. Returns 0 or -1.
+  int save(const std::string &path) const;
+  int load(const std::string &path);
+
+  // Where the fly is, in frame pixels. Returns 0 with roi set, 1 if
+  // nothing differs from the background, or -1 with no background (or
+  // one of another size). Safe to call from several threads at once.
+  int detect(const uint8_t *mosaic, int stride, int width, int height,
+             cv::Rect &roi) const;
+
+private:
+  void shrink(const uint8_t *mosaic, int stride, int width, int height,
+              cv::Mat &small) const;
+
+  DetectOptions opt;
+  cv::Mat background;     // CV_8UC1, 1/scale of the frame
+  cv::Mat sum;            // CV_32FC1 while frames are being added
+  int frames;
+};
+
+// Grab nFrames from source (which must not be grabbing) into det's
+// background. Returns 0 or -1.
+int captureBackground(CameraSource &source, FlyDetector &det, int nFrames);
+
+// A small BGR picture of the whole frame, thumbWidth wide: each pixel is
+// the average of a square of 2x2 Bayer blocks, so it costs one pass over
+// the mosaic and no demosaic. Formats that aren't Bayer come out gray.
+void bayerThumbnail(const uint8_t *mosaic, int stride, int width, int height,
+                    const std::string &pixelFormat, int thumbWidth,
+                    cv::Mat &bgr);
+
+#endif // __FLYDETECTOR_H__
@@ -0,0 +1,189 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Compares the output formats (ImageFormat.h) on full-size synthetic
+// frames, both as BGR (after the in-tree demosaic) and, where the format
+// can hold it, as the raw Bayer mosaic.
+//
+//   FormatBench [-frames n] [-dir path] [format ...]
+//
+// For each format it reports the time to encode and to write a frame,
+// the bytes on disk, and the time to read it back. Every file is read
+// back and compared with what was written: lossless formats must match
+// exactly, lossy ones report their PSNR. With no formats given, a spread
+// of PNG levels, TIFF, JPEG qualities and QOI is run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+#include "PhotoFuncs.h"
+#include "ImageFormat.h"
+#include "SyntheticSource.h"
+#include "Demosaic.h"
+
+using namespace cv;
+using namespace std;
+
+static const int W = 3840, H = 2748;
+
+struct Result {
+  double encodeMs, writeMs, readMs;
+  double bytes;
+  double psnr;     // 99 = identical
+  int frames;
+};
+
+static double psnr(const Mat &a, const Mat &b)
+{
+  double se = 0;
+  size_t rowBytes = (size_t)a.cols * a.channels();
+  for ( int y = 0; y < a.rows; y++ ) {
+    const unsigned char *p = a.ptr<unsigned char>(y), *q = b.ptr<unsigned char>(y);
+    for ( size_t i = 0; i < rowBytes; i++ ) {
+      double d = (double)p[i] - q[i];
+      se += d * d;
+    }
+  }
+  if ( se == 0 ) return 99.0;
+  return 10.0 * log10(255.0 * 255.0 / (se / ((double)rowBytes * a.rows)));
+}
+
+// Encode, write and read back one image. Returns 0, or -1 on an error.
+static int runOne(const Mat &img, const OutputFormat &fmt, const string &basename,
+                  Result &r)
+{
+  vector<unsigned char> data;
+  unsigned long long t0 = monotonicUs();
+  if ( encodeImage(img, fmt, data) != 0 ) return -1;
+  unsigned long long t1 = monotonicUs();
+
+  string path = basename + formatExtension(fmt.format);
+  FILE *fp = fopen(path.c_str(), "wb");
+  if ( fp == NULL ) {
+    perror(path.c_str());
+    return -1;
+  }
+  size_t n = fwrite(&data[0], 1, data.size(), fp);
+  if ( fclose(fp) != 0 || n != data.size() ) {
+    perror(path.c_str());
+    return -1;
+  }
+  unsigned long long t2 = monotonicUs();
+
+  Mat back = readImage(path);
+  unsigned long long t3 = monotonicUs();
+  if ( back.empty() || back.size() != img.size() ||
+       back.channels() != img.channels() ) {
+    printf("%s: didn't read back as written.\n", path.c_str());
+    return -1;
+  }
+
+  r.encodeMs += (t1 - t0) / 1000.0;
+  r.writeMs += (t2 - t1) / 1000.0;
+  r.readMs += (t3 - t2) / 1000.0;
+  r.bytes += data.size();
+  double p = psnr(img, back);
+  if ( p < r.psnr ) r.psnr = p;
+  r.frames++;
+  return 0;
+}
+
+static void printResult(const char *kind, const OutputFormat &fmt,
+                        const Result &r, size_t frameBytes)
+{
+  double n = r.frames;
+  char check[32];
+  if ( r.psnr >= 99.0 ) snprintf(check, sizeof(check), "exact");
+  else snprintf(check, sizeof(check), "%.1f dB", r.psnr);
+  printf("  %-5s %-9s %9.1f %9.1f %9.1f %7.1f %6.2f %9.1f  %s\n", kind,
+    formatName(fmt).c_str(), r.encodeMs / n, r.writeMs / n,
+    r.bytes / n / 1e6, frameBytes / (r.bytes / n),
+    frameBytes / 1e6 / ((r.encodeMs + r.writeMs) / n / 1000.0),
+    r.readMs / n, check);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  int frames = 3;
+  string dir = "/tmp/formatbench";
+  vector<OutputFormat> formats;
+
+  for ( int i = 1; i < argc; i++ ) {
+    OutputFormat fmt;
+    if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      frames = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-dir") == 0 && i + 1 < argc ) {
+      dir = argv[++i];
+    } else if ( parseOutputFormat(argv[i], fmt) ) {
+      formats.push_back(fmt);
+    } else {
+      printf("Usage: %s [-frames n] [-dir path] [format ...]\n"
+             "  format: %s\n", argv[0], outputFormatUsage);
+      return 1;
+    }
+  }
+  if ( frames < 1 ) frames = 1;
+  if ( formats.empty() ) {
+    const char *defaults[] = { "png", "png:1", "png:6", "tiff", "jpeg:95",
+                               "jpeg:80", "qoi" };
+    for ( size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++ ) {
+      OutputFormat fmt;
+      parseOutputFormat(defaults[i], fmt);
+      formats.push_back(fmt);
+    }
+  }
+  mkdir(dir.c_str(), 0755);
+
+  printf("Rendering %d synthetic %dx%d frames...\n", frames, W, H);
+  SyntheticSource source(W, H, 0, frames, 1);
+  vector<Mat> raws, bgrs;
+  DemosaicOptions opt;
+  for ( int i = 0; i < frames; i++ ) {
+    raws.push_back(Mat(H, W, CV_8UC1, (void *)source.mosaic(i)));
+    Mat bgr(H, W, CV_8UC3);
+    demosaicBayerBG8(source.mosaic(i), W, bgr.data, bgr.step, W, H, opt);
+    bgrs.push_back(bgr);
+  }
+
+  printf("Writing to %s; times are per frame.\n\n", dir.c_str());
+  printf("  %-5s %-9s %9s %9s %9s %7s %6s %9s  %s\n", "frame", "format",
+    "encode ms", "write ms", "MB", "ratio", "MB/s", "read ms", "check");
+
+  int status = 0;
+  const char *kinds[] = { "bgr", "raw" };
+  for ( int k = 0; k < 2; k++ ) {
+    const vector<Mat> &images = k == 0 ? bgrs : raws;
+    size_t frameBytes = (size_t)W * H * (k == 0 ? 3 : 1);
+    for ( size_t f = 0; f < formats.size(); f++ ) {
+      if ( k == 1 && !formatKeepsRaw(formats[f].format) ) continue;
+      Result r = Result();
+      r.psnr = 99.0;
+      for ( int i = 0; i < frames; i++ ) {
+        char basename[300];
+        snprintf(basename, sizeof(basename), "%s/%s%03d", dir.c_str(),
+          kinds[k], i);
+        if ( runOne(images[i], formats[f], basename, r) != 0 ) {
+          printf("  %-5s %-9s failed\n", kinds[k], formatName(formats[f]).c_str());
+          status = 1;
+          break;
+        }
+      }
+      if ( r.frames == frames ) printResult(kinds[k], formats[f], r, frameBytes);
+      if ( r.psnr < 99.0 && formats[f].format != FormatJPEG ) {
+        printf("  %s is meant to be lossless but the frames differ.\n",
+          formatName(formats[f]).c_str());
+        status = 1;
+      }
+    }
+  }
+  printf("\nMB/s is frame bytes over encode + write time.\n");
+  return status;
+}
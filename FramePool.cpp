@@ -0,0 +1,124 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "FramePool.h"
+
+using namespace std;
+
+FramePool::FramePool(size_t bufferBytes, size_t maxBytes) :
+  held(0), peakHeld(0), empty(0)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size = (bufferBytes + page - 1) / page * page;
+  if ( size == 0 ) size = page;
+  size_t n = maxBytes / size;
+  if ( n < 1 ) n = 1;
+
+  for ( size_t i = 0; i < n; i++ ) {
+    void *p;
+    if ( posix_memalign(&p, page, size) != 0 ) {
+      printf("Frame pool: couldn't allocate %zu buffers of %.1f MB.\n", n,
+        size / 1e6);
+      for ( size_t j = 0; j < all.size(); j++ ) free(all[j]);
+      all.clear();
+      freeList.clear();
+      return;
+    }
+    // Fault the pages in now rather than during the first grabs.
+    memset(p, 0, size);
+    all.push_back((uint8_t *)p);
+    freeList.push_back((uint8_t *)p);
+  }
+}
+
+FramePool::~FramePool()
+{
+  if ( freeList.size() != all.size() ) {
+    printf("Frame pool: %d buffers still in use at exit.\n",
+      (int)(all.size() - freeList.size()));
+    return;  // leak them rather than free memory someone still uses
+  }
+  for ( size_t i = 0; i < all.size(); i++ ) free(all[i]);
+}
+
+uint8_t *FramePool::take(int timeoutMs)
+{
+  unique_lock<mutex> l(lock);
+  if ( freeList.empty() ) {
+    empty++;
+    unsigned long long t0 = monotonicUs();
+    returned.wait_for(l, chrono::milliseconds(timeoutMs),
+      [this]() { return !freeList.empty(); });
+    waits.add(monotonicUs() - t0);
+    if ( freeList.empty() ) return NULL;
+  }
+  uint8_t *buffer = freeList.back();
+  freeList.pop_back();
+  return buffer;
+}
+
+void FramePool::give(uint8_t *buffer)
+{
+  {
+    lock_guard<mutex> l(lock);
+    freeList.push_back(buffer);
+  }
+  returned.notify_one();
+}
+
+shared_ptr<uint8_t> FramePool::acquire(int timeoutMs)
+{
+  uint8_t *buffer = take(timeoutMs);
+  if ( buffer == NULL ) return shared_ptr<uint8_t>();
+  {
+    lock_guard<mutex> l(lock);
+    if ( ++held > peakHeld ) peakHeld = held;
+  }
+  return shared_ptr<uint8_t>(buffer, [this](uint8_t *b) { release(b); });
+}
+
+void FramePool::release(uint8_t *buffer)
+{
+  unhold();
+  give(buffer);
+}
+
+void FramePool::unhold()
+{
+  lock_guard<mutex> l(lock);
+  held--;
+}
+
+shared_ptr<const void> FramePool::track(const shared_ptr<const void> &owner)
+{
+  {
+    lock_guard<mutex> l(lock);
+    if ( ++held > peakHeld ) peakHeld = held;
+  }
+  // The copy of owner in the deleter keeps the buffer until the last
+  // reference to the wrapper goes.
+  shared_ptr<const void> keep = owner;
+  return shared_ptr<const void>(owner.get(), [this, keep](const void *) mutable {
+    keep.reset();
+    unhold();
+  });
+}
+
+void FramePool::printStats(const char *name)
+{
+  lock_guard<mutex> l(lock);
+  printf("Frame pool (%s): %d x %.1f MB = %.0f MB; %d frames held now, "
+    "%d at most.\n", name, (int)all.size(), size / 1e6, bytes() / 1e6, held,
+    peakHeld);
+  if ( empty ) {
+    printf("  Out of buffers %lu times:\n", empty);
+    waits.print("waited");
+  }
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __FRAMEPOOL_H__
+#define __FRAMEPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "PhotoFuncs.h"
+
+// A fixed set of page-aligned frame buffers, allocated and touched once
+// up front and reused for the whole session, so grabbing a frame never
+// allocates or page-faults and the memory frames can tie up is capped.
+//
+// A camera grabs into these buffers (PylonSource installs the pool as
+// its Pylon buffer factory; SyntheticSource copies into them), and every
+// later stage works on views into the same memory through Frame. A
+// buffer is only reused once the last Frame referring to it is gone;
+// when all of them are in use, the grab waits for one to come back.
+//
+// The pool must outlive every Frame taken from it.
+class FramePool {
+public:
+  // As many buffers of bufferBytes (rounded up to whole pages) as fit in
+  // maxBytes, but at least one. Check ok() afterwards.
+  FramePool(size_t bufferBytes, size_t maxBytes);
+  ~FramePool();
+  bool ok() const { return !all.empty(); }
+
+  // A free buffer, waiting up to timeoutMs for one. It goes back to the
+  // pool when the last copy of the pointer is released. Empty if none
+  // came free in time.
+  std::shared_ptr<uint8_t> acquire(int timeoutMs);
+
+  // For an allocator that hands buffers out and back itself (Pylon's
+  // buffer factory): take() waits up to timeoutMs and returns NULL if no
+  // buffer came free; give() puts one back.
+  uint8_t *take(int timeoutMs);
+  void give(uint8_t *buffer);
+
+  // Wraps a Frame's owner so frames living on a taken buffer are counted
+  // as held, like the ones from acquire().
+  std::shared_ptr<const void> track(const std::shared_ptr<const void> &owner);
+
+  int buffers() const { return (int)all.size(); }
+  size_t bufferBytes() const { return size; }
+  size_t bytes() const { return size * all.size(); }
+
+  // Size, frames held now and at most, and how often a grab had to wait.
+  void printStats(const char *name);
+
+private:
+  void release(uint8_t *buffer);
+  void unhold();
+
+  size_t size;
+  std::vector<uint8_t *> all;
+  std::vector<uint8_t *> freeList;
+  int held, peakHeld;
+  unsigned long empty;        // take/acquire found no free buffer
+  StageTimer waits;
+
+  std::mutex lock;
+  std::condition_variable returned;
+};
+
+#endif // __FRAMEPOOL_H__
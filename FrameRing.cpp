@@ -0,0 +1,373 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <atomic>
+
+#include "PhotoFuncs.h"
+#include "FrameRing.h"
+
+using namespace std;
+
+// The counters are shared between processes, so they have to be real
+// atomic instructions rather than a lock hidden inside std::atomic.
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "FrameRing needs lock-free 32 and 64 bit atomics");
+
+// The layout in shared memory; readers check magic and version before
+// trusting the rest. magic is set last, so a ring still being created
+// isn't mistaken for one that's ready.
+struct FrameRingHeader {
+  atomic<uint32_t> magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t cameras;
+  uint64_t slotBytes;      // frame data per slot
+  uint64_t slotStride;     // bytes from one slot to the next
+  uint64_t firstSlot;      // offset of slot 0 from the header
+  char cameraNames[FRAMERING_CAMERAS][32];
+  atomic<uint64_t> published;   // frames complete so far
+  atomic<uint32_t> wake;        // futex word, bumped with each frame
+  atomic<uint32_t> closed;
+};
+
+struct FrameRingSlot {
+  atomic<uint64_t> seq;    // odd while written, 2 * (frame + 1) when done
+  int32_t camera, fly, frameIndex;
+  int32_t width, height, stride;
+  char pixelFormat[16];
+  uint64_t hostUs, cameraTicks, publishUs;
+  uint64_t bytes;
+};
+
+// Frame data starts this far into a slot.
+#define SLOT_DATA  ((sizeof(FrameRingSlot) + 63) & ~(size_t)63)
+
+static size_t pageRound(size_t n)
+{
+  return (n + 4095) & ~(size_t)4095;
+}
+
+// shm_open wants a name starting with a slash.
+static string shmPath(const char *name)
+{
+  return name[0] == '/' ? string(name) : "/" + string(name);
+}
+
+// Not FUTEX_PRIVATE_FLAG: the waiters are in other processes.
+static void futexWakeAll(atomic<uint32_t> *word)
+{
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void futexWait(const atomic<uint32_t> *word, uint32_t seen,
+                      const struct timespec *timeout)
+{
+  syscall(SYS_futex, (const uint32_t *)word, FUTEX_WAIT, seen, timeout, NULL, 0);
+}
+
+FrameRing::FrameRing() : header(NULL), mapBytes(0), oversize(0) { }
+
+FrameRing::~FrameRing()
+{
+  close();
+}
+
+int FrameRing::create(const char *name, int slots, size_t slotBytes)
+{
+  if ( slots < 2 ) {
+    printf("Frame ring %s: need at least 2 slots.\n", name);
+    return -1;
+  }
+  shmName = shmPath(name);
+  size_t stride = pageRound(SLOT_DATA + slotBytes);
+  size_t first = pageRound(sizeof(FrameRingHeader));
+  mapBytes = first + stride * slots;
+
+  // A ring left by an earlier run goes; its readers keep their mapping.
+  shm_unlink(shmName.c_str());
+  int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if ( fd < 0 ) {
+    perror(shmName.c_str());
+    return -1;
+  }
+  if ( ftruncate(fd, mapBytes) != 0 ) {
+    perror(shmName.c_str());
+    ::close(fd);
+    shm_unlink(shmName.c_str());
+    return -1;
+  }
+  // Populated now, so the first lap round the ring doesn't take page
+  // faults in the grab threads.
+  void *p = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if ( p == MAP_FAILED ) {
+    perror(shmName.c_str());
+    shm_unlink(shmName.c_str());
+    return -1;
+  }
+
+  header = (FrameRingHeader *)p;
+  header->version = FRAMERING_VERSION;
+  header->slots = slots;
+  header->cameras = 0;
+  header->slotBytes = slotBytes;
+  header->slotStride = stride;
+  header->firstSlot = first;
+  header->published.store(0);
+  header->wake.store(0);
+  header->closed.store(0);
+  for ( int i = 0; i < slots; i++ ) slot(i)->seq.store(0);
+  header->magic.store(FRAMERING_MAGIC, memory_order_release);
+  oversize = 0;
+  printf("Publishing frames to /dev/shm%s (%d slots of %.1f MB).\n",
+    shmName.c_str(), slots, slotBytes / 1048576.0);
+  return 0;
+}
+
+void FrameRing::close()
+{
+  if ( header == NULL ) return;
+  header->closed.store(1, memory_order_release);
+  header->wake.fetch_add(1);
+  futexWakeAll(&header->wake);
+  munmap(header, mapBytes);
+  shm_unlink(shmName.c_str());
+  header = NULL;
+}
+
+FrameRingSlot *FrameRing::slot(unsigned long long seq)
+{
+  return (FrameRingSlot *)((char *)header + header->firstSlot +
+                           (seq % header->slots) * header->slotStride);
+}
+
+unsigned long long FrameRing::published() const
+{
+  return header != NULL ? header->published.load() : 0;
+}
+
+int FrameRing::addCamera(const char *name)
+{
+  lock_guard<mutex> l(lock);
+  if ( header == NULL || header->cameras >= FRAMERING_CAMERAS ) return -1;
+  int id = header->cameras;
+  snprintf(header->cameraNames[id], sizeof(header->cameraNames[id]), "%s", name);
+  // Published with the first frame that uses it.
+  header->cameras = id + 1;
+  return id;
+}
+
+int FrameRing::publish(int camera, int fly, int frameIndex, const uint8_t *data,
+                       int width, int height, int stride, const char *pixelFormat,
+                       unsigned long long hostUs, unsigned long long cameraTicks)
+{
+  if ( header == NULL || camera < 0 ) return -1;
+  size_t bytes = (size_t)stride * height;
+  lock_guard<mutex> l(lock);
+  if ( bytes > header->slotBytes ) {
+    if ( oversize++ == 0 ) {
+      printf("Frame ring: %dx%d frames don't fit its %.1f MB slots; left out.\n",
+        width, height, header->slotBytes / 1048576.0);
+    }
+    return -1;
+  }
+
+  unsigned long long seq = header->published.load(memory_order_relaxed);
+  FrameRingSlot *s = slot(seq);
+  s->seq.store(2 * seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  s->camera = camera;
+  s->fly = fly;
+  s->frameIndex = frameIndex;
+  s->width = width;
+  s->height = height;
+  s->stride = stride;
+  snprintf(s->pixelFormat, sizeof(s->pixelFormat), "%s", pixelFormat);
+  s->hostUs = hostUs;
+  s->cameraTicks = cameraTicks;
+  s->bytes = bytes;
+  memcpy((char *)s + SLOT_DATA, data, bytes);
+  s->publishUs = monotonicUs();
+
+  s->seq.store(2 * (seq + 1), memory_order_release);
+  header->published.store(seq + 1, memory_order_release);
+  header->wake.fetch_add(1, memory_order_release);
+  futexWakeAll(&header->wake);
+  return 0;
+}
+
+FrameRingReader::FrameRingReader() :
+  header(NULL), mapBytes(0), nextSeq(0), overrun(0), torn(0) { }
+
+FrameRingReader::~FrameRingReader()
+{
+  close();
+}
+
+int FrameRingReader::open(const char *name, bool fromOldest)
+{
+  close();
+  string path = shmPath(name);
+  int fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if ( fd < 0 ) {
+    perror(path.c_str());
+    return -1;
+  }
+  struct stat st;
+  if ( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FrameRingHeader) ) {
+    printf("%s isn't a frame ring (yet).\n", path.c_str());
+    ::close(fd);
+    return -1;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if ( p == MAP_FAILED ) {
+    perror(path.c_str());
+    return -1;
+  }
+  const FrameRingHeader *h = (const FrameRingHeader *)p;
+  if ( h->magic.load(memory_order_acquire) != FRAMERING_MAGIC ||
+       h->version != FRAMERING_VERSION ||
+       h->firstSlot + h->slots * h->slotStride > (uint64_t)st.st_size ) {
+    printf("%s isn't a frame ring this program can read.\n", path.c_str());
+    munmap(p, st.st_size);
+    return -1;
+  }
+
+  header = h;
+  mapBytes = st.st_size;
+  unsigned long long pub = header->published.load(memory_order_acquire);
+  nextSeq = pub;
+  if ( fromOldest ) nextSeq = pub > header->slots ? pub - header->slots : 0;
+  overrun = torn = 0;
+  return 0;
+}
+
+void FrameRingReader::close()
+{
+  if ( header == NULL ) return;
+  munmap((void *)header, mapBytes);
+  header = NULL;
+}
+
+int FrameRingReader::slots() const
+{
+  return header != NULL ? header->slots : 0;
+}
+
+size_t FrameRingReader::slotBytes() const
+{
+  return header != NULL ? header->slotBytes : 0;
+}
+
+const FrameRingSlot *FrameRingReader::slot(unsigned long long seq) const
+{
+  return (const FrameRingSlot *)((const char *)header + header->firstSlot +
+                                 (seq % header->slots) * header->slotStride);
+}
+
+int FrameRingReader::next(RingFrame &f, int timeoutMs)
+{
+  if ( header == NULL ) return -1;
+  unsigned long long deadline = 0;
+  if ( timeoutMs >= 0 ) deadline = monotonicUs() + timeoutMs * 1000ULL;
+
+  for (;;) {
+    unsigned long long pub = header->published.load(memory_order_acquire);
+    if ( nextSeq < pub ) {
+      // More than a ring behind: those frames are gone.
+      if ( pub - nextSeq > header->slots ) {
+        overrun += pub - header->slots - nextSeq;
+        nextSeq = pub - header->slots;
+      }
+      const FrameRingSlot *s = slot(nextSeq);
+      unsigned long long want = 2 * (nextSeq + 1);
+      unsigned long long before = s->seq.load(memory_order_acquire);
+      if ( before != want ) {
+        // The writer has come round to the slot again since.
+        overrun++;
+        nextSeq++;
+        continue;
+      }
+      f.seq = nextSeq;
+      f.camera = s->camera;
+      f.fly = s->fly;
+      f.frameIndex = s->frameIndex;
+      f.width = s->width;
+      f.height = s->height;
+      f.stride = s->stride;
+      memcpy(f.pixelFormat, s->pixelFormat, sizeof(f.pixelFormat));
+      f.pixelFormat[sizeof(f.pixelFormat) - 1] = 0;
+      f.hostUs = s->hostUs;
+      f.cameraTicks = s->cameraTicks;
+      f.publishUs = s->publishUs;
+      f.bytes = s->bytes;
+      atomic_thread_fence(memory_order_acquire);
+      if ( s->seq.load(memory_order_relaxed) != want ) {
+        torn++;
+        continue;
+      }
+      if ( f.camera < 0 || f.camera >= FRAMERING_CAMERAS || f.bytes > header->slotBytes ) {
+        overrun++;
+        nextSeq++;
+        continue;
+      }
+      f.cameraName = header->cameraNames[f.camera];
+      f.data = (const uint8_t *)s + SLOT_DATA;
+      nextSeq++;
+      return 0;
+    }
+
+    // Caught up. Note the futex word before looking again, so a frame
+    // published in between wakes us rather than being slept through.
+    uint32_t seen = header->wake.load(memory_order_acquire);
+    if ( header->published.load(memory_order_acquire) > nextSeq ) continue;
+    if ( header->closed.load(memory_order_acquire) ) return -1;
+    struct timespec ts, *tp = NULL;
+    if ( timeoutMs >= 0 ) {
+      unsigned long long now = monotonicUs();
+      if ( now >= deadline ) return 1;
+      ts.tv_sec = (deadline - now) / 1000000;
+      ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+      tp = &ts;
+    }
+    futexWait(&header->wake, seen, tp);
+  }
+}
+
+bool FrameRingReader::stillValid(const RingFrame &f) const
+{
+  if ( header == NULL ) return false;
+  atomic_thread_fence(memory_order_acquire);
+  return slot(f.seq)->seq.load(memory_order_relaxed) == 2 * (f.seq + 1);
+}
+
+bool parseRingSpec(const char *spec, string &name, int &slots)
+{
+  const char *colon = strchr(spec, ':');
+  slots = 6;
+  if ( colon == NULL ) {
+    name = spec;
+  } else {
+    name.assign(spec, colon - spec);
+    char *end;
+    slots = strtol(colon + 1, &end, 10);
+    if ( *end != 0 ) return false;
+  }
+  return !name.empty() && name.find('/', 1) == string::npos && slots >= 2;
+}
@@ -0,0 +1,143 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __FRAMERING_H__
+#define __FRAMERING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <mutex>
+
+// Every grabbed frame, as it comes off the camera, in POSIX shared memory
+// (/dev/shm/<name>), so a viewer or analyzer in another process can look
+// at it straight away: no encoding, no file, one copy in all.
+//
+// The memory is a header and a ring of slots, each holding one frame and
+// what it is (camera, fly, image number, size, pixel format, times).
+// Photobooth writes; any number of readers map it read-only and follow
+// along without ever blocking it or each other:
+//
+//  - Frame n (counting from 0) goes in slot n % slots. The slot's
+//    sequence word is odd while it is being written and 2 * (n + 1) once
+//    frame n is complete; a reader reads the word, then the slot, then
+//    the word again, and only believes the slot if neither changed.
+//  - The header counts the frames published; readers sleep on a futex in
+//    the header until it moves, so waiting costs nothing and a new frame
+//    wakes them at once.
+//  - A reader that falls more than a ring behind skips to the oldest
+//    frame still there and counts the ones it missed. The writer never
+//    waits for anyone.
+//
+// Both cameras' grab threads publish into one ring; a mutex in the writing
+// process keeps it to one writer at a time, so readers see a single
+// producer. Publishing is a copy of the frame into its slot (about 1 ms
+// for a full 10 MP frame).
+
+#define FRAMERING_MAGIC    0x474e4952u   // "RING"
+#define FRAMERING_VERSION  1
+#define FRAMERING_CAMERAS  8
+
+// A full frame of the booth's cameras, 8 bits per pixel.
+#define FRAMERING_SLOT_BYTES  (3840 * 2748)
+
+struct FrameRingSlot;
+struct FrameRingHeader;
+
+// One frame as a reader sees it. data points into the shared memory and
+// is only good until the writer comes round to the slot again; check with
+// FrameRingReader::stillValid() after using it, or copy it first.
+struct RingFrame {
+  unsigned long long seq;         // frame number, from 0
+  int camera;                     // index into the ring's camera names
+  const char *cameraName;         // e.g. "Upper"
+  int fly, frameIndex;            // -1 if not known
+  int width, height, stride;
+  char pixelFormat[16];           // e.g. "BayerBG8"
+  unsigned long long hostUs;      // monotonicUs() when it was grabbed
+  unsigned long long cameraTicks;
+  unsigned long long publishUs;   // monotonicUs() when it was complete
+  const uint8_t *data;
+  size_t bytes;
+};
+
+// The writing side, in Photobooth.
+class FrameRing {
+public:
+  FrameRing();
+  ~FrameRing();
+
+  // Create /dev/shm/<name> with slots slots of slotBytes each, replacing
+  // any left by an earlier run (readers still on that one keep it until
+  // they close). Returns 0, or -1 with the reason printed.
+  int create(const char *name, int slots, size_t slotBytes = FRAMERING_SLOT_BYTES);
+  // Tell readers the ring is finished and remove it.
+  void close();
+
+  // Name a camera for readers. Returns its id for publish(), or -1 if
+  // there are already FRAMERING_CAMERAS.
+  int addCamera(const char *name);
+
+  // Copy a frame into the next slot. Frames bigger than a slot are left
+  // out (with a message the first time). Returns 0 or -1.
+  int publish(int camera, int fly, int frameIndex, const uint8_t *data,
+              int width, int height, int stride, const char *pixelFormat,
+              unsigned long long hostUs, unsigned long long cameraTicks);
+
+  bool isOpen() const { return header != NULL; }
+  const std::string &name() const { return shmName; }
+  unsigned long long published() const;
+  unsigned long long tooBig() const { return oversize; }
+
+private:
+  FrameRingSlot *slot(unsigned long long seq);
+
+  std::string shmName;
+  FrameRingHeader *header;
+  size_t mapBytes;
+  std::mutex lock;
+  unsigned long long oversize;
+};
+
+// The reading side, for any process; needs only this file, FrameRing.cpp
+// and PhotoFuncs (for monotonicUs()).
+class FrameRingReader {
+public:
+  FrameRingReader();
+  ~FrameRingReader();
+
+  // Map /dev/shm/<name>. Reading starts with the next frame published,
+  // or with the oldest still in the ring if fromOldest. Returns 0 or -1.
+  int open(const char *name, bool fromOldest = false);
+  void close();
+
+  // Wait up to timeoutMs (-1 for ever) for the next frame. Returns 0 with
+  // f filled in, 1 on a timeout, or -1 once the writer has closed the
+  // ring and every frame has been read.
+  int next(RingFrame &f, int timeoutMs);
+  // Whether f's slot still holds f, i.e. whatever was read from f.data
+  // was f and not part of a later frame.
+  bool stillValid(const RingFrame &f) const;
+
+  int slots() const;
+  size_t slotBytes() const;
+  // Frames the writer overwrote before they were read, and slots that
+  // changed while next() was reading them (tried again; a torn read is
+  // never returned).
+  unsigned long long skipped() const { return overrun; }
+  unsigned long long retried() const { return torn; }
+
+private:
+  const FrameRingSlot *slot(unsigned long long seq) const;
+
+  const FrameRingHeader *header;
+  size_t mapBytes;
+  unsigned long long nextSeq;
+  unsigned long long overrun, torn;
+};
+
+// "name" or "name:slots", as Photobooth's -ring takes it.
+bool parseRingSpec(const char *spec, std::string &name, int &slots);
+
+#endif // __FRAMERING_H__
@@ -0,0 +1,371 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+
+#include "PhotoFuncs.h"
+#include "GrabEngine.h"
+#include "Trace.h"
+
+using namespace std;
+
+CameraGrabber::CameraGrabber(CameraSource &source, const char *name,
+                             CapturePipeline &pipeline, const char *dir) :
+  source(source), camName(name), dir(dir), pipeline(pipeline),
+  scoreLog(NULL), ring(NULL), ringCamera(-1), burstFrames(0), exposureUs(0), clockHostUs(0),
+  clockTicks(0), clockErrorUs(0), clockHz(1000000000ULL), clockLatched(false),
+  triggerStatus(0),
+  startUs(0), finishUs(0), status(0)
+{
+}
+
+CameraGrabber::~CameraGrabber()
+{
+  if ( triggerThread.joinable() ) triggerThread.join();
+  if ( worker.joinable() ) worker.join();
+}
+
+const char *triggerModeName(TriggerMode mode)
+{
+  switch ( mode ) {
+  case TriggerSoftware: return "software";
+  case TriggerLine:     return "line";
+  default:              return "free";
+  }
+}
+
+bool parseTriggerMode(const char *s, TriggerMode &mode)
+{
+  if ( strcmp(s, "free") == 0 ) mode = TriggerFree;
+  else if ( strcmp(s, "software") == 0 ) mode = TriggerSoftware;
+  else if ( strcmp(s, "line") == 0 ) mode = TriggerLine;
+  else return false;
+  return true;
+}
+
+void CameraGrabber::setRing(FrameRing *r, int id)
+{
+  ring = r;
+  ringCamera = id;
+}
+
+int CameraGrabber::setBurst(const BurstPlan &p)
+{
+  if ( source.setTrigger(p.mode) != 0 ) return -1;
+  plan = p;
+  return 0;
+}
+
+void CameraGrabber::start(int nFrames, int firstIndex, int fly)
+{
+  frameStamps.clear();
+  status = 0;
+  startUs = monotonicUs();
+  finishUs = startUs;
+
+  // Raw frames are stored with the settings they were taken with. Read
+  // them once per fly, before grabbing, rather than once per frame.
+  settings = RawMetadata();
+  settings.camera = camName;
+  settings.fly = fly;
+  if ( pipeline.mode() == CaptureRaw ) {
+    source.readSettings(settings);
+  }
+
+  // Triggered, the frames are matched to their triggers afterwards. The
+  // camera clock is latched here so each frame's timestamp can be put on
+  // the host's clock too; the midpoint of the round trip is the guess.
+  burstFrames = nFrames;
+  triggers.clear();
+  plannedUs.clear();
+  triggerStatus = 0;
+  clockLatched = false;
+  if ( plan.mode != TriggerFree ) {
+    RawMetadata m;
+    exposureUs = source.readSettings(m) == 0 ? m.exposureUs : 0;
+    unsigned long long t0 = monotonicUs();
+    if ( source.latchClock(clockTicks, clockHz) == 0 ) {
+      unsigned long long t1 = monotonicUs();
+      clockHostUs = (t0 + t1) / 2;
+      clockErrorUs = (t1 - t0) / 2;
+      clockLatched = true;
+    }
+  }
+
+  if ( source.startGrabbing(nFrames) != 0 ) {
+    status = -1;
+    return;
+  }
+  worker = thread(&CameraGrabber::grabLoop, this, firstIndex);
+  if ( plan.mode == TriggerSoftware ) {
+    triggerThread = thread(&CameraGrabber::triggerLoop, this, nFrames);
+  }
+}
+
+static void sleepUntilUs(unsigned long long us)
+{
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR ) { }
+}
+
+// Fires the burst against the clock rather than one interval after the
+// last trigger, so a slow trigger doesn't push the rest back.
+void CameraGrabber::triggerLoop(int nFrames)
+{
+  traceThreadName(("trigger " + camName).c_str());
+  unsigned long long base = monotonicUs();
+  for ( int i = 0; i < nFrames; i++ ) {
+    unsigned long long due = base + (unsigned long long)i * plan.intervalUs;
+    sleepUntilUs(due);
+    unsigned long long firedUs;
+    TraceSpan span("trigger", i, camName.c_str());
+    if ( source.fireTrigger(1000, firedUs) != 0 ) {
+      cerr << camName << " trigger " << i << " failed." << endl;
+      triggerStatus = -1;
+      return;
+    }
+    triggers.push_back(firedUs);
+    plannedUs.push_back(due);
+  }
+}
+
+void CameraGrabber::pulsesSent(unsigned long long firstUs, int intervalUs)
+{
+  source.pulsesSent(burstFrames, firstUs, intervalUs);
+  for ( int i = 0; i < burstFrames; i++ ) {
+    triggers.push_back(firstUs + (unsigned long long)i * intervalUs);
+    plannedUs.push_back(triggers.back());
+  }
+}
+
+void CameraGrabber::waitExposed()
+{
+  if ( plan.mode == TriggerFree ) return;
+  if ( triggerThread.joinable() ) triggerThread.join();
+  if ( !triggers.empty() ) {
+    sleepUntilUs(triggers.back() + exposureUs);
+  }
+}
+
+int CameraGrabber::join()
+{
+  if ( triggerThread.joinable() ) triggerThread.join();
+  if ( worker.joinable() ) worker.join();
+  for ( size_t i = 0; i < frameStamps.size(); i++ ) {
+    FrameStamp &fs = frameStamps[i];
+    if ( fs.shot < (int)triggers.size() ) fs.triggerUs = triggers[fs.shot];
+  }
+  return status != 0 ? status : triggerStatus;
+}
+
+void CameraGrabber::setSelection(const FrameSelection &sel, ScoreLog *log)
+{
+  selection = sel;
+  scoreLog = log;
+}
+
+void CameraGrabber::grabLoop(int firstIndex)
+{
+  // Frames waiting for the end of the start to see whether they are
+  // among the sharpest (keepBest only).
+  struct Held {
+    Frame frame;
+    string basename;
+    RawMetadata meta;
+    size_t stamp;
+  };
+  vector<Held> held;
+
+  char basename[300];
+  int imgCount = firstIndex;
+  int shot = 0;
+  traceThreadName(("grab " + camName).c_str());
+
+  while ( source.isGrabbing() ) {
+    Frame frame;
+    int r;
+    {
+      TraceSpan span("retrieve", imgCount, camName.c_str());
+      r = source.retrieve(5000, frame);
+    }
+    if ( r == 1 ) {  // lost frame, already reported
+      shot++;
+      continue;
+    }
+    if ( r != 0 ) {
+      cerr << camName << " grab failed." << endl;
+      source.stopGrabbing();
+      status = -1;
+      break;
+    }
+
+    FrameStamp fs;
+    fs.index = imgCount;
+    fs.shot = shot++;
+    fs.hostUs = monotonicUs();
+    fs.cameraTicks = frame.cameraTicks;
+    fs.triggerUs = 0;
+    fs.exposedUs = 0;
+    if ( clockLatched ) {
+      fs.exposedUs = clockHostUs +
+        (long long)((long long)(fs.cameraTicks - clockTicks) * 1e6 / clockHz);
+    }
+    fs.sharpness = -1;
+    fs.kept = true;
+
+    if ( ring != NULL ) {
+      TraceSpan span("ring", fs.index, camName.c_str());
+      ring->publish(ringCamera, settings.fly, fs.index, frame.data, frame.width,
+                    frame.height, frame.stride, frame.pixelFormat.c_str(),
+                    fs.hostUs, fs.cameraTicks);
+    }
+
+    RawMetadata meta = settings;
+    meta.frameIndex = imgCount;
+    meta.hostUs = fs.hostUs;
+    meta.cameraTicks = fs.cameraTicks;
+
+    snprintf(basename, sizeof(basename), "%s/%s%03d", dir.c_str(),
+      camName.c_str(), imgCount++);
+
+    if ( selection.enabled() ) {
+      {
+        TraceSpan span("score", fs.index, camName.c_str());
+        fs.sharpness = sharpnessScore(frame.data, frame.stride, frame.width,
+                                      frame.height, selection.scoring);
+      }
+      meta.sharpness = fs.sharpness;
+      fs.kept = fs.sharpness >= selection.minScore;
+    }
+    frameStamps.push_back(fs);
+
+    if ( !fs.kept ) {
+      cout << "Dropping image " << basename << " (sharpness "
+           << fs.sharpness << ")" << endl;
+      if ( scoreLog != NULL ) scoreLog->add(meta, false);
+      continue;
+    }
+
+    if ( selection.keepBest > 0 ) {
+      Held h = { frame, basename, meta, frameStamps.size() - 1 };
+      held.push_back(h);
+      frame.release();
+      if ( (int)held.size() > selection.keepBest ) {
+        // Let the least sharp go; its buffer goes straight back.
+        size_t worst = 0;
+        for ( size_t i = 1; i < held.size(); i++ ) {
+          if ( held[i].meta.sharpness < held[worst].meta.sharpness ) worst = i;
+        }
+        frameStamps[held[worst].stamp].kept = false;
+        if ( scoreLog != NULL ) scoreLog->add(held[worst].meta, false);
+        held.erase(held.begin() + worst);
+      }
+      continue;
+    }
+
+    if ( scoreLog != NULL && selection.enabled() ) scoreLog->add(meta, true);
+    cout << "Queueing image " << basename << endl;
+    TraceSpan span("submit", fs.index, camName.c_str());
+    pipeline.submit(frame, basename, meta);
+  }
+
+  for ( size_t i = 0; i < held.size(); i++ ) {
+    if ( scoreLog != NULL ) scoreLog->add(held[i].meta, true);
+    cout << "Queueing image " << held[i].basename << endl;
+    TraceSpan span("submit", held[i].meta.frameIndex, camName.c_str());
+    pipeline.submit(held[i].frame, held[i].basename, held[i].meta);
+  }
+  finishUs = monotonicUs();
+}
+
+void CameraGrabber::printStamps() const
+{
+  for ( size_t i = 0; i < frameStamps.size(); i++ ) {
+    const FrameStamp &fs = frameStamps[i];
+    printf("  %s%03d: host +%.1f ms, camera %llu", camName.c_str(), fs.index,
+      (fs.hostUs - startUs) / 1000.0, fs.cameraTicks);
+    if ( i > 0 ) {
+      printf(" (+%.1f ms)",
+        (fs.cameraTicks - frameStamps[i-1].cameraTicks) * 1e3 / clockHz);
+    }
+    if ( fs.sharpness >= 0 ) {
+      printf(", sharpness %.1f%s", fs.sharpness, fs.kept ? "" : " (dropped)");
+    }
+    if ( fs.triggerUs != 0 ) {
+      printf(", trigger +%.1f ms", ((long long)fs.triggerUs - (long long)startUs) / 1000.0);
+      if ( fs.exposedUs != 0 ) {
+        printf(", exposed %+.2f ms after", ((long long)fs.exposedUs - (long long)fs.triggerUs) / 1000.0);
+      }
+    }
+    printf("\n");
+  }
+}
+
+void CameraGrabber::printLatency() const
+{
+  if ( plan.mode == TriggerFree || triggers.empty() ) return;
+
+  double late = 0, worstLate = 0;
+  for ( size_t i = 0; i < triggers.size(); i++ ) {
+    double us = (long long)triggers[i] - (long long)plannedUs[i];
+    late += us;
+    if ( us > worstLate ) worstLate = us;
+  }
+  printf("%s: %d %s triggers, %.1f ms apart", camName.c_str(),
+    (int)triggers.size(), triggerModeName(plan.mode), plan.intervalUs / 1000.0);
+  if ( plan.mode == TriggerSoftware ) {
+    printf(", late by %.3f ms mean, %.3f ms worst", late / triggers.size() / 1000.0,
+      worstLate / 1000.0);
+  }
+  printf(".\n");
+
+  // Signed: the clock offset is only known to within clockErrorUs.
+  int n = 0, nExposed = 0;
+  double toFrame = 0, worstFrame = 0, toExposure = 0, minExposure = 0, maxExposure = 0;
+  for ( size_t i = 0; i < frameStamps.size(); i++ ) {
+    const FrameStamp &fs = frameStamps[i];
+    if ( fs.triggerUs == 0 ) continue;
+    double us = (long long)fs.hostUs - (long long)fs.triggerUs;
+    toFrame += us;
+    if ( n == 0 || us > worstFrame ) worstFrame = us;
+    n++;
+    if ( fs.exposedUs == 0 ) continue;
+    us = (long long)fs.exposedUs - (long long)fs.triggerUs;
+    toExposure += us;
+    if ( nExposed == 0 || us < minExposure ) minExposure = us;
+    if ( nExposed == 0 || us > maxExposure ) maxExposure = us;
+    nExposed++;
+  }
+  if ( n == 0 ) return;
+  printf("  trigger to frame: %.2f ms mean, %.2f ms worst (%d frames)\n",
+    toFrame / n / 1000.0, worstFrame / 1000.0, n);
+  if ( nExposed > 0 ) {
+    printf("  trigger to exposure: %.3f ms mean, %.3f to %.3f ms, "
+      "clocks matched to +-%.3f ms\n", toExposure / nExposed / 1000.0,
+      minExposure / 1000.0, maxExposure / 1000.0, clockErrorUs / 1000.0);
+  }
+}
+
+void printCaptureTiming(const CameraGrabber &a, const CameraGrabber &b)
+{
+  unsigned long long start = a.startedUs() < b.startedUs() ?
+    a.startedUs() : b.startedUs();
+  unsigned long long finish = a.finishedUs() > b.finishedUs() ?
+    a.finishedUs() : b.finishedUs();
+
+  printf("Capture: %s %.1f ms, %s %.1f ms, total %.1f ms.\n",
+    a.name(), (a.finishedUs() - a.startedUs()) / 1000.0,
+    b.name(), (b.finishedUs() - b.startedUs()) / 1000.0,
+    (finish - start) / 1000.0);
+  a.printStamps();
+  b.printStamps();
+  a.printLatency();
+  b.printLatency();
+}
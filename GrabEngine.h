@@ -0,0 +1,147 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __GRABENGINE_H__
+#define __GRABENGINE_H__
+
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "CapturePipeline.h"
+#include "CameraSource.h"
+#include "Sharpness.h"
+#include "FrameRing.h"
+
+// When a frame was grabbed: host time is the monotonic clock when
+// RetrieveResult returned it, camera time is the camera's own timestamp
+// counter (nanoseconds on the ace USB cameras; GigE ones say their rate).
+//
+// Triggered, the frame also has the host time of its trigger and of the
+// start of its exposure, the latter from the camera's timestamp and the
+// offset between the two clocks (latched at start()).
+struct FrameStamp {
+  int index;
+  int shot;           // which trigger of the burst, lost frames counted
+  unsigned long long hostUs;
+  unsigned long long cameraTicks;
+  unsigned long long triggerUs;   // 0 if free running
+  unsigned long long exposedUs;   // 0 if the camera clock wasn't latched
+  double sharpness;   // -1 if not scored
+  bool kept;          // passed on to the pipeline
+};
+
+// How start() gets its frames.
+//
+// TriggerFree: the camera runs at its own frame rate.
+// TriggerSoftware: a burst; a second thread fires one trigger every
+//   intervalUs, the first as soon as the camera is grabbing.
+// TriggerLine: the camera waits for pulses on its trigger input. The
+//   caller sends them (stepVanesAndTrigger()) and says when with
+//   pulsesSent().
+struct BurstPlan {
+  TriggerMode mode;
+  int intervalUs;
+
+  BurstPlan() : mode(TriggerFree), intervalUs(100000) { }
+};
+
+// "free", "software" or "line"; parseTriggerMode returns false if s is
+// none of them.
+const char *triggerModeName(TriggerMode mode);
+bool parseTriggerMode(const char *s, TriggerMode &mode);
+
+// Drains one camera on its own thread.
+//
+// start() starts the camera grabbing and returns immediately; a background
+// thread retrieves each frame as soon as it arrives and submits it to the
+// capture pipeline. Running one grabber per camera lets the upper and
+// lower cameras be emptied at the same time, so a fly's capture takes as
+// long as the slower camera rather than the sum of both.
+class CameraGrabber {
+public:
+  // Frames are written to <dir>/<name>NNN.png (or .bayer.png + .yml in
+  // raw mode).
+  CameraGrabber(CameraSource &source, const char *name,
+                CapturePipeline &pipeline, const char *dir = "images");
+  ~CameraGrabber();
+
+  // Grab nFrames, numbering the files from firstIndex. fly is recorded
+  // with each frame.
+  void start(int nFrames, int firstIndex, int fly = -1);
+
+  // Score each frame and pass on only those sel keeps (Sharpness.h),
+  // logging every score to log if given. Applies from the next start().
+  // With keepBest, up to keepBest + 1 frames are held until the start is
+  // over, so the camera needs that many buffers.
+  void setSelection(const FrameSelection &sel, ScoreLog *log = NULL);
+
+  // Configure the camera for plan's trigger mode; applies from the next
+  // start(). Returns 0, or -1 if the camera can't do it.
+  int setBurst(const BurstPlan &plan);
+  const BurstPlan &burst() const { return plan; }
+
+  // Also publish every frame, as soon as it's retrieved and before it is
+  // scored, to ring (FrameRing.h) as camera id. NULL to stop.
+  void setRing(FrameRing *ring, int id);
+
+  // Line mode: the pulses for the current start went out, the first at
+  // firstUs (monotonicUs()) and then every intervalUs.
+  void pulsesSent(unsigned long long firstUs, int intervalUs);
+
+  // Triggered modes: wait until the last trigger of the current start has
+  // been sent and its exposure is over, e.g. before moving the vanes.
+  // Free running, returns at once.
+  void waitExposed();
+
+  // Wait for the grab thread. Returns 0 if every frame was retrieved,
+  // -1 on a timeout or camera error.
+  int join();
+
+  const char *name() const { return camName.c_str(); }
+  const std::vector<FrameStamp> &stamps() const { return frameStamps; }
+  unsigned long long startedUs() const { return startUs; }
+  unsigned long long finishedUs() const { return finishUs; }
+
+  // One line per frame plus the inter-frame intervals.
+  void printStamps() const;
+  // Triggered: how late the triggers went against the plan, and the
+  // time from trigger to exposure and to the frame arriving.
+  void printLatency() const;
+
+private:
+  void grabLoop(int firstIndex);
+  void triggerLoop(int nFrames);
+
+  CameraSource &source;
+  std::string camName;
+  std::string dir;
+  CapturePipeline &pipeline;
+  std::thread worker;
+  FrameSelection selection;
+  ScoreLog *scoreLog;
+  FrameRing *ring;
+  int ringCamera;
+
+  BurstPlan plan;
+  std::thread triggerThread;
+  int burstFrames;
+  int exposureUs;
+  std::vector<unsigned long long> triggers, plannedUs;
+  // The same moment on both clocks, and how sure we are of it.
+  unsigned long long clockHostUs, clockTicks, clockErrorUs;
+  unsigned long long clockHz;   // of the camera's clock
+  bool clockLatched;
+  int triggerStatus;
+
+  RawMetadata settings;
+  std::vector<FrameStamp> frameStamps;
+  unsigned long long startUs, finishUs;
+  int status;
+};
+
+// Print how long each camera took and the overall capture time.
+void printCaptureTiming(const CameraGrabber &a, const CameraGrabber &b);
+
+#endif // __GRABENGINE_H__
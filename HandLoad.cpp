@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <termios.h>
 #include <string.h>
+#include <memory>
 #include <pylon/PylonIncludes.h>
 #include <pylon/ImagePersistence.h>
 #include "opencv2/core/core.hpp"
@@ -14,177 +15,393 @@
 #include "opencv2/highgui/highgui.hpp"
 
 #include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "GrabEngine.h"
+#include "PylonSource.h"
+#include "SyntheticSource.h"
+#include "FramePool.h"
+#include "Trace.h"
+#include "SessionManifest.h"
+#include "FlyDetector.h"
+#include "SerialDiscovery.h"
+#include "CameraSettings.h"
 
 using namespace cv;
 using namespace Pylon;
 using namespace std;
 
-const char *servoCtrl = "/dev/ttyACM0";
-const char *arduino   = "/dev/ttyUSB0";
+// Serial devices, found by USB identity (SerialDiscovery.h); "" is the
+// usual hardware.
+const char *servoCtrl = "";
+const char *arduino   = "";
 
-int main(int argc, char **argv)
+// Camera features put on both cameras at startup (CameraSettings.h).
+const char *cameraConfig = "AceFlashSettings.pfs";
+const char *settingsCachePath = "images/camera-settings.cache";
+
+// FlyDetector backgrounds (-roi), kept between sessions.
+const char *upperBackground = "images/background_Upper.png";
+const char *lowerBackground = "images/background_Lower.png";
+
+// Wait for gates to get where they were sent, and for the servos to stop.
+static int waitForGates(int servoFD, unsigned int channels)
 {
+  if ( maestroWaitUntilSettled(servoFD, channels, 2000) != 0 ) return -1;
+  traceSleep(GATE_MARGIN_US, "gate margin");
+  return 0;
+}
 
-  int imgCount = 0;
+int main(int argc, char **argv)
+{
 
-  if ( argc > 1 ) {
-    imgCount = atoi(argv[1]);
+  int imgCount = -1;
+
+  // Usage: HandLoad [-raw] [-synthetic] [-servo dev] [-arduino dev]
+  //                 [-format fmt] [-archive file] [-pool MB] [-trace file]
+  //                 [-frames n] [-keep k] [-minsharp s] [-roi] [-background]
+  //                 [-thumb w] [-trigger software|line] [-interval ms]
+  //                 [-settle ms] [-camconfig file|none] [-fullconfig]
+  //                 [first image number]
+  //   -raw: store Bayer mosaics and demosaic later with Debayer.
+  //   -synthetic: use generated frames instead of the Basler cameras.
+  //   -servo, -arduino: where to find these serial devices instead of by
+  //       their usual USB IDs: a path, usb:VVVV:PPPP or a serial number.
+  //   -format: output image format, e.g. qoi, tiff, png:1 (ImageFormat.h).
+  //   -archive: put every frame in one session archive (SessionArchive.h).
+  //   -pool: MB of grab buffers per camera (FramePool.h; default 256,
+  //          0 = let Pylon allocate them).
+  //   -trace: write a Chrome trace of the session to this file on exit.
+  //   -frames: frames to grab per camera (default 3).
+  //   -keep, -minsharp: write only the k sharpest of them, and none scoring
+  //          under s (Sharpness.h); every score goes to images/scores.csv.
+  //   -roi: store only the crop around the fly (FlyDetector.h), found
+  //          against a background of the empty chamber taken at startup
+  //          if there isn't one in images/ yet; -background retakes it.
+  //   -thumb: with -roi, also store a thumbnail of the whole frame, w
+  //          pixels wide.
+  //   -trigger: trigger each frame instead of letting the cameras run
+  //          free; the upper camera by software, the lower one by software
+  //          too or (line) by the Arduino as soon as the vanes settle.
+  //   -interval: ms between triggered frames (default 100).
+  //   -settle: ms to wait after stepping the vanes (default 1000).
+  //   -camconfig: camera features to put on the cameras (default above);
+  //          only those that differ are set, and none if the cache says a
+  //          camera has them already. -fullconfig compares every one.
+  // Numbering carries on from images/session.manifest (SessionManifest.h),
+  // which is updated after each fly; a first image number overrides it.
+  CaptureMode captureMode = CaptureBGR;
+  bool syntheticCameras = false;
+  const char *tracePath = NULL;
+  const char *archivePath = NULL;
+  int poolMB = 256;
+  int framesPerCamera = 3;
+  bool fullConfig = false;
+  OutputFormat outputFormat;
+  FrameSelection selection;
+  bool cropToFly = false, newBackground = false;
+  DetectOptions detectOptions;
+  TriggerMode triggerMode = TriggerFree;
+  int intervalUs = 100000, settleUs = 1000000;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-raw") == 0 ) {
+      captureMode = CaptureRaw;
+    } else if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      framesPerCamera = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-keep") == 0 && i + 1 < argc ) {
+      selection.keepBest = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-minsharp") == 0 && i + 1 < argc ) {
+      selection.minScore = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-roi") == 0 ) {
+      cropToFly = true;
+    } else if ( strcmp(argv[i], "-background") == 0 ) {
+      cropToFly = newBackground = true;
+    } else if ( strcmp(argv[i], "-thumb") == 0 && i + 1 < argc ) {
+      detectOptions.thumbWidth = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-trigger") == 0 && i + 1 < argc ) {
+      if ( !parseTriggerMode(argv[++i], triggerMode) ) {
+        printf("Unknown trigger '%s'; use software or line.\n", argv[i]);
+        return 1;
+      }
+    } else if ( strcmp(argv[i], "-interval") == 0 && i + 1 < argc ) {
+      intervalUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-settle") == 0 && i + 1 < argc ) {
+      settleUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-synthetic") == 0 ) {
+      syntheticCameras = true;
+    } else if ( strcmp(argv[i], "-servo") == 0 && i + 1 < argc ) {
+      servoCtrl = argv[++i];
+    } else if ( strcmp(argv[i], "-arduino") == 0 && i + 1 < argc ) {
+      arduino = argv[++i];
+    } else if ( strcmp(argv[i], "-trace") == 0 && i + 1 < argc ) {
+      tracePath = argv[++i];
+    } else if ( strcmp(argv[i], "-archive") == 0 && i + 1 < argc ) {
+      archivePath = argv[++i];
+    } else if ( strcmp(argv[i], "-camconfig") == 0 && i + 1 < argc ) {
+      cameraConfig = argv[++i];
+    } else if ( strcmp(argv[i], "-fullconfig") == 0 ) {
+      fullConfig = true;
+    } else if ( strcmp(argv[i], "-pool") == 0 && i + 1 < argc ) {
+      poolMB = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-format") == 0 && i + 1 < argc ) {
+      if ( !parseOutputFormat(argv[++i], outputFormat) ) {
+        printf("Unknown format '%s'; use %s.\n", argv[i], outputFormatUsage);
+        return 1;
+      }
+    } else {
+      imgCount = atoi(argv[i]);
+    }
   }
+  if ( captureMode == CaptureRaw && !formatKeepsRaw(outputFormat.format) ) {
+    printf("Raw frames can only be stored as png or tiff.\n");
+    return 1;
+  }
+  if ( framesPerCamera < 1 ) {
+    printf("Need at least one frame per camera.\n");
+    return 1;
+  }
+  SessionManifest manifest;
+  if ( resumeSession("images", framesPerCamera, manifest, archivePath) != 0 ) {
+    return 1;
+  }
+  ScoreLog scoreLog;
+  if ( selection.enabled() && scoreLog.open("images/scores.csv") != 0 ) {
+    return 1;
+  }
+  if ( imgCount < 0 ) imgCount = manifest.nextFrame;
+  printf("Starting at image %d, fly %d.\n", imgCount, manifest.flies + 1);
+  SessionArchive archive;
+  if ( archivePath != NULL && archive.create(archivePath) != 0 ) {
+    return 1;
+  }
+  traceEnable(tracePath != NULL);
+  traceThreadName("main");
 
   printf("While serial ports are opening, set diffuser vane to block *lower* camera.\n");
   char replyString[100];
   int n;
+  // Declared first so they outlive the cameras and every frame.
+  unique_ptr<FramePool> upperPool, lowerPool;
   CInstantCamera upper, lower;
+  unique_ptr<CameraSource> upperSource, lowerSource;
+  SyntheticSource *syntheticUpper = NULL, *syntheticLower = NULL;
 
   PylonInitialize();
 
-  int arduinoFD = openSerialPort(arduino);
-  if ( arduinoFD == -1 ) {
-    perror(arduino);
+  // Opening the Arduino probes it, which turns the lights on.
+  BoothDevices dev;
+  dev.spec[DeviceServo] = servoCtrl;
+  dev.spec[DeviceArduino] = arduino;
+  if ( openBoothDevices(dev, NEED_SERVO | NEED_ARDUINO) != 0 ) {
     return 1;
-  } else {
-    printf("Arduino FD opened: %d.\n", arduinoFD);
-   
   }
-
-  int servoFD = openSerialPort(servoCtrl);
-  if (servoFD == -1)
-  {
-    perror(servoCtrl);
-    return 1;
-  } else {
-    printf("Servo FD opened: %d.\n", servoFD);
+  int servoFD = dev.fd[DeviceServo];
+  int arduinoFD = dev.fd[DeviceArduino];
+
+  const unsigned short gates[] = { INLET_GATE_OPEN, OUTLET_GATE_CLOSED };
+  if ( maestroSetLimits(servoFD, GATE_CHANNELS, GATE_SPEED, GATE_ACCEL) != 0 ||
+       maestroSetTargets(servoFD, 0, gates, 2) != 0 ||
+       waitForGates(servoFD, GATE_CHANNELS) != 0 ) {
+    perror("error setting gates"); return 1;
   }
-
-  usleep(1000000);
-
-  printf("Current positions are %d and %d.\n", maestroGetPosition(servoFD, 0),
-    maestroGetPosition(servoFD, 1));
-
-  usleep(100000);
-  maestroSetTarget(servoFD, 0, INLET_GATE_OPEN);
-  usleep(100000);
-  maestroSetTarget(servoFD, 1, OUTLET_GATE_CLOSED);
-
-  usleep(1000000);
-
-  if ( enableLights(arduinoFD) != 0 ) {
-    perror("error enabling lights"); return 1;
-  }
-
-  printf("Lights enabled.\n");
     
-  try
-  {
-    // Get the transport layer factory.
-    CTlFactory& tlFactory = CTlFactory::GetInstance();
-
-    // Get all attached devices and exit application if
-    // two cameras aren't found
-    DeviceInfoList_t devices;
-    if ( tlFactory.EnumerateDevices(devices) != 2 )
-    {
-      cout << "Found " << devices.size() << " cameras." << endl;
-        throw RUNTIME_EXCEPTION( "Did not find exactly two cameras.");
+  // -synthetic runs the whole post-grab pipeline without cameras.
+  if ( syntheticCameras ) {
+    printf("Using synthetic cameras.\n");
+    SyntheticSource *u = new SyntheticSource(3840, 2748, 10.0, 3, 1);
+    SyntheticSource *l = new SyntheticSource(3840, 2748, 10.0, 3, 2);
+    if ( poolMB > 0 ) {
+      upperPool.reset(new FramePool(3840 * 2748, (size_t)poolMB << 20));
+      lowerPool.reset(new FramePool(3840 * 2748, (size_t)poolMB << 20));
+      if ( !upperPool->ok() || !lowerPool->ok() ) return 1;
+      u->setPool(upperPool.get());
+      l->setPool(lowerPool.get());
     }
+    upperSource.reset(u);
+    lowerSource.reset(l);
+    syntheticUpper = u;
+    syntheticLower = l;
+  } else {
+    try
+    {
+      // Get the transport layer factory.
+      CTlFactory& tlFactory = CTlFactory::GetInstance();
+
+      // Get all attached devices and exit application if
+      // two cameras aren't found
+      DeviceInfoList_t devices;
+      if ( tlFactory.EnumerateDevices(devices) != 2 )
+      {
+        cout << "Found " << devices.size() << " cameras." << endl;
+          throw RUNTIME_EXCEPTION( "Did not find exactly two cameras.");
+      }
 
-    cout << "Device 0 name: " << devices[0].GetFriendlyName() << endl;
-    cout << "Device 1 name: " << devices[1].GetFriendlyName() << endl;
-    if ( strncmp( devices[0].GetFriendlyName(), "upper", 5) == 0 ) {
-      cout << "Device 0 is upper." << endl;
-      upper.Attach(tlFactory.CreateDevice( devices[0] ) ); upper.Open();
-      lower.Attach(tlFactory.CreateDevice( devices[1] ) ); lower.Open();
-    } else {
-      cout << "Device 1 is upper." << endl;
-      upper.Attach(tlFactory.CreateDevice( devices[1] ) ); upper.Open();
-      lower.Attach(tlFactory.CreateDevice( devices[0] ) ); lower.Open();
-    }
+      cout << "Device 0 name: " << devices[0].GetFriendlyName() << endl;
+      cout << "Device 1 name: " << devices[1].GetFriendlyName() << endl;
+      if ( strncmp( devices[0].GetFriendlyName(), "upper", 5) == 0 ) {
+        cout << "Device 0 is upper." << endl;
+        upper.Attach(tlFactory.CreateDevice( devices[0] ) ); upper.Open();
+        lower.Attach(tlFactory.CreateDevice( devices[1] ) ); lower.Open();
+      } else {
+        cout << "Device 1 is upper." << endl;
+        upper.Attach(tlFactory.CreateDevice( devices[1] ) ); upper.Open();
+        lower.Attach(tlFactory.CreateDevice( devices[0] ) ); lower.Open();
+      }
 
 
-  } catch (const GenericException &e) {
-    // Error handling.
-    cerr << "An exception occurred." << endl
-      << e.GetDescription() << endl;
-    return 1;
+    } catch (const GenericException &e) {
+      // Error handling.
+      cerr << "An exception occurred." << endl
+        << e.GetDescription() << endl;
+      return 1;
+    }
+    // Before the pools are sized: the settings decide the frame size.
+    if ( strcmp(cameraConfig, "none") != 0 ) {
+      CameraSettings settings;
+      SettingsCache cache;
+      if ( readCameraSettings(cameraConfig, settings) != 0 ||
+           cache.load(settingsCachePath) != 0 ) {
+        return 1;
+      }
+      SettingsReport upperReport, lowerReport;
+      int r = applyCameraSettings(upper, settings, &cache, fullConfig, upperReport);
+      printSettingsReport("", "Upper", settings, upperReport);
+      if ( r == 0 ) {
+        r = applyCameraSettings(lower, settings, &cache, fullConfig, lowerReport);
+        printSettingsReport("", "Lower", settings, lowerReport);
+      }
+      if ( r != 0 ) return 1;
+    }
+    if ( poolMB > 0 ) {
+      long long upperBytes = pylonPayloadSize(upper);
+      long long lowerBytes = pylonPayloadSize(lower);
+      if ( upperBytes <= 0 || lowerBytes <= 0 ) return 1;
+      upperPool.reset(new FramePool(upperBytes, (size_t)poolMB << 20));
+      lowerPool.reset(new FramePool(lowerBytes, (size_t)poolMB << 20));
+      if ( !upperPool->ok() || !lowerPool->ok() ) return 1;
+    }
+    upperSource.reset(new PylonSource(upper, upperPool.get()));
+    lowerSource.reset(new PylonSource(lower, lowerPool.get()));
   }
 
   printf("Cameras all set up.\n");
  
+  // Frames are converted and written in the background while the
+  // cycle carries on; we only wait for them at the end of each fly.
+  FlyDetector upperDetector, lowerDetector;  // outlive the pipeline
+  CapturePipeline pipeline;
+  pipeline.setMode(captureMode);
+  pipeline.setFormat(outputFormat);
+  if ( archivePath != NULL ) pipeline.setArchive(&archive);
+
+  // -roi: store only the crop around the fly. The background is the
+  // empty chamber, taken once with the vanes as each camera sees them
+  // and kept in images/ for later sessions; -background takes it again.
+  if ( cropToFly ) {
+    upperDetector.setOptions(detectOptions);
+    lowerDetector.setOptions(detectOptions);
+    bool upperNew = newBackground || upperDetector.load(upperBackground) != 0;
+    bool lowerNew = newBackground || lowerDetector.load(lowerBackground) != 0;
+    if ( upperNew || lowerNew ) {
+      printf("Taking the background; the chamber must be empty.\n");
+      if ( syntheticUpper != NULL ) {
+        syntheticUpper->setEmpty(true);
+        syntheticLower->setEmpty(true);
+      }
+      int r = 0;
+      if ( upperNew ) {
+        r = captureBackground(*upperSource, upperDetector, 5);
+        if ( r == 0 ) r = upperDetector.save(upperBackground);
+      }
+      if ( r == 0 && lowerNew ) {
+        r = stepVanes(arduinoFD);
+        if ( r == 0 ) r = captureBackground(*lowerSource, lowerDetector, 5);
+        if ( r == 0 ) r = lowerDetector.save(lowerBackground);
+        if ( r == 0 ) r = stepVanes(arduinoFD);
+      }
+      if ( syntheticUpper != NULL ) {
+        syntheticUpper->setEmpty(false);
+        syntheticLower->setEmpty(false);
+      }
+      if ( r != 0 ) {
+        printf("error taking the background\n");
+        return 1;
+      }
+    }
+    pipeline.setDetector("Upper", &upperDetector);
+    pipeline.setDetector("Lower", &lowerDetector);
+  }
+
+  // Each camera is drained on its own thread as soon as it starts.
+  CameraGrabber upperGrab(*upperSource, "Upper", pipeline);
+  CameraGrabber lowerGrab(*lowerSource, "Lower", pipeline);
+  if ( selection.enabled() ) {
+    upperGrab.setSelection(selection, &scoreLog);
+    lowerGrab.setSelection(selection, &scoreLog);
+  }
+  // Set even when free running, so a camera left triggered by an
+  // earlier session runs free again.
+  BurstPlan upperBurst, lowerBurst;
+  upperBurst.mode = triggerMode == TriggerFree ? TriggerFree : TriggerSoftware;
+  upperBurst.intervalUs = intervalUs;
+  lowerBurst.mode = triggerMode;
+  lowerBurst.intervalUs = intervalUs;
+  if ( upperGrab.setBurst(upperBurst) != 0 || lowerGrab.setBurst(lowerBurst) != 0 ) {
+    printf("error setting up the camera triggers\n"); return 1;
+  }
 
   // Now we're all set up.
   printf("Load fly and press enter.\n");
 
   int keepDispensing = 1;
+  int fly = manifest.flies;
   char inp;
   cin.get(inp);
 
   while ( keepDispensing ) {
 
 
-    usleep(100000);
+    traceSleep(100000, "load");
 
     // Close the gate and take a picture or two!
     maestroSetTarget(servoFD, 0, INLET_GATE_CLOSED);
-    usleep(2500000);
-
-    CGrabResultPtr ptrGrabResult;
-    char filename[100];
-
-    CImageFormatConverter fc;
-    fc.OutputPixelFormat = PixelType_BGR8packed;
-    CPylonImage image;
-
-    upper.StartGrabbing(3);
-    usleep(1000000);
-      
-    // Now spin the vanes
-    if ( stepVanes(arduinoFD) != 0 ) {
-      perror("error stepping vanes"); return 1;
+    if ( waitForGates(servoFD, 1 << 0) != 0 ) {
+      printf("error closing inlet gate\n"); return 1;
     }
 
-    usleep(1000000);
+    fly++;
+    upperGrab.start(framesPerCamera, imgCount, fly);
+    if ( triggerMode == TriggerFree ) {
+      traceSleep(1000000, "upper grab");
+    } else {
+      TraceSpan span("upper burst");
+      upperGrab.waitExposed();
+    }
+    
+    // Now spin the vanes
+    if ( triggerMode == TriggerLine ) {
+      lowerGrab.start(framesPerCamera, imgCount, fly);
+      if ( stepVanesAndTrigger(arduinoFD, framesPerCamera, intervalUs,
+                               settleUs) != 0 ) {
+        perror("error stepping vanes"); return 1;
+      }
+      lowerGrab.pulsesSent(monotonicUs(), intervalUs);
+    } else {
+      if ( stepVanes(arduinoFD) != 0 ) {
+        perror("error stepping vanes"); return 1;
+      }
 
-    lower.StartGrabbing(3);
+      traceSleep(settleUs, "vanes settle");
 
-    int currentCount = imgCount;
-    while ( upper.IsGrabbing() ) {
-      upper.RetrieveResult(5000, ptrGrabResult,
-        TimeoutHandling_ThrowException);
-      if ( ptrGrabResult->GrabSucceeded()) {
-        snprintf(filename, 100, "images/Upper%03d.png", currentCount++);
-        cout << "Writing image to " << filename << endl;
-        // Convert to OpenCV Mat
-        fc.Convert(image, ptrGrabResult);
-        Mat cimg(ptrGrabResult->GetHeight(), ptrGrabResult->GetWidth(),
-          CV_8UC3, (uint8_t *)image.GetBuffer()), rs;
-        // resize(cimg, rs, Size(), 0.25, 0.25);
-        imwrite(filename, cimg);
-      } else {
-        cout << "Error: " << ptrGrabResult->GetErrorCode() << " "
-             << ptrGrabResult->GetErrorDescription() << endl;
-      }
+      lowerGrab.start(framesPerCamera, imgCount, fly);
     }
 
-    currentCount = imgCount;
-    while ( lower.IsGrabbing() ) {
-      lower.RetrieveResult(5000, ptrGrabResult,
-        TimeoutHandling_ThrowException);
-      if ( ptrGrabResult->GrabSucceeded()) {
-        snprintf(filename, 100, "images/Lower%03d.png", currentCount++);
-        cout << "Writing image to " << filename << endl;
-        // Convert to OpenCV Mat
-        fc.Convert(image, ptrGrabResult);
-        Mat cimg(ptrGrabResult->GetHeight(), ptrGrabResult->GetWidth(),
-          CV_8UC3, (uint8_t *)image.GetBuffer()), rs;
-        // resize(cimg, rs, Size(), 0.25, 0.25);
-        imwrite(filename, cimg);
-      } else {
-        cout << "Error: " << ptrGrabResult->GetErrorCode() << " "
-             << ptrGrabResult->GetErrorDescription() << endl;
-      }
+    if ( upperGrab.join() != 0 || lowerGrab.join() != 0 ) {
+      printf("error grabbing images\n"); return 1;
     }
+    printCaptureTiming(upperGrab, lowerGrab);
 
-    imgCount = currentCount;
+    // Start the next fly after the highest number either camera used.
+    imgCount += max(upperGrab.stamps().size(), lowerGrab.stamps().size());
 
     // Spin the vanes back
     if ( stepVanes(arduinoFD) != 0 ) {
@@ -192,23 +409,39 @@ int main(int argc, char **argv)
     }
 
     maestroSetTarget(servoFD, 1, OUTLET_GATE_OPEN);
-
-    usleep(100000);
+    if ( waitForGates(servoFD, 1 << 1) != 0 ) {
+      printf("error opening outlet gate\n"); return 1;
+    }
 
     if ( pumpOn(arduinoFD) != 0 ) {
       perror("error turning on pump"); return 1;
     }
 
-    usleep(4000000);
+    traceSleep(4000000, "pump");
 
     if ( pumpOff(arduinoFD) != 0 ) {
       perror("error turning on pump"); return 1;
     }
 
-    usleep(100000);
-    maestroSetTarget(servoFD, 0, INLET_GATE_OPEN);
-    usleep(100000);
-    maestroSetTarget(servoFD, 1, OUTLET_GATE_CLOSED);
+    maestroSetTargets(servoFD, 0, gates, 2);
+    if ( waitForGates(servoFD, GATE_CHANNELS) != 0 ) {
+      printf("error resetting gates\n"); return 1;
+    }
+
+    // Images were encoding while the vanes and pump ran.
+    {
+      TraceSpan span("wait writes");
+      pipeline.waitIdle();
+    }
+    pipeline.printStats();
+    pipeline.resetStats();
+    if ( upperPool ) upperPool->printStats("Upper");
+    if ( lowerPool ) lowerPool->printStats("Lower");
+
+    // This fly is on disk; a restart picks up after it.
+    manifest.nextFrame = imgCount;
+    manifest.flies = fly;
+    writeManifest("images", manifest);
 
     printf("Done. Load another fly? (q + [ENTER] quits)\n");
 
@@ -219,17 +452,30 @@ int main(int argc, char **argv)
 
   }
 
+  if ( archivePath != NULL ) {
+    int n = archive.records();
+    if ( archive.close() == 0 ) printf("%d frames in %s.\n", n, archivePath);
+  }
+
+  if ( tracePath != NULL ) {
+    tracePrintSummary();
+    traceWriteChrome(tracePath);
+  }
+
   // Cleanup
   stepperOff(arduinoFD);
 
-  maestroSetTarget(servoFD, 0, INLET_GATE_OPEN);
-  maestroSetTarget(servoFD, 1, OUTLET_GATE_CLOSED);
+  printSerialCmdStats();
 
-  upper.Close();
-  lower.Close();
+  maestroSetTargets(servoFD, 0, gates, 2);
+
+  if ( !syntheticCameras ) {
+    upper.Close();
+    lower.Close();
+  }
 
-  close(servoFD);
-  close(arduinoFD);
+  closeSerialPort(servoFD);
+  closeSerialPort(arduinoFD);
 
   return 0;
 }
@@ -0,0 +1,383 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "ImageFormat.h"
+
+using namespace cv;
+using namespace std;
+
+OutputFormat::OutputFormat() : format(FormatPNG), pngLevel(-1), jpegQuality(95) { }
+
+const char *outputFormatUsage =
+  "png[:level 0-9] | tiff | jpeg[:quality 0-100] | qoi";
+
+bool parseOutputFormat(const char *spec, OutputFormat &fmt)
+{
+  string name(spec), arg;
+  size_t colon = name.find(':');
+  if ( colon != string::npos ) {
+    arg = name.substr(colon + 1);
+    name.erase(colon);
+    if ( arg.empty() ) return false;
+  }
+  char *end;
+  long value = strtol(arg.c_str(), &end, 10);
+  if ( *end != 0 ) return false;
+
+  OutputFormat f;
+  if ( name == "png" ) {
+    f.format = FormatPNG;
+    if ( !arg.empty() ) {
+      if ( value < 0 || value > 9 ) return false;
+      f.pngLevel = value;
+    }
+  } else if ( name == "jpeg" || name == "jpg" ) {
+    f.format = FormatJPEG;
+    if ( !arg.empty() ) {
+      if ( value < 0 || value > 100 ) return false;
+      f.jpegQuality = value;
+    }
+  } else if ( (name == "tiff" || name == "tif") && arg.empty() ) {
+    f.format = FormatTIFF;
+  } else if ( name == "qoi" && arg.empty() ) {
+    f.format = FormatQOI;
+  } else {
+    return false;
+  }
+  fmt = f;
+  return true;
+}
+
+const char *formatExtension(ImageFormat format)
+{
+  switch ( format ) {
+  case FormatTIFF: return ".tiff";
+  case FormatJPEG: return ".jpg";
+  case FormatQOI:  return ".qoi";
+  default:         return ".png";
+  }
+}
+
+string formatName(const OutputFormat &fmt)
+{
+  char name[32];
+  switch ( fmt.format ) {
+  case FormatTIFF: return "tiff";
+  case FormatQOI:  return "qoi";
+  case FormatJPEG:
+    snprintf(name, sizeof(name), "jpeg:%d", fmt.jpegQuality);
+    return name;
+  default:
+    if ( fmt.pngLevel < 0 ) return "png";
+    snprintf(name, sizeof(name), "png:%d", fmt.pngLevel);
+    return name;
+  }
+}
+
+bool formatKeepsRaw(ImageFormat format)
+{
+  return format == FormatPNG || format == FormatTIFF;
+}
+
+static void put16(unsigned char *p, unsigned v)
+{
+  p[0] = v & 0xFF;
+  p[1] = v >> 8 & 0xFF;
+}
+
+static void put32(unsigned char *p, unsigned v)
+{
+  put16(p, v & 0xFFFF);
+  put16(p + 2, v >> 16);
+}
+
+// Baseline TIFF, little-endian, one strip, no compression.
+static int tiffEncode(const Mat &img, vector<unsigned char> &out)
+{
+  int spp = img.channels();
+  unsigned rowBytes = img.cols * spp;
+  unsigned dataBytes = rowBytes * img.rows;
+
+  const int nEntries = 10;
+  const unsigned ifdOffset = 8;
+  const unsigned bpsOffset = ifdOffset + 2 + nEntries * 12 + 4;
+  const unsigned dataOffset = bpsOffset + 8;
+  out.resize(dataOffset + dataBytes);
+  unsigned char *p = &out[0];
+  memset(p, 0, dataOffset);
+
+  p[0] = 'I'; p[1] = 'I';
+  put16(p + 2, 42);
+  put32(p + 4, ifdOffset);
+
+  // Tag, type (3 = SHORT, 4 = LONG), count, value; sorted by tag.
+  unsigned entries[nEntries][4] = {
+    { 256, 4, 1, (unsigned)img.cols },                 // ImageWidth
+    { 257, 4, 1, (unsigned)img.rows },                 // ImageLength
+    { 258, 3, (unsigned)spp, spp == 1 ? 8 : bpsOffset }, // BitsPerSample
+    { 259, 3, 1, 1 },                                  // Compression: none
+    { 262, 3, 1, spp == 1 ? 1u : 2u },                 // BlackIsZero / RGB
+    { 273, 4, 1, dataOffset },                         // StripOffsets
+    { 277, 3, 1, (unsigned)spp },                      // SamplesPerPixel
+    { 278, 4, 1, (unsigned)img.rows },                 // RowsPerStrip
+    { 279, 4, 1, dataBytes },                          // StripByteCounts
+    { 284, 3, 1, 1 },                                  // PlanarConfig: chunky
+  };
+  unsigned char *e = p + ifdOffset;
+  put16(e, nEntries);
+  e += 2;
+  for ( int i = 0; i < nEntries; i++, e += 12 ) {
+    put16(e, entries[i][0]);
+    put16(e + 2, entries[i][1]);
+    put32(e + 4, entries[i][2]);
+    if ( entries[i][1] == 3 && entries[i][2] == 1 ) put16(e + 8, entries[i][3]);
+    else put32(e + 8, entries[i][3]);
+  }
+  put32(e, 0);  // no more IFDs
+  for ( int i = 0; i < 3; i++ ) put16(p + bpsOffset + 2*i, 8);
+
+  unsigned char *dst = p + dataOffset;
+  for ( int y = 0; y < img.rows; y++, dst += rowBytes ) {
+    const unsigned char *src = img.ptr<unsigned char>(y);
+    if ( spp == 1 ) {
+      memcpy(dst, src, rowBytes);
+    } else {
+      for ( unsigned x = 0; x < rowBytes; x += 3 ) {  // BGR -> RGB
+        dst[x] = src[x + 2];
+        dst[x + 1] = src[x + 1];
+        dst[x + 2] = src[x];
+      }
+    }
+  }
+  return 0;
+}
+
+// QOI, as specified at qoiformat.org: 14-byte header, then a stream of
+// run / index / small-difference / literal ops, then 7 zeros and a 1.
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HASH(r, g, b, a) (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) % 64)
+
+struct QoiPixel {
+  unsigned char r, g, b, a;
+  bool operator==(const QoiPixel &o) const {
+    return r == o.r && g == o.g && b == o.b && a == o.a;
+  }
+};
+
+int qoiEncode(const Mat &bgr, vector<unsigned char> &out)
+{
+  if ( bgr.depth() != CV_8U || bgr.channels() != 3 ) return -1;
+
+  size_t pixels = (size_t)bgr.cols * bgr.rows;
+  out.resize(14 + pixels * 4 + 8);  // worst case: every pixel a literal
+  unsigned char *p = &out[0];
+  memcpy(p, "qoif", 4);
+  p[4] = bgr.cols >> 24; p[5] = bgr.cols >> 16; p[6] = bgr.cols >> 8; p[7] = bgr.cols;
+  p[8] = bgr.rows >> 24; p[9] = bgr.rows >> 16; p[10] = bgr.rows >> 8; p[11] = bgr.rows;
+  p[12] = 3;  // channels
+  p[13] = 0;  // sRGB
+  p += 14;
+
+  QoiPixel index[64];
+  memset(index, 0, sizeof(index));
+  QoiPixel prev = { 0, 0, 0, 255 };
+  int run = 0;
+
+  for ( int y = 0; y < bgr.rows; y++ ) {
+    const unsigned char *src = bgr.ptr<unsigned char>(y);
+    bool lastRow = y == bgr.rows - 1;
+    for ( int x = 0; x < bgr.cols; x++, src += 3 ) {
+      QoiPixel px = { src[2], src[1], src[0], 255 };
+      if ( px == prev ) {
+        run++;
+        if ( run == 62 || (lastRow && x == bgr.cols - 1) ) {
+          *p++ = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if ( run > 0 ) {
+        *p++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      int h = QOI_HASH(px.r, px.g, px.b, 255);
+      if ( index[h] == px ) {
+        *p++ = QOI_OP_INDEX | h;
+      } else {
+        index[h] = px;
+        signed char vr = px.r - prev.r, vg = px.g - prev.g, vb = px.b - prev.b;
+        signed char vgr = vr - vg, vgb = vb - vg;
+        if ( vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2 ) {
+          *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        } else if ( vgr > -9 && vgr < 8 && vg > -33 && vg < 32 &&
+                    vgb > -9 && vgb < 8 ) {
+          *p++ = QOI_OP_LUMA | (vg + 32);
+          *p++ = (vgr + 8) << 4 | (vgb + 8);
+        } else {
+          *p++ = QOI_OP_RGB;
+          *p++ = px.r;
+          *p++ = px.g;
+          *p++ = px.b;
+        }
+      }
+      prev = px;
+    }
+  }
+
+  memset(p, 0, 7);
+  p[7] = 1;
+  p += 8;
+  out.resize(p - &out[0]);
+  return 0;
+}
+
+int qoiDecode(const unsigned char *data, size_t len, Mat &bgr)
+{
+  if ( len < 14 + 8 || memcmp(data, "qoif", 4) != 0 ) return -1;
+  unsigned w = (unsigned)data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+  unsigned h = (unsigned)data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+  if ( w == 0 || h == 0 || w > 65536 || h > 65536 ) return -1;
+
+  bgr.create(h, w, CV_8UC3);
+  QoiPixel index[64];
+  memset(index, 0, sizeof(index));
+  QoiPixel px = { 0, 0, 0, 255 };
+  int run = 0;
+  const unsigned char *p = data + 14, *end = data + len - 8;
+
+  for ( unsigned y = 0; y < h; y++ ) {
+    unsigned char *dst = bgr.ptr<unsigned char>(y);
+    for ( unsigned x = 0; x < w; x++, dst += 3 ) {
+      if ( run > 0 ) {
+        run--;
+      } else {
+        if ( p >= end ) return -1;
+        int b1 = *p++;
+        if ( b1 == QOI_OP_RGB ) {
+          if ( end - p < 3 ) return -1;
+          px.r = p[0]; px.g = p[1]; px.b = p[2];
+          p += 3;
+        } else if ( b1 == QOI_OP_RGBA ) {
+          if ( end - p < 4 ) return -1;
+          px.r = p[0]; px.g = p[1]; px.b = p[2]; px.a = p[3];
+          p += 4;
+        } else if ( (b1 & QOI_MASK_2) == QOI_OP_INDEX ) {
+          px = index[b1];
+        } else if ( (b1 & QOI_MASK_2) == QOI_OP_DIFF ) {
+          px.r += ((b1 >> 4) & 0x03) - 2;
+          px.g += ((b1 >> 2) & 0x03) - 2;
+          px.b += (b1 & 0x03) - 2;
+        } else if ( (b1 & QOI_MASK_2) == QOI_OP_LUMA ) {
+          if ( p >= end ) return -1;
+          int b2 = *p++;
+          int vg = (b1 & 0x3f) - 32;
+          px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+          px.g += vg;
+          px.b += vg - 8 + (b2 & 0x0f);
+        } else {
+          run = b1 & 0x3f;
+        }
+        index[QOI_HASH(px.r, px.g, px.b, px.a)] = px;
+      }
+      dst[0] = px.b;
+      dst[1] = px.g;
+      dst[2] = px.r;
+    }
+  }
+  return 0;
+}
+
+int encodeImage(const Mat &img, const OutputFormat &fmt,
+                vector<unsigned char> &out)
+{
+  if ( img.depth() != CV_8U || (img.channels() != 1 && img.channels() != 3) ) {
+    return -1;
+  }
+  vector<int> params;
+  switch ( fmt.format ) {
+  case FormatTIFF:
+    return tiffEncode(img, out);
+  case FormatQOI:
+    return qoiEncode(img, out);
+  case FormatJPEG:
+    if ( img.channels() != 3 ) return -1;
+    params.push_back(IMWRITE_JPEG_QUALITY);
+    params.push_back(fmt.jpegQuality);
+    return imencode(".jpg", img, out, params) ? 0 : -1;
+  default:
+    if ( fmt.pngLevel >= 0 ) {
+      params.push_back(IMWRITE_PNG_COMPRESSION);
+      params.push_back(fmt.pngLevel);
+    }
+    return imencode(".png", img, out, params) ? 0 : -1;
+  }
+}
+
+int writeImage(const string &basename, const Mat &img, const OutputFormat &fmt,
+               string &path)
+{
+  path = basename + formatExtension(fmt.format);
+  vector<unsigned char> data;
+  if ( encodeImage(img, fmt, data) != 0 ) {
+    printf("Couldn't encode %s.\n", path.c_str());
+    return -1;
+  }
+
+  FILE *fp = fopen(path.c_str(), "wb");
+  if ( fp == NULL ) {
+    perror(path.c_str());
+    return -1;
+  }
+  size_t n = fwrite(&data[0], 1, data.size(), fp);
+  if ( fclose(fp) != 0 || n != data.size() ) {
+    perror(path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+Mat readImage(const string &path)
+{
+  size_t n = path.size();
+  if ( n < 4 || path.compare(n - 4, 4, ".qoi") != 0 ) {
+    return imread(path, IMREAD_UNCHANGED);
+  }
+
+  Mat img;
+  FILE *fp = fopen(path.c_str(), "rb");
+  if ( fp == NULL ) return img;
+  vector<unsigned char> data;
+  unsigned char chunk[65536];
+  size_t got;
+  while ( (got = fread(chunk, 1, sizeof(chunk), fp)) > 0 ) {
+    data.insert(data.end(), chunk, chunk + got);
+  }
+  fclose(fp);
+  if ( data.empty() || qoiDecode(&data[0], data.size(), img) != 0 ) img.release();
+  return img;
+}
+
+int decodeImage(const unsigned char *data, size_t len, Mat &img)
+{
+  if ( len >= 4 && memcmp(data, "qoif", 4) == 0 ) {
+    return qoiDecode(data, len, img);
+  }
+  // Wraps the bytes without copying them.
+  Mat buf(1, (int)len, CV_8UC1, (void *)data);
+  img = imdecode(buf, IMREAD_UNCHANGED);
+  return img.empty() ? -1 : 0;
+}
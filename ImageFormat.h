@@ -0,0 +1,65 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __IMAGEFORMAT_H__
+#define __IMAGEFORMAT_H__
+
+#include <string>
+#include <vector>
+#include "opencv2/core/core.hpp"
+
+// File formats for captured frames, chosen at run time (-format):
+//
+//   png[:level]    lossless, zlib level 0-9 (default: OpenCV's own)
+//   tiff           uncompressed; little more than a copy to disk
+//   jpeg[:quality] lossy, quality 0-100 (default 95); BGR only
+//   qoi            lossless "Quite OK Image" format, several times faster
+//                  than PNG at a similar size; BGR only
+//
+// TIFF and QOI are written in-tree, so they don't depend on how OpenCV
+// was built. Raw (Bayer mosaic) frames can only be stored losslessly as
+// single-channel images, i.e. png or tiff.
+enum ImageFormat { FormatPNG, FormatTIFF, FormatJPEG, FormatQOI };
+
+struct OutputFormat {
+  ImageFormat format;
+  int pngLevel;      // -1 = OpenCV's default
+  int jpegQuality;
+
+  OutputFormat();
+};
+
+// Parses "png", "png:1", "tiff", "jpeg:90", "qoi". Returns false if spec
+// isn't one of those.
+bool parseOutputFormat(const char *spec, OutputFormat &fmt);
+extern const char *outputFormatUsage;
+
+// ".png", ".tiff", ".jpg" or ".qoi".
+const char *formatExtension(ImageFormat format);
+// "png:1", "jpeg:95", ... as parseOutputFormat would accept.
+std::string formatName(const OutputFormat &fmt);
+// Whether a Bayer mosaic can be stored this way without loss.
+bool formatKeepsRaw(ImageFormat format);
+
+// Encodes an 8-bit 1- or 3-channel (BGR) image. Returns 0, or -1 if the
+// format can't hold it or encoding failed.
+int encodeImage(const cv::Mat &img, const OutputFormat &fmt,
+                std::vector<unsigned char> &out);
+
+// Encodes img and writes it to basename + formatExtension(); path is set
+// to the file written. Returns 0 or -1.
+int writeImage(const std::string &basename, const cv::Mat &img,
+               const OutputFormat &fmt, std::string &path);
+
+// Reads any of the above, keeping the channel count. Returns an empty Mat
+// on failure.
+cv::Mat readImage(const std::string &path);
+// The same, from an encoded image already in memory. Returns 0 or -1.
+int decodeImage(const unsigned char *data, size_t len, cv::Mat &img);
+
+// QOI on its own, for BGR images (stored as RGB, as the format requires).
+int qoiEncode(const cv::Mat &bgr, std::vector<unsigned char> &out);
+int qoiDecode(const unsigned char *data, size_t len, cv::Mat &bgr);
+
+#endif // __IMAGEFORMAT_H__
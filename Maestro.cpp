@@ -0,0 +1,206 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <mutex>
+
+#include "PhotoFuncs.h"
+#include "Maestro.h"
+#include "Trace.h"
+
+using namespace std;
+
+// How often maestroWaitUntilSettled asks.
+#define MAESTRO_POLL_US 5000
+
+// The last target set on each channel, per fd; 0 = none yet (0 also
+// means "off" to the Maestro, which is reached at once).
+#define MAESTRO_MAX_FDS 256
+
+static mutex targetLock;
+static unsigned short targets[MAESTRO_MAX_FDS][MAESTRO_CHANNELS];
+
+static void rememberTarget(int fd, int channel, unsigned short target)
+{
+  if ( fd < 0 || fd >= MAESTRO_MAX_FDS || channel >= MAESTRO_CHANNELS ) return;
+  lock_guard<mutex> l(targetLock);
+  targets[fd][channel] = target;
+}
+
+static unsigned short lastTarget(int fd, int channel)
+{
+  if ( fd < 0 || fd >= MAESTRO_MAX_FDS ) return 0;
+  lock_guard<mutex> l(targetLock);
+  return targets[fd][channel];
+}
+
+static bool debug = false;
+
+void maestroSetDebug(bool on)
+{
+  debug = on;
+}
+
+static void dumpBytes(const char *what, const unsigned char *b, int n)
+{
+  printf("maestro: %s", what);
+  for ( int i = 0; i < n; i++ ) printf(" %02X", b[i]);
+  printf("\n");
+}
+
+int maestroGetPositions(int fd, const unsigned char *channels, int count,
+                        unsigned short *positions, int timeout)
+{
+  TraceSpan span("maestro get", count);
+  if ( count < 1 || count > MAESTRO_CHANNELS ) return -1;
+
+  // All the queries go out in one write; the replies come back in order.
+  unsigned char command[2 * MAESTRO_CHANNELS], response[2 * MAESTRO_CHANNELS];
+  for ( int i = 0; i < count; i++ ) {
+    command[2*i] = 0x90;
+    command[2*i + 1] = channels[i];
+  }
+  if ( debug ) dumpBytes("wrote", command, 2 * count);
+
+  int r = serialQuery(fd, command, 2 * count, response, 2 * count, timeout);
+  if ( r != 0 ) {
+    if ( r == -2 ) printf("No position from Maestro within %d ms.\n", timeout);
+    return r;
+  }
+  if ( debug ) dumpBytes("read", response, 2 * count);
+
+  for ( int i = 0; i < count; i++ ) {
+    positions[i] = response[2*i] | response[2*i + 1] << 8;
+  }
+  return 0;
+}
+
+// Gets the position of a Maestro channel.
+int maestroGetPosition(int fd, unsigned char channel)
+{
+  unsigned short pos;
+  if ( maestroGetPositions(fd, &channel, 1, &pos) != 0 ) return -1;
+  return pos;
+}
+
+// Sets the target of a Maestro channel.
+int maestroSetTarget(int fd, unsigned char channel, unsigned short target)
+{
+  TraceSpan span("maestro set", channel);
+  unsigned char command[] = {0x84, channel, (unsigned char)(target & 0x7F),
+                             (unsigned char)(target >> 7 & 0x7F)};
+  if ( serialWrite(fd, command, sizeof(command)) != 0 ) return -1;
+  rememberTarget(fd, channel, target);
+  return 0;
+}
+
+int maestroSetTargets(int fd, unsigned char firstChannel,
+                      const unsigned short *t, int count)
+{
+  TraceSpan span("maestro set", firstChannel, "multiple");
+  if ( count < 1 || firstChannel + count > MAESTRO_CHANNELS ) return -1;
+
+  unsigned char command[3 + 2 * MAESTRO_CHANNELS];
+  command[0] = 0x9F;
+  command[1] = count;
+  command[2] = firstChannel;
+  for ( int i = 0; i < count; i++ ) {
+    command[3 + 2*i] = t[i] & 0x7F;
+    command[4 + 2*i] = t[i] >> 7 & 0x7F;
+  }
+  if ( serialWrite(fd, command, 3 + 2 * count) != 0 ) return -1;
+  for ( int i = 0; i < count; i++ ) rememberTarget(fd, firstChannel + i, t[i]);
+  return 0;
+}
+
+int maestroSetSpeed(int fd, unsigned char channel, unsigned short speed)
+{
+  unsigned char command[] = {0x87, channel, (unsigned char)(speed & 0x7F),
+                             (unsigned char)(speed >> 7 & 0x7F)};
+  return serialWrite(fd, command, sizeof(command));
+}
+
+int maestroSetAcceleration(int fd, unsigned char channel, unsigned short accel)
+{
+  unsigned char command[] = {0x89, channel, (unsigned char)(accel & 0x7F),
+                             (unsigned char)(accel >> 7 & 0x7F)};
+  return serialWrite(fd, command, sizeof(command));
+}
+
+int maestroSetLimits(int fd, unsigned int channels, unsigned short speed,
+                     unsigned short accel)
+{
+  for ( int ch = 0; ch < MAESTRO_CHANNELS; ch++ ) {
+    if ( !(channels & (1u << ch)) ) continue;
+    if ( maestroSetSpeed(fd, ch, speed) != 0 ||
+         maestroSetAcceleration(fd, ch, accel) != 0 ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int maestroGetMovingState(int fd)
+{
+  unsigned char command = 0x93, state;
+  int r = serialQuery(fd, &command, 1, &state, 1, MAESTRO_REPLY_MS);
+  if ( r != 0 ) {
+    if ( r == -2 ) printf("No reply from Maestro to get moving state.\n");
+    return -1;
+  }
+  return state != 0;
+}
+
+// 1 if a channel in the mask is short of its target, 0 if not, -1 on error.
+// last holds each channel's position from the previous poll (0 before the
+// first). A channel short of its target but where it was last time may
+// have been clamped to its range by the Maestro, which then counts it as
+// arrived; get moving state says whether it is still on its way.
+static int channelsMoving(int fd, unsigned int channels, unsigned short *last)
+{
+  // One byte covers every channel.
+  if ( channels == MAESTRO_ALL_CHANNELS ) return maestroGetMovingState(fd);
+
+  unsigned char chans[MAESTRO_CHANNELS];
+  unsigned short want[MAESTRO_CHANNELS], pos[MAESTRO_CHANNELS];
+  int n = 0;
+  for ( int ch = 0; ch < MAESTRO_CHANNELS; ch++ ) {
+    if ( !(channels & (1u << ch)) ) continue;
+    want[n] = lastTarget(fd, ch);
+    if ( want[n] == 0 ) continue;
+    chans[n++] = ch;
+  }
+  if ( n == 0 ) return 0;
+
+  if ( maestroGetPositions(fd, chans, n, pos) != 0 ) return -1;
+  bool behind = false, stopped = true;
+  for ( int i = 0; i < n; i++ ) {
+    if ( pos[i] != want[i] ) {
+      behind = true;
+      if ( pos[i] != last[chans[i]] ) stopped = false;
+    }
+    last[chans[i]] = pos[i];
+  }
+  if ( !behind ) return 0;
+  if ( !stopped ) return 1;
+  return maestroGetMovingState(fd);
+}
+
+int maestroWaitUntilSettled(int fd, unsigned int channels, int timeout)
+{
+  TraceSpan span("maestro settle", channels);
+  unsigned long long deadline = monotonicUs() + (unsigned long long)timeout * 1000;
+  unsigned short last[MAESTRO_CHANNELS] = { 0 };
+  for (;;) {
+    int moving = channelsMoving(fd, channels, last);
+    if ( moving <= 0 ) return moving;
+    if ( monotonicUs() + MAESTRO_POLL_US > deadline ) {
+      printf("Maestro channels %#x still moving after %d ms.\n", channels,
+        timeout);
+      return -2;
+    }
+    usleep(MAESTRO_POLL_US);
+  }
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __MAESTRO_H__
+#define __MAESTRO_H__
+
+// Pololu Maestro servo controller, compact serial protocol. See the
+// "Serial Servo Commands" section of the user's guide. Targets and
+// positions are in quarter-microseconds.
+//
+// NOTE: The Maestro's serial mode must be set to "USB Dual Port".
+//
+// The Maestro can't see the servos: the position it reports is where its
+// own ramp toward the target has got to. With no speed limit that is the
+// target itself, the moment it is set. Limit a channel's speed to roughly
+// what the servo can manage and "reached its target" means the servo is
+// (nearly) there, which is what maestroWaitUntilSettled relies on.
+
+#define MAESTRO_CHANNELS     24
+#define MAESTRO_ALL_CHANNELS 0xFFFFFF
+
+// How long a query waits for the Maestro's reply, by default.
+#define MAESTRO_REPLY_MS 100
+
+// Position of one channel, or -1 on error / no reply.
+int maestroGetPosition(int fd, unsigned char channel);
+// Positions of several channels in one round trip. Returns 0, -2 if the
+// replies didn't all arrive within timeout (ms), or -1 on error.
+int maestroGetPositions(int fd, const unsigned char *channels, int count,
+                        unsigned short *positions,
+                        int timeout = MAESTRO_REPLY_MS);
+// Print every query's bytes (off by default).
+void maestroSetDebug(bool on);
+
+int maestroSetTarget(int fd, unsigned char channel, unsigned short target);
+
+// Sets count consecutive channels from firstChannel in one command (0x9F;
+// Mini Maestro 12/18/24 only).
+int maestroSetTargets(int fd, unsigned char firstChannel,
+                      const unsigned short *targets, int count);
+
+// Speed in (0.25 us) / (10 ms), acceleration in (0.25 us) / (10 ms) /
+// (80 ms), 0 = unlimited. Both last until the Maestro is reset.
+int maestroSetSpeed(int fd, unsigned char channel, unsigned short speed);
+int maestroSetAcceleration(int fd, unsigned char channel, unsigned short accel);
+// Both, for each channel in the bitmask.
+int maestroSetLimits(int fd, unsigned int channels, unsigned short speed,
+                     unsigned short accel);
+
+// 1 if any channel is still moving toward its target, 0 if none is, -1 on
+// error.
+int maestroGetMovingState(int fd);
+
+// Waits until every channel in the bitmask has reached the target last
+// set through this file (channels never set here don't count). A target
+// outside a channel's configured range is clamped by the Maestro and
+// never reached; such a channel counts once its position stops changing
+// and the Maestro reports nothing moving. Returns 0 once they have, -2 if
+// timeout (ms) passes first, -1 on error.
+int maestroWaitUntilSettled(int fd, unsigned int channels, int timeout);
+
+#endif // __MAESTRO_H__
@@ -4,61 +4,21 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include <termios.h>
 #include <string.h>
+#include <time.h>
+#include <map>
+#include <mutex>
+#include <string>
 
 #include "PhotoFuncs.h"
+#include "Trace.h"
 
 using namespace std;
 
-#define  INLET_GATE_OPEN   7100
-#define  INLET_GATE_CLOSED 5400
-
-#define OUTLET_GATE_OPEN   4500
-#define OUTLET_GATE_CLOSED 6500
-
-// NOTE: The Maestro's serial mode must be set to "USB Dual Port".
-
-// Gets the position of a Maestro channel.
-// See the "Serial Servo Commands" section of the user's guide.
-int maestroGetPosition(int fd, unsigned char channel)
-{
-  unsigned char command[] = {0x90, channel};
-  if(write(fd, command, sizeof(command)) == -1)
-  {
-    perror("error writing");
-    return -1;
-  }
-  printf("mgp: wrote command %02X %02X.\n", command[0], command[1]);
-
-  usleep(50000);
- 
-  unsigned char response[2];
-  if(read(fd,response,2) != 2)
-  {
-    perror("error reading");
-    return -1;
-  }
-  printf("mgp: read response %02X %02X.\n", response[0], response[1]);
- 
-  return response[0] + 256*response[1];
-}
- 
-// Sets the target of a Maestro channel.
-// See the "Serial Servo Commands" section of the user's guide.
-// The units of 'target' are quarter-microseconds.
-int maestroSetTarget(int fd, unsigned char channel, unsigned short target)
-{
-  unsigned char command[] = {0x84, channel, target & 0x7F, target >> 7 & 0x7F};
-  if (write(fd, command, sizeof(command)) == -1)
-  {
-    perror("error writing");
-    return -1;
-  }
-  return 0;
-}
-
 int openSerialPort(const char *dev) {
 
   int fd = open(dev, O_RDWR | O_SYNC );
@@ -110,60 +70,256 @@ int openSerialPort(const char *dev) {
 
   printf("Options set.\n");
 
+  serialport_flush(fd);
+
   return fd;
 }
 
+// Bytes received from each serial device but not yet handed to a caller,
+// indexed by fd. A read takes whatever the driver has in one call, so a
+// reply that arrives in one USB packet costs one syscall, and anything
+// past the terminator is kept for the next call.
+//
+// Each fd's buffer must only be used from one thread at a time;
+// sendSerialCmd takes cmdLock so steps running concurrently (e.g. the pump
+// and the vanes, both on the Arduino) can share a device.
+#define SERIAL_MAX_FDS  256
+#define SERIAL_BUF_SIZE 512
+
+struct SerialBuffer {
+  char data[SERIAL_BUF_SIZE];
+  int len;
+  mutex cmdLock;
+};
+
+static SerialBuffer serialBuffers[SERIAL_MAX_FDS];
+
+static SerialBuffer *serialBuffer(int fd)
+{
+  if ( fd < 0 || fd >= SERIAL_MAX_FDS ) return NULL;
+  return &serialBuffers[fd];
+}
+
+// Move up to n buffered bytes into buf (NUL-terminated) and drop them
+// from the buffer.
+static void takeBuffered(SerialBuffer *sb, char *buf, int n)
+{
+  memcpy(buf, sb->data, n);
+  buf[n] = 0;
+  memmove(sb->data, sb->data + n, sb->len - n);
+  sb->len -= n;
+}
+
+// Wait until fd is readable or the deadline passes, then append what's
+// available to the buffer. Returns 1 if data was added, 0 on timeout,
+// -1 on error.
+static int fillBuffer(int fd, SerialBuffer *sb, unsigned long long deadline)
+{
+  for (;;) {
+    unsigned long long now = monotonicUs();
+    if ( now >= deadline ) return 0;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ms = (int)((deadline - now + 999) / 1000);
+    int r = poll(&pfd, 1, ms);
+    if ( r < 0 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    if ( r == 0 ) continue;
+    if ( !(pfd.revents & POLLIN) ) return -1;  // POLLERR / POLLHUP
+
+    int n = read(fd, sb->data + sb->len, SERIAL_BUF_SIZE - sb->len);
+    if ( n < 0 ) {
+      if ( errno == EINTR || errno == EAGAIN ) continue;
+      return -1;
+    }
+    if ( n == 0 ) return -1;  // readable but empty: device went away
+    sb->len += n;
+    return 1;
+  }
+}
+
+// Reads up to and including 'until' into buf (at most buf_max-1 chars,
+// NUL-terminated). Returns as soon as the terminator arrives. timeout is
+// in milliseconds. Returns 0 on success (or if buf filled up first), -2 on
+// timeout with whatever arrived left in buf, -1 on error.
 int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeout)
 {
-    char b[1];  // read expects an array, so we give it a 1-byte array
-    int i=0;
-    do { 
-        int n = read(fd, b, 1);  // read a char at a time
-        if( n==-1) return -1;    // couldn't read
-        if( n==0 ) {
-            usleep( 1 * 1000 );  // wait 1 msec try again
-            timeout--;
-            if( timeout==0 ) { buf[i]=0; return -2; }
-            continue;
+    TraceSpan span("serial read");
+    SerialBuffer *sb = serialBuffer(fd);
+    if ( sb == NULL || buf_max < 1 ) return -1;
+
+    unsigned long long deadline = monotonicUs() + (unsigned long long)timeout * 1000;
+    int scanned = 0;
+    for (;;) {
+        // Only look at the bytes that are new since the last pass.
+        char *end = (char *)memchr(sb->data + scanned, until, sb->len - scanned);
+        scanned = sb->len;
+        if ( end != NULL && end - sb->data + 1 <= buf_max - 1 ) {
+            takeBuffered(sb, buf, end - sb->data + 1);
+            return 0;
+        }
+        if ( sb->len >= buf_max - 1 || sb->len == SERIAL_BUF_SIZE ) {
+            takeBuffered(sb, buf, sb->len < buf_max - 1 ? sb->len : buf_max - 1);
+            return 0;
         }
-        // printf("sp_r_u: i=%d, n=%d b='%c'\n",i,n,b[0]); // debug
-        buf[i] = b[0]; 
-        i++;
-    } while( b[0] != until && i < buf_max && timeout>0 );
 
-    buf[i] = 0;  // null terminate the string
-    return 0;
+        int r = fillBuffer(fd, sb, deadline);
+        if ( r < 0 ) { buf[0] = 0; return -1; }
+        if ( r == 0 ) {
+            takeBuffered(sb, buf, sb->len);
+            return -2;
+        }
+    }
 }
 
-int sendSerialCmd(int fd, char *msg, const char *reply,
-                  int waitTime /* = 500000 */) {
+// Discard anything pending on the device, in the driver and in our buffer.
+void serialport_flush(int fd)
+{
+  tcflush(fd, TCIOFLUSH);
+  SerialBuffer *sb = serialBuffer(fd);
+  if ( sb != NULL ) sb->len = 0;
+}
+
+void closeSerialPort(int fd)
+{
+  serialport_flush(fd);
+  close(fd);
+}
+
+// Round-trip times per command, keyed by the command without its newline.
+static mutex cmdStatsLock;
+static map<string, StageTimer> cmdStats;
+static map<string, int> cmdFailures;
+
+static string commandName(const char *msg)
+{
+  string name(msg);
+  while ( !name.empty() && (name[name.size()-1] == '\n' ||
+                            name[name.size()-1] == '\r') ) {
+    name.erase(name.size() - 1);
+  }
+  return name;
+}
+
+static void recordCommand(const char *msg, unsigned long long us, bool ok)
+{
+  lock_guard<mutex> l(cmdStatsLock);
+  string name = commandName(msg);
+  if ( ok ) cmdStats[name].add(us);
+  else cmdFailures[name]++;
+}
+
+// Sends msg and waits for the reply line. Returns as soon as the reply
+// arrives; timeout (ms) only bounds how long a silent device can stall us.
+int sendSerialCmd(int fd, const char *msg, const char *reply,
+                  int timeout /* = 2500 */) {
   int n;
   char replyString[100];
 
-  tcflush(fd, TCIOFLUSH); usleep(100000);
+  SerialBuffer *sb = serialBuffer(fd);
+  if ( sb == NULL ) return -1;
+  TraceSpan span("serial cmd", -1, commandName(msg).c_str());
+  lock_guard<mutex> l(sb->cmdLock);
 
-  n = write(fd, msg, strlen(msg));
-  if ( n != strlen(msg) ) { perror("error writing to dispenser"); return -1; }
+  // Drop anything stale so we only see the reply to this command.
+  serialport_flush(fd);
 
-  usleep(waitTime);
+  unsigned long long t0 = monotonicUs();
+  n = write(fd, msg, strlen(msg));
+  if ( n != (int)strlen(msg) ) {
+    perror("error writing to device");
+    recordCommand(msg, 0, false);
+    return -1;
+  }
 
-  n = serialport_read_until(fd, replyString, '\n', 100, 2000);
+  n = serialport_read_until(fd, replyString, '\n', 100, timeout);
+  unsigned long long rtt = monotonicUs() - t0;
   if ( n == 0 ) {
     if ( strcmp(replyString, reply) == 0 ) {
+      recordCommand(msg, rtt, true);
       return 0;
     } else {
       printf("Expected '%s', received: '%s'\n", reply, replyString);
-      tcflush(fd, TCIOFLUSH);
+      serialport_flush(fd);
+      recordCommand(msg, rtt, false);
       return 1;
     }
   } else {
-    perror("error reading from device"); return -1;
+    if ( n == -2 ) {
+      printf("No reply to '%s' within %d ms (got '%s').\n",
+        commandName(msg).c_str(), timeout, replyString);
+    } else {
+      perror("error reading from device");
+    }
+    recordCommand(msg, rtt, false);
+    return -1;
   }
 
 }
 
+// Writes a binary command, taking turns with other commands to the device.
+int serialWrite(int fd, const void *cmd, int len)
+{
+  SerialBuffer *sb = serialBuffer(fd);
+  if ( sb == NULL ) return -1;
+  lock_guard<mutex> l(sb->cmdLock);
+  if ( write(fd, cmd, len) != len ) {
+    perror("error writing to device");
+    return -1;
+  }
+  return 0;
+}
+
+// Binary request / reply: sends cmd and waits for exactly replyLen bytes.
+// Only input is discarded beforehand; output still queued for the device
+// (another thread's command) must not be.
+int serialQuery(int fd, const void *cmd, int cmdLen, void *reply, int replyLen,
+                int timeout)
+{
+  SerialBuffer *sb = serialBuffer(fd);
+  if ( sb == NULL || replyLen > SERIAL_BUF_SIZE ) return -1;
+  lock_guard<mutex> l(sb->cmdLock);
+
+  tcflush(fd, TCIFLUSH);
+  sb->len = 0;
+
+  unsigned long long deadline = monotonicUs() + (unsigned long long)timeout * 1000;
+  if ( write(fd, cmd, cmdLen) != cmdLen ) {
+    perror("error writing to device");
+    return -1;
+  }
+  while ( sb->len < replyLen ) {
+    int r = fillBuffer(fd, sb, deadline);
+    if ( r < 0 ) return -1;
+    if ( r == 0 ) return -2;
+  }
+  memcpy(reply, sb->data, replyLen);
+  memmove(sb->data, sb->data + replyLen, sb->len - replyLen);
+  sb->len -= replyLen;
+  return 0;
+}
+
+void printSerialCmdStats()
+{
+  lock_guard<mutex> l(cmdStatsLock);
+  printf("Serial command round trips:\n");
+  map<string, StageTimer>::const_iterator i;
+  for ( i = cmdStats.begin(); i != cmdStats.end(); ++i ) {
+    i->second.print(i->first.c_str());
+  }
+  map<string, int>::const_iterator f;
+  for ( f = cmdFailures.begin(); f != cmdFailures.end(); ++f ) {
+    printf("  %-12s %d failed\n", f->first.c_str(), f->second);
+  }
+}
+
 int initDispenser(int fd) {
-  return sendSerialCmd(fd, "I", "ok\n", 1500000);
+  return sendSerialCmd(fd, "I", "ok\n", 3500);
 }
 
 int dispenseFly(int fd) {
@@ -190,7 +346,36 @@ int stepVanes(int fd) {
   return sendSerialCmd(fd, "S\n", "S\n");
 }
 
+int stepVanesAndTrigger(int fd, int pulses, int intervalUs, int settleUs) {
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "T%d,%d,%d\n", pulses, intervalUs, settleUs);
+  return sendSerialCmd(fd, cmd, "T\n", 2500 + settleUs / 1000);
+}
+
 int stepperOff(int fd) {
   return sendSerialCmd(fd, "s\n", "s\n");
 }
 
+
+unsigned long long monotonicUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void StageTimer::add(unsigned long long us)
+{
+  count++;
+  totalUs += us;
+  if ( us > maxUs ) maxUs = us;
+}
+
+void StageTimer::print(const char *name) const
+{
+  if ( count == 0 ) {
+    printf("  %-12s (none)\n", name);
+    return;
+  }
+  printf("  %-12s n=%-4lu avg=%8.1f ms  max=%8.1f ms  total=%8.1f ms\n",
+    name, count, totalUs / 1000.0 / count, maxUs / 1000.0, totalUs / 1000.0);
+}
@@ -11,12 +11,34 @@
 #define OUTLET_GATE_OPEN   5700
 #define OUTLET_GATE_CLOSED 7000
 
-int maestroGetPosition(int fd, unsigned char channel);
-int maestroSetTarget(int fd, unsigned char channel, unsigned short target);
+// The gates are Maestro channels 0 (inlet) and 1 (outlet). Their speed
+// limit stretches the Maestro's ramp to about what the servos take for a
+// full swing (~140 ms), so waiting for the ramp waits for the gate.
+#define GATE_CHANNELS 0x03
+#define GATE_SPEED    100
+#define GATE_ACCEL    0
+// After the ramp ends, for the servo to catch up and stop.
+#define GATE_MARGIN_US 50000
+
+#include "Maestro.h"
 
 int openSerialPort(const char *dev);
+void closeSerialPort(int fd);
+// timeout is in milliseconds of wall time.
 int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeout);
-int sendSerialCmd(int fd, char *msg, const char *reply, int waitTime = 500000);
+// Use instead of tcflush so bytes we've already read are dropped too.
+void serialport_flush(int fd);
+// Returns as soon as the reply arrives; timeout (ms) is an upper bound.
+// Safe to call from several threads; commands to one device take turns.
+int sendSerialCmd(int fd, const char *msg, const char *reply, int timeout = 2500);
+// Per-command round-trip times since startup.
+void printSerialCmdStats();
+// Binary protocols (the Maestro's): write a command, or write one and
+// wait for exactly replyLen bytes. Both take turns with sendSerialCmd.
+// serialQuery returns 0, -2 on timeout (ms) or -1 on error.
+int serialWrite(int fd, const void *cmd, int len);
+int serialQuery(int fd, const void *cmd, int cmdLen, void *reply, int replyLen,
+                int timeout);
 
 int initDispenser(int fd);
 int dispenseFly(int fd);
@@ -25,6 +47,25 @@ int disableLights(int fd);
 int pumpOn(int fd);
 int pumpOff(int fd);
 int stepVanes(int fd);
+// Step the vanes, wait settleUs for them to come to rest, then send
+// pulses trigger pulses intervalUs apart (the lower camera's line 1).
+// "T<pulses>,<intervalUs>,<settleUs>\n"; the Arduino answers "T\n" just
+// before the first pulse, so the reply marks when the burst starts.
+int stepVanesAndTrigger(int fd, int pulses, int intervalUs, int settleUs);
 int stepperOff(int fd);
 
+// Microseconds on the monotonic clock, for timing.
+unsigned long long monotonicUs();
+
+// Accumulated timing for one stage or command, in microseconds.
+struct StageTimer {
+  unsigned long count;
+  unsigned long long totalUs;
+  unsigned long long maxUs;
+
+  StageTimer() : count(0), totalUs(0), maxUs(0) { }
+  void add(unsigned long long us);
+  void print(const char *name) const;
+};
+
 #endif // __PHOTOFUNCS_H__
@@ -4,9 +4,15 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <termios.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <memory>
+#include <set>
+#include <vector>
 #include <pylon/PylonIncludes.h>
 #include <pylon/ImagePersistence.h>
 #include "opencv2/core/core.hpp"
@@ -14,6 +20,12 @@
 #include "opencv2/highgui/highgui.hpp"
 
 #include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "GrabEngine.h"
+#include "Trace.h"
+#include "Station.h"
+#include "SerialDiscovery.h"
+#include "BoothDaemon.h"
 
 using namespace cv;
 using namespace Pylon;
@@ -32,240 +44,351 @@ using namespace std;
        - Trigger lower camera to capture N images
        - Move servos, move fly to vial, move servos
 
+   With -stations, one process runs several booths this way (Station.h),
+   each cycle on its own thread, sharing the encoder threads and the
+   session archive.
 */
 
-const char *servoCtrl = "/dev/ttyACM0";
-const char *dispenser = "/dev/ttyACM2";
-const char *arduino   = "/dev/ttyUSB0";
+// Serial devices, found by USB identity (SerialDiscovery.h); "" is the
+// usual hardware.
+const char *servoCtrl = "";
+const char *dispenser = "";
+const char *arduino   = "";
 
-int main()
-{
-
-  printf("While serial ports are opening, set diffuser vane to block *lower* camera.\n");
-  char replyString[100];
-  int n;
-  CInstantCamera upper, lower;
+// Camera features put on both cameras at startup (CameraSettings.h), and
+// the cameras they're known to be on already.
+const char *cameraConfig = "AceFlashSettings.pfs";
+const char *settingsCachePath = "images/camera-settings.cache";
 
-  PylonInitialize();
+int main(int argc, char **argv)
+{
 
-  int arduinoFD = openSerialPort(arduino);
-  if ( arduinoFD == -1 ) {
-    perror(arduino);
-    return 1;
-  } else {
-    printf("Arduino FD opened: %d.\n", arduinoFD);
-   
+  // -raw:     store Bayer mosaics and demosaic later with Debayer.
+  // -n N:     image N flies (0 = until the dispenser runs dry; default 1).
+  // -serial:  run one step at a time, as before the cycle was overlapped.
+  // -servo, -dispenser, -arduino <spec>:
+  //           where to find these serial devices instead of by their
+  //           usual USB IDs: a path (e.g. BoothSim's), usb:VVVV:PPPP or a
+  //           USB serial number (SerialDiscovery.h).
+  // -devices: list the USB serial ports and which node each station's
+  //           devices would be, then exit.
+  // -stations file: run every booth listed in file (see readStations()
+  //           in Station.h) instead of the one above; each stores into
+  //           images/<name>/.
+  // -synthetic: use generated frames instead of the Basler cameras.
+  // -format fmt: output image format, e.g. qoi, tiff, png:1 (ImageFormat.h).
+  // -archive file: put every frame in one session archive (SessionArchive.h;
+  //           ArchiveExtract gets the images back) instead of images/.
+  // -pool MB: grab buffers per camera (FramePool.h; default 256, 0 = let
+  //           Pylon allocate them).
+  // -frames n: frames to grab per camera (default 3).
+  // -keep k, -minsharp s: write only the k sharpest frames of each camera,
+  //           and none scoring under s (Sharpness.h); every score goes to
+  //           images/scores.csv.
+  // -roi:     store only the crop around the fly (FlyDetector.h), found
+  //           against a background of the empty chamber taken at startup
+  //           if there isn't one in images/ yet; -background retakes it.
+  // -thumb w: with -roi, also store a thumbnail of the whole frame.
+  // -trigger software|line: trigger each frame instead of letting the
+  //           cameras run free. The upper camera's burst is always
+  //           software-triggered; line puts the lower camera on the
+  //           Arduino's trigger output, pulsed as soon as the vanes settle.
+  // -interval ms: time between triggered frames (default 100).
+  // -settle ms: wait this long after stepping the vanes (default 1000).
+  // -camconfig file|none: camera features to put on the cameras (default
+  //           above); only those that differ are set, and not even that
+  //           if the cache says a camera has them already.
+  // -fullconfig: compare every feature whatever the cache says.
+  // -ring name[:slots]: also publish every grabbed frame to shared
+  //           memory, /dev/shm/<name> (FrameRing.h; default 6 slots), for
+  //           viewers and analyzers; RingWatch shows what arrives.
+  // -daemon socket: keep everything set up and take load, capture, pump,
+  //           status and stats commands on a Unix socket (BoothDaemon.h)
+  //           instead of running the fly cycle; a booth loaded by hand
+  //           has -dispenser none.
+  // -workers n: encoder threads, shared by every station (default 3).
+  // -trace file: record where the time goes and write it as a Chrome
+  //           trace (chrome://tracing, ui.perfetto.dev) at the end.
+  // Image and fly numbers carry on from images/session.manifest
+  // (SessionManifest.h), which is updated as each fly's frames land.
+  CaptureMode captureMode = CaptureBGR;
+  const char *tracePath = NULL;
+  const char *archivePath = NULL;
+  const char *stationsPath = NULL;
+  const char *daemonPath = NULL;
+  string ringName;
+  int ringSlots = 0;
+  bool listDevices = false;
+  bool fullConfig = false;
+  int workers = 3;
+  OutputFormat outputFormat;
+  StationOptions opt;
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-raw") == 0 ) {
+      captureMode = CaptureRaw;
+    } else if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      opt.framesPerCamera = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-keep") == 0 && i + 1 < argc ) {
+      opt.selection.keepBest = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-minsharp") == 0 && i + 1 < argc ) {
+      opt.selection.minScore = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-roi") == 0 ) {
+      opt.cropToFly = true;
+    } else if ( strcmp(argv[i], "-background") == 0 ) {
+      opt.cropToFly = opt.newBackground = true;
+    } else if ( strcmp(argv[i], "-thumb") == 0 && i + 1 < argc ) {
+      opt.detectOptions.thumbWidth = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-trigger") == 0 && i + 1 < argc &&
+                parseTriggerMode(argv[i + 1], opt.triggerMode) ) {
+      i++;
+    } else if ( strcmp(argv[i], "-interval") == 0 && i + 1 < argc ) {
+      opt.intervalUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-settle") == 0 && i + 1 < argc ) {
+      opt.settleUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-n") == 0 && i + 1 < argc ) {
+      opt.cycle.flies = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-serial") == 0 ) {
+      opt.cycle.dispenseAhead = false;
+      opt.cycle.vanesDuringPump = false;
+    } else if ( strcmp(argv[i], "-synthetic") == 0 ) {
+      opt.synthetic = true;
+    } else if ( strcmp(argv[i], "-servo") == 0 && i + 1 < argc ) {
+      servoCtrl = argv[++i];
+    } else if ( strcmp(argv[i], "-dispenser") == 0 && i + 1 < argc ) {
+      dispenser = argv[++i];
+    } else if ( strcmp(argv[i], "-arduino") == 0 && i + 1 < argc ) {
+      arduino = argv[++i];
+    } else if ( strcmp(argv[i], "-devices") == 0 ) {
+      listDevices = true;
+    } else if ( strcmp(argv[i], "-stations") == 0 && i + 1 < argc ) {
+      stationsPath = argv[++i];
+    } else if ( strcmp(argv[i], "-camconfig") == 0 && i + 1 < argc ) {
+      cameraConfig = argv[++i];
+    } else if ( strcmp(argv[i], "-fullconfig") == 0 ) {
+      fullConfig = true;
+    } else if ( strcmp(argv[i], "-ring") == 0 && i + 1 < argc &&
+                parseRingSpec(argv[i + 1], ringName, ringSlots) ) {
+      i++;
+    } else if ( strcmp(argv[i], "-daemon") == 0 && i + 1 < argc ) {
+      daemonPath = argv[++i];
+    } else if ( strcmp(argv[i], "-workers") == 0 && i + 1 < argc ) {
+      workers = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-trace") == 0 && i + 1 < argc ) {
+      tracePath = argv[++i];
+    } else if ( strcmp(argv[i], "-archive") == 0 && i + 1 < argc ) {
+      archivePath = argv[++i];
+    } else if ( strcmp(argv[i], "-pool") == 0 && i + 1 < argc ) {
+      opt.poolMB = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-format") == 0 && i + 1 < argc &&
+                parseOutputFormat(argv[i + 1], outputFormat) ) {
+      i++;
+    } else {
+      printf("Usage: %s [-raw] [-n flies] [-serial] [-synthetic] [-servo dev] "
+             "[-dispenser dev] [-arduino dev] [-devices] [-stations file] "
+             "[-format fmt] [-archive file] [-pool MB] [-frames n] [-keep k] "
+             "[-minsharp s] [-roi] [-background] [-thumb w] "
+             "[-trigger software|line] [-interval ms] [-settle ms] "
+             "[-camconfig file|none] [-fullconfig] [-ring name[:slots]] "
+             "[-daemon socket] [-workers n] [-trace file]\n"
+             "  fmt: %s\n", argv[0], outputFormatUsage);
+      return 1;
+    }
   }
-
-  int servoFD = openSerialPort(servoCtrl);
-  if (servoFD == -1)
-  {
-    perror(servoCtrl);
+  if ( captureMode == CaptureRaw && !formatKeepsRaw(outputFormat.format) ) {
+    printf("Raw frames can only be stored as png or tiff.\n");
     return 1;
-  } else {
-    printf("Servo FD opened: %d.\n", servoFD);
   }
-
- 
-  int dispenserFD = openSerialPort(dispenser);
-  if ( dispenserFD == -1 ) {
-    perror(dispenser);
+  if ( opt.framesPerCamera < 1 ) {
+    printf("Need at least one frame per camera.\n");
     return 1;
-  } else {
-    printf("Dispenser FD opened: %d.\n", dispenserFD);
-   
   }
- 
-  usleep(1000000);
-
-  printf("Current positions are %d and %d.\n", maestroGetPosition(servoFD, 0),
-    maestroGetPosition(servoFD, 1));
 
-  maestroSetTarget(servoFD, 0, INLET_GATE_OPEN);
-  maestroSetTarget(servoFD, 1, OUTLET_GATE_CLOSED);
-
-  if ( initDispenser(dispenserFD) != 0 ) {
-    perror("error initializing dispenser"); return 1;
+  // A lone booth, unnamed, unless there's a stations file.
+  vector<StationConfig> configs;
+  if ( stationsPath != NULL ) {
+    if ( readStations(stationsPath, configs) != 0 ) return 1;
+  } else {
+    StationConfig c;
+    c.servo = servoCtrl;
+    c.dispenser = dispenser;
+    c.arduino = arduino;
+    configs.push_back(c);
   }
-
-  if ( enableLights(arduinoFD) != 0 ) {
-    perror("error enabling lights"); return 1;
+  // The cycle dispenses every fly.
+  for ( size_t i = 0; i < configs.size(); i++ ) {
+    if ( configs[i].dispenser == "none" && daemonPath == NULL ) {
+      printf("A booth without a dispenser needs -daemon.\n");
+      return 1;
+    }
   }
-
-  printf("Dispenser initialized, lights enabled.\n");
-    
-  try
-  {
-    // Get the transport layer factory.
-    CTlFactory& tlFactory = CTlFactory::GetInstance();
-
-    // Get all attached devices and exit application if
-    // two cameras aren't found
-    DeviceInfoList_t devices;
-    if ( tlFactory.EnumerateDevices(devices) != 2 )
-    {
-      cout << "Found " << devices.size() << " cameras." << endl;
-        throw RUNTIME_EXCEPTION( "Did not find exactly two cameras.");
+  if ( listDevices ) {
+    vector<UsbSerialPort> ports;
+    if ( listUsbSerialPorts(ports) != 0 ) return 1;
+    printUsbSerialPorts(ports);
+    int status = 0;
+    for ( size_t i = 0; i < configs.size(); i++ ) {
+      BoothDevices dev;
+      dev.spec[DeviceServo] = configs[i].servo;
+      dev.spec[DeviceDispenser] = configs[i].dispenser;
+      dev.spec[DeviceArduino] = configs[i].arduino;
+      string who = configs[i].name.empty() ? "" : configs[i].name + ": ";
+      unsigned needed = NEED_SERVO | NEED_ARDUINO;
+      if ( configs[i].dispenser != "none" ) needed |= NEED_DISPENSER;
+      if ( resolveBoothDevices(dev, needed, who.c_str()) != 0 ) {
+        status = 1;
+      }
     }
+    return status;
+  }
 
-    cout << "Device 0 name: " << devices[0].GetFriendlyName() << endl;
-    cout << "Device 1 name: " << devices[1].GetFriendlyName() << endl;
-    if ( strncmp( devices[0].GetFriendlyName(), "upper", 5) == 0 ) {
-      cout << "Device 0 is upper." << endl;
-      upper.Attach(tlFactory.CreateDevice( devices[0] ) ); upper.Open();
-      lower.Attach(tlFactory.CreateDevice( devices[1] ) ); lower.Open();
-    } else {
-      cout << "Device 1 is upper." << endl;
-      upper.Attach(tlFactory.CreateDevice( devices[1] ) ); upper.Open();
-      lower.Attach(tlFactory.CreateDevice( devices[0] ) ); lower.Open();
+  CameraSettings cameraSettings;
+  SettingsCache settingsCache;
+  if ( !opt.synthetic && strcmp(cameraConfig, "none") != 0 ) {
+    mkdir("images", 0755);
+    if ( readCameraSettings(cameraConfig, cameraSettings) != 0 ||
+         settingsCache.load(settingsCachePath) != 0 ) {
+      return 1;
     }
+    opt.cameraSettings = &cameraSettings;
+    opt.settingsCache = &settingsCache;
+    opt.fullConfig = fullConfig;
+  }
 
-
-  } catch (const GenericException &e) {
-    // Error handling.
-    cerr << "An exception occurred." << endl
-      << e.GetDescription() << endl;
+  SessionArchive archive;
+  if ( archivePath != NULL && archive.create(archivePath) != 0 ) {
     return 1;
   }
+  opt.archivePath = archivePath;
+  FrameRing ring;
+  if ( !ringName.empty() ) {
+    if ( ring.create(ringName.c_str(), ringSlots) != 0 ) return 1;
+    opt.ring = &ring;
+  }
+  traceEnable(tracePath != NULL);
+  traceThreadName("main");
 
-  printf("Cameras all set up.\n");
- 
-
-  // Now we're all set up.
-
-  int keepDispensing = 1;
-
-  while ( keepDispensing ) {
-    printf("Dispensing fly.\n");
+  PylonInitialize();
 
-    usleep(100000);
-    if ( dispenseFly(dispenserFD) != 0 ) {
-      perror("error dispensing fly"); return 1;
+  // Frames are converted and written in the background while the
+  // cycles carry on; we only wait for them at the end of the session.
+  // The stations are declared first so their fly detectors and frame
+  // pools outlive the pipeline.
+  vector<unique_ptr<Station> > stations;
+  CapturePipeline pipeline(workers, 2 * workers);
+  pipeline.setMode(captureMode);
+  pipeline.setFormat(outputFormat);
+  if ( archivePath != NULL ) pipeline.setArchive(&archive);
+
+  // Find every station's serial devices before opening any.
+  set<string> devicesInUse;
+  for ( size_t i = 0; i < configs.size(); i++ ) {
+    stations.push_back(unique_ptr<Station>(new Station(configs[i], opt, pipeline)));
+    Station &st = *stations.back();
+    if ( st.resolve() != 0 ) {
+      printf("Couldn't find the serial devices of %s.\n",
+        configs.size() > 1 ? st.name().c_str() : "the booth");
+      return 1;
     }
-
-    usleep(100000);
-    tcflush(dispenserFD, TCIOFLUSH);
-
-    // Now read status of dispenser (up to 20 s delay):
-    //   f = fly dispensed
-    //   t = timeout
-    //   n = didn't detect fly at tip
-
-    n = serialport_read_until(dispenserFD, replyString, '\n', 100, 20000);
-    if ( n == 0 ) {
-      if ( strcmp(replyString, "f\n") == 0 ) {
-        printf("Dispensed fly.\n");
-      } else if ( strcmp(replyString, "t\n") == 0 ) {
-        printf("Timeout waiting for dispense.\n");
-        keepDispensing = 0;
-      } else if ( strcmp(replyString, "n\n") == 0 ) {
-        printf("Dispensed fly but didn't see at detector.\n");
-        keepDispensing = 0;
-      } else {
-        printf("After dispense, expected 'ok' from dispenser, received: '%s'\n", replyString);
+    // Two stations on one serial device would fight over it.
+    vector<string> paths = st.devicePaths();
+    for ( size_t k = 0; k < paths.size(); k++ ) {
+      char real[PATH_MAX];
+      string key = realpath(paths[k].c_str(), real) != NULL ? real : paths[k];
+      if ( !devicesInUse.insert(key).second ) {
+        printf("%s is used by more than one station.\n", key.c_str());
+        return 1;
       }
-      tcflush(dispenserFD, TCIOFLUSH);
-    } else {
-      perror("error reading from dispenser"); return 1;
     }
+  }
 
-    if ( keepDispensing == 1 ) {
-      // Close the gate and take a picture or two!
-      maestroSetTarget(servoFD, 0, INLET_GATE_CLOSED);
-      usleep(1000000);
-
-      CGrabResultPtr ptrGrabResult;
-      char filename[100]; int imgCount;
-
-      CImageFormatConverter fc;
-      fc.OutputPixelFormat = PixelType_BGR8packed;
-      CPylonImage image;
-
-      upper.StartGrabbing(3);
-      usleep(1000000);
-      
-      // Now spin the vanes
-      if ( stepVanes(arduinoFD) != 0 ) {
-        perror("error stepping vanes"); return 1;
-      }
-
-      usleep(1000000);
-
-      lower.StartGrabbing(3);
-
-      imgCount = 0;
-      while ( upper.IsGrabbing() ) {
-        upper.RetrieveResult(5000, ptrGrabResult,
-          TimeoutHandling_ThrowException);
-        if ( ptrGrabResult->GrabSucceeded()) {
-          snprintf(filename, 100, "images/Upper%03d.png", imgCount++);
-          cout << "Writing image to " << filename << endl;
-          // Convert to OpenCV Mat
-          fc.Convert(image, ptrGrabResult);
-          Mat cimg(ptrGrabResult->GetHeight(), ptrGrabResult->GetWidth(),
-            CV_8UC3, (uint8_t *)image.GetBuffer());
-          imwrite(filename, cimg);
-        } else {
-          cout << "Error: " << ptrGrabResult->GetErrorCode() << " "
-               << ptrGrabResult->GetErrorDescription() << endl;
-        }
-      }
-
-      imgCount=0;
-      while ( lower.IsGrabbing() ) {
-        lower.RetrieveResult(5000, ptrGrabResult,
-          TimeoutHandling_ThrowException);
-        if ( ptrGrabResult->GrabSucceeded()) {
-          snprintf(filename, 100, "images/Lower%03d.png", imgCount++);
-          cout << "Writing image to " << filename << endl;
-          // Convert to OpenCV Mat
-          fc.Convert(image, ptrGrabResult);
-          Mat cimg(ptrGrabResult->GetHeight(), ptrGrabResult->GetWidth(),
-            CV_8UC3, (uint8_t *)image.GetBuffer());
-          imwrite(filename, cimg);
-        } else {
-          cout << "Error: " << ptrGrabResult->GetErrorCode() << " "
-               << ptrGrabResult->GetErrorDescription() << endl;
-        }
-      }
-
-      // Spin the vanes back
-      if ( stepVanes(arduinoFD) != 0 ) {
-        perror("error stepping vanes"); return 1;
-      }
-
-      maestroSetTarget(servoFD, 1, OUTLET_GATE_OPEN);
-
-      usleep(100000);
-
-      if ( pumpOn(arduinoFD) != 0 ) {
-        perror("error turning on pump"); return 1;
+  // Then set everything up at once: each device only waits for what it
+  // really needs, so the booth is ready in about the time of its slowest
+  // device. Every station's cameras come from one enumeration.
+  printf("While serial ports are opening, set diffuser vane to block *lower* camera.\n");
+  TaskGraph startup;
+  DeviceInfoList_t devices;
+  int devicesFound = -1;
+  if ( opt.synthetic ) {
+    printf("Using synthetic cameras.\n");
+  } else {
+    devicesFound = startup.add("find cameras", -1, 0, [&devices]() {
+      try {
+        CTlFactory::GetInstance().EnumerateDevices(devices);
+      } catch (const GenericException &e) {
+        cerr << "An exception occurred." << endl
+          << e.GetDescription() << endl;
+        return StepFail;
       }
-
-      usleep(3000000);
-
-      if ( pumpOff(arduinoFD) != 0 ) {
-        perror("error turning on pump"); return 1;
+      for ( size_t i = 0; i < devices.size(); i++ ) {
+        cout << "Device " << i << " name: " << devices[i].GetFriendlyName() << endl;
       }
+      return StepOk;
+    });
+    startup.timeout(devicesFound, 10000);
+  }
+  for ( size_t i = 0; i < stations.size(); i++ ) {
+    stations[i]->addStartup(startup, devicesFound, devices);
+  }
+  StepResult ready = startup.run();
+  startup.printTimeline();
+  if ( ready != StepOk ) {
+    printf("Couldn't set up %s.\n", stations.size() > 1 ? "every station" : "the booth");
+    return 1;
+  }
+  printf("Cameras all set up.\n");
 
-      keepDispensing = 0;
-
+  // Now we're all set up.
+  int imaged = 0;
+  bool failed = false;
+  if ( daemonPath != NULL ) {
+    vector<Station *> list;
+    for ( size_t i = 0; i < stations.size(); i++ ) list.push_back(stations[i].get());
+    BoothDaemon daemon(list);
+    if ( daemon.run(daemonPath) != 0 ) failed = true;
+    daemon.printStats();
+    for ( size_t i = 0; i < stations.size(); i++ ) imaged += stations[i]->imaged();
+  } else {
+    for ( size_t i = 0; i < stations.size(); i++ ) stations[i]->start();
+    for ( size_t i = 0; i < stations.size(); i++ ) {
+      int n = stations[i]->join();
+      if ( n < 0 ) failed = true;
+      else imaged += n;
     }
-
   }
 
-  // Cleanup
-  stepperOff(arduinoFD);
+  unsigned long long longestUs = 0;
+  for ( size_t i = 0; i < stations.size(); i++ ) {
+    stations[i]->printReport();
+    if ( stations[i]->elapsedUs() > longestUs ) longestUs = stations[i]->elapsedUs();
+  }
+  if ( stations.size() > 1 ) {
+    printf("\n%d stations: %d flies imaged", (int)stations.size(), imaged);
+    if ( longestUs > 0 ) printf(", %.0f flies/hour together", imaged * 3600e6 / longestUs);
+    printf(".\n");
+  } else if ( !failed ) {
+    printf("%d flies imaged.\n", imaged);
+  }
 
-  maestroSetTarget(servoFD, 0, INLET_GATE_OPEN);
-  maestroSetTarget(servoFD, 1, OUTLET_GATE_CLOSED);
+  // Images were encoding while the cycle ran.
+  pipeline.waitIdle();
+  pipeline.printStats();
+  if ( archivePath != NULL ) {
+    int n = archive.records();
+    if ( archive.close() == 0 ) printf("%d frames in %s.\n", n, archivePath);
+  }
+  if ( ring.isOpen() ) {
+    printf("%llu frames published to /dev/shm%s.\n", ring.published(),
+      ring.name().c_str());
+  }
 
-  upper.Close();
-  lower.Close();
+  if ( tracePath != NULL ) {
+    tracePrintSummary();
+    traceWriteChrome(tracePath);
+  }
 
-  close(servoFD);
-  close(dispenserFD);
-  close(arduinoFD);
+  // Cleanup
+  printSerialCmdStats();
+  for ( size_t i = 0; i < stations.size(); i++ ) stations[i]->close();
 
-  return 0;
+  return failed ? 1 : 0;
 }
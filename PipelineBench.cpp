@@ -0,0 +1,299 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Everything after the grab, without cameras: two synthetic 3840x2748
+// BayerBG8 sources feed the grab engine and the capture pipeline exactly
+// as the booth's cameras do.
+//
+//   PipelineBench [-raw] [-flies n] [-frames n] [-fps f] [-workers n]
+//                 [-queue n] [-dir path] [-format fmt] [-archive]
+//                 [-pool MB] [-keep k] [-minsharp s]
+//                 [-sharpness laplacian|tenengrad] [-roi] [-thumb w]
+//                 [-trace file]
+//
+// Each "fly" grabs -frames frames from each source at the same time, as
+// Photobooth does, then the pipeline is drained and its stage timings
+// printed. Afterwards the first frame written is read back and compared
+// with what the source produced, so a change that alters the output
+// shows up as a mismatch (unless -format is lossy).
+// FormatBench compares the formats on their own. -archive stores the
+// frames in dir/session.fsa (SessionArchive.h) instead of separate files.
+// -trace writes the grab and writer threads' spans as a Chrome trace.
+// -pool delivers frames in a FramePool of that many MB per source, as
+// the booth's cameras do, instead of handing out the rendered frames; a
+// small pool shows the grab waiting on the writers. -keep and -minsharp
+// score every frame and write only the sharpest (Sharpness.h); the
+// output isn't checked then, since the first frame may not be kept.
+// -roi stores only the crop around the fly (FlyDetector.h), against a
+// background taken from the sources with no fly; -thumb adds a
+// thumbnail of the whole frame, w pixels wide.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <memory>
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "GrabEngine.h"
+#include "SyntheticSource.h"
+#include "Demosaic.h"
+#include "Trace.h"
+#include "ImageFormat.h"
+#include "SessionArchive.h"
+#include "FramePool.h"
+#include "FlyDetector.h"
+
+using namespace cv;
+using namespace std;
+
+static const int W = 3840, H = 2748;
+
+// Compare the first Upper frame on disk (or in the archive, if there is
+// one) with the source's mosaic (or its demosaic in BGR mode), or with
+// the part of it the frame was cropped to. Returns 0 if identical.
+static int checkOutput(const string &dir, const string &archivePath,
+                       CaptureMode mode, const OutputFormat &format,
+                       SyntheticSource &source)
+{
+  const uint8_t *mosaic = source.mosaic(0);
+  if ( format.format == FormatJPEG ) {
+    printf("Not checking output: JPEG is lossy.\n");
+    return 0;
+  }
+  string base = dir + "/Upper000";
+  string path = base + (mode == CaptureRaw ? ".bayer" : "") +
+    formatExtension(format.format);
+
+  Mat written;
+  RawMetadata meta;
+  ArchiveReader reader;
+  if ( !archivePath.empty() ) {
+    path = archivePath + ": Upper 0";
+    if ( reader.open(archivePath) != 0 ) return -1;
+    for ( int i = 0; i < reader.records(); i++ ) {
+      const ArchiveRecord &r = reader.record(i);
+      if ( r.frameIndex == 0 && strcmp(r.camera, "Upper") == 0 &&
+           reader.kind(i) == ArchiveFrame ) {
+        reader.image(i, written);
+        meta = reader.metadata(i);
+        break;
+      }
+    }
+  } else {
+    written = readImage(path);
+    if ( access((base + ".yml").c_str(), R_OK) == 0 ) {
+      readRawMetadata(base + ".yml", meta);
+    }
+  }
+  if ( written.empty() ) {
+    printf("Couldn't read back %s.\n", path.c_str());
+    return -1;
+  }
+
+  // What the pipeline should have stored, from the same part of the frame.
+  Rect roi(0, 0, W, H);
+  if ( meta.frameWidth > 0 ) {
+    roi = Rect(meta.cropX, meta.cropY, meta.width, meta.height);
+    printf("%s is cropped to %dx%d at (%d, %d).\n", path.c_str(), roi.width,
+      roi.height, roi.x, roi.y);
+  }
+  Mat expected;
+  if ( mode == CaptureRaw ) {
+    expected = Mat(H, W, CV_8UC1, (void *)mosaic)(roi);
+  } else {
+    expected.create(roi.height, roi.width, CV_8UC3);
+    DemosaicOptions opt;
+    demosaicBayerBG8(mosaic + (size_t)roi.y * W + roi.x, W, expected.data,
+                     expected.step, roi.width, roi.height, opt);
+  }
+
+  if ( written.size() != expected.size() || written.type() != expected.type() ) {
+    printf("%s: wrong size or type.\n", path.c_str());
+    return -1;
+  }
+  Mat diff;
+  absdiff(written, expected, diff);
+  int bad = countNonZero(diff.reshape(1));
+  if ( bad != 0 ) {
+    printf("%s: %d values differ from the source.\n", path.c_str(), bad);
+    return -1;
+  }
+  printf("%s matches the source.\n", path.c_str());
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  CaptureMode mode = CaptureBGR;
+  int flies = 5, frames = 3, workers = 3, queue = 6;
+  double fps = 10.0;
+  string dir = "/tmp/pipelinebench";
+  const char *tracePath = NULL;
+  bool archiving = false;
+  int poolMB = 0;
+  OutputFormat format;
+  FrameSelection selection;
+  bool cropToFly = false;
+  DetectOptions detectOptions;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-raw") == 0 ) {
+      mode = CaptureRaw;
+    } else if ( strcmp(argv[i], "-flies") == 0 && i + 1 < argc ) {
+      flies = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      frames = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-fps") == 0 && i + 1 < argc ) {
+      fps = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-workers") == 0 && i + 1 < argc ) {
+      workers = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-queue") == 0 && i + 1 < argc ) {
+      queue = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-dir") == 0 && i + 1 < argc ) {
+      dir = argv[++i];
+    } else if ( strcmp(argv[i], "-trace") == 0 && i + 1 < argc ) {
+      tracePath = argv[++i];
+    } else if ( strcmp(argv[i], "-archive") == 0 ) {
+      archiving = true;
+    } else if ( strcmp(argv[i], "-pool") == 0 && i + 1 < argc ) {
+      poolMB = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-keep") == 0 && i + 1 < argc ) {
+      selection.keepBest = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-minsharp") == 0 && i + 1 < argc ) {
+      selection.minScore = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-roi") == 0 ) {
+      cropToFly = true;
+    } else if ( strcmp(argv[i], "-thumb") == 0 && i + 1 < argc ) {
+      detectOptions.thumbWidth = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-sharpness") == 0 && i + 1 < argc &&
+                parseSharpnessMethod(argv[i + 1], selection.scoring.method) ) {
+      i++;
+    } else if ( strcmp(argv[i], "-format") == 0 && i + 1 < argc &&
+                parseOutputFormat(argv[i + 1], format) ) {
+      i++;
+    } else {
+      printf("Usage: %s [-raw] [-flies n] [-frames n] [-fps f] [-workers n] "
+             "[-queue n] [-dir path] [-format fmt] [-archive] [-pool MB] "
+             "[-keep k] [-minsharp s] [-sharpness laplacian|tenengrad] "
+             "[-roi] [-thumb w] [-trace file]\n"
+             "  fmt: %s\n", argv[0], outputFormatUsage);
+      return 1;
+    }
+  }
+  if ( mode == CaptureRaw && !formatKeepsRaw(format.format) ) {
+    printf("Raw frames can only be stored as png or tiff.\n");
+    return 1;
+  }
+  if ( flies < 1 ) flies = 1;
+  if ( frames < 1 ) frames = 1;
+  traceEnable(tracePath != NULL);
+  traceThreadName("main");
+  mkdir(dir.c_str(), 0755);
+  SessionArchive archive;
+  string archivePath;
+  if ( archiving ) {
+    archivePath = dir + "/session.fsa";
+    unlink(archivePath.c_str());
+    if ( archive.create(archivePath) != 0 ) return 1;
+  }
+
+  printf("Rendering synthetic frames...\n");
+  unique_ptr<FramePool> upperPool, lowerPool;
+  SyntheticSource upper(W, H, fps, 3, 1), lower(W, H, fps, 3, 2);
+  if ( poolMB > 0 ) {
+    upperPool.reset(new FramePool(W * H, (size_t)poolMB << 20));
+    lowerPool.reset(new FramePool(W * H, (size_t)poolMB << 20));
+    if ( !upperPool->ok() || !lowerPool->ok() ) return 1;
+    upper.setPool(upperPool.get());
+    lower.setPool(lowerPool.get());
+  }
+
+  FlyDetector upperDetector, lowerDetector;
+  if ( cropToFly ) {
+    upperDetector.setOptions(detectOptions);
+    lowerDetector.setOptions(detectOptions);
+    upper.setEmpty(true);
+    lower.setEmpty(true);
+    if ( captureBackground(upper, upperDetector, 3) != 0 ||
+         captureBackground(lower, lowerDetector, 3) != 0 ) {
+      printf("error taking the backgrounds\n");
+      return 1;
+    }
+    upper.setEmpty(false);
+    lower.setEmpty(false);
+  }
+
+  CapturePipeline pipeline(workers, queue);
+  pipeline.setMode(mode);
+  pipeline.setFormat(format);
+  if ( archiving ) pipeline.setArchive(&archive);
+  if ( cropToFly ) {
+    pipeline.setDetector("Upper", &upperDetector);
+    pipeline.setDetector("Lower", &lowerDetector);
+  }
+  CameraGrabber upperGrab(upper, "Upper", pipeline, dir.c_str());
+  CameraGrabber lowerGrab(lower, "Lower", pipeline, dir.c_str());
+  upperGrab.setSelection(selection);
+  lowerGrab.setSelection(selection);
+
+  printf("%d flies x %d frames per camera at %.1f fps, %s as %s, %d workers, "
+    "queue %d, writing to %s.\n", flies, frames, fps,
+    mode == CaptureRaw ? "raw" : "BGR", formatName(format).c_str(), workers,
+    queue, archiving ? archivePath.c_str() : dir.c_str());
+
+  StageTimer capture;
+  int kept = 0;
+  unsigned long long t0 = monotonicUs();
+  for ( int fly = 0; fly < flies; fly++ ) {
+    unsigned long long c0 = monotonicUs();
+    upperGrab.start(frames, fly * frames, fly + 1);
+    lowerGrab.start(frames, fly * frames, fly + 1);
+    if ( upperGrab.join() != 0 || lowerGrab.join() != 0 ) {
+      printf("error grabbing images\n");
+      return 1;
+    }
+    capture.add(monotonicUs() - c0);
+    for ( const CameraGrabber *g : { &upperGrab, &lowerGrab } ) {
+      for ( size_t i = 0; i < g->stamps().size(); i++ ) {
+        if ( g->stamps()[i].kept ) kept++;
+      }
+    }
+  }
+  unsigned long long grabbed = monotonicUs();
+  pipeline.waitIdle();
+  if ( archiving && archive.close() != 0 ) {
+    printf("error closing %s\n", archivePath.c_str());
+    return 1;
+  }
+  unsigned long long done = monotonicUs();
+
+  int total = 2 * flies * frames;
+  printf("\n");
+  capture.print("capture");
+  pipeline.printStats();
+  if ( upperPool ) upperPool->printStats("Upper");
+  if ( lowerPool ) lowerPool->printStats("Lower");
+  printf("%d frames: grabbed in %.1f s, written %.1f s later; %.2f frames/s "
+    "end to end.\n", total, (grabbed - t0) / 1e6, (done - grabbed) / 1e6,
+    total / ((done - t0) / 1e6));
+  if ( selection.enabled() ) {
+    printf("%d of %d frames kept (%s).\n", kept, total,
+      sharpnessMethodName(selection.scoring.method));
+  }
+  if ( tracePath != NULL ) {
+    tracePrintSummary();
+    traceWriteChrome(tracePath);
+  }
+
+  int status = pipeline.failures() ? 1 : 0;
+  if ( !selection.enabled() &&
+       checkOutput(dir, archivePath, mode, format, upper) != 0 ) status = 1;
+  return status;
+}
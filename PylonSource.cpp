@@ -0,0 +1,239 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <pylon/PylonIncludes.h>
+
+#include "PylonSource.h"
+#include "PhotoFuncs.h"
+
+using namespace GenApi;
+using namespace Pylon;
+using namespace std;
+
+// How long StartGrabbing waits for frames downstream to free a buffer.
+#define POOL_WAIT_MS 5000
+
+void PoolBufferFactory::AllocateBuffer(size_t bufferSize, void **buffer,
+                                       intptr_t &context)
+{
+  if ( bufferSize > pool->bufferBytes() ) {
+    throw RUNTIME_EXCEPTION("Frame pool buffers are smaller than the payload.");
+  }
+  uint8_t *b = pool->take(POOL_WAIT_MS);
+  if ( b == NULL ) {
+    throw RUNTIME_EXCEPTION("No frame pool buffer came free.");
+  }
+  *buffer = b;
+  context = 0;
+}
+
+void PoolBufferFactory::FreeBuffer(void *buffer, intptr_t)
+{
+  pool->give((uint8_t *)buffer);
+}
+
+PylonSource::PylonSource(CInstantCamera &camera, FramePool *pool) :
+  camera(camera), pool(pool), factory(pool)
+{
+  // The camera keeps the factory until it's closed; both live as long.
+  if ( pool != NULL ) camera.SetBufferFactory(&factory, Cleanup_None);
+}
+
+int PylonSource::startGrabbing(int nFrames)
+{
+  try {
+    if ( pool != NULL ) {
+      int n = nFrames > 0 && nFrames < pool->buffers() ? nFrames : pool->buffers();
+      camera.MaxNumBuffer = n;
+    }
+    camera.StartGrabbing(nFrames);
+  } catch (const GenericException &e) {
+    cerr << "Couldn't start grabbing: " << e.GetDescription() << endl;
+    return -1;
+  }
+  return 0;
+}
+
+bool PylonSource::isGrabbing()
+{
+  return camera.IsGrabbing();
+}
+
+int PylonSource::retrieve(int timeoutMs, Frame &frame)
+{
+  CGrabResultPtr ptrGrabResult;
+  try {
+    camera.RetrieveResult(timeoutMs, ptrGrabResult,
+      TimeoutHandling_ThrowException);
+  } catch (const GenericException &e) {
+    cerr << "Grab failed: " << e.GetDescription() << endl;
+    return -1;
+  }
+
+  if ( !ptrGrabResult->GrabSucceeded() ) {
+    cout << "Grab error: " << ptrGrabResult->GetErrorCode() << " "
+         << ptrGrabResult->GetErrorDescription() << endl;
+    return 1;
+  }
+
+  frame.data = (const uint8_t *)ptrGrabResult->GetBuffer();
+  frame.width = ptrGrabResult->GetWidth();
+  frame.height = ptrGrabResult->GetHeight();
+  frame.stride = frame.width + ptrGrabResult->GetPaddingX();
+  frame.pixelFormat = pylonPixelFormatName(ptrGrabResult->GetPixelType());
+  frame.cameraTicks = ptrGrabResult->GetTimeStamp();
+  frame.owner = make_shared<CGrabResultPtr>(ptrGrabResult);
+  if ( pool != NULL ) frame.owner = pool->track(frame.owner);
+  return 0;
+}
+
+void PylonSource::stopGrabbing()
+{
+  try {
+    camera.StopGrabbing();
+  } catch (const GenericException &e) {
+    cerr << "Couldn't stop grabbing: " << e.GetDescription() << endl;
+  }
+}
+
+// Fields that the camera doesn't expose are left at their defaults.
+int PylonSource::readSettings(RawMetadata &meta)
+{
+  try {
+    INodeMap &nodemap = camera.GetNodeMap();
+
+    CEnumerationPtr pixelFormat(nodemap.GetNode("PixelFormat"));
+    if ( IsReadable(pixelFormat) ) meta.pixelFormat = pixelFormat->ToString().c_str();
+
+    CEnumerationPtr selector(nodemap.GetNode("BalanceRatioSelector"));
+    CFloatPtr ratio(nodemap.GetNode("BalanceRatio"));
+    if ( IsWritable(selector) && IsReadable(ratio) ) {
+      selector->FromString("Red");   meta.balanceRed   = ratio->GetValue();
+      selector->FromString("Green"); meta.balanceGreen = ratio->GetValue();
+      selector->FromString("Blue");  meta.balanceBlue  = ratio->GetValue();
+    }
+
+    CFloatPtr exposure(nodemap.GetNode("ExposureTime"));
+    if ( IsReadable(exposure) ) meta.exposureUs = exposure->GetValue();
+
+    CFloatPtr gain(nodemap.GetNode("Gain"));
+    if ( IsReadable(gain) ) meta.gain = gain->GetValue();
+  } catch (const GenericException &e) {
+    cerr << "Error reading camera settings: " << e.GetDescription() << endl;
+    return -1;
+  }
+  return 0;
+}
+
+// FrameStart is the trigger that starts each exposure; line 1 is the
+// camera's opto-coupled input.
+int PylonSource::setTrigger(TriggerMode mode)
+{
+  try {
+    INodeMap &nodemap = camera.GetNodeMap();
+    CEnumerationPtr selector(nodemap.GetNode("TriggerSelector"));
+    CEnumerationPtr trigger(nodemap.GetNode("TriggerMode"));
+    CEnumerationPtr source(nodemap.GetNode("TriggerSource"));
+    if ( !IsWritable(selector) || !IsWritable(trigger) || !IsWritable(source) ) {
+      cerr << "Camera has no frame start trigger." << endl;
+      return -1;
+    }
+    selector->FromString("FrameStart");
+    if ( mode == TriggerFree ) {
+      trigger->FromString("Off");
+      return 0;
+    }
+    source->FromString(mode == TriggerSoftware ? "Software" : "Line1");
+    CEnumerationPtr activation(nodemap.GetNode("TriggerActivation"));
+    if ( IsWritable(activation) ) activation->FromString("RisingEdge");
+    trigger->FromString("On");
+  } catch (const GenericException &e) {
+    cerr << "Couldn't set the trigger: " << e.GetDescription() << endl;
+    return -1;
+  }
+  return 0;
+}
+
+int PylonSource::fireTrigger(int timeoutMs, unsigned long long &hostUs)
+{
+  try {
+    if ( !camera.WaitForFrameTriggerReady(timeoutMs, TimeoutHandling_Return) ) {
+      cerr << "Camera wasn't ready for a trigger within " << timeoutMs
+           << " ms." << endl;
+      return -1;
+    }
+    // The command is a control transfer; the trigger lands somewhere
+    // between sending it and the camera acknowledging it.
+    unsigned long long t0 = monotonicUs();
+    camera.ExecuteSoftwareTrigger();
+    hostUs = (t0 + monotonicUs()) / 2;
+  } catch (const GenericException &e) {
+    cerr << "Software trigger failed: " << e.GetDescription() << endl;
+    return -1;
+  }
+  return 0;
+}
+
+int PylonSource::latchClock(unsigned long long &ticks, unsigned long long &hz)
+{
+  if ( pylonLatchClock(camera, ticks) != 0 ) return -1;
+  hz = pylonClockHz(camera.GetNodeMap());
+  return 0;
+}
+
+long long pylonPayloadSize(CInstantCamera &camera)
+{
+  try {
+    CIntegerPtr payload(camera.GetNodeMap().GetNode("PayloadSize"));
+    if ( IsReadable(payload) ) return payload->GetValue();
+  } catch (const GenericException &e) {
+    cerr << "Couldn't read PayloadSize: " << e.GetDescription() << endl;
+  }
+  return -1;
+}
+
+// USB cameras call it TimestampLatch, GigE ones GevTimestampControlLatch.
+int pylonLatchClock(CInstantCamera &camera, unsigned long long &ticks)
+{
+  try {
+    INodeMap &nodemap = camera.GetNodeMap();
+    CCommandPtr latch(nodemap.GetNode("TimestampLatch"));
+    CIntegerPtr value(nodemap.GetNode("TimestampLatchValue"));
+    if ( !IsWritable(latch) ) {
+      latch = nodemap.GetNode("GevTimestampControlLatch");
+      value = nodemap.GetNode("GevTimestampValue");
+    }
+    if ( !IsWritable(latch) || !IsReadable(value) ) return -1;
+    latch->Execute();
+    ticks = value->GetValue();
+  } catch (const GenericException &e) {
+    cerr << "Couldn't latch the camera clock: " << e.GetDescription() << endl;
+    return -1;
+  }
+  return 0;
+}
+
+// GigE cameras say how fast their clock runs; USB ones count ns.
+unsigned long long pylonClockHz(INodeMap &nodemap)
+{
+  try {
+    CIntegerPtr hz(nodemap.GetNode("GevTimestampTickFrequency"));
+    if ( hz && IsReadable(hz) && hz->GetValue() > 0 ) return hz->GetValue();
+  } catch (const GenericException &e) {
+  }
+  return 1000000000ULL;
+}
+
+const char *pylonPixelFormatName(EPixelType type)
+{
+  switch ( type ) {
+  case PixelType_BayerBG8: return "BayerBG8";
+  case PixelType_BayerGB8: return "BayerGB8";
+  case PixelType_BayerRG8: return "BayerRG8";
+  case PixelType_BayerGR8: return "BayerGR8";
+  case PixelType_Mono8:    return "Mono8";
+  default:                 return "Unknown";
+  }
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __PYLONSOURCE_H__
+#define __PYLONSOURCE_H__
+
+#include <pylon/PylonIncludes.h>
+
+#include "CameraSource.h"
+#include "FramePool.h"
+
+// Hands Pylon its grab buffers from a FramePool.
+class PoolBufferFactory : public Pylon::IBufferFactory {
+public:
+  PoolBufferFactory(FramePool *pool) : pool(pool) { }
+  virtual void AllocateBuffer(size_t bufferSize, void **buffer,
+                              intptr_t &context);
+  virtual void FreeBuffer(void *buffer, intptr_t context);
+  virtual void DestroyBufferFactory() { }
+
+private:
+  FramePool *pool;
+};
+
+// A Basler camera, opened and configured by the caller. Frames hold on
+// to their Pylon grab buffers, so no more than MaxNumBuffer of them may
+// be alive at once.
+//
+// With a pool, the grab buffers come from it instead of being allocated
+// by Pylon at every startGrabbing(); the pool's buffers must be at least
+// pylonPayloadSize() bytes. Each start asks for a buffer per frame (up
+// to the pool's size) and waits for frames still held downstream to
+// give theirs back if need be.
+class PylonSource : public CameraSource {
+public:
+  PylonSource(Pylon::CInstantCamera &camera, FramePool *pool = NULL);
+
+  virtual int startGrabbing(int nFrames);
+  virtual bool isGrabbing();
+  virtual int retrieve(int timeoutMs, Frame &frame);
+  virtual void stopGrabbing();
+  virtual int readSettings(RawMetadata &meta);
+  virtual int setTrigger(TriggerMode mode);
+  virtual int fireTrigger(int timeoutMs, unsigned long long &hostUs);
+  virtual int latchClock(unsigned long long &ticks, unsigned long long &hz);
+
+private:
+  Pylon::CInstantCamera &camera;
+  FramePool *pool;
+  PoolBufferFactory factory;
+};
+
+// Bytes per grab buffer the camera needs with its current settings, or
+// -1 on error.
+long long pylonPayloadSize(Pylon::CInstantCamera &camera);
+
+// Latch the camera's clock and read it (ticks since it was powered up).
+// Returns 0, or -1 if the camera can't.
+int pylonLatchClock(Pylon::CInstantCamera &camera, unsigned long long &ticks);
+
+// How many times a second the camera's clock ticks.
+unsigned long long pylonClockHz(GenApi::INodeMap &nodemap);
+
+// Basler name of a pixel type ("BayerBG8", ...), or "Unknown".
+const char *pylonPixelFormatName(Pylon::EPixelType type);
+
+#endif // __PYLONSOURCE_H__
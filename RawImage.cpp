@@ -0,0 +1,124 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "RawImage.h"
+
+using namespace cv;
+using namespace std;
+
+RawMetadata::RawMetadata() :
+  fly(-1), frameIndex(0), pixelFormat("BayerBG8"), width(0), height(0),
+  cropX(0), cropY(0), frameWidth(0), frameHeight(0),
+  balanceRed(1.0), balanceGreen(1.0), balanceBlue(1.0),
+  exposureUs(0.0), gain(0.0), hostUs(0), cameraTicks(0), sharpness(-1.0)
+{
+}
+
+int writeRawMetadata(const string &path, const RawMetadata &meta)
+{
+  char buf[32];
+  FileStorage fs(path, FileStorage::WRITE);
+  if ( !fs.isOpened() ) {
+    printf("Couldn't open %s for writing.\n", path.c_str());
+    return -1;
+  }
+
+  fs << "camera" << meta.camera;
+  fs << "fly" << meta.fly;
+  fs << "frameIndex" << meta.frameIndex;
+  fs << "pixelFormat" << meta.pixelFormat;
+  fs << "width" << meta.width;
+  fs << "height" << meta.height;
+  if ( meta.frameWidth > 0 ) {
+    fs << "cropX" << meta.cropX;
+    fs << "cropY" << meta.cropY;
+    fs << "frameWidth" << meta.frameWidth;
+    fs << "frameHeight" << meta.frameHeight;
+  }
+  fs << "balanceRed" << meta.balanceRed;
+  fs << "balanceGreen" << meta.balanceGreen;
+  fs << "balanceBlue" << meta.balanceBlue;
+  fs << "exposureUs" << meta.exposureUs;
+  fs << "gain" << meta.gain;
+  // FileStorage has no 64-bit integers, so the timestamps go as strings.
+  snprintf(buf, sizeof(buf), "%llu", meta.hostUs);
+  fs << "hostUs" << string(buf);
+  snprintf(buf, sizeof(buf), "%llu", meta.cameraTicks);
+  fs << "cameraTicks" << string(buf);
+  fs << "sharpness" << meta.sharpness;
+  fs.release();
+  return 0;
+}
+
+int readRawMetadata(const string &path, RawMetadata &meta)
+{
+  FileStorage fs(path, FileStorage::READ);
+  if ( !fs.isOpened() ) {
+    printf("Couldn't open %s.\n", path.c_str());
+    return -1;
+  }
+
+  string s;
+  fs["camera"] >> meta.camera;
+  if ( !fs["fly"].empty() ) fs["fly"] >> meta.fly;
+  fs["frameIndex"] >> meta.frameIndex;
+  fs["pixelFormat"] >> meta.pixelFormat;
+  fs["width"] >> meta.width;
+  fs["height"] >> meta.height;
+  if ( !fs["frameWidth"].empty() ) {
+    fs["cropX"] >> meta.cropX;
+    fs["cropY"] >> meta.cropY;
+    fs["frameWidth"] >> meta.frameWidth;
+    fs["frameHeight"] >> meta.frameHeight;
+  }
+  fs["balanceRed"] >> meta.balanceRed;
+  fs["balanceGreen"] >> meta.balanceGreen;
+  fs["balanceBlue"] >> meta.balanceBlue;
+  fs["exposureUs"] >> meta.exposureUs;
+  fs["gain"] >> meta.gain;
+  fs["hostUs"] >> s;      meta.hostUs = strtoull(s.c_str(), NULL, 10);
+  fs["cameraTicks"] >> s; meta.cameraTicks = strtoull(s.c_str(), NULL, 10);
+  if ( !fs["sharpness"].empty() ) fs["sharpness"] >> meta.sharpness;
+  return 0;
+}
+
+int bayerConversionCode(const string &pixelFormat)
+{
+  if ( pixelFormat == "BayerBG8" ) return COLOR_BayerRG2BGR;
+  if ( pixelFormat == "BayerRG8" ) return COLOR_BayerBG2BGR;
+  if ( pixelFormat == "BayerGB8" ) return COLOR_BayerGR2BGR;
+  if ( pixelFormat == "BayerGR8" ) return COLOR_BayerGB2BGR;
+  return -1;
+}
+
+int demosaicRaw(const Mat &raw, const RawMetadata &meta, bool applyBalance,
+                Mat &bgr)
+{
+  int code = bayerConversionCode(meta.pixelFormat);
+  if ( code < 0 ) {
+    printf("Unsupported pixel format '%s'.\n", meta.pixelFormat.c_str());
+    return -1;
+  }
+  if ( raw.empty() || raw.channels() != 1 ) {
+    printf("Raw image must be a single-channel mosaic.\n");
+    return -1;
+  }
+
+  cvtColor(raw, bgr, code);
+
+  if ( applyBalance ) {
+    vector<Mat> ch;
+    split(bgr, ch);
+    ch[0].convertTo(ch[0], -1, meta.balanceBlue);
+    ch[1].convertTo(ch[1], -1, meta.balanceGreen);
+    ch[2].convertTo(ch[2], -1, meta.balanceRed);
+    merge(ch, bgr);
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __RAWIMAGE_H__
+#define __RAWIMAGE_H__
+
+#include <string>
+#include "opencv2/core/core.hpp"
+
+// Everything needed to turn a stored Bayer mosaic back into a color
+// image later: the pattern, the camera's white balance and exposure at
+// capture time, and when the frame was grabbed.
+struct RawMetadata {
+  std::string camera;       // "Upper" / "Lower"
+  int fly;                  // which fly in the session, -1 if unknown
+  int frameIndex;
+  std::string pixelFormat;  // e.g. "BayerBG8"
+  int width, height;        // of the stored image
+  int cropX, cropY;         // where it sits in the frame (FlyDetector.h)
+  int frameWidth, frameHeight;  // of the whole frame; 0 if not cropped
+  double balanceRed, balanceGreen, balanceBlue;
+  double exposureUs;
+  double gain;
+  unsigned long long hostUs;
+  unsigned long long cameraTicks;
+  double sharpness;         // Sharpness.h score, -1 if not scored
+
+  RawMetadata();
+};
+
+// Sidecar file (YAML) stored next to each raw frame.
+int writeRawMetadata(const std::string &path, const RawMetadata &meta);
+int readRawMetadata(const std::string &path, RawMetadata &meta);
+
+// OpenCV color conversion code for a Basler Bayer pixel format, or -1.
+// OpenCV names Bayer patterns by the second row, so Basler's BayerBG is
+// OpenCV's BayerRG.
+int bayerConversionCode(const std::string &pixelFormat);
+
+// Demosaic a single-channel mosaic into BGR. If applyBalance is set the
+// balance ratios from meta are multiplied in afterwards; leave it off when
+// the camera already applied white balance to the raw data.
+int demosaicRaw(const cv::Mat &raw, const RawMetadata &meta,
+                bool applyBalance, cv::Mat &bgr);
+
+#endif // __RAWIMAGE_H__
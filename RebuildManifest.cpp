@@ -0,0 +1,78 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Recreates the session manifest (SessionManifest.h) from the frames in
+// the image directory, for when it's lost, damaged, or images were added
+// or removed by hand.
+//
+//   RebuildManifest [-n] [-frames n] [-archive file ...] [-station name]
+//                   [dir]
+//
+//   -n       Only print what the manifest would say.
+//   -frames  Frames per camera per fly (default 3), to count the flies.
+//   -archive A session archive (-archive of HandLoad / Photobooth) whose
+//            frames count too, besides those dir's session.archives
+//            lists; repeat it for each. They're added to the list.
+//   -station Count only that station's records in the archives (stations
+//            share them).
+//   dir      The image directory (default: images).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "SessionManifest.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+  bool dryRun = false;
+  int framesPerFly = 3;
+  string dir = "images";
+  vector<string> archives;
+  string cameraPrefix;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-n") == 0 ) {
+      dryRun = true;
+    } else if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      framesPerFly = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-archive") == 0 && i + 1 < argc ) {
+      archives.push_back(argv[++i]);
+    } else if ( strcmp(argv[i], "-station") == 0 && i + 1 < argc ) {
+      cameraPrefix = string(argv[++i]) + "-";
+    } else if ( argv[i][0] != '-' ) {
+      dir = argv[i];
+    } else {
+      printf("Usage: %s [-n] [-frames n] [-archive file ...] [-station name] "
+        "[dir]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  SessionManifest old, m;
+  int r = readManifest(dir, old);
+  if ( r == 0 ) {
+    printf("Current manifest: next frame %d, %d flies.\n", old.nextFrame,
+      old.flies);
+  } else if ( r == 1 ) {
+    printf("No manifest in %s.\n", dir.c_str());
+  }
+
+  if ( rebuildManifest(dir, framesPerFly, m, archives, cameraPrefix) != 0 ) {
+    return 1;
+  }
+  printf("From the frames:  next frame %d, %d flies.\n", m.nextFrame, m.flies);
+  if ( dryRun ) return 0;
+
+  if ( writeManifest(dir, m) != 0 ) return 1;
+  for ( size_t i = 0; i < archives.size(); i++ ) {
+    if ( addSessionArchive(dir, archives[i]) != 0 ) return 1;
+  }
+  printf("Wrote %s.\n", manifestPath(dir).c_str());
+  return 0;
+}
@@ -0,0 +1,169 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Follows the frames Photobooth publishes with -ring (FrameRing.h) and
+// measures how long they take to get here, i.e. what a viewer or
+// analyzer in another process would see.
+//
+//   RingWatch [-oldest] [-n frames] [-wait s] [-copy] [-quiet] <name>
+//
+// For each frame: camera, fly, image number, size and pixel format, and
+// the time from the grab thread retrieving it to this process having it,
+// split into publishing (the copy into shared memory) and waking up here.
+// Ctrl-C, the frame count or Photobooth finishing ends it with a summary.
+//
+//   -oldest  Start with the oldest frame still in the ring rather than
+//            the next one published.
+//   -n       Stop after this many frames.
+//   -wait    Wait up to s seconds for the ring to appear (default 30).
+//   -copy    Copy each frame out, as a slow consumer would; otherwise the
+//            frame is read where it is, then checked it wasn't overwritten
+//            meanwhile.
+//   -quiet   Only the summary.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "PhotoFuncs.h"
+#include "FrameRing.h"
+
+using namespace std;
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int)
+{
+  stop = 1;
+}
+
+// Latencies in us, for percentiles at the end.
+struct Latency {
+  vector<unsigned long long> us;
+
+  void print(const char *name)
+  {
+    if ( us.empty() ) {
+      printf("  %-16s (none)\n", name);
+      return;
+    }
+    sort(us.begin(), us.end());
+    printf("  %-16s p50=%8.3f ms  p95=%8.3f ms  max=%8.3f ms\n", name,
+      us[us.size() / 2] / 1000.0, us[us.size() * 95 / 100] / 1000.0,
+      us.back() / 1000.0);
+  }
+};
+
+int main(int argc, char **argv)
+{
+  bool oldest = false, copy = false, quiet = false;
+  long frames = 0;
+  double waitS = 30;
+  const char *name = NULL;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "-oldest") == 0 ) {
+      oldest = true;
+    } else if ( strcmp(argv[i], "-n") == 0 && i + 1 < argc ) {
+      frames = atol(argv[++i]);
+    } else if ( strcmp(argv[i], "-wait") == 0 && i + 1 < argc ) {
+      waitS = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-copy") == 0 ) {
+      copy = true;
+    } else if ( strcmp(argv[i], "-quiet") == 0 ) {
+      quiet = true;
+    } else if ( argv[i][0] != '-' && name == NULL ) {
+      name = argv[i];
+    } else {
+      name = NULL;
+      break;
+    }
+  }
+  if ( name == NULL ) {
+    printf("Usage: %s [-oldest] [-n frames] [-wait s] [-copy] [-quiet] <name>\n",
+      argv[0]);
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  // Photobooth creates the ring once it has started; it may not be there
+  // yet.
+  FrameRingReader reader;
+  string path = string("/dev/shm/") + (name[0] == '/' ? name + 1 : name);
+  unsigned long long giveUp = monotonicUs() + (unsigned long long)(waitS * 1e6);
+  while ( access(path.c_str(), R_OK) != 0 ) {
+    if ( stop ) return 1;
+    if ( monotonicUs() >= giveUp ) {
+      printf("No frame ring at %s.\n", path.c_str());
+      return 1;
+    }
+    usleep(100000);
+  }
+  if ( reader.open(name, oldest) != 0 ) return 1;
+  printf("Reading %s: %d slots of %.1f MB.\n", path.c_str(), reader.slots(),
+    reader.slotBytes() / 1048576.0);
+
+  Latency grabToSeen, grabToPublished, publishedToSeen, readUs;
+  vector<uint8_t> buf;
+  unsigned long long first = 0, last = 0, changed = 0, bytes = 0;
+  long n = 0;
+  int r = 0;
+  while ( !stop && (frames == 0 || n < frames) ) {
+    RingFrame f;
+    r = reader.next(f, 200);
+    if ( r == 1 ) continue;
+    if ( r != 0 ) break;
+    unsigned long long seenUs = monotonicUs();
+
+    // Touch every byte, as anything looking at the frame would.
+    unsigned long sum = 0;
+    if ( copy ) {
+      buf.assign(f.data, f.data + f.bytes);
+      if ( !reader.stillValid(f) ) changed++;
+      for ( size_t i = 0; i < buf.size(); i += 64 ) sum += buf[i];
+    } else {
+      for ( size_t i = 0; i < f.bytes; i += 64 ) sum += f.data[i];
+      if ( !reader.stillValid(f) ) changed++;
+    }
+    unsigned long long doneUs = monotonicUs();
+
+    if ( n == 0 ) first = seenUs;
+    last = seenUs;
+    n++;
+    bytes += f.bytes;
+    grabToSeen.us.push_back(seenUs - f.hostUs);
+    grabToPublished.us.push_back(f.publishUs - f.hostUs);
+    publishedToSeen.us.push_back(seenUs - f.publishUs);
+    readUs.us.push_back(doneUs - seenUs);
+    if ( !quiet ) {
+      printf("%6llu %-12s fly %4d #%04d %dx%d %-10s grab->here %7.3f ms "
+        "(publish %6.3f, wake %6.3f)%s\n", f.seq, f.cameraName, f.fly,
+        f.frameIndex, f.width, f.height, f.pixelFormat,
+        (seenUs - f.hostUs) / 1000.0, (f.publishUs - f.hostUs) / 1000.0,
+        (seenUs - f.publishUs) / 1000.0, sum == 0 ? " (all black)" : "");
+    }
+  }
+  if ( r < 0 ) printf("Photobooth closed the ring.\n");
+
+  printf("%ld frames", n);
+  if ( n > 1 ) {
+    printf(" in %.1f s, %.1f frames/s, %.1f MB/s", (last - first) / 1e6,
+      (n - 1) * 1e6 / (last - first), bytes / 1048576.0 * 1e6 / (last - first));
+  }
+  printf("; %llu missed (overwritten before they were read), %llu reads "
+    "retried, %llu overwritten while being %s.\n", reader.skipped(),
+    reader.retried(), changed, copy ? "copied" : "read");
+  printf("Latency:\n");
+  grabToSeen.print("grab -> here");
+  grabToPublished.print("grab -> published");
+  publishedToSeen.print("published -> here");
+  readUs.print(copy ? "copy + read" : "read in place");
+  return 0;
+}
@@ -0,0 +1,282 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "PhotoFuncs.h"
+#include "Scheduler.h"
+#include "Trace.h"
+
+using namespace std;
+
+// "fly:name", or the name for steps that aren't about a fly.
+static string stepLabel(const string &name, int fly)
+{
+  if ( fly < 0 ) return name;
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d:", fly);
+  return buf + name;
+}
+
+TaskGraph::TaskGraph() : busy(0), running(0), holding(0), failed(false), t0(0) { }
+
+TaskGraph::~TaskGraph()
+{
+  for ( size_t i = 0; i < tasks.size(); i++ ) {
+    if ( tasks[i].worker.joinable() ) tasks[i].worker.join();
+  }
+}
+
+int TaskGraph::add(const string &name, int fly, unsigned resources,
+                   Action action)
+{
+  lock_guard<mutex> l(lock);
+  tasks.push_back(Task());
+  Task &t = tasks.back();
+  t.name = name;
+  t.fly = fly;
+  t.resources = resources;
+  t.timeoutMs = 0;
+  t.timedOut = false;
+  t.held = holding > 0;
+  t.action = action;
+  t.state = Pending;
+  t.result = StepOk;
+  t.joined = false;
+  t.startUs = t.endUs = 0;
+  changed.notify_all();
+  return tasks.size() - 1;
+}
+
+void TaskGraph::after(int task, int dependency, bool evenIfSkipped)
+{
+  lock_guard<mutex> l(lock);
+  if ( task < 0 || task >= (int)tasks.size() ||
+       dependency < 0 || dependency >= (int)tasks.size() ||
+       dependency == task ) {
+    printf("TaskGraph: bad dependency %d -> %d ignored.\n", task, dependency);
+    return;
+  }
+  Dep d;
+  d.task = dependency;
+  d.evenIfSkipped = evenIfSkipped;
+  tasks[task].deps.push_back(d);
+  changed.notify_all();
+}
+
+void TaskGraph::timeout(int task, int ms)
+{
+  lock_guard<mutex> l(lock);
+  if ( task < 0 || task >= (int)tasks.size() ) return;
+  tasks[task].timeoutMs = ms;
+}
+
+void TaskGraph::hold()
+{
+  lock_guard<mutex> l(lock);
+  holding++;
+}
+
+void TaskGraph::release()
+{
+  lock_guard<mutex> l(lock);
+  if ( holding == 0 || --holding > 0 ) return;
+  for ( size_t i = 0; i < tasks.size(); i++ ) tasks[i].held = false;
+  changed.notify_all();
+}
+
+// Called with the lock held. Skips steps whose dependencies were skipped
+// and starts every step that is ready and whose resources are free, in id
+// order. Repeats until a pass skips nothing, so a skip ripples down a
+// whole chain whatever order its steps were added in.
+void TaskGraph::launchReady()
+{
+  bool skipped = true;
+  while ( skipped ) {
+    skipped = false;
+    launchPass(skipped);
+  }
+}
+
+void TaskGraph::launchPass(bool &skipped)
+{
+  for ( size_t i = 0; i < tasks.size(); i++ ) {
+    Task &t = tasks[i];
+    if ( t.state != Pending || t.held ) continue;
+
+    bool ready = true, skip = failed;
+    for ( size_t d = 0; d < t.deps.size() && !skip; d++ ) {
+      const Task &dep = tasks[t.deps[d].task];
+      if ( dep.state != Finished ) ready = false;
+      else if ( dep.result != StepOk && !t.deps[d].evenIfSkipped ) skip = true;
+    }
+    if ( skip ) {
+      t.state = Finished;
+      t.result = StepSkip;
+      t.joined = true;
+      skipped = true;
+      continue;
+    }
+    if ( !ready || (t.resources & busy) ) continue;
+
+    t.state = Running;
+    t.startUs = monotonicUs();
+    busy |= t.resources;
+    running++;
+    t.worker = thread(&TaskGraph::runTask, this, (int)i);
+  }
+}
+
+void TaskGraph::runTask(int id)
+{
+  Action action;
+  string name;
+  int fly;
+  {
+    lock_guard<mutex> l(lock);
+    action = tasks[id].action;
+    name = tasks[id].name;
+    fly = tasks[id].fly;
+  }
+
+  StepResult r;
+  {
+    traceThreadName("step");
+    TraceSpan span("step", fly, name.c_str());
+    r = action();
+  }
+
+  lock_guard<mutex> l(lock);
+  Task &t = tasks[id];
+  t.endUs = monotonicUs();
+  t.result = t.timedOut ? StepFail : r;
+  t.state = Finished;
+  if ( t.timedOut ) {
+    printf("Step %s ended after %.0f ms, over its %d ms.\n",
+      stepLabel(t.name, t.fly).c_str(), (t.endUs - t.startUs) / 1000.0,
+      t.timeoutMs);
+  } else if ( r == StepFail ) {
+    printf("Step %s failed; stopping.\n", stepLabel(t.name, t.fly).c_str());
+    failed = true;
+  }
+  busy &= ~t.resources;
+  running--;
+  changed.notify_all();
+}
+
+// Called with the lock held. Fails every running step that is over its
+// time, and returns the soonest deadline of the others (0 if none).
+unsigned long long TaskGraph::checkTimeouts()
+{
+  unsigned long long now = monotonicUs(), soonest = 0;
+  for ( size_t i = 0; i < tasks.size(); i++ ) {
+    Task &t = tasks[i];
+    if ( t.state != Running || t.timeoutMs <= 0 || t.timedOut ) continue;
+    unsigned long long deadline = t.startUs + t.timeoutMs * 1000ULL;
+    if ( now >= deadline ) {
+      printf("Step %s timed out after %d ms; stopping.\n",
+        stepLabel(t.name, t.fly).c_str(), t.timeoutMs);
+      t.timedOut = true;
+      failed = true;
+    } else if ( soonest == 0 || deadline < soonest ) {
+      soonest = deadline;
+    }
+  }
+  return soonest;
+}
+
+StepResult TaskGraph::run()
+{
+  unique_lock<mutex> l(lock);
+  t0 = monotonicUs();
+  for (;;) {
+    launchReady();
+
+    // Reap finished workers so a long session doesn't pile up threads.
+    // (Steps may add to the deque meanwhile; element addresses stay put.)
+    vector<thread *> done;
+    for ( size_t i = 0; i < tasks.size(); i++ ) {
+      if ( tasks[i].state == Finished && !tasks[i].joined ) {
+        tasks[i].joined = true;
+        done.push_back(&tasks[i].worker);
+      }
+    }
+    if ( !done.empty() ) {
+      l.unlock();
+      for ( size_t i = 0; i < done.size(); i++ ) done[i]->join();
+      l.lock();
+      continue;
+    }
+
+    // Nothing running means nothing can change; anything still pending
+    // would wait forever.
+    if ( running == 0 ) break;
+    unsigned long long deadline = checkTimeouts(), now = monotonicUs();
+    if ( deadline == 0 ) {
+      changed.wait(l);
+    } else if ( deadline > now ) {
+      changed.wait_for(l, chrono::microseconds(deadline - now));
+    }
+  }
+  return failed ? StepFail : StepOk;
+}
+
+void TaskGraph::printTimeline()
+{
+  lock_guard<mutex> l(lock);
+  vector<int> order;
+  for ( size_t i = 0; i < tasks.size(); i++ ) {
+    if ( tasks[i].startUs != 0 ) order.push_back(i);
+  }
+  sort(order.begin(), order.end(), [this](int a, int b) {
+    return tasks[a].startUs < tasks[b].startUs;
+  });
+
+  printf("Step timeline (ms from start):\n");
+  for ( size_t i = 0; i < order.size(); i++ ) {
+    const Task &t = tasks[order[i]];
+    char fly[16] = "";
+    if ( t.fly >= 0 ) snprintf(fly, sizeof(fly), "fly %d", t.fly);
+    printf("  %9.1f %9.1f  %-7s %-12s %s\n", (t.startUs - t0) / 1000.0,
+      (t.endUs - t0) / 1000.0, fly, t.name.c_str(),
+      t.result == StepOk ? "" : t.result == StepSkip ? "skip" :
+      t.timedOut ? "TIMED OUT" : "FAILED");
+  }
+}
+
+void TaskGraph::printStats()
+{
+  lock_guard<mutex> l(lock);
+  map<string, StageTimer> byName;
+  for ( size_t i = 0; i < tasks.size(); i++ ) {
+    const Task &t = tasks[i];
+    if ( t.startUs != 0 && t.endUs != 0 ) byName[t.name].add(t.endUs - t.startUs);
+  }
+  printf("Step durations:\n");
+  map<string, StageTimer>::const_iterator i;
+  for ( i = byName.begin(); i != byName.end(); ++i ) {
+    i->second.print(i->first.c_str());
+  }
+}
+
+unsigned long long TaskGraph::startedUs(int task)
+{
+  lock_guard<mutex> l(lock);
+  return task >= 0 && task < (int)tasks.size() ? tasks[task].startUs : 0;
+}
+
+unsigned long long TaskGraph::finishedUs(int task)
+{
+  lock_guard<mutex> l(lock);
+  return task >= 0 && task < (int)tasks.size() ? tasks[task].endUs : 0;
+}
+
+StepResult TaskGraph::result(int task)
+{
+  lock_guard<mutex> l(lock);
+  return task >= 0 && task < (int)tasks.size() ? tasks[task].result : StepFail;
+}
@@ -0,0 +1,112 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// What a step reports when it finishes.
+//   StepOk:   done; dependents may run.
+//   StepSkip: nothing to do (e.g. no fly came out); dependents are
+//             skipped too unless they were added with evenIfSkipped.
+//   StepFail: hardware error; nothing new is started and run() returns.
+enum StepResult { StepOk = 0, StepSkip = 1, StepFail = -1 };
+
+// Runs steps concurrently as soon as their dependencies are done and the
+// hardware they use is free.
+//
+// Each step names the resources it needs as a bitmask (gates, pump,
+// cameras, ...) and holds all of them for its whole duration, so two steps
+// never drive the same device at once. Ready steps start in the order they
+// were added, which keeps earlier flies ahead of later ones. Steps may add
+// more steps while the graph is running, which is how the cycle queues up
+// the next fly; they do that between hold() and release(), so none of the
+// new steps starts before its dependencies are in place.
+class TaskGraph {
+public:
+  typedef std::function<StepResult()> Action;
+
+  TaskGraph();
+  ~TaskGraph();
+
+  // Returns the new step's id. fly is only used for reporting (-1 for
+  // steps that aren't about a fly).
+  int add(const std::string &name, int fly, unsigned resources, Action action);
+
+  // task may not start until dependency has finished. Dependencies must
+  // not form a cycle.
+  void after(int task, int dependency, bool evenIfSkipped = false);
+
+  // task fails if it runs longer than ms. A step can't be interrupted,
+  // so it still runs to the end, but nothing new is started from then on
+  // and run() returns StepFail once it does end.
+  void timeout(int task, int ms);
+
+  // Steps added from hold() until the matching release() don't start
+  // before release(), whatever their dependencies say so far.
+  void hold();
+  void release();
+
+  // Run until every step has finished or been skipped. Returns StepFail
+  // if any step failed, otherwise StepOk.
+  StepResult run();
+
+  // One line per step: start and end relative to run(), and the result.
+  void printTimeline();
+
+  // Per-step-name durations, e.g. how long "pump" took on average.
+  void printStats();
+
+  // When step `task` started / finished (monotonic us), or 0.
+  unsigned long long startedUs(int task);
+  unsigned long long finishedUs(int task);
+  StepResult result(int task);
+
+private:
+  enum State { Pending, Running, Finished };
+
+  struct Dep {
+    int task;
+    bool evenIfSkipped;
+  };
+
+  struct Task {
+    std::string name;
+    int fly;
+    unsigned resources;
+    int timeoutMs;        // 0 = none
+    bool timedOut;
+    bool held;            // added under hold(); not startable yet
+    Action action;
+    std::deque<Dep> deps;
+    State state;
+    StepResult result;
+    bool joined;
+    unsigned long long startUs, endUs;
+    std::thread worker;
+  };
+
+  void launchReady();
+  void launchPass(bool &skipped);
+  void runTask(int id);
+  unsigned long long checkTimeouts();
+
+  std::deque<Task> tasks;
+  unsigned busy;        // resources held by running steps
+  int running;
+  int holding;          // hold() calls not yet released
+  bool failed;
+  unsigned long long t0;
+
+  std::mutex lock;
+  std::condition_variable changed;
+};
+
+#endif // __SCHEDULER_H__
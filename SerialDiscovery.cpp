@@ -0,0 +1,344 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <algorithm>
+#include <thread>
+
+#include "PhotoFuncs.h"
+#include "Maestro.h"
+#include "SerialDiscovery.h"
+
+using namespace std;
+
+// How long the Arduino gets to boot after its port is opened (which
+// resets it), and how long each try waits for the echo.
+#define ARDUINO_BOOT_MS  4000
+#define ARDUINO_TRY_MS    500
+
+const char *boothDeviceName(BoothDevice d)
+{
+  switch ( d ) {
+  case DeviceServo:     return "servo";
+  case DeviceDispenser: return "dispenser";
+  case DeviceArduino:   return "arduino";
+  default:              return "?";
+  }
+}
+
+BoothDevices::BoothDevices()
+{
+  for ( int i = 0; i < nBoothDevices; i++ ) fd[i] = -1;
+}
+
+// First line of a sysfs attribute, without the newline. false if there
+// is no such attribute.
+static bool readAttr(const string &path, string &value)
+{
+  FILE *fp = fopen(path.c_str(), "r");
+  if ( fp == NULL ) return false;
+  char line[256];
+  bool ok = fgets(line, sizeof(line), fp) != NULL;
+  fclose(fp);
+  if ( !ok ) return false;
+  line[strcspn(line, "\n")] = 0;
+  value = line;
+  return true;
+}
+
+static bool byNode(const UsbSerialPort &a, const UsbSerialPort &b)
+{
+  return a.node < b.node;
+}
+
+int listUsbSerialPorts(vector<UsbSerialPort> &ports)
+{
+  ports.clear();
+  DIR *d = opendir("/sys/class/tty");
+  if ( d == NULL ) {
+    perror("/sys/class/tty");
+    return -1;
+  }
+  struct dirent *e;
+  while ( (e = readdir(d)) != NULL ) {
+    if ( e->d_name[0] == '.' ) continue;
+    // Virtual terminals have no device; USB ones lead, a level or two up
+    // (the usb-serial port for FTDI), to the interface and the device.
+    char real[PATH_MAX];
+    string link = string("/sys/class/tty/") + e->d_name + "/device";
+    if ( realpath(link.c_str(), real) == NULL ) continue;
+
+    UsbSerialPort p;
+    p.interfaceNum = -1;
+    string dir = real, value;
+    for ( int up = 0; up < 4 && dir.size() > 1; up++ ) {
+      if ( p.interfaceNum < 0 && readAttr(dir + "/bInterfaceNumber", value) ) {
+        p.interfaceNum = strtol(value.c_str(), NULL, 16);
+      }
+      if ( readAttr(dir + "/idVendor", p.vendor) ) {
+        p.usbDevice = dir.substr(dir.rfind('/') + 1);
+        readAttr(dir + "/idProduct", p.product);
+        readAttr(dir + "/serial", p.serial);
+        string maker, product;
+        readAttr(dir + "/manufacturer", maker);
+        readAttr(dir + "/product", product);
+        p.description = maker.empty() ? product : maker + " " + product;
+        break;
+      }
+      dir.erase(dir.rfind('/'));
+    }
+    if ( p.usbDevice.empty() ) continue;
+    p.node = string("/dev/") + e->d_name;
+    ports.push_back(p);
+  }
+  closedir(d);
+
+  const char *byId = "/dev/serial/by-id";
+  d = opendir(byId);
+  if ( d != NULL ) {
+    while ( (e = readdir(d)) != NULL ) {
+      if ( e->d_name[0] == '.' ) continue;
+      char real[PATH_MAX];
+      string link = string(byId) + "/" + e->d_name;
+      if ( realpath(link.c_str(), real) == NULL ) continue;
+      for ( size_t i = 0; i < ports.size(); i++ ) {
+        if ( ports[i].node == real ) ports[i].byId = link;
+      }
+    }
+    closedir(d);
+  }
+  sort(ports.begin(), ports.end(), byNode);
+  return 0;
+}
+
+void printUsbSerialPorts(const vector<UsbSerialPort> &ports)
+{
+  if ( ports.empty() ) {
+    printf("No USB serial ports.\n");
+    return;
+  }
+  printf("USB serial ports:\n");
+  for ( size_t i = 0; i < ports.size(); i++ ) {
+    const UsbSerialPort &p = ports[i];
+    printf("  %-14s %s:%s if%d  serial %-20s %s\n", p.node.c_str(),
+      p.vendor.c_str(), p.product.c_str(), p.interfaceNum,
+      p.serial.empty() ? "-" : p.serial.c_str(), p.description.c_str());
+  }
+}
+
+static bool usualDevice(BoothDevice role, const UsbSerialPort &p)
+{
+  switch ( role ) {
+  case DeviceServo:
+    return p.vendor == "1ffb" && p.interfaceNum == 0 &&
+      (p.product == "0089" || p.product == "008a" || p.product == "008b" ||
+       p.product == "008c");
+  case DeviceArduino:
+    return p.vendor == "0403" && (p.product == "6001" || p.product == "6015");
+  case DeviceDispenser:
+    return p.node.compare(0, 11, "/dev/ttyACM") == 0 && p.vendor != "1ffb";
+  default:
+    return false;
+  }
+}
+
+static bool matches(BoothDevice role, const string &spec, const UsbSerialPort &p)
+{
+  if ( spec.empty() ) return usualDevice(role, p);
+  if ( spec.compare(0, 4, "usb:") == 0 ) {
+    char vendor[16] = "", product[16] = "", serial[128] = "";
+    if ( sscanf(spec.c_str() + 4, "%15[^:]:%15[^:]:%127s", vendor, product,
+                serial) < 2 ) {
+      return false;
+    }
+    return strcasecmp(vendor, p.vendor.c_str()) == 0 &&
+      (strcmp(product, "*") == 0 || strcasecmp(product, p.product.c_str()) == 0) &&
+      (serial[0] == 0 || p.serial == serial);
+  }
+  return p.serial == spec ||
+    (!p.byId.empty() && p.byId.find(spec) != string::npos);
+}
+
+// Path for role, or -1 if spec matches no port or several. Ports of one
+// USB device (the Maestro has two) count once, as the lowest interface.
+static int resolve(BoothDevice role, const string &spec,
+                   const vector<UsbSerialPort> &ports, string &path,
+                   const UsbSerialPort *&port)
+{
+  port = NULL;
+  if ( spec.find('/') != string::npos ) {
+    path = spec;
+    return 0;
+  }
+  vector<const UsbSerialPort *> found;
+  for ( size_t i = 0; i < ports.size(); i++ ) {
+    if ( !matches(role, spec, ports[i]) ) continue;
+    bool sameDevice = false;
+    for ( size_t k = 0; k < found.size(); k++ ) {
+      if ( found[k]->usbDevice != ports[i].usbDevice ) continue;
+      sameDevice = true;
+      if ( ports[i].interfaceNum < found[k]->interfaceNum ) found[k] = &ports[i];
+    }
+    if ( !sameDevice ) found.push_back(&ports[i]);
+  }
+  if ( found.size() != 1 ) {
+    printf("No single %s: %d USB serial ports match '%s'.\n",
+      boothDeviceName(role), (int)found.size(),
+      spec.empty() ? "(usual hardware)" : spec.c_str());
+    for ( size_t k = 0; k < found.size(); k++ ) {
+      printf("  %s\n", found[k]->node.c_str());
+    }
+    return -1;
+  }
+  port = found[0];
+  path = port->node;
+  return 0;
+}
+
+// Sends cmd and waits for reply, quietly. Returns 0 if it came.
+static int probeLine(int fd, const char *cmd, const char *reply, int timeoutMs)
+{
+  serialport_flush(fd);
+  int len = strlen(cmd);
+  if ( write(fd, cmd, len) != len ) return -1;
+  char buf[100];
+  if ( serialport_read_until(fd, buf, '\n', sizeof(buf), timeoutMs) != 0 ) return -1;
+  return strcmp(buf, reply) == 0 ? 0 : -1;
+}
+
+struct Probe {
+  int fd;
+  int result;
+  unsigned long long us;
+  char detail[64];
+};
+
+static void probe(BoothDevice role, const string &path, Probe &p)
+{
+  unsigned long long t0 = monotonicUs();
+  p.result = -1;
+  p.detail[0] = 0;
+  p.fd = openSerialPort(path.c_str());
+  if ( p.fd == -1 ) {
+    // openSerialPort has said why.
+    snprintf(p.detail, sizeof(p.detail), "couldn't open it");
+  } else if ( role == DeviceServo ) {
+    const unsigned char channels[] = { 0, 1 };
+    unsigned short pos[2];
+    p.result = maestroGetPositions(p.fd, channels, 2, pos, 500);
+    if ( p.result == 0 ) {
+      snprintf(p.detail, sizeof(p.detail), "gates at %d, %d", pos[0], pos[1]);
+    } else {
+      snprintf(p.detail, sizeof(p.detail), "no position from the Maestro");
+    }
+  } else if ( role == DeviceDispenser ) {
+    p.result = probeLine(p.fd, "I", "ok\n", 3500);
+    if ( p.result != 0 ) snprintf(p.detail, sizeof(p.detail), "no ok to I");
+  } else {
+    do {
+      p.result = probeLine(p.fd, "A\n", "A\n", ARDUINO_TRY_MS);
+    } while ( p.result != 0 && monotonicUs() - t0 < ARDUINO_BOOT_MS * 1000ULL );
+    if ( p.result != 0 ) snprintf(p.detail, sizeof(p.detail), "no echo of A");
+  }
+  p.us = monotonicUs() - t0;
+}
+
+// "vid:pid serial" of the port a device was found on.
+static string describePort(const UsbSerialPort *port)
+{
+  if ( port == NULL ) return "as given";
+  return port->vendor + ":" + port->product + " " +
+    (port->serial.empty() ? "-" : port->serial);
+}
+
+int resolveBoothDevices(BoothDevices &dev, unsigned needed, const char *who)
+{
+  vector<UsbSerialPort> ports;
+  listUsbSerialPorts(ports);
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    if ( !(needed & (1 << i)) ) continue;
+    const UsbSerialPort *port;
+    if ( resolve((BoothDevice)i, dev.spec[i], ports, dev.path[i], port) != 0 ) {
+      printUsbSerialPorts(ports);
+      return -1;
+    }
+    dev.found[i] = describePort(port);
+    for ( int k = 0; k < i; k++ ) {
+      if ( (needed & (1 << k)) && dev.path[k] == dev.path[i] ) {
+        printf("%s%s and %s are both %s.\n", who, boothDeviceName((BoothDevice)k),
+          boothDeviceName((BoothDevice)i), dev.path[i].c_str());
+        return -1;
+      }
+    }
+  }
+  printf("%sSerial devices:\n", who);
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    if ( !(needed & (1 << i)) ) continue;
+    printf("%s  %-9s %-24s %s\n", who, boothDeviceName((BoothDevice)i),
+      dev.path[i].c_str(), dev.found[i].c_str());
+  }
+  return 0;
+}
+
+static void printProbe(const BoothDevices &dev, BoothDevice d, const Probe &p,
+                       const char *who)
+{
+  printf("%s  %-9s %-24s %-28s %s in %.0f ms%s%s\n", who, boothDeviceName(d),
+    dev.path[d].c_str(), dev.found[d].c_str(),
+    p.result == 0 ? "answered" : "FAILED", p.us / 1000.0,
+    p.detail[0] ? ", " : "", p.detail);
+}
+
+int openBoothDevice(BoothDevices &dev, BoothDevice d, const char *who)
+{
+  Probe p;
+  probe(d, dev.path[d], p);
+  printProbe(dev, d, p, who);
+  if ( p.result != 0 ) {
+    if ( p.fd != -1 ) closeSerialPort(p.fd);
+    return -1;
+  }
+  dev.fd[d] = p.fd;
+  return 0;
+}
+
+int openBoothDevices(BoothDevices &dev, unsigned needed, const char *who)
+{
+  // Work out the whole mapping before opening anything.
+  if ( resolveBoothDevices(dev, needed, who) != 0 ) return -1;
+
+  Probe probes[nBoothDevices];
+  vector<thread> threads;
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    probes[i].fd = -1;
+    if ( !(needed & (1 << i)) ) continue;
+    threads.push_back(thread(probe, (BoothDevice)i, dev.path[i], ref(probes[i])));
+  }
+  for ( size_t i = 0; i < threads.size(); i++ ) threads[i].join();
+
+  int status = 0;
+  printf("%sProbes:\n", who);
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    if ( !(needed & (1 << i)) ) continue;
+    printProbe(dev, (BoothDevice)i, probes[i], who);
+    if ( probes[i].result != 0 ) status = -1;
+    dev.fd[i] = probes[i].fd;
+  }
+  if ( status != 0 ) closeBoothDevices(dev);
+  return status;
+}
+
+void closeBoothDevices(BoothDevices &dev)
+{
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    if ( dev.fd[i] != -1 ) closeSerialPort(dev.fd[i]);
+    dev.fd[i] = -1;
+  }
+}
@@ -0,0 +1,90 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SERIALDISCOVERY_H__
+#define __SERIALDISCOVERY_H__
+
+#include <string>
+#include <vector>
+
+// Finds the booth's serial devices by what they are rather than by the
+// tty number they happened to get at boot.
+//
+// Every tty in /sys/class/tty that sits on a USB device is listed with
+// the device's vendor and product IDs, serial number and interface. Each
+// role is then looked up by a spec:
+//
+//   ""                 the role's usual hardware (below)
+//   /dev/...           that node as it is (also BoothSim's ptys)
+//   usb:VVVV:PPPP[:S]  vendor and product ID in hex (PPPP may be *),
+//                      and serial number S if given
+//   anything else      a serial number, or a piece of a
+//                      /dev/serial/by-id name
+//
+// Usual hardware: the servo controller is a Pololu Maestro (1ffb:0089 to
+// 008c; its command port, interface 0), the Arduino sits behind an FTDI
+// USB serial chip (0403:6001 or 6015), and the dispenser is the one other
+// CDC ACM (/dev/ttyACM*) device.
+
+enum BoothDevice { DeviceServo, DeviceDispenser, DeviceArduino, nBoothDevices };
+
+#define NEED_SERVO     (1 << DeviceServo)
+#define NEED_DISPENSER (1 << DeviceDispenser)
+#define NEED_ARDUINO   (1 << DeviceArduino)
+
+// "servo", "dispenser" or "arduino".
+const char *boothDeviceName(BoothDevice d);
+
+struct UsbSerialPort {
+  std::string node;          // /dev/ttyACM0
+  std::string vendor;        // idVendor, e.g. "1ffb"
+  std::string product;       // idProduct
+  std::string serial;        // "" if the device has none
+  std::string description;   // manufacturer and product strings
+  std::string byId;          // /dev/serial/by-id link to it, if any
+  std::string usbDevice;     // sysfs name of the USB device, e.g. 1-1.2
+  int interfaceNum;
+};
+
+// Every USB serial port there is now. Returns 0, or -1 if sysfs can't be
+// read.
+int listUsbSerialPorts(std::vector<UsbSerialPort> &ports);
+void printUsbSerialPorts(const std::vector<UsbSerialPort> &ports);
+
+// Where to find each device, and what was found.
+struct BoothDevices {
+  std::string spec[nBoothDevices];
+  std::string path[nBoothDevices];
+  std::string found[nBoothDevices];  // "vid:pid serial", or "as given"
+  int fd[nBoothDevices];             // -1 if not open
+
+  BoothDevices();
+};
+
+// Work out which node each device in needed (NEED_* bits) is and print
+// it, without opening anything. Returns 0, or -1 if a spec matches no
+// device or several, or two devices are the same node.
+int resolveBoothDevices(BoothDevices &dev, unsigned needed, const char *who = "");
+
+// Resolve as above and, if every device resolves, open them and check
+// each answers, all at once, each on its own thread: the Maestro a
+// position query, the dispenser "I", the Arduino "A" (which
+// turns the lights on; asked again while the Arduino boots, since opening
+// its port resets it). Prints which node each role went to and how its
+// probe went. "I" starts the dispenser, which wants the gates set first;
+// a booth opens the servo here and the dispenser with openBoothDevice()
+// once the gates are in place (Station::addStartup).
+//
+// Returns 0 with every needed fd open, or -1 with none open: before
+// opening anything if a spec matches no device or several, or after the
+// probes if any device didn't answer.
+int openBoothDevices(BoothDevices &dev, unsigned needed, const char *who = "");
+void closeBoothDevices(BoothDevices &dev);
+
+// Open and probe one device resolveBoothDevices() has found, on this
+// thread, for callers that order the devices themselves. Returns 0 with
+// its fd open, or -1 with it closed.
+int openBoothDevice(BoothDevices &dev, BoothDevice d, const char *who = "");
+
+#endif // __SERIALDISCOVERY_H__
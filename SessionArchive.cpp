@@ -0,0 +1,410 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "opencv2/core/core.hpp"
+
+#include "SessionArchive.h"
+
+using namespace cv;
+using namespace std;
+
+struct ArchiveHeader {
+  char magic[8];            // "FSARCHV1"
+  uint32_t version;
+  uint32_t headerBytes;     // sizeof(ArchiveHeader)
+  uint64_t created;         // seconds since the epoch
+  char name[40];            // file name the archive was created with
+};
+
+struct ArchiveFooter {
+  char magic[8];            // "FSAINDEX"
+  uint64_t count;
+};
+
+static_assert(sizeof(ArchiveHeader) == 64, "archive header layout");
+static_assert(sizeof(ArchiveRecord) == 160, "archive record layout");
+static_assert(sizeof(ArchiveIndexEntry) == 32, "archive index layout");
+static_assert(sizeof(ArchiveFooter) == 16, "archive footer layout");
+
+// Older records are shorter: version 1 ends before sharpness, version 2
+// after it (plus 8 bytes of zeros).
+static const uint32_t version1RecordBytes = 128;
+static const uint32_t version2RecordBytes = 144;
+static_assert(offsetof(ArchiveRecord, sharpness) == version1RecordBytes,
+              "archive record layout");
+
+static unsigned long long alignUp(unsigned long long n)
+{
+  return (n + ARCHIVE_ALIGN - 1) & ~(unsigned long long)(ARCHIVE_ALIGN - 1);
+}
+
+static void copyName(char *dst, size_t size, const string &src)
+{
+  memset(dst, 0, size);
+  strncpy(dst, src.c_str(), size - 1);
+}
+
+// pwrite() all of it, retrying short writes.
+static int writeAt(int fd, const void *buf, size_t len, unsigned long long offset)
+{
+  const char *p = (const char *)buf;
+  while ( len > 0 ) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if ( n < 0 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+SessionArchive::SessionArchive() :
+  fd(-1), end(0), allocated(0), growBytes(0)
+{
+}
+
+SessionArchive::~SessionArchive()
+{
+  if ( fd >= 0 ) close();
+}
+
+int SessionArchive::create(const string &path, unsigned long long grow)
+{
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if ( fd < 0 ) {
+    perror(path.c_str());
+    return -1;
+  }
+  archivePath = path;
+  growBytes = alignUp(grow < ARCHIVE_ALIGN ? ARCHIVE_ALIGN : grow);
+  index.clear();
+
+  ArchiveHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "FSARCHV1", 8);
+  h.version = 3;            // 2: sharpness; 3: crops and thumbnails
+  h.headerBytes = sizeof(h);
+  h.created = time(NULL);
+  size_t slash = path.rfind('/');
+  copyName(h.name, sizeof(h.name),
+    slash == string::npos ? path : path.substr(slash + 1));
+  if ( writeAt(fd, &h, sizeof(h), 0) != 0 ) {
+    perror(path.c_str());
+    ::close(fd);
+    fd = -1;
+    return -1;
+  }
+  end = ARCHIVE_ALIGN;
+  allocated = ARCHIVE_ALIGN;
+  return 0;
+}
+
+int SessionArchive::reserve(unsigned long long bytes, unsigned long long &offset)
+{
+  lock_guard<mutex> l(lock);
+  if ( fd < 0 ) return -1;
+  if ( end + bytes > allocated ) {
+    unsigned long long grow = max(growBytes, alignUp(end + bytes - allocated));
+    int err = posix_fallocate(fd, allocated, grow);
+    if ( err != 0 ) {
+      printf("%s: can't preallocate %llu MB: %s\n", archivePath.c_str(),
+        grow >> 20, strerror(err));
+      return -1;
+    }
+    allocated += grow;
+  }
+  offset = end;
+  end += bytes;
+  return 0;
+}
+
+int SessionArchive::append(const Mat &img, const RawMetadata &meta,
+                           const OutputFormat &fmt, ArchiveKind kind)
+{
+  if ( img.empty() || img.depth() != CV_8U ||
+       (img.channels() != 1 && img.channels() != 3) ) {
+    printf("%s: can only store 8-bit mono or BGR frames.\n", archivePath.c_str());
+    return -1;
+  }
+
+  ArchiveRecord r;
+  memset(&r, 0, sizeof(r));
+  memcpy(r.magic, "FREC", 4);
+  r.headerBytes = sizeof(r);
+  r.fly = meta.fly;
+  r.frameIndex = meta.frameIndex;
+  copyName(r.camera, sizeof(r.camera), meta.camera);
+  copyName(r.pixelFormat, sizeof(r.pixelFormat), meta.pixelFormat);
+  r.width = img.cols;
+  r.height = img.rows;
+  r.channels = img.channels();
+  r.hostUs = meta.hostUs;
+  r.cameraTicks = meta.cameraTicks;
+  r.balanceRed = meta.balanceRed;
+  r.balanceGreen = meta.balanceGreen;
+  r.balanceBlue = meta.balanceBlue;
+  r.exposureUs = meta.exposureUs;
+  r.gain = meta.gain;
+  r.sharpness = meta.sharpness;
+  r.kind = kind;
+  r.cropX = meta.cropX;
+  r.cropY = meta.cropY;
+  r.frameWidth = meta.frameWidth;
+  r.frameHeight = meta.frameHeight;
+
+  // The payload: the pixels themselves where possible, so an
+  // uncompressed frame goes to disk without another copy.
+  vector<unsigned char> encoded;
+  Mat pixels;
+  const void *payload;
+  if ( fmt.format == FormatTIFF ) {
+    r.encoding = ArchivePixels;
+    pixels = img.isContinuous() ? img : img.clone();
+    payload = pixels.data;
+    r.payloadBytes = (uint64_t)img.cols * img.rows * img.channels();
+  } else {
+    if ( encodeImage(img, fmt, encoded) != 0 ) return -1;
+    r.encoding = fmt.format + 1;
+    payload = encoded.empty() ? NULL : &encoded[0];
+    r.payloadBytes = encoded.size();
+  }
+
+  unsigned long long offset;
+  if ( reserve(alignUp(sizeof(r) + r.payloadBytes), offset) != 0 ) return -1;
+
+  // Payload first: a record whose header can be read is complete.
+  if ( writeAt(fd, payload, r.payloadBytes, offset + sizeof(r)) != 0 ||
+       writeAt(fd, &r, sizeof(r), offset) != 0 ) {
+    perror(archivePath.c_str());
+    return -1;
+  }
+
+  ArchiveIndexEntry e;
+  memset(&e, 0, sizeof(e));
+  e.offset = offset;
+  e.fly = r.fly;
+  e.frameIndex = r.frameIndex;
+  memcpy(e.camera, r.camera, sizeof(e.camera));
+  lock_guard<mutex> l(lock);
+  index.push_back(e);
+  return 0;
+}
+
+int SessionArchive::records()
+{
+  lock_guard<mutex> l(lock);
+  return (int)index.size();
+}
+
+static bool byOffset(const ArchiveIndexEntry &a, const ArchiveIndexEntry &b)
+{
+  return a.offset < b.offset;
+}
+
+int SessionArchive::close()
+{
+  lock_guard<mutex> l(lock);
+  if ( fd < 0 ) return 0;
+
+  // Appends can finish out of order.
+  sort(index.begin(), index.end(), byOffset);
+  ArchiveFooter f;
+  memcpy(f.magic, "FSAINDEX", 8);
+  f.count = index.size();
+  int status = 0;
+  size_t indexBytes = index.size() * sizeof(ArchiveIndexEntry);
+  if ( (indexBytes > 0 && writeAt(fd, &index[0], indexBytes, end) != 0) ||
+       writeAt(fd, &f, sizeof(f), end + indexBytes) != 0 ||
+       ftruncate(fd, end + indexBytes + sizeof(f)) != 0 ||
+       fsync(fd) != 0 ) {
+    perror(archivePath.c_str());
+    status = -1;
+  }
+  if ( ::close(fd) != 0 ) status = -1;
+  fd = -1;
+  return status;
+}
+
+ArchiveReader::ArchiveReader() :
+  base(NULL), length(0), noIndex(false)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+  close();
+}
+
+void ArchiveReader::close()
+{
+  if ( base != NULL ) munmap((void *)base, length);
+  base = NULL;
+  length = 0;
+  offsets.clear();
+}
+
+// Whether a whole record, header and payload, starts at offset within
+// the length bytes mapped at base.
+static bool recordFits(const uint8_t *base, uint64_t length, uint64_t offset)
+{
+  if ( offset > length || length - offset < version1RecordBytes ) return false;
+  const ArchiveRecord *r = (const ArchiveRecord *)(base + offset);
+  return memcmp(r->magic, "FREC", 4) == 0 &&
+         r->headerBytes >= version1RecordBytes &&
+         r->headerBytes <= length - offset &&
+         r->payloadBytes <= length - offset - r->headerBytes;
+}
+
+int ArchiveReader::open(const string &path)
+{
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if ( fd < 0 ) {
+    perror(path.c_str());
+    return -1;
+  }
+  struct stat st;
+  if ( fstat(fd, &st) != 0 ) {
+    perror(path.c_str());
+    ::close(fd);
+    return -1;
+  }
+  if ( (size_t)st.st_size < sizeof(ArchiveHeader) ) {
+    printf("%s: not a session archive.\n", path.c_str());
+    ::close(fd);
+    return -1;
+  }
+  length = st.st_size;
+  void *p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if ( p == MAP_FAILED ) {
+    perror(path.c_str());
+    length = 0;
+    return -1;
+  }
+  base = (const uint8_t *)p;
+  madvise(p, length, MADV_SEQUENTIAL);
+
+  const ArchiveHeader *h = (const ArchiveHeader *)base;
+  if ( memcmp(h->magic, "FSARCHV1", 8) != 0 ) {
+    printf("%s: not a session archive.\n", path.c_str());
+    close();
+    return -1;
+  }
+
+  // The index, if the writer got as far as close(). If any entry doesn't
+  // point at a whole record, the index isn't trusted and the records are
+  // walked instead.
+  noIndex = true;
+  if ( length >= ARCHIVE_ALIGN + sizeof(ArchiveFooter) ) {
+    const ArchiveFooter *f =
+      (const ArchiveFooter *)(base + length - sizeof(ArchiveFooter));
+    uint64_t indexBytes = f->count * sizeof(ArchiveIndexEntry);
+    if ( memcmp(f->magic, "FSAINDEX", 8) == 0 &&
+         f->count <= length / ARCHIVE_ALIGN &&
+         indexBytes + sizeof(ArchiveFooter) + ARCHIVE_ALIGN <= length ) {
+      const ArchiveIndexEntry *e = (const ArchiveIndexEntry *)
+        (base + length - sizeof(ArchiveFooter) - indexBytes);
+      noIndex = false;
+      for ( uint64_t i = 0; i < f->count; i++ ) {
+        if ( !recordFits(base, length, e[i].offset) ) {
+          noIndex = true;
+          break;
+        }
+        offsets.push_back(e[i].offset);
+      }
+    }
+  }
+  if ( noIndex ) {
+    offsets.clear();
+    scan();
+  }
+  return 0;
+}
+
+// Walks the records from the start. A record being written when the
+// writer stopped has no header yet; skip over it a block at a time.
+int ArchiveReader::scan()
+{
+  uint64_t offset = ARCHIVE_ALIGN;
+  while ( offset + version1RecordBytes <= length ) {
+    const ArchiveRecord *r = (const ArchiveRecord *)(base + offset);
+    if ( recordFits(base, length, offset) ) {
+      offsets.push_back(offset);
+      offset += alignUp(r->headerBytes + r->payloadBytes);
+    } else {
+      offset += ARCHIVE_ALIGN;
+    }
+  }
+  return (int)offsets.size();
+}
+
+const ArchiveRecord &ArchiveReader::record(int i) const
+{
+  return *(const ArchiveRecord *)(base + offsets[i]);
+}
+
+ArchiveKind ArchiveReader::kind(int i) const
+{
+  const ArchiveRecord &r = record(i);
+  if ( r.headerBytes < sizeof(ArchiveRecord) ) return ArchiveFrame;  // older
+  return (ArchiveKind)r.kind;
+}
+
+const uint8_t *ArchiveReader::payload(int i) const
+{
+  return base + offsets[i] + record(i).headerBytes;
+}
+
+int ArchiveReader::image(int i, Mat &img) const
+{
+  const ArchiveRecord &r = record(i);
+  if ( r.encoding == ArchivePixels ) {
+    if ( r.payloadBytes != (uint64_t)r.width * r.height * r.channels ) return -1;
+    img = Mat(r.height, r.width, CV_8UC(r.channels), (void *)payload(i));
+    return 0;
+  }
+  if ( decodeImage(payload(i), r.payloadBytes, img) != 0 ) return -1;
+  return img.cols == (int)r.width && img.rows == (int)r.height ? 0 : -1;
+}
+
+RawMetadata ArchiveReader::metadata(int i) const
+{
+  const ArchiveRecord &r = record(i);
+  RawMetadata meta;
+  meta.camera = string(r.camera, strnlen(r.camera, sizeof(r.camera)));
+  meta.fly = r.fly;
+  meta.frameIndex = r.frameIndex;
+  meta.pixelFormat = string(r.pixelFormat, strnlen(r.pixelFormat, sizeof(r.pixelFormat)));
+  meta.width = r.width;
+  meta.height = r.height;
+  meta.balanceRed = r.balanceRed;
+  meta.balanceGreen = r.balanceGreen;
+  meta.balanceBlue = r.balanceBlue;
+  meta.exposureUs = r.exposureUs;
+  meta.gain = r.gain;
+  if ( r.headerBytes >= version2RecordBytes ) meta.sharpness = r.sharpness;
+  if ( r.headerBytes >= sizeof(ArchiveRecord) ) {
+    meta.cropX = r.cropX;
+    meta.cropY = r.cropY;
+    meta.frameWidth = r.frameWidth;
+    meta.frameHeight = r.frameHeight;
+  }
+  meta.hostUs = r.hostUs;
+  meta.cameraTicks = r.cameraTicks;
+  return meta;
+}
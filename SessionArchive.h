@@ -0,0 +1,155 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SESSIONARCHIVE_H__
+#define __SESSIONARCHIVE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include "opencv2/core/core.hpp"
+
+#include "RawImage.h"
+#include "ImageFormat.h"
+
+// One file per session holding every frame, instead of one file per
+// frame in a flat directory.
+//
+// Layout (all integers little-endian):
+//
+//   file header      64 bytes, "FSARCHV1"
+//   record           160-byte ArchiveRecord, then the payload; each
+//   record           record starts on a 4 KiB boundary
+//   ...
+//   index            one ArchiveIndexEntry per record, in file order
+//   footer           16 bytes: "FSAINDEX", record count
+//
+// Records are only ever appended. The file is grown in large
+// preallocated steps so appends don't fragment it, and is trimmed to
+// its real length when closed. If the session dies before close() there
+// is no index, and the reader finds the records by walking the headers
+// instead; only records still being written at the time are lost.
+//
+// Records of older archives are shorter (version 1: 128 bytes, up to
+// sharpness; version 2: 144) and read as unscored, uncropped frames.
+
+#define ARCHIVE_ALIGN 4096
+
+// How a record's payload is stored.
+enum ArchiveEncoding {
+  ArchivePixels = 0,               // rows of width * channels bytes
+  ArchivePNG = FormatPNG + 1,      // otherwise the file format's bytes
+  ArchiveTIFF = FormatTIFF + 1,
+  ArchiveJPEG = FormatJPEG + 1,
+  ArchiveQOI = FormatQOI + 1
+};
+
+// What a record holds.
+enum ArchiveKind {
+  ArchiveFrame = 0,                // a frame, or the crop of one
+  ArchiveThumbnail = 1             // a small picture of the whole frame
+};
+
+struct ArchiveRecord {
+  char magic[4];            // "FREC"
+  uint32_t headerBytes;     // sizeof(ArchiveRecord)
+  uint64_t payloadBytes;
+  int32_t fly;
+  int32_t frameIndex;
+  char camera[16];
+  char pixelFormat[16];     // of the camera frame, e.g. "BayerBG8"
+  uint32_t width, height;
+  uint32_t channels;        // of the stored image: 1 = mosaic, 3 = BGR
+  uint32_t encoding;        // ArchiveEncoding
+  uint64_t hostUs;
+  uint64_t cameraTicks;
+  double balanceRed, balanceGreen, balanceBlue;
+  double exposureUs, gain;
+  double sharpness;         // Sharpness.h score, -1 if not scored
+  uint32_t kind;            // ArchiveKind
+  int32_t cropX, cropY;     // where the image sits in the frame
+  uint32_t frameWidth, frameHeight;  // whole frame; 0 if not cropped
+  uint8_t reserved[4];
+};
+
+struct ArchiveIndexEntry {
+  uint64_t offset;          // of the record header
+  int32_t fly;
+  int32_t frameIndex;
+  char camera[16];
+};
+
+// Writer. append() may be called from several threads at once; each
+// caller reserves its own region and writes it without holding the lock.
+class SessionArchive {
+public:
+  SessionArchive();
+  ~SessionArchive();
+
+  // Creates path (it must not exist). growBytes is how much space is
+  // preallocated at a time. Returns 0 or -1.
+  int create(const std::string &path, unsigned long long growBytes = 1ULL << 30);
+
+  // Stores img (1-channel mosaic or 3-channel BGR) with meta. With
+  // FormatTIFF the pixels are stored as they are, since the archive
+  // already has everything a TIFF header would say. Returns 0 or -1.
+  int append(const cv::Mat &img, const RawMetadata &meta,
+             const OutputFormat &fmt, ArchiveKind kind = ArchiveFrame);
+
+  // Writes the index and footer, trims the preallocation and syncs.
+  int close();
+
+  const std::string &path() const { return archivePath; }
+  int records();
+
+private:
+  int reserve(unsigned long long bytes, unsigned long long &offset);
+
+  std::string archivePath;
+  int fd;
+  std::mutex lock;
+  unsigned long long end;        // where the next record goes
+  unsigned long long allocated;  // preallocated so far
+  unsigned long long growBytes;
+  std::vector<ArchiveIndexEntry> index;
+};
+
+// Read-only view of an archive, memory-mapped so a payload can be used
+// in place.
+class ArchiveReader {
+public:
+  ArchiveReader();
+  ~ArchiveReader();
+
+  // Returns 0, or -1 if path isn't an archive. recovered() tells whether
+  // the index was missing and the records were found by scanning.
+  int open(const std::string &path);
+  void close();
+  bool recovered() const { return noIndex; }
+
+  int records() const { return (int)offsets.size(); }
+  // The header as stored; an old record has only the fields before
+  // sharpness, so use kind() and metadata() for the rest.
+  const ArchiveRecord &record(int i) const;
+  ArchiveKind kind(int i) const;
+  const uint8_t *payload(int i) const;
+
+  // The stored image, decoded if need be: a 1-channel mosaic or BGR.
+  // Uncompressed pixels aren't copied; img then points into the mapping
+  // and is only valid until close(). Returns 0 or -1.
+  int image(int i, cv::Mat &img) const;
+  // The record as RawMetadata, e.g. for writeRawMetadata().
+  RawMetadata metadata(int i) const;
+
+private:
+  int scan();
+
+  const uint8_t *base;
+  size_t length;
+  bool noIndex;
+  std::vector<uint64_t> offsets;
+};
+
+#endif // __SESSIONARCHIVE_H__
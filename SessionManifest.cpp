@@ -0,0 +1,252 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+#include "SessionManifest.h"
+#include "SessionArchive.h"
+
+using namespace std;
+
+SessionManifest::SessionManifest() :
+  nextFrame(0), flies(0), updated(0)
+{
+}
+
+string manifestPath(const string &dir)
+{
+  return dir + "/" MANIFEST_NAME;
+}
+
+int readManifest(const string &dir, SessionManifest &m)
+{
+  string path = manifestPath(dir);
+  FILE *fp = fopen(path.c_str(), "r");
+  if ( fp == NULL ) return 1;
+
+  SessionManifest read;
+  bool complete = false;
+  char line[200], key[64];
+  unsigned long long value;
+  while ( fgets(line, sizeof(line), fp) != NULL ) {
+    if ( strcmp(line, "end\n") == 0 ) {
+      complete = true;
+      break;
+    }
+    if ( line[0] == '#' || sscanf(line, "%63s %llu", key, &value) != 2 ) continue;
+    if ( strcmp(key, "nextFrame") == 0 ) read.nextFrame = value;
+    else if ( strcmp(key, "flies") == 0 ) read.flies = value;
+    else if ( strcmp(key, "updated") == 0 ) read.updated = value;
+  }
+  fclose(fp);
+  if ( !complete ) {
+    printf("%s is incomplete.\n", path.c_str());
+    return -1;
+  }
+  m = read;
+  return 0;
+}
+
+int writeManifest(const string &dir, const SessionManifest &m)
+{
+  string path = manifestPath(dir);
+  string tmp = path + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if ( fp == NULL ) {
+    perror(tmp.c_str());
+    return -1;
+  }
+  fprintf(fp, "# Written by HandLoad/Photobooth; see SessionManifest.h.\n");
+  fprintf(fp, "nextFrame %d\n", m.nextFrame);
+  fprintf(fp, "flies %d\n", m.flies);
+  fprintf(fp, "updated %llu\n", (unsigned long long)time(NULL));
+  fprintf(fp, "end\n");
+  if ( fflush(fp) != 0 || fsync(fileno(fp)) != 0 ) {
+    perror(tmp.c_str());
+    fclose(fp);
+    unlink(tmp.c_str());
+    return -1;
+  }
+  fclose(fp);
+  if ( rename(tmp.c_str(), path.c_str()) != 0 ) {
+    perror(path.c_str());
+    unlink(tmp.c_str());
+    return -1;
+  }
+
+  // The rename only survives a power cut once the directory is synced.
+  int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if ( dfd >= 0 ) {
+    fsync(dfd);
+    close(dfd);
+  }
+  return 0;
+}
+
+// The number in "<camera><digits>.<anything>", or -1. The camera name is
+// letters, digits, '-' and '_', e.g. Upper or booth1-Upper, so the number
+// is the run of digits right before the first '.'.
+static int frameNumber(const char *name)
+{
+  const char *dot = strchr(name, '.');
+  if ( dot == NULL ) return -1;
+  for ( const char *p = name; p < dot; p++ ) {
+    if ( !isalnum((unsigned char)*p) && *p != '-' && *p != '_' ) return -1;
+  }
+  const char *digits = dot;
+  while ( digits > name && isdigit((unsigned char)digits[-1]) ) digits--;
+  if ( digits == dot || digits == name ) return -1;
+  return atoi(digits);
+}
+
+// path from /, so the list is the same whichever directory it is used
+// from.
+static string canonical(const string &path)
+{
+  if ( path.empty() || path[0] == '/' ) return path;
+  char cwd[4096];
+  if ( getcwd(cwd, sizeof(cwd)) == NULL ) return path;
+  return string(cwd) + "/" + path;
+}
+
+int readSessionArchives(const string &dir, vector<string> &archives)
+{
+  archives.clear();
+  string path = dir + "/" ARCHIVES_NAME;
+  FILE *fp = fopen(path.c_str(), "r");
+  if ( fp == NULL ) return 1;
+  char line[1024];
+  while ( fgets(line, sizeof(line), fp) != NULL ) {
+    line[strcspn(line, "\r\n")] = 0;
+    if ( line[0] == '#' || line[0] == 0 ) continue;
+    archives.push_back(line);
+  }
+  fclose(fp);
+  return 0;
+}
+
+int addSessionArchive(const string &dir, const string &archive)
+{
+  vector<string> archives;
+  readSessionArchives(dir, archives);
+  string path = canonical(archive);
+  for ( size_t i = 0; i < archives.size(); i++ ) {
+    if ( archives[i] == path ) return 0;
+  }
+  string listPath = dir + "/" ARCHIVES_NAME;
+  bool created = archives.empty();
+  FILE *fp = fopen(listPath.c_str(), "a");
+  if ( fp == NULL ) {
+    perror(listPath.c_str());
+    return -1;
+  }
+  if ( created ) {
+    fprintf(fp, "# Archives of this session; see SessionManifest.h.\n");
+  }
+  fprintf(fp, "%s\n", path.c_str());
+  if ( fflush(fp) != 0 || fsync(fileno(fp)) != 0 ) {
+    perror(listPath.c_str());
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  return 0;
+}
+
+int rebuildManifest(const string &dir, int framesPerFly, SessionManifest &m,
+                    const vector<string> &extra, const string &cameraPrefix)
+{
+  DIR *d = opendir(dir.c_str());
+  if ( d == NULL ) {
+    perror(dir.c_str());
+    return -1;
+  }
+  int highest = -1;
+  struct dirent *ent;
+  while ( (ent = readdir(d)) != NULL ) {
+    int n = frameNumber(ent->d_name);
+    if ( n > highest ) highest = n;
+  }
+  closedir(d);
+
+  // The archives the session lists, and any more given.
+  vector<string> archives;
+  readSessionArchives(dir, archives);
+  for ( size_t i = 0; i < extra.size(); i++ ) {
+    string path = canonical(extra[i]);
+    bool listed = false;
+    for ( size_t k = 0; k < archives.size(); k++ ) {
+      if ( archives[k] == path ) listed = true;
+    }
+    if ( !listed ) archives.push_back(path);
+  }
+
+  int highestFly = 0;
+  for ( size_t a = 0; a < archives.size(); a++ ) {
+    // Without every archive there's no telling how far numbering got.
+    ArchiveReader reader;
+    if ( reader.open(archives[a]) != 0 ) {
+      printf("Can't count the frames in %s, so can't rebuild the manifest "
+        "of %s.\n", archives[a].c_str(), dir.c_str());
+      return -1;
+    }
+    int counted = 0;
+    for ( int i = 0; i < reader.records(); i++ ) {
+      const ArchiveRecord &r = reader.record(i);
+      string camera(r.camera, strnlen(r.camera, sizeof(r.camera)));
+      if ( camera.compare(0, cameraPrefix.size(), cameraPrefix) != 0 ) continue;
+      if ( r.frameIndex > highest ) highest = r.frameIndex;
+      if ( r.fly > highestFly ) highestFly = r.fly;
+      counted++;
+    }
+    printf("%s: %d of %d records counted.\n", archives[a].c_str(), counted,
+      reader.records());
+  }
+
+  if ( framesPerFly < 1 ) framesPerFly = 1;
+  m = SessionManifest();
+  m.nextFrame = highest + 1;
+  m.flies = (m.nextFrame + framesPerFly - 1) / framesPerFly;
+  if ( highestFly > m.flies ) m.flies = highestFly;
+  return 0;
+}
+
+int resumeSession(const string &dir, int framesPerFly, SessionManifest &m,
+                  const char *archive, const string &cameraPrefix)
+{
+  int r = readManifest(dir, m);
+  if ( r != 0 ) {
+    // A manifest that is there but unusable means the session has run
+    // before; if it stored into archives and they aren't listed, numbering
+    // from the files alone would repeat the flies and frames in them.
+    vector<string> archives;
+    bool listed = readSessionArchives(dir, archives) == 0;
+    if ( archive != NULL && r == -1 && !listed ) {
+      printf("%s is unusable, and this session stores its frames in archives "
+        "that %s doesn't list. Rebuild it with RebuildManifest -archive "
+        "<file> for each of them.\n", manifestPath(dir).c_str(),
+        (dir + "/" ARCHIVES_NAME).c_str());
+      return -1;
+    }
+    printf("%s %s; rebuilding it from the frames in %s%s.\n",
+      manifestPath(dir).c_str(), r == 1 ? "doesn't exist" : "is unusable",
+      dir.c_str(), archives.empty() ? "" : " and its archives");
+    if ( rebuildManifest(dir, framesPerFly, m, vector<string>(),
+                         cameraPrefix) != 0 ||
+         writeManifest(dir, m) != 0 ) {
+      return -1;
+    }
+  }
+  if ( archive != NULL && addSessionArchive(dir, archive) != 0 ) return -1;
+  return 0;
+}
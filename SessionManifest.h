@@ -0,0 +1,77 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SESSIONMANIFEST_H__
+#define __SESSIONMANIFEST_H__
+
+#include <string>
+#include <vector>
+
+// Where numbering picks up when HandLoad or Photobooth starts: a small
+// text file in the image directory, rewritten once each fly's frames are
+// all on disk. Reading it is the only thing startup does, however many
+// images the directory holds.
+//
+// The file is replaced atomically (written to a temporary, synced and
+// renamed over the old one), so after a crash it describes the last fly
+// that was completely written; frames of a fly still in progress get
+// overwritten when the session resumes.
+//
+// If it's missing or unreadable, RebuildManifest (or rebuildManifest())
+// scans the directory once to make a new one. Frames stored in a session
+// archive (SessionArchive.h) leave no files there, so the archives a
+// session has used are listed beside the manifest, and the rebuild counts
+// their records too.
+
+#define MANIFEST_NAME "session.manifest"
+#define ARCHIVES_NAME "session.archives"
+
+struct SessionManifest {
+  int nextFrame;                 // first unused frame number
+  int flies;                     // flies imaged so far
+  unsigned long long updated;    // when written, seconds since the epoch
+
+  SessionManifest();
+};
+
+// dir + "/" MANIFEST_NAME
+std::string manifestPath(const std::string &dir);
+
+// Returns 0, 1 if there's no manifest, or -1 if it can't be read.
+int readManifest(const std::string &dir, SessionManifest &m);
+// Replaces the manifest atomically, stamped with the current time.
+// Returns 0 or -1.
+int writeManifest(const std::string &dir, const SessionManifest &m);
+
+// The archives listed in dir, as absolute paths. Returns 0, or 1 if
+// there's no list.
+int readSessionArchives(const std::string &dir, std::vector<std::string> &archives);
+// Add archive to dir's list unless it's there already. Returns 0 or -1.
+int addSessionArchive(const std::string &dir, const std::string &archive);
+
+// Works out the manifest from the frames in dir: nextFrame is one past
+// the highest <camera>NNN number of any file (the camera as Station names
+// it, e.g. Upper or booth1-Upper; numbers compared as numbers, so 1000
+// follows 999), and flies is that divided by framesPerFly, rounded up.
+// The records of the archives dir lists, and of any more given, count
+// too: frameIndex like the file numbers, and flies is at least the
+// highest fly. Only records whose camera starts with cameraPrefix count
+// (a named station's, e.g. "b1-"). Doesn't write it. Returns 0, or -1 if
+// dir or one of the archives can't be read.
+int rebuildManifest(const std::string &dir, int framesPerFly,
+                    SessionManifest &m,
+                    const std::vector<std::string> &archives =
+                      std::vector<std::string>(),
+                    const std::string &cameraPrefix = "");
+
+// What HandLoad and Photobooth do at startup: read the manifest, or if
+// there isn't a usable one, rebuild it and write it. archive is where this
+// run stores its frames (NULL if in files); it is added to the list. An
+// unusable manifest of a session that stores into archives but has no
+// list isn't rebuilt, since its frames can't be counted. Returns 0 or -1.
+int resumeSession(const std::string &dir, int framesPerFly, SessionManifest &m,
+                  const char *archive = NULL,
+                  const std::string &cameraPrefix = "");
+
+#endif // __SESSIONMANIFEST_H__
@@ -0,0 +1,219 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "Sharpness.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+SharpnessOptions::SharpnessOptions() :
+  method(SharpnessLaplacian), step(1), x(0), y(0), w(0), h(0), simd(true)
+{
+}
+
+FrameSelection::FrameSelection() :
+  keepBest(0), minScore(0)
+{
+}
+
+// One row of block sums: out[i] is the 2x2 block at column 2 * i * step
+// of rows r0, r1. At most 4 * 255, so it fits in 16 bits with room to
+// spare for the filters below.
+static void blockRow(const uint8_t *r0, const uint8_t *r1, int n, int step,
+                     bool simd, int16_t *out)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  if ( simd && step == 1 ) {
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    for ( ; i + 8 <= n; i += 8 ) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(r0 + 2 * i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(r1 + 2 * i));
+      __m128i s = _mm_add_epi16(
+        _mm_add_epi16(_mm_and_si128(a, lowBytes), _mm_srli_epi16(a, 8)),
+        _mm_add_epi16(_mm_and_si128(b, lowBytes), _mm_srli_epi16(b, 8)));
+      _mm_storeu_si128((__m128i *)(out + i), s);
+    }
+  }
+#endif
+  for ( ; i < n; i++ ) {
+    int x = 2 * i * step;
+    out[i] = r0[x] + r0[x + 1] + r1[x] + r1[x + 1];
+  }
+}
+
+// Sum and sum of squares of the Laplacian along row b (a above, c below),
+// for columns 1 .. n-2.
+static void laplacianRow(const int16_t *a, const int16_t *b, const int16_t *c,
+                         int n, bool simd, long long &sum, long long &sumSq)
+{
+  int i = 1;
+#if defined(__SSE2__)
+  if ( simd ) {
+    const __m128i ones = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+    __m128i s = zero, sq = zero;
+    for ( ; i + 8 <= n - 1; i += 8 ) {
+      __m128i mid = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i l = _mm_sub_epi16(_mm_slli_epi16(mid, 2),
+        _mm_add_epi16(
+          _mm_add_epi16(_mm_loadu_si128((const __m128i *)(b + i - 1)),
+                        _mm_loadu_si128((const __m128i *)(b + i + 1))),
+          _mm_add_epi16(_mm_loadu_si128((const __m128i *)(a + i)),
+                        _mm_loadu_si128((const __m128i *)(c + i)))));
+      // Pairs of squares reach 2 * 4080^2; widen before they add up.
+      __m128i p = _mm_madd_epi16(l, l);
+      sq = _mm_add_epi64(sq, _mm_unpacklo_epi32(p, zero));
+      sq = _mm_add_epi64(sq, _mm_unpackhi_epi32(p, zero));
+      s = _mm_add_epi32(s, _mm_madd_epi16(l, ones));
+    }
+    int32_t s4[4];
+    long long q2[2];
+    _mm_storeu_si128((__m128i *)s4, s);
+    _mm_storeu_si128((__m128i *)q2, sq);
+    sum += (long long)s4[0] + s4[1] + s4[2] + s4[3];
+    sumSq += q2[0] + q2[1];
+  }
+#endif
+  for ( ; i < n - 1; i++ ) {
+    int l = 4 * b[i] - b[i - 1] - b[i + 1] - a[i] - c[i];
+    sum += l;
+    sumSq += l * l;
+  }
+}
+
+// Sum of the squared Sobel gradient along row b, columns 1 .. n-2.
+static void tenengradRow(const int16_t *a, const int16_t *b, const int16_t *c,
+                         int n, bool simd, long long &sumSq)
+{
+  int i = 1;
+#if defined(__SSE2__)
+  if ( simd ) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sq = zero;
+    for ( ; i + 8 <= n - 1; i += 8 ) {
+      __m128i al = _mm_loadu_si128((const __m128i *)(a + i - 1));
+      __m128i am = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i ar = _mm_loadu_si128((const __m128i *)(a + i + 1));
+      __m128i bl = _mm_loadu_si128((const __m128i *)(b + i - 1));
+      __m128i br = _mm_loadu_si128((const __m128i *)(b + i + 1));
+      __m128i cl = _mm_loadu_si128((const __m128i *)(c + i - 1));
+      __m128i cm = _mm_loadu_si128((const __m128i *)(c + i));
+      __m128i cr = _mm_loadu_si128((const __m128i *)(c + i + 1));
+      __m128i gx = _mm_sub_epi16(
+        _mm_add_epi16(_mm_add_epi16(ar, cr), _mm_slli_epi16(br, 1)),
+        _mm_add_epi16(_mm_add_epi16(al, cl), _mm_slli_epi16(bl, 1)));
+      __m128i gy = _mm_sub_epi16(
+        _mm_add_epi16(_mm_add_epi16(cl, cr), _mm_slli_epi16(cm, 1)),
+        _mm_add_epi16(_mm_add_epi16(al, ar), _mm_slli_epi16(am, 1)));
+      __m128i p = _mm_add_epi32(_mm_madd_epi16(gx, gx), _mm_madd_epi16(gy, gy));
+      sq = _mm_add_epi64(sq, _mm_unpacklo_epi32(p, zero));
+      sq = _mm_add_epi64(sq, _mm_unpackhi_epi32(p, zero));
+    }
+    long long q2[2];
+    _mm_storeu_si128((__m128i *)q2, sq);
+    sumSq += q2[0] + q2[1];
+  }
+#endif
+  for ( ; i < n - 1; i++ ) {
+    int gx = (a[i + 1] + 2 * b[i + 1] + c[i + 1]) - (a[i - 1] + 2 * b[i - 1] + c[i - 1]);
+    int gy = (c[i - 1] + 2 * c[i] + c[i + 1]) - (a[i - 1] + 2 * a[i] + a[i + 1]);
+    sumSq += gx * gx + gy * gy;
+  }
+}
+
+double sharpnessScore(const uint8_t *mosaic, int stride, int width, int height,
+                      const SharpnessOptions &opt)
+{
+  // The region, on whole Bayer blocks and inside the frame.
+  int x0 = opt.w > 0 ? opt.x : 0, y0 = opt.w > 0 ? opt.y : 0;
+  int x1 = opt.w > 0 ? opt.x + opt.w : width, y1 = opt.w > 0 ? opt.y + opt.h : height;
+  if ( x0 < 0 ) x0 = 0;
+  if ( y0 < 0 ) y0 = 0;
+  if ( x1 > width ) x1 = width;
+  if ( y1 > height ) y1 = height;
+  x0 &= ~1;
+  y0 &= ~1;
+  int step = opt.step < 1 ? 1 : opt.step;
+  int blocksX = (x1 - x0) / 2, blocksY = (y1 - y0) / 2;
+  int nx = blocksX > 0 ? (blocksX - 1) / step + 1 : 0;
+  int ny = blocksY > 0 ? (blocksY - 1) / step + 1 : 0;
+  if ( nx < 3 || ny < 3 ) return -1;
+
+  // Three rows of block sums, reused as the window slides down.
+  vector<int16_t> rows(3 * (size_t)nx);
+  int16_t *row[3] = { &rows[0], &rows[nx], &rows[2 * (size_t)nx] };
+  long long sum = 0, sumSq = 0;
+  for ( int j = 0; j < ny; j++ ) {
+    const uint8_t *r0 = mosaic + (size_t)(y0 + 2 * j * step) * stride + x0;
+    blockRow(r0, r0 + stride, nx, step, opt.simd, row[j % 3]);
+    if ( j < 2 ) continue;
+    const int16_t *a = row[(j - 2) % 3], *b = row[(j - 1) % 3], *c = row[j % 3];
+    if ( opt.method == SharpnessTenengrad ) {
+      tenengradRow(a, b, c, nx, opt.simd, sumSq);
+    } else {
+      laplacianRow(a, b, c, nx, opt.simd, sum, sumSq);
+    }
+  }
+
+  double n = (double)(nx - 2) * (ny - 2);
+  double mean = sum / n;
+  return sumSq / n - mean * mean;
+}
+
+const char *sharpnessMethodName(SharpnessMethod method)
+{
+  return method == SharpnessTenengrad ? "tenengrad" : "laplacian";
+}
+
+bool parseSharpnessMethod(const char *name, SharpnessMethod &method)
+{
+  if ( strcmp(name, "laplacian") == 0 ) method = SharpnessLaplacian;
+  else if ( strcmp(name, "tenengrad") == 0 ) method = SharpnessTenengrad;
+  else return false;
+  return true;
+}
+
+ScoreLog::ScoreLog() : fp(NULL) { }
+
+ScoreLog::~ScoreLog()
+{
+  close();
+}
+
+int ScoreLog::open(const string &path)
+{
+  struct stat st;
+  bool isNew = stat(path.c_str(), &st) != 0 || st.st_size == 0;
+  fp = fopen(path.c_str(), "a");
+  if ( fp == NULL ) {
+    perror(path.c_str());
+    return -1;
+  }
+  if ( isNew ) fprintf(fp, "fly,camera,frame,hostUs,sharpness,kept\n");
+  return 0;
+}
+
+void ScoreLog::add(const RawMetadata &meta, bool kept)
+{
+  lock_guard<mutex> l(lock);
+  if ( fp == NULL ) return;
+  fprintf(fp, "%d,%s,%d,%llu,%.1f,%d\n", meta.fly, meta.camera.c_str(),
+    meta.frameIndex, meta.hostUs, meta.sharpness, kept ? 1 : 0);
+  fflush(fp);
+}
+
+void ScoreLog::close()
+{
+  lock_guard<mutex> l(lock);
+  if ( fp != NULL ) fclose(fp);
+  fp = NULL;
+}
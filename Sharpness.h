@@ -0,0 +1,79 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SHARPNESS_H__
+#define __SHARPNESS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <mutex>
+
+#include "RawImage.h"
+
+// Focus / motion-blur score of a raw frame, so a fly's blurred frames can
+// be dropped before they are encoded.
+//
+// Scores are computed on the mosaic itself: each 2x2 Bayer block is
+// summed into one half-resolution luma value (whatever the pattern), and
+// the score is taken over that plane, optionally decimated further and
+// restricted to a region. Higher is sharper. Scores of frames of the same
+// scene compare well; across cameras or lighting they don't.
+//
+//   Laplacian  variance of the 4-neighbour Laplacian
+//   Tenengrad  mean squared Sobel gradient magnitude
+//
+// The SSE2 path gives exactly the same result as the scalar one.
+enum SharpnessMethod { SharpnessLaplacian, SharpnessTenengrad };
+
+struct SharpnessOptions {
+  SharpnessMethod method;
+  int step;               // use every step-th block in each direction
+  int x, y, w, h;         // region in mosaic pixels; w = 0: whole frame
+  bool simd;              // false forces the scalar path
+
+  SharpnessOptions();
+};
+
+// Score of an 8-bit Bayer mosaic (stride in bytes), or -1 if the region
+// is too small (under 3x3 blocks after decimation).
+double sharpnessScore(const uint8_t *mosaic, int stride, int width, int height,
+                      const SharpnessOptions &opt);
+
+// "laplacian" or "tenengrad".
+const char *sharpnessMethodName(SharpnessMethod method);
+bool parseSharpnessMethod(const char *name, SharpnessMethod &method);
+
+// Which frames of each start a CameraGrabber passes on to the pipeline.
+// Frames scoring below minScore are dropped as they arrive; of the rest
+// only the keepBest sharpest are kept (all of them if keepBest is 0).
+// Kept frames are submitted in the order they were grabbed.
+struct FrameSelection {
+  int keepBest;
+  double minScore;
+  SharpnessOptions scoring;
+
+  FrameSelection();
+  bool enabled() const { return keepBest > 0 || minScore > 0; }
+};
+
+// Every score, kept or not, one CSV line per frame. Safe to share between
+// grabbers.
+class ScoreLog {
+public:
+  ScoreLog();
+  ~ScoreLog();
+
+  // Appends to path, writing the header if the file is new. Returns 0 or
+  // -1.
+  int open(const std::string &path);
+  void add(const RawMetadata &meta, bool kept);
+  void close();
+
+private:
+  FILE *fp;
+  std::mutex lock;
+};
+
+#endif // __SHARPNESS_H__
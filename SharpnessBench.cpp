@@ -0,0 +1,95 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// Times the sharpness scores (Sharpness.h) on a full-size synthetic
+// frame, scalar against SSE2 and at a few decimation steps, and checks
+// that both paths agree and that a motion-blurred copy of the frame
+// scores lower than the original.
+//
+//   SharpnessBench [iterations]
+//
+// The time per frame is what scoring adds to each grab; it has to stay
+// well under the frame interval (100 ms at 10 fps).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "PhotoFuncs.h"
+#include "Sharpness.h"
+#include "SyntheticSource.h"
+
+using namespace std;
+
+static const int W = 3840, H = 2748;
+
+// Horizontal motion blur over len pixels, each Bayer color on its own.
+static void motionBlur(const uint8_t *in, uint8_t *out, int len)
+{
+  for ( int y = 0; y < H; y++ ) {
+    const uint8_t *r = in + (size_t)y * W;
+    uint8_t *o = out + (size_t)y * W;
+    for ( int x = 0; x < W; x++ ) {
+      int sum = 0, n = 0;
+      for ( int k = 0; k < len; k++ ) {
+        int xx = x + 2 * (k - len / 2);
+        if ( xx < 0 || xx >= W ) continue;
+        sum += r[xx];
+        n++;
+      }
+      o[x] = sum / n;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 20;
+  if ( iterations < 1 ) iterations = 1;
+
+  printf("Rendering a synthetic frame...\n");
+  SyntheticSource source(W, H, 0, 1, 1);
+  const uint8_t *sharp = source.mosaic(0);
+  vector<uint8_t> blurred((size_t)W * H);
+  motionBlur(sharp, &blurred[0], 5);
+
+  int status = 0;
+  const SharpnessMethod methods[] = { SharpnessLaplacian, SharpnessTenengrad };
+  const int steps[] = { 1, 2, 4 };
+  printf("%-10s %4s %-6s %10s %10s %14s %14s\n", "method", "step", "path",
+    "mean ms", "worst ms", "sharp", "blurred");
+  for ( SharpnessMethod method : methods ) {
+    for ( int step : steps ) {
+      double score[2] = { 0, 0 };
+      for ( int simd = 0; simd < 2; simd++ ) {
+        SharpnessOptions opt;
+        opt.method = method;
+        opt.step = step;
+        opt.simd = simd != 0;
+        StageTimer t;
+        double s = 0;
+        for ( int i = 0; i < iterations; i++ ) {
+          unsigned long long t0 = monotonicUs();
+          s = sharpnessScore(sharp, W, W, H, opt);
+          t.add(monotonicUs() - t0);
+        }
+        double b = sharpnessScore(&blurred[0], W, W, H, opt);
+        score[simd] = s;
+        printf("%-10s %4d %-6s %10.2f %10.2f %14.1f %14.1f\n",
+          sharpnessMethodName(method), step, simd ? "sse2" : "scalar",
+          t.totalUs / 1000.0 / t.count, t.maxUs / 1000.0, s, b);
+        if ( b >= s ) {
+          printf("  The blurred frame doesn't score lower.\n");
+          status = 1;
+        }
+      }
+      if ( score[0] != score[1] ) {
+        printf("  Scalar and SSE2 scores differ.\n");
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
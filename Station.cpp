@@ -0,0 +1,555 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+#include <pylon/PylonIncludes.h>
+
+#include "Station.h"
+#include "PylonSource.h"
+#include "Trace.h"
+
+using namespace Pylon;
+using namespace std;
+
+StationOptions::StationOptions() :
+  synthetic(false), poolMB(256), framesPerCamera(3), cropToFly(false),
+  newBackground(false), triggerMode(TriggerFree), intervalUs(100000),
+  settleUs(1000000), cameraSettings(NULL), settingsCache(NULL),
+  fullConfig(false), ring(NULL), archivePath(NULL) { }
+
+int readStations(const string &path, vector<StationConfig> &out)
+{
+  ifstream in(path.c_str());
+  if ( !in ) {
+    printf("Couldn't read %s.\n", path.c_str());
+    return -1;
+  }
+  string line;
+  int lineNo = 0;
+  while ( getline(in, line) ) {
+    lineNo++;
+    size_t hash = line.find('#');
+    if ( hash != string::npos ) line.erase(hash);
+    istringstream words(line);
+    StationConfig c;
+    if ( !(words >> c.name) ) continue;
+    if ( !(words >> c.cameraPrefix >> c.servo >> c.dispenser >> c.arduino) ) {
+      printf("%s:%d: expected name, camera prefix, servo, dispenser and "
+        "arduino.\n", path.c_str(), lineNo);
+      return -1;
+    }
+    if ( c.cameraPrefix == "-" ) c.cameraPrefix = "";
+    string *serial[] = { &c.servo, &c.dispenser, &c.arduino };
+    for ( string *spec : serial ) {
+      if ( *spec == "auto" ) spec->clear();
+    }
+    for ( size_t i = 0; i < out.size(); i++ ) {
+      if ( out[i].name == c.name || out[i].cameraPrefix == c.cameraPrefix ) {
+        printf("%s:%d: station %s has the same name or camera prefix as "
+          "%s.\n", path.c_str(), lineNo, c.name.c_str(), out[i].name.c_str());
+        return -1;
+      }
+    }
+    out.push_back(c);
+  }
+  if ( out.empty() ) {
+    printf("No stations in %s.\n", path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+// Index of the device whose friendly name starts with prefix, or -1.
+static int findCamera(const DeviceInfoList_t &devices, const string &prefix)
+{
+  for ( size_t i = 0; i < devices.size(); i++ ) {
+    if ( strncmp(devices[i].GetFriendlyName(), prefix.c_str(), prefix.size()) == 0 ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+Station::Station(const StationConfig &c, const StationOptions &o,
+                 CapturePipeline &p) :
+  cfg(c), opt(o), pipeline(p), servoFD(-1), dispenserFD(-1), arduinoFD(-1),
+  syntheticUpper(NULL), syntheticLower(NULL), flies(0), runUs(0), grabbed(0),
+  kept(0)
+{
+  if ( cfg.name.empty() ) {
+    dir = "images";
+    upperName = "Upper";
+    lowerName = "Lower";
+  } else {
+    dir = "images/" + cfg.name;
+    tag = cfg.name + ": ";
+    upperName = cfg.name + "-Upper";
+    lowerName = cfg.name + "-Lower";
+  }
+}
+
+Station::~Station()
+{
+  if ( worker.joinable() ) worker.join();
+}
+
+vector<string> Station::devicePaths() const
+{
+  vector<string> paths;
+  for ( int i = 0; i < nBoothDevices; i++ ) {
+    if ( !serial.path[i].empty() ) paths.push_back(serial.path[i]);
+  }
+  return paths;
+}
+
+int Station::resolve()
+{
+  serial.spec[DeviceServo] = cfg.servo;
+  serial.spec[DeviceDispenser] = cfg.dispenser;
+  serial.spec[DeviceArduino] = cfg.arduino;
+  unsigned needed = NEED_SERVO | NEED_ARDUINO;
+  if ( hasDispenser() ) needed |= NEED_DISPENSER;
+  return resolveBoothDevices(serial, needed, who());
+}
+
+// Each step's name, with the station's for several.
+string Station::stepName(const char *step) const
+{
+  return cfg.name.empty() ? step : cfg.name + " " + step;
+}
+
+void Station::addStartup(TaskGraph &g, int devicesFound,
+                         const DeviceInfoList_t &devices)
+{
+  const DeviceInfoList_t *list = &devices;
+
+  // The serial devices answer on their own time; the Arduino needs the
+  // longest, as opening its port resets it. The gates must be where the
+  // dispenser expects them before it starts.
+  int servo = g.add(stepName("servo"), -1, 0, [this]() {
+    if ( openBoothDevice(serial, DeviceServo, who()) != 0 ) return StepFail;
+    servoFD = serial.fd[DeviceServo];
+    return StepOk;
+  });
+  g.timeout(servo, 2000);
+  int arduino = g.add(stepName("arduino"), -1, 0, [this]() {
+    if ( openBoothDevice(serial, DeviceArduino, who()) != 0 ) return StepFail;
+    arduinoFD = serial.fd[DeviceArduino];
+    return StepOk;
+  });
+  g.timeout(arduino, 6000);
+  int gates = g.add(stepName("gates"), -1, 0, [this]() { return setGates(); });
+  g.after(gates, servo);
+  g.timeout(gates, opt.cycle.gateTimeoutMs + 1000);
+  if ( hasDispenser() ) {
+    int dispenser = g.add(stepName("dispenser"), -1, 0, [this]() {
+      if ( openBoothDevice(serial, DeviceDispenser, who()) != 0 ) return StepFail;
+      dispenserFD = serial.fd[DeviceDispenser];
+      return StepOk;
+    });
+    g.after(dispenser, gates);
+    g.timeout(dispenser, 5000);
+  }
+
+  // The cameras open side by side as soon as they've been found.
+  int upperCam = g.add(stepName("upper cam"), -1, 0, [this, list]() {
+    return openCamera(true, *list);
+  });
+  int lowerCam = g.add(stepName("lower cam"), -1, 0, [this, list]() {
+    return openCamera(false, *list);
+  });
+  for ( int cam : { upperCam, lowerCam } ) {
+    if ( devicesFound >= 0 ) g.after(cam, devicesFound);
+    g.timeout(cam, 15000);
+  }
+
+  int session = g.add(stepName("session"), -1, 0, [this]() { return resumeStep(); });
+
+  int grabbers = g.add(stepName("grabbers"), -1, 0, [this]() { return setupGrabbers(); });
+  g.after(grabbers, upperCam);
+  g.after(grabbers, lowerCam);
+  g.after(grabbers, session);
+  g.timeout(grabbers, 5000);
+
+  // The background needs the lights on and the vanes, so the Arduino.
+  if ( opt.cropToFly ) {
+    int background = g.add(stepName("background"), -1, 0, [this]() {
+      return takeBackground();
+    });
+    g.after(background, upperCam);
+    g.after(background, lowerCam);
+    g.after(background, arduino);
+    g.after(background, session);
+    g.timeout(background, 30000);
+    g.after(grabbers, background);
+  }
+}
+
+StepResult Station::setGates()
+{
+  const unsigned short gates[] = { INLET_GATE_OPEN, OUTLET_GATE_CLOSED };
+  if ( maestroSetLimits(servoFD, GATE_CHANNELS, GATE_SPEED, GATE_ACCEL) != 0 ||
+       maestroSetTargets(servoFD, 0, gates, 2) != 0 ||
+       maestroWaitUntilSettled(servoFD, GATE_CHANNELS, opt.cycle.gateTimeoutMs) != 0 ) {
+    printf("%serror setting gates\n", who());
+    return StepFail;
+  }
+  return StepOk;
+}
+
+StepResult Station::openCamera(bool isUpper, const DeviceInfoList_t &devices)
+{
+  unique_ptr<FramePool> &pool = isUpper ? upperPool : lowerPool;
+  unique_ptr<CameraSource> &source = isUpper ? upperSource : lowerSource;
+
+  // Synthetic cameras run the whole post-grab pipeline without cameras;
+  // each station gets its own flies.
+  if ( opt.synthetic ) {
+    unsigned seed = 1;
+    for ( size_t i = 0; i < cfg.name.size(); i++ ) seed = seed * 31 + cfg.name[i];
+    SyntheticSource *s = new SyntheticSource(3840, 2748, 10.0, 3,
+                                             isUpper ? seed : seed + 1);
+    if ( opt.poolMB > 0 ) {
+      pool.reset(new FramePool(3840 * 2748, (size_t)opt.poolMB << 20));
+      if ( !pool->ok() ) return StepFail;
+      s->setPool(pool.get());
+    }
+    source.reset(s);
+    (isUpper ? syntheticUpper : syntheticLower) = s;
+    return StepOk;
+  }
+
+  int u = findCamera(devices, cfg.cameraPrefix + "upper");
+  int l = findCamera(devices, cfg.cameraPrefix + "lower");
+  if ( l < 0 && cfg.cameraPrefix.empty() && u >= 0 && devices.size() == 2 ) {
+    l = 1 - u;
+  }
+  int index = isUpper ? u : l;
+  if ( index < 0 ) {
+    printf("%sFound %d cameras, but not %s%s.\n", who(), (int)devices.size(),
+      cfg.cameraPrefix.c_str(), isUpper ? "upper" : "lower");
+    return StepFail;
+  }
+  CInstantCamera &camera = isUpper ? upper : lower;
+  try {
+    CTlFactory& tlFactory = CTlFactory::GetInstance();
+    printf("%s%s camera: %s\n", who(), isUpper ? "Upper" : "Lower",
+      devices[index].GetFriendlyName().c_str());
+    camera.Attach(tlFactory.CreateDevice(devices[index]));
+    camera.Open();
+  } catch (const GenericException &e) {
+    printf("%sAn exception occurred.\n%s\n", who(), e.GetDescription());
+    return StepFail;
+  }
+  // Before the pool is sized: the settings decide the frame size.
+  if ( opt.cameraSettings != NULL ) {
+    SettingsReport report;
+    int r = applyCameraSettings(camera, *opt.cameraSettings, opt.settingsCache,
+                                opt.fullConfig, report);
+    printSettingsReport(who(), isUpper ? "Upper" : "Lower", *opt.cameraSettings,
+                        report);
+    if ( r != 0 ) return StepFail;
+  }
+  if ( opt.poolMB > 0 ) {
+    long long bytes = pylonPayloadSize(camera);
+    if ( bytes <= 0 ) return StepFail;
+    pool.reset(new FramePool(bytes, (size_t)opt.poolMB << 20));
+    if ( !pool->ok() ) return StepFail;
+  }
+  source.reset(new PylonSource(camera, pool.get()));
+  return StepOk;
+}
+
+StepResult Station::resumeStep()
+{
+  if ( !cfg.name.empty() ) mkdir("images", 0755);
+  mkdir(dir.c_str(), 0755);
+  if ( resumeSession(dir, opt.framesPerCamera, manifest, opt.archivePath,
+                     cfg.name.empty() ? "" : cfg.name + "-") != 0 ) {
+    return StepFail;
+  }
+  if ( opt.selection.enabled() && scoreLog.open(dir + "/scores.csv") != 0 ) {
+    return StepFail;
+  }
+  printf("%sStarting at image %d, fly %d.\n", who(), manifest.nextFrame,
+    manifest.flies + 1);
+  return StepOk;
+}
+
+// -roi: store only the crop around the fly. The background is the empty
+// chamber, taken once with the vanes as each camera sees them and kept in
+// the image directory for later sessions; -background takes it again.
+StepResult Station::takeBackground()
+{
+  string upperBackground = dir + "/background_Upper.png";
+  string lowerBackground = dir + "/background_Lower.png";
+  upperDetector.setOptions(opt.detectOptions);
+  lowerDetector.setOptions(opt.detectOptions);
+  bool upperNew = opt.newBackground || upperDetector.load(upperBackground) != 0;
+  bool lowerNew = opt.newBackground || lowerDetector.load(lowerBackground) != 0;
+  if ( upperNew || lowerNew ) {
+    printf("%sTaking the background; the chamber must be empty.\n", who());
+    if ( syntheticUpper != NULL ) {
+      syntheticUpper->setEmpty(true);
+      syntheticLower->setEmpty(true);
+    }
+    int r = 0;
+    if ( upperNew ) {
+      r = captureBackground(*upperSource, upperDetector, 5);
+      if ( r == 0 ) r = upperDetector.save(upperBackground);
+    }
+    if ( r == 0 && lowerNew ) {
+      r = stepVanes(arduinoFD);
+      if ( r == 0 ) r = captureBackground(*lowerSource, lowerDetector, 5);
+      if ( r == 0 ) r = lowerDetector.save(lowerBackground);
+      if ( r == 0 ) r = stepVanes(arduinoFD);
+    }
+    if ( syntheticUpper != NULL ) {
+      syntheticUpper->setEmpty(false);
+      syntheticLower->setEmpty(false);
+    }
+    if ( r != 0 ) {
+      printf("%serror taking the background\n", who());
+      return StepFail;
+    }
+  }
+  pipeline.setDetector(upperName, &upperDetector);
+  pipeline.setDetector(lowerName, &lowerDetector);
+  return StepOk;
+}
+
+StepResult Station::setupGrabbers()
+{
+  // Each camera is drained on its own thread as soon as it starts.
+  upperGrab.reset(new CameraGrabber(*upperSource, upperName.c_str(), pipeline,
+                                    dir.c_str()));
+  lowerGrab.reset(new CameraGrabber(*lowerSource, lowerName.c_str(), pipeline,
+                                    dir.c_str()));
+  if ( opt.ring != NULL ) {
+    upperGrab->setRing(opt.ring, opt.ring->addCamera(upperName.c_str()));
+    lowerGrab->setRing(opt.ring, opt.ring->addCamera(lowerName.c_str()));
+  }
+  if ( opt.selection.enabled() ) {
+    upperGrab->setSelection(opt.selection, &scoreLog);
+    lowerGrab->setSelection(opt.selection, &scoreLog);
+  }
+  // Set even when free running, so a camera left triggered by an
+  // earlier session runs free again.
+  BurstPlan upperBurst, lowerBurst;
+  upperBurst.mode = opt.triggerMode == TriggerFree ? TriggerFree : TriggerSoftware;
+  upperBurst.intervalUs = opt.intervalUs;
+  lowerBurst.mode = opt.triggerMode;
+  lowerBurst.intervalUs = opt.intervalUs;
+  if ( upperGrab->setBurst(upperBurst) != 0 || lowerGrab->setBurst(lowerBurst) != 0 ) {
+    printf("%serror setting up the camera triggers\n", who());
+    return StepFail;
+  }
+  return StepOk;
+}
+
+StepResult Station::captureFly(int cycleFly)
+{
+  CameraGrabber &up = *upperGrab, &down = *lowerGrab;
+  int n = opt.framesPerCamera;
+  int fly = manifest.flies + cycleFly;
+  int firstIndex = manifest.nextFrame + (cycleFly - 1) * n;
+  unsigned long long c0 = monotonicUs();
+
+  up.start(n, firstIndex, fly);
+  if ( opt.triggerMode == TriggerFree ) {
+    traceSleep(1000000, "upper grab");
+  } else {
+    // The vanes can move as soon as the last exposure is over.
+    TraceSpan span("upper burst");
+    up.waitExposed();
+  }
+
+  // Now spin the vanes. Line-triggered, the Arduino fires the lower
+  // camera itself once they've settled.
+  if ( opt.triggerMode == TriggerLine ) {
+    down.start(n, firstIndex, fly);
+    if ( stepVanesAndTrigger(arduinoFD, n, opt.intervalUs, opt.settleUs) != 0 ) {
+      printf("%serror stepping vanes\n", who());
+      up.join();
+      down.join();
+      return StepFail;
+    }
+    down.pulsesSent(monotonicUs(), opt.intervalUs);
+  } else {
+    if ( stepVanes(arduinoFD) != 0 ) {
+      printf("%serror stepping vanes\n", who());
+      up.join();
+      return StepFail;
+    }
+
+    traceSleep(opt.settleUs, "vanes settle");
+
+    down.start(n, firstIndex, fly);
+  }
+
+  if ( up.join() != 0 || down.join() != 0 ) {
+    printf("%serror grabbing images\n", who());
+    return StepFail;
+  }
+  capture.add(monotonicUs() - c0);
+  printCaptureTiming(up, down);
+  for ( const CameraGrabber *g : { &up, &down } ) {
+    for ( size_t i = 0; i < g->stamps().size(); i++ ) {
+      grabbed++;
+      if ( g->stamps()[i].kept ) kept++;
+    }
+  }
+
+  // Record the fly once its frames are written; the cycle doesn't wait.
+  SessionManifest done;
+  done.nextFrame = firstIndex + n;
+  done.flies = fly;
+  string d = dir;
+  pipeline.whenWritten([d, done]() { writeManifest(d, done); });
+  return StepOk;
+}
+
+StepResult Station::moveGate(int channel, unsigned short target)
+{
+  if ( maestroSetTarget(servoFD, channel, target) != 0 ||
+       maestroWaitUntilSettled(servoFD, 1 << channel, opt.cycle.gateTimeoutMs) != 0 ) {
+    printf("%serror moving gate %d\n", who(), channel);
+    return StepFail;
+  }
+  traceSleep(opt.cycle.gateMarginUs, "gate margin");
+  return StepOk;
+}
+
+StepResult Station::loadFly(bool byHand, string &detail)
+{
+  if ( !byHand ) {
+    if ( dispenserFD == -1 ) {
+      detail = "no dispenser";
+      return StepFail;
+    }
+    printf("%sDispensing a fly.\n", who());
+    int r = dispenseOne(dispenserFD, opt.cycle.dispenseTimeoutMs);
+    if ( r < 0 ) {
+      detail = "dispenser error";
+      return StepFail;
+    }
+    if ( r > 0 ) {
+      detail = "no fly came";
+      return StepSkip;
+    }
+    traceSleep(opt.cycle.fallUs, "fly fall");
+  }
+  if ( moveGate(0, INLET_GATE_CLOSED) != StepOk ) {
+    detail = "error closing the inlet";
+    return StepFail;
+  }
+  detail = byHand ? "by hand" : "dispensed";
+  return StepOk;
+}
+
+StepResult Station::captureNext(string &detail)
+{
+  int before = grabbed, keptBefore = kept;
+  int fly = manifest.flies + flies + 1;
+  int firstIndex = manifest.nextFrame + flies * opt.framesPerCamera;
+  if ( captureFly(flies + 1) != StepOk ) {
+    detail = "error capturing";
+    return StepFail;
+  }
+  flies++;
+  if ( stepVanes(arduinoFD) != 0 ) {
+    printf("%serror stepping vanes\n", who());
+    detail = "error stepping the vanes back";
+    return StepFail;
+  }
+  char buf[128];
+  snprintf(buf, sizeof(buf), "fly=%d first=%d frames=%d kept=%d", fly,
+    firstIndex, grabbed - before, kept - keptBefore);
+  detail = buf;
+  return StepOk;
+}
+
+StepResult Station::pumpOut(string &detail)
+{
+  if ( moveGate(1, OUTLET_GATE_OPEN) != StepOk ) {
+    detail = "error opening the outlet";
+    return StepFail;
+  }
+  if ( pumpOn(arduinoFD) != 0 ) {
+    printf("%serror turning on pump\n", who());
+    detail = "error turning on the pump";
+    return StepFail;
+  }
+  traceSleep(opt.cycle.pumpUs, "pump");
+  if ( pumpOff(arduinoFD) != 0 ) {
+    printf("%serror turning off pump\n", who());
+    detail = "error turning off the pump";
+    return StepFail;
+  }
+  if ( setGates() != StepOk ) {
+    detail = "error resetting the gates";
+    return StepFail;
+  }
+  detail = "";
+  return StepOk;
+}
+
+void Station::run()
+{
+  traceThreadName(("cycle " + (cfg.name.empty() ? string("booth") : cfg.name)).c_str());
+  BoothPorts ports = { servoFD, dispenserFD, arduinoFD };
+  cycle.reset(new FlyCycle(ports, opt.cycle,
+    [this](int cycleFly) { return captureFly(cycleFly); }));
+  flies = cycle->run();
+  runUs = cycle->elapsedUs();
+}
+
+void Station::start()
+{
+  worker = thread(&Station::run, this);
+}
+
+int Station::join()
+{
+  if ( worker.joinable() ) worker.join();
+  return flies;
+}
+
+void Station::printReport()
+{
+  if ( !cfg.name.empty() ) printf("\n== Station %s ==\n", cfg.name.c_str());
+  if ( cycle ) cycle->printReport();
+  if ( flies < 0 ) {
+    printf("%sStopped after a hardware error.\n", who());
+  } else {
+    printf("%s%d flies imaged, %d of %d frames kept", who(), flies, kept, grabbed);
+    if ( runUs > 0 ) {
+      printf(", %.2f frames/s", kept / (runUs / 1e6));
+    }
+    printf(".\n");
+  }
+  if ( capture.count ) capture.print("capture");
+  if ( upperPool ) upperPool->printStats(upperName.c_str());
+  if ( lowerPool ) lowerPool->printStats(lowerName.c_str());
+}
+
+void Station::close()
+{
+  if ( arduinoFD != -1 ) stepperOff(arduinoFD);
+  if ( servoFD != -1 ) {
+    const unsigned short gates[] = { INLET_GATE_OPEN, OUTLET_GATE_CLOSED };
+    maestroSetTargets(servoFD, 0, gates, 2);
+  }
+  if ( upper.IsOpen() ) upper.Close();
+  if ( lower.IsOpen() ) lower.Close();
+  if ( servoFD != -1 ) closeSerialPort(servoFD);
+  if ( dispenserFD != -1 ) closeSerialPort(dispenserFD);
+  if ( arduinoFD != -1 ) closeSerialPort(arduinoFD);
+  servoFD = dispenserFD = arduinoFD = -1;
+}
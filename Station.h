@@ -0,0 +1,174 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __STATION_H__
+#define __STATION_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <pylon/PylonIncludes.h>
+
+#include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "GrabEngine.h"
+#include "SyntheticSource.h"
+#include "FramePool.h"
+#include "FlyCycle.h"
+#include "SessionManifest.h"
+#include "FlyDetector.h"
+#include "Sharpness.h"
+#include "SerialDiscovery.h"
+#include "CameraSettings.h"
+
+// Where one booth's devices are.
+//
+// The cameras are the two whose friendly names start with
+// cameraPrefix + "upper" and cameraPrefix + "lower" (the DeviceUserID set
+// in Pylon Viewer). A lone booth has no prefix, and if its lower camera
+// isn't named it is whichever of exactly two cameras isn't the upper one.
+//
+// The serial devices are specs for openBoothDevices (SerialDiscovery.h):
+// "" for the usual hardware, a path, usb:VVVV:PPPP, or a USB serial
+// number, which stays with the device whichever port it's plugged into.
+// A booth loaded by hand has dispenser "none"; only the daemon
+// (BoothDaemon.h) can run one.
+struct StationConfig {
+  std::string name;          // "" for a lone booth
+  std::string cameraPrefix;
+  std::string servo, dispenser, arduino;
+};
+
+// Stations file: one line per booth, '#' starts a comment.
+//   name  camera-prefix  servo  dispenser  arduino
+// A prefix of - means none, a serial device of auto the usual hardware
+// (only right for one booth), a dispenser of none a booth loaded by hand.
+// Returns 0 or -1.
+int readStations(const std::string &path, std::vector<StationConfig> &out);
+
+// How every station captures; Photobooth's options.
+struct StationOptions {
+  bool synthetic;
+  int poolMB;
+  int framesPerCamera;
+  FrameSelection selection;
+  bool cropToFly, newBackground;
+  DetectOptions detectOptions;
+  TriggerMode triggerMode;
+  int intervalUs, settleUs;
+  CycleConfig cycle;
+  // Put on each camera as it opens (CameraSettings.h), unless NULL.
+  const CameraSettings *cameraSettings;
+  SettingsCache *settingsCache;
+  bool fullConfig;
+  // Every grabbed frame is published here too (FrameRing.h), unless NULL.
+  FrameRing *ring;
+  // The session archive frames go into, for the manifest; NULL if files.
+  const char *archivePath;
+
+  StationOptions();
+};
+
+// One booth: its serial devices, cameras, grabbers and fly cycle. The
+// capture pipeline (and with it the encoder threads and the session
+// archive) is shared, so several stations can run from one process,
+// each cycle on its own thread.
+//
+// A lone booth stores into images/ with cameras named Upper and Lower, as
+// Photobooth always has; a named one into images/<name>/ with cameras
+// <name>-Upper and <name>-Lower, so frames of different booths in a
+// shared archive stay apart. Each station keeps its own manifest.
+class Station {
+public:
+  Station(const StationConfig &cfg, const StationOptions &opt,
+          CapturePipeline &pipeline);
+  ~Station();
+
+  // Work out where the serial devices are, without opening them.
+  // Returns 0 or -1.
+  int resolve();
+  // Add the steps that set the booth up to startup, each with its own
+  // timeout: open and probe the serial devices, set the gates and then
+  // start the dispenser, open the cameras in devices once step
+  // devicesFound has filled it in (-1 for none, e.g. synthetic cameras),
+  // resume numbering, take the fly detector backgrounds if need be and
+  // set up the grabbers. Steps that don't depend on each other run at
+  // once.
+  void addStartup(TaskGraph &startup, int devicesFound,
+                  const Pylon::DeviceInfoList_t &devices);
+
+  // Single steps of the cycle, run on the caller's thread, for the
+  // daemon (BoothDaemon.h). Each returns StepOk, StepSkip if load got no
+  // fly, or StepFail after a hardware error, and says what happened in
+  // detail ("key=value ..." or a message).
+  //
+  // Shut a fly in the chamber: a dispensed one, or with byHand one put
+  // in through the open inlet.
+  StepResult loadFly(bool byHand, std::string &detail);
+  // Photograph the fly in the chamber and step the vanes back.
+  StepResult captureNext(std::string &detail);
+  // Open the outlet, pump the chamber out and reset the gates for the
+  // next fly.
+  StepResult pumpOut(std::string &detail);
+  bool hasDispenser() const { return cfg.dispenser != "none"; }
+
+  // Run the fly cycle on a thread of its own.
+  void start();
+  // Wait for it. Returns the number of flies imaged, or -1 after a
+  // hardware error.
+  int join();
+
+  // The cycle's report and this station's throughput.
+  void printReport();
+  // Put the hardware back and close it.
+  void close();
+
+  const std::string &name() const { return cfg.name; }
+  const std::string &directory() const { return dir; }
+  int imaged() const { return flies; }
+  int framesGrabbed() const { return grabbed; }
+  int framesKept() const { return kept; }
+  unsigned long long elapsedUs() const { return runUs; }
+  // Paths the serial devices resolved to (none for a dispenser of none).
+  std::vector<std::string> devicePaths() const;
+
+private:
+  StepResult setGates();
+  StepResult moveGate(int channel, unsigned short target);
+  StepResult openCamera(bool isUpper, const Pylon::DeviceInfoList_t &devices);
+  StepResult resumeStep();
+  StepResult takeBackground();
+  StepResult setupGrabbers();
+  StepResult captureFly(int cycleFly);
+  void run();
+  const char *who() const { return tag.c_str(); }
+  std::string stepName(const char *step) const;
+
+  StationConfig cfg;
+  StationOptions opt;
+  CapturePipeline &pipeline;
+  std::string dir, tag, upperName, lowerName;
+  BoothDevices serial;
+  int servoFD, dispenserFD, arduinoFD;
+
+  // Declared first so they outlive the cameras and every frame.
+  std::unique_ptr<FramePool> upperPool, lowerPool;
+  Pylon::CInstantCamera upper, lower;
+  std::unique_ptr<CameraSource> upperSource, lowerSource;
+  SyntheticSource *syntheticUpper, *syntheticLower;
+  FlyDetector upperDetector, lowerDetector;
+  std::unique_ptr<CameraGrabber> upperGrab, lowerGrab;
+
+  SessionManifest manifest;
+  ScoreLog scoreLog;
+  std::unique_ptr<FlyCycle> cycle;
+  std::thread worker;
+  int flies;
+  unsigned long long runUs;
+  int grabbed, kept;
+  StageTimer capture;
+};
+
+#endif // __STATION_H__
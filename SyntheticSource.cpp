@@ -0,0 +1,298 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#include "PhotoFuncs.h"
+#include "SyntheticSource.h"
+
+using namespace std;
+
+// Color of the point (u, v) of the fly, in fly coordinates: pixels at
+// 3840 wide, u along the body towards the head. b, g, r come in as the
+// background and are replaced or blended.
+static void shadeFly(double u, double v, double &b, double &g, double &r)
+{
+  // Wings: translucent, swept back from the thorax.
+  for ( int side = -1; side <= 1; side += 2 ) {
+    double du = u + 170, dv = v - side * 100;
+    double rot = side * 0.35;
+    double wu = du * cos(rot) + dv * sin(rot), wv = -du * sin(rot) + dv * cos(rot);
+    if ( (wu * wu) / (230.0 * 230.0) + (wv * wv) / (75.0 * 75.0) <= 1.0 ) {
+      b = 0.65 * b + 0.35 * 110;
+      g = 0.65 * g + 0.35 * 115;
+      r = 0.65 * r + 0.35 * 120;
+    }
+  }
+
+  struct Part { double u, v, a, b, cb, cg, cr; };
+  static const Part parts[] = {
+    { -130,   0, 180, 100,  30,  45,  70 },   // abdomen
+    {   70,   0, 100,  85,  35,  55,  85 },   // thorax
+    {  195,   0,  50,  75,  40,  60,  95 },   // head
+    {  200, -55,  40,  40,  30,  35, 170 },   // eyes
+    {  200,  55,  40,  40,  30,  35, 170 },
+  };
+  for ( size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++ ) {
+    const Part &p = parts[i];
+    double du = (u - p.u) / p.a, dv = (v - p.v) / p.b;
+    double rr = du * du + dv * dv;
+    if ( rr > 1.0 ) continue;
+    double shade = 0.7 + 0.3 * (1.0 - rr);   // rounded, lit from above
+    if ( i == 0 && sin(u / 22.0) > 0.6 ) shade *= 0.6;  // abdominal bands
+    b = p.cb * shade; g = p.cg * shade; r = p.cr * shade;
+  }
+}
+
+void renderSyntheticFly(uint8_t *raw, int width, int height, double fx,
+                        double fy, double angle, unsigned seed)
+{
+  double s = width / 3840.0;
+  double cx = width / 2.0, cy = height / 2.0;
+  double r2max = cx * cx + cy * cy;
+  double ca = cos(angle), sa = sin(angle);
+  double reach = 420 * s;
+  unsigned rng = seed;
+
+  for ( int y = 0; y < height; y++ ) {
+    double dy2 = (y - cy) * (y - cy);
+    bool flyRow = fabs(y - fy) < reach;
+    uint8_t *row = raw + (size_t)y * width;
+    for ( int x = 0; x < width; x++ ) {
+      // The vane: pale paper under a light that falls off to the corners.
+      double vig = 1.0 - 0.35 * ((x - cx) * (x - cx) + dy2) / r2max;
+      double b = 205 * vig, g = 215 * vig, r = 220 * vig;
+
+      if ( flyRow && fabs(x - fx) < reach ) {
+        double dx = (x - fx) / s, dy = (y - fy) / s;
+        shadeFly(dx * ca + dy * sa, -dx * sa + dy * ca, b, g, r);
+      }
+
+      // BG/GR filter array.
+      double c = (y & 1) == 0 ? ((x & 1) == 0 ? b : g) : ((x & 1) == 0 ? g : r);
+      rng = rng * 1103515245 + 12345;
+      c += (int)((rng >> 16) % 9) - 4;           // sensor noise
+      if ( (x * 7 + y * 13) % 23 < 2 ) c -= 6;   // paper fibres
+      row[x] = c < 0 ? 0 : c > 255 ? 255 : (uint8_t)c;
+    }
+  }
+}
+
+SyntheticSource::SyntheticSource(int w, int h, double f, int poses,
+                                 unsigned seed) :
+  width(w), height(h), fps(f), empty(false), pool(NULL), remaining(0), delivered(0),
+  nextUs(0), firstUs(0), triggerMode(TriggerFree), exposureUs(8015),
+  readoutUs(0), readyUs(0), readoutEndUs(0)
+{
+  if ( fps > 0 && 1e6 / fps > exposureUs ) readoutUs = 1e6 / fps - exposureUs;
+  if ( poses < 1 ) poses = 1;
+  for ( int i = 0; i < poses; i++ ) {
+    double fx = width / 2.0 + (rand_r(&seed) % 1000 - 500) / 500.0 * width / 8;
+    double fy = height / 2.0 + (rand_r(&seed) % 1000 - 500) / 500.0 * height / 8;
+    double angle = (rand_r(&seed) % 1000) / 1000.0 * 2 * M_PI;
+    shared_ptr<vector<uint8_t> > img = make_shared<vector<uint8_t> >((size_t)width * height);
+    renderSyntheticFly(&(*img)[0], width, height, fx, fy, angle, seed + i);
+    frames.push_back(img);
+  }
+}
+
+unsigned long long SyntheticSource::clockZero()
+{
+  if ( firstUs == 0 ) firstUs = monotonicUs();
+  return firstUs;
+}
+
+int SyntheticSource::startGrabbing(int nFrames)
+{
+  unsigned long long now = monotonicUs();
+  clockZero();
+  {
+    lock_guard<mutex> l(triggerLock);
+    exposures.clear();
+  }
+  remaining = nFrames;
+  nextUs = fps > 0 ? now + (unsigned long long)(1e6 / fps) : now;
+  return 0;
+}
+
+bool SyntheticSource::isGrabbing()
+{
+  return remaining > 0;
+}
+
+int SyntheticSource::retrieve(int timeoutMs, Frame &frame)
+{
+  if ( remaining <= 0 ) return -1;
+
+  // Deliver each frame when the camera would have finished reading it out.
+  unsigned long long now = monotonicUs();
+  unsigned long long startUs = 0;
+  if ( triggerMode != TriggerFree ) {
+    if ( waitTrigger(timeoutMs, startUs) != 0 ) {
+      printf("Synthetic camera: no trigger within %d ms.\n", timeoutMs);
+      return -1;
+    }
+    unsigned long long doneUs = startUs + exposureUs;
+    if ( doneUs < readoutEndUs ) doneUs = readoutEndUs;
+    readoutEndUs = doneUs + readoutUs;
+    now = monotonicUs();
+    if ( readoutEndUs > now ) usleep(readoutEndUs - now);
+  } else if ( nextUs > now ) {
+    if ( nextUs - now > (unsigned long long)timeoutMs * 1000 ) {
+      usleep(timeoutMs * 1000);
+      printf("Synthetic camera: no frame within %d ms.\n", timeoutMs);
+      return -1;
+    }
+    usleep(nextUs - now);
+  }
+
+  const shared_ptr<vector<uint8_t> > &img =
+    empty ? emptyFrame : frames[delivered % frames.size()];
+  frame.width = width;
+  frame.height = height;
+  frame.stride = width;
+  frame.pixelFormat = "BayerBG8";
+  frame.cameraTicks = (nextUs - firstUs) * 1000;  // ns, like the ace
+  if ( triggerMode != TriggerFree ) {
+    frame.cameraTicks = (startUs - firstUs) * 1000;  // exposure start
+  }
+  if ( pool != NULL ) {
+    frame.release();
+    shared_ptr<uint8_t> buffer = pool->acquire(timeoutMs);
+    if ( buffer ) {
+      memcpy(buffer.get(), &(*img)[0], img->size());
+      frame.data = buffer.get();
+      frame.owner = buffer;
+    }
+  } else {
+    frame.data = &(*img)[0];
+    frame.owner = img;
+  }
+
+  if ( !empty ) delivered++;
+  remaining--;
+  if ( fps > 0 && triggerMode == TriggerFree ) nextUs += (unsigned long long)(1e6 / fps);
+  if ( frame.data == NULL ) {
+    printf("Synthetic camera: no free buffer, frame dropped.\n");
+    return 1;
+  }
+  return 0;
+}
+
+void SyntheticSource::stopGrabbing()
+{
+  remaining = 0;
+}
+
+int SyntheticSource::setTrigger(TriggerMode mode)
+{
+  lock_guard<mutex> l(triggerLock);
+  triggerMode = mode;
+  exposures.clear();
+  return 0;
+}
+
+// An exposure starting at us (which may be in the future, for pulses
+// already scheduled), unless the last one is still running.
+void SyntheticSource::trigger(unsigned long long us)
+{
+  lock_guard<mutex> l(triggerLock);
+  if ( us < readyUs ) {
+    printf("Synthetic camera: trigger %.1f ms into an exposure; lost.\n",
+      (us + exposureUs - readyUs) / 1000.0);
+    return;
+  }
+  exposures.push_back(us);
+  readyUs = us + exposureUs;
+  triggered.notify_all();
+}
+
+int SyntheticSource::waitTrigger(int timeoutMs, unsigned long long &startUs)
+{
+  unique_lock<mutex> l(triggerLock);
+  if ( !triggered.wait_for(l, chrono::milliseconds(timeoutMs),
+                           [this]() { return !exposures.empty(); }) ) {
+    return -1;
+  }
+  startUs = exposures.front();
+  exposures.pop_front();
+  return 0;
+}
+
+int SyntheticSource::fireTrigger(int timeoutMs, unsigned long long &hostUs)
+{
+  if ( triggerMode != TriggerSoftware ) {
+    printf("Synthetic camera: not in software trigger mode.\n");
+    return -1;
+  }
+  // As WaitForFrameTriggerReady: wait out the running exposure.
+  unsigned long long now = monotonicUs(), ready;
+  {
+    lock_guard<mutex> l(triggerLock);
+    ready = readyUs;
+  }
+  if ( ready > now ) {
+    if ( ready - now > (unsigned long long)timeoutMs * 1000 ) return -1;
+    usleep(ready - now);
+  }
+  hostUs = monotonicUs();
+  trigger(hostUs);
+  return 0;
+}
+
+void SyntheticSource::pulsesSent(int n, unsigned long long first, int intervalUs)
+{
+  if ( triggerMode != TriggerLine ) return;
+  for ( int i = 0; i < n; i++ ) {
+    trigger(first + (unsigned long long)i * intervalUs);
+  }
+}
+
+int SyntheticSource::latchClock(unsigned long long &ticks, unsigned long long &hz)
+{
+  ticks = (monotonicUs() - clockZero()) * 1000;
+  hz = 1000000000ULL;
+  return 0;
+}
+
+// The booth's usual settings (AceFlashSettings.pfs).
+int SyntheticSource::readSettings(RawMetadata &meta)
+{
+  meta.pixelFormat = "BayerBG8";
+  meta.balanceRed = 1.30371;
+  meta.balanceGreen = 1.0;
+  meta.balanceBlue = 1.63403;
+  meta.exposureUs = exposureUs;
+  meta.gain = 0;
+  return 0;
+}
+
+void SyntheticSource::setPool(FramePool *p)
+{
+  if ( p != NULL && p->bufferBytes() < (size_t)width * height ) {
+    printf("Synthetic camera: pool buffers are too small; not using them.\n");
+    return;
+  }
+  pool = p;
+}
+
+void SyntheticSource::setEmpty(bool e)
+{
+  if ( e && !emptyFrame ) {
+    // The fly well off the frame, so only the vane is drawn.
+    emptyFrame = make_shared<vector<uint8_t> >((size_t)width * height);
+    renderSyntheticFly(&(*emptyFrame)[0], width, height, -10.0 * width,
+                       -10.0 * height, 0, 0);
+  }
+  empty = e;
+}
+
+const uint8_t *SyntheticSource::mosaic(int n)
+{
+  return &(*frames[n % frames.size()])[0];
+}
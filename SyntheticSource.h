@@ -0,0 +1,90 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __SYNTHETICSOURCE_H__
+#define __SYNTHETICSOURCE_H__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "CameraSource.h"
+#include "FramePool.h"
+
+// A stand-in camera that produces BayerBG8 frames of a fly lying on the
+// lit vane, at a fixed frame rate. A handful of frames (the fly in
+// different poses) are rendered up front and handed out in turn, so
+// retrieving costs nothing and the output is the same on every run with
+// the same seed.
+//
+// Triggered, it behaves like the ace: a trigger starts an exposure
+// (exposureUs, as readSettings() reports) unless the previous one is
+// still running, in which case the trigger is lost; the frame arrives
+// after its exposure and a readout, and readouts take turns. The readout
+// is what is left of the frame interval at fps, so a trigger every
+// 1 / fps keeps up exactly.
+class SyntheticSource : public CameraSource {
+public:
+  // fps 0 delivers frames as fast as they are retrieved.
+  SyntheticSource(int width = 3840, int height = 2748, double fps = 10.0,
+                  int poses = 3, unsigned seed = 1);
+
+  virtual int startGrabbing(int nFrames);
+  virtual bool isGrabbing();
+  virtual int retrieve(int timeoutMs, Frame &frame);
+  virtual void stopGrabbing();
+  virtual int readSettings(RawMetadata &meta);
+  virtual int setTrigger(TriggerMode mode);
+  virtual int fireTrigger(int timeoutMs, unsigned long long &hostUs);
+  virtual void pulsesSent(int n, unsigned long long firstUs, int intervalUs);
+  virtual int latchClock(unsigned long long &ticks, unsigned long long &hz);
+
+  // The mosaic carried by the n-th frame with a fly, for checking
+  // what was written.
+  const uint8_t *mosaic(int n);
+
+  // Deliver each frame in a buffer from pool (at least width * height
+  // bytes), copied in as a camera's DMA would, instead of handing out the
+  // rendered frames themselves. A frame with no free buffer is dropped.
+  void setPool(FramePool *pool);
+
+  // While set, deliver the chamber with no fly in it, e.g. to take a
+  // FlyDetector background.
+  void setEmpty(bool empty);
+
+private:
+  void trigger(unsigned long long us);
+  int waitTrigger(int timeoutMs, unsigned long long &startUs);
+  unsigned long long clockZero();
+
+  int width, height;
+  double fps;
+  std::vector<std::shared_ptr<std::vector<uint8_t> > > frames;
+  std::shared_ptr<std::vector<uint8_t> > emptyFrame;
+  bool empty;
+  FramePool *pool;
+
+  int remaining;
+  int delivered;
+  unsigned long long nextUs, firstUs;
+
+  TriggerMode triggerMode;
+  int exposureUs, readoutUs;
+  std::mutex triggerLock;
+  std::condition_variable triggered;
+  std::deque<unsigned long long> exposures;   // start of each, not yet read out
+  unsigned long long readyUs;     // when the running exposure ends
+  unsigned long long readoutEndUs;
+};
+
+// Render one BayerBG8 mosaic: the vane background with vignetting and
+// paper texture, and a fly (abdomen, thorax, head, eyes, translucent
+// wings) centred at (fx, fy) pointing along angle (radians).
+void renderSyntheticFly(uint8_t *raw, int width, int height, double fx,
+                        double fy, double angle, unsigned seed);
+
+#endif // __SYNTHETICSOURCE_H__
@@ -0,0 +1,258 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "PhotoFuncs.h"
+#include "Trace.h"
+
+using namespace std;
+
+// Events kept per thread; older ones are overwritten.
+#define TRACE_RING_SIZE 16384
+
+struct TraceEvent {
+  const char *name;
+  unsigned long long startUs, endUs;
+  int arg;
+  char detail[16];
+};
+
+// One per thread that has recorded something. Buffers live until exit so
+// they can be dumped after their thread has finished; a buffer whose
+// thread has exited is handed to the next new thread, so the many
+// short-lived step threads don't each cost a ring.
+struct ThreadTrace {
+  int tid;
+  string name;
+  bool retired;
+  vector<TraceEvent> ring;
+  size_t next;       // slot for the next event once the ring is full
+  mutex lock;        // only contended while dumping
+};
+
+static atomic<bool> tracing(false);
+static mutex registryLock;
+static vector<ThreadTrace *> registry;
+
+// Marks the thread's buffer free for reuse when the thread exits.
+struct ThreadTraceHolder {
+  ThreadTrace *trace;
+  ThreadTraceHolder() : trace(NULL) { }
+  ~ThreadTraceHolder() {
+    if ( trace != NULL ) {
+      lock_guard<mutex> l(registryLock);
+      trace->retired = true;
+    }
+  }
+};
+
+static thread_local ThreadTraceHolder current;
+
+static ThreadTrace *threadTrace()
+{
+  if ( current.trace != NULL ) return current.trace;
+
+  lock_guard<mutex> l(registryLock);
+  for ( size_t i = 0; i < registry.size(); i++ ) {
+    if ( registry[i]->retired ) {
+      ThreadTrace *t = registry[i];
+      lock_guard<mutex> tl(t->lock);
+      char name[32];
+      snprintf(name, sizeof(name), "thread %d", t->tid);
+      t->name = name;
+      t->retired = false;
+      current.trace = t;
+      return current.trace;
+    }
+  }
+  ThreadTrace *t = new ThreadTrace;
+  t->tid = registry.size() + 1;
+  t->retired = false;
+  t->next = 0;
+  char name[32];
+  snprintf(name, sizeof(name), "thread %d", t->tid);
+  t->name = name;
+  registry.push_back(t);
+  current.trace = t;
+  return t;
+}
+
+void traceEnable(bool on)
+{
+  tracing = on;
+}
+
+bool traceEnabled()
+{
+  return tracing.load(memory_order_relaxed);
+}
+
+void traceThreadName(const char *name)
+{
+  ThreadTrace *t = threadTrace();
+  lock_guard<mutex> l(t->lock);
+  t->name = name;
+}
+
+void traceRecord(const char *name, unsigned long long startUs,
+                 unsigned long long endUs, int arg, const char *detail)
+{
+  if ( !traceEnabled() ) return;
+
+  TraceEvent e;
+  e.name = name;
+  e.startUs = startUs;
+  e.endUs = endUs;
+  e.arg = arg;
+  e.detail[0] = 0;
+  if ( detail != NULL ) {
+    strncpy(e.detail, detail, sizeof(e.detail) - 1);
+    e.detail[sizeof(e.detail) - 1] = 0;
+  }
+
+  ThreadTrace *t = threadTrace();
+  lock_guard<mutex> l(t->lock);
+  if ( t->ring.size() < TRACE_RING_SIZE ) {
+    t->ring.push_back(e);
+  } else {
+    t->ring[t->next] = e;
+    t->next = (t->next + 1) % TRACE_RING_SIZE;
+  }
+}
+
+TraceSpan::TraceSpan(const char *n, int a, const char *d) :
+  name(n), arg(a), startUs(0)
+{
+  if ( !traceEnabled() ) return;
+  detail[0] = 0;
+  if ( d != NULL ) {
+    strncpy(detail, d, sizeof(detail) - 1);
+    detail[sizeof(detail) - 1] = 0;
+  }
+  startUs = monotonicUs();
+}
+
+TraceSpan::~TraceSpan()
+{
+  if ( startUs != 0 ) traceRecord(name, startUs, monotonicUs(), arg, detail);
+}
+
+void traceSleep(unsigned int us, const char *why)
+{
+  TraceSpan span("sleep", -1, why);
+  usleep(us);
+}
+
+// "name" or "name detail", as shown in the trace and the summary.
+static string eventLabel(const TraceEvent &e)
+{
+  string label = e.name;
+  if ( e.detail[0] != 0 ) label += string(" ") + e.detail;
+  return label;
+}
+
+// Copy out every thread's events, holding each thread's lock briefly.
+static void snapshot(vector<pair<ThreadTrace *, vector<TraceEvent> > > &out)
+{
+  lock_guard<mutex> l(registryLock);
+  for ( size_t i = 0; i < registry.size(); i++ ) {
+    ThreadTrace *t = registry[i];
+    lock_guard<mutex> tl(t->lock);
+    out.push_back(make_pair(t, t->ring));
+  }
+}
+
+static void writeJsonString(FILE *fp, const string &s)
+{
+  fputc('"', fp);
+  for ( size_t i = 0; i < s.size(); i++ ) {
+    if ( s[i] == '"' || s[i] == '\\' ) fputc('\\', fp);
+    if ( (unsigned char)s[i] >= 0x20 ) fputc(s[i], fp);
+  }
+  fputc('"', fp);
+}
+
+int traceWriteChrome(const char *path)
+{
+  vector<pair<ThreadTrace *, vector<TraceEvent> > > threads;
+  snapshot(threads);
+
+  FILE *fp = fopen(path, "w");
+  if ( fp == NULL ) {
+    perror(path);
+    return -1;
+  }
+
+  int pid = getpid();
+  int n = 0;
+  fprintf(fp, "{\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+    "\"args\":{\"name\":\"Photobooth\"}}", pid);
+  for ( size_t i = 0; i < threads.size(); i++ ) {
+    ThreadTrace *t = threads[i].first;
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+      "\"tid\":%d,\"args\":{\"name\":", pid, t->tid);
+    writeJsonString(fp, t->name);
+    fprintf(fp, "}}");
+
+    const vector<TraceEvent> &events = threads[i].second;
+    for ( size_t j = 0; j < events.size(); j++ ) {
+      const TraceEvent &e = events[j];
+      fprintf(fp, ",\n{\"name\":");
+      writeJsonString(fp, eventLabel(e));
+      fprintf(fp, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,"
+        "\"dur\":%llu", pid, t->tid, e.startUs, e.endUs - e.startUs);
+      if ( e.arg >= 0 ) fprintf(fp, ",\"args\":{\"n\":%d}", e.arg);
+      fprintf(fp, "}");
+      n++;
+    }
+  }
+  fprintf(fp, "\n]}\n");
+
+  if ( fclose(fp) != 0 ) {
+    perror(path);
+    return -1;
+  }
+  printf("Wrote %d trace events to %s.\n", n, path);
+  return 0;
+}
+
+void tracePrintSummary()
+{
+  vector<pair<ThreadTrace *, vector<TraceEvent> > > threads;
+  snapshot(threads);
+
+  map<string, vector<unsigned long long> > byLabel;
+  for ( size_t i = 0; i < threads.size(); i++ ) {
+    const vector<TraceEvent> &events = threads[i].second;
+    for ( size_t j = 0; j < events.size(); j++ ) {
+      byLabel[eventLabel(events[j])].push_back(events[j].endUs - events[j].startUs);
+    }
+  }
+
+  printf("Trace summary (ms):\n");
+  printf("  %-24s %6s %9s %9s %9s %10s\n", "stage", "n", "p50", "p95", "max",
+    "total");
+  map<string, vector<unsigned long long> >::iterator i;
+  for ( i = byLabel.begin(); i != byLabel.end(); ++i ) {
+    vector<unsigned long long> &d = i->second;
+    sort(d.begin(), d.end());
+    unsigned long long total = 0;
+    for ( size_t j = 0; j < d.size(); j++ ) total += d[j];
+    // Nearest rank.
+    size_t p50 = (d.size() * 50 + 99) / 100, p95 = (d.size() * 95 + 99) / 100;
+    printf("  %-24s %6lu %9.1f %9.1f %9.1f %10.1f\n", i->first.c_str(),
+      (unsigned long)d.size(), d[p50 - 1] / 1000.0, d[p95 - 1] / 1000.0,
+      d.back() / 1000.0, total / 1000.0);
+  }
+}
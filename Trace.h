@@ -0,0 +1,56 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Lightweight timing trace of where a session's time goes.
+//
+// Code marks stages with a TraceSpan on the stack; when it goes out of
+// scope the begin and end times (monotonic us) are appended to a ring
+// buffer owned by the calling thread, so threads never contend with each
+// other. While tracing is off a span costs one flag test.
+//
+// At the end of a session the spans can be written as a Chrome trace
+// (load it in chrome://tracing or ui.perfetto.dev) and summarised as
+// p50 / p95 / max per stage.
+//
+// name must be a string literal (only the pointer is kept); detail, if
+// given, is copied (up to 15 chars) and distinguishes e.g. which serial
+// command or which camera.
+
+void traceEnable(bool on);
+bool traceEnabled();
+
+// Label the calling thread in the trace ("grab Upper", "writer 2", ...).
+void traceThreadName(const char *name);
+
+// Record a span whose times were measured elsewhere (e.g. queue wait).
+void traceRecord(const char *name, unsigned long long startUs,
+                 unsigned long long endUs, int arg = -1,
+                 const char *detail = 0);
+
+class TraceSpan {
+public:
+  TraceSpan(const char *name, int arg = -1, const char *detail = 0);
+  ~TraceSpan();
+
+private:
+  const char *name;
+  char detail[16];
+  int arg;
+  unsigned long long startUs;
+};
+
+// usleep, recorded as a "sleep" span so fixed delays show up in the trace.
+void traceSleep(unsigned int us, const char *why);
+
+// Write everything recorded so far as Chrome trace-event JSON. Returns 0,
+// or -1 if the file couldn't be written.
+int traceWriteChrome(const char *path);
+
+// Per stage: count, p50, p95, max and total.
+void tracePrintSummary();
+
+#endif // __TRACE_H__
@@ -0,0 +1,192 @@
+/* Copyright (c) 2016/2017, FlySorter LLC *
+ *                                        *
+ *                                        */
+
+// The triggered capture without cameras: two synthetic sources in
+// trigger mode, the grab engine's bursts, and the Arduino's step-and-
+// trigger command against its simulator (DeviceSim.h).
+//
+//   TriggerBench [-flies n] [-frames n] [-interval ms] [-settle ms]
+//                [-fps f] [-dir path] [simulator options]
+//
+// Each fly is captured as Photobooth does it, once free running (fixed
+// sleeps around the vane step), once with both cameras software-triggered
+// and once with the lower camera on the Arduino's trigger line. For each
+// it reports the capture time per fly and the trigger latencies, and
+// checks that every frame came and that the frames of a burst are the
+// interval apart on the camera's clock. The line run also shows how far
+// the host's idea of the first pulse (when the reply arrived) is from
+// when the simulated Arduino sent it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "PhotoFuncs.h"
+#include "CapturePipeline.h"
+#include "GrabEngine.h"
+#include "SyntheticSource.h"
+#include "DeviceSim.h"
+#include "Trace.h"
+
+using namespace std;
+
+static const int W = 1280, H = 916;
+
+struct BenchConfig {
+  int flies, frames, intervalUs, settleUs;
+  double fps;
+  string dir;
+};
+
+// Frames of one burst should be intervalUs apart on the camera clock.
+static int checkBurst(const CameraGrabber &g, int frames, int intervalUs)
+{
+  const vector<FrameStamp> &st = g.stamps();
+  if ( (int)st.size() != frames ) {
+    printf("  %s: %d of %d frames.\n", g.name(), (int)st.size(), frames);
+    return 1;
+  }
+  for ( size_t i = 1; i < st.size(); i++ ) {
+    double us = (st[i].cameraTicks - st[i-1].cameraTicks) / 1000.0;
+    if ( us < intervalUs - 1000 || us > intervalUs + 1000 ) {
+      printf("  %s: frames %d and %d are %.1f ms apart.\n", g.name(),
+        st[i-1].index, st[i].index, us / 1000.0);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int runMode(TriggerMode mode, const BenchConfig &cfg,
+                   const SimSetup &setup)
+{
+  ArduinoSim arduinoSim(setup.faults, setup.stepUs);
+  if ( arduinoSim.start() != 0 ) return -1;
+  int arduinoFD = openSerialPort(arduinoSim.path());
+  if ( arduinoFD == -1 ) return -1;
+
+  SyntheticSource upper(W, H, cfg.fps, 3, 1), lower(W, H, cfg.fps, 3, 2);
+  CapturePipeline pipeline;
+  pipeline.setMode(CaptureRaw);
+  CameraGrabber upperGrab(upper, "Upper", pipeline, cfg.dir.c_str());
+  CameraGrabber lowerGrab(lower, "Lower", pipeline, cfg.dir.c_str());
+  BurstPlan upperBurst, lowerBurst;
+  upperBurst.mode = mode == TriggerFree ? TriggerFree : TriggerSoftware;
+  upperBurst.intervalUs = cfg.intervalUs;
+  lowerBurst.mode = mode;
+  lowerBurst.intervalUs = cfg.intervalUs;
+  if ( upperGrab.setBurst(upperBurst) != 0 || lowerGrab.setBurst(lowerBurst) != 0 ) {
+    return -1;
+  }
+
+  printf("\n%s:\n", mode == TriggerFree ? "Free running" :
+    mode == TriggerSoftware ? "Software triggers" : "Lower camera on the trigger line");
+  StageTimer capture, pulseError;
+  int status = 0;
+  for ( int fly = 0; fly < cfg.flies; fly++ ) {
+    int first = fly * cfg.frames;
+    unsigned long long c0 = monotonicUs();
+    upperGrab.start(cfg.frames, first, fly + 1);
+    if ( mode == TriggerFree ) {
+      traceSleep(1000000, "upper grab");
+    } else {
+      upperGrab.waitExposed();
+    }
+    if ( mode == TriggerLine ) {
+      lowerGrab.start(cfg.frames, first, fly + 1);
+      if ( stepVanesAndTrigger(arduinoFD, cfg.frames, cfg.intervalUs,
+                               cfg.settleUs) != 0 ) {
+        printf("error stepping vanes\n");
+        status = -1;
+        break;
+      }
+      unsigned long long replyUs = monotonicUs();
+      lowerGrab.pulsesSent(replyUs, cfg.intervalUs);
+      pulseError.add(replyUs - arduinoSim.pulses().firstUs);
+    } else {
+      if ( stepVanes(arduinoFD) != 0 ) {
+        printf("error stepping vanes\n");
+        status = -1;
+        break;
+      }
+      traceSleep(cfg.settleUs, "vanes settle");
+      lowerGrab.start(cfg.frames, first, fly + 1);
+    }
+    if ( upperGrab.join() != 0 || lowerGrab.join() != 0 ) {
+      printf("error grabbing images\n");
+      status = -1;
+      break;
+    }
+    capture.add(monotonicUs() - c0);
+    if ( fly == 0 ) {
+      printCaptureTiming(upperGrab, lowerGrab);
+    }
+    if ( mode != TriggerFree &&
+         (checkBurst(upperGrab, cfg.frames, cfg.intervalUs) != 0 ||
+          checkBurst(lowerGrab, cfg.frames, cfg.intervalUs) != 0) ) {
+      status = 1;
+    }
+  }
+  pipeline.waitIdle();
+  capture.print("capture per fly");
+  if ( pulseError.count > 0 ) pulseError.print("reply after first pulse");
+  closeSerialPort(arduinoFD);
+  return status;
+}
+
+int main(int argc, char **argv)
+{
+  BenchConfig cfg;
+  cfg.flies = 2;
+  cfg.frames = 3;
+  cfg.intervalUs = 100000;
+  cfg.settleUs = 200000;
+  cfg.fps = 10.0;
+  cfg.dir = "/tmp/triggerbench";
+  SimSetup setup;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( simOption(argc, argv, i, setup) ) {
+      continue;
+    } else if ( strcmp(argv[i], "-flies") == 0 && i + 1 < argc ) {
+      cfg.flies = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-frames") == 0 && i + 1 < argc ) {
+      cfg.frames = atoi(argv[++i]);
+    } else if ( strcmp(argv[i], "-interval") == 0 && i + 1 < argc ) {
+      cfg.intervalUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-settle") == 0 && i + 1 < argc ) {
+      cfg.settleUs = atof(argv[++i]) * 1000;
+    } else if ( strcmp(argv[i], "-fps") == 0 && i + 1 < argc ) {
+      cfg.fps = atof(argv[++i]);
+    } else if ( strcmp(argv[i], "-dir") == 0 && i + 1 < argc ) {
+      cfg.dir = argv[++i];
+    } else {
+      printf("Usage: %s [-flies n] [-frames n] [-interval ms] [-settle ms] "
+             "[-fps f] [-dir path] [simulator options]\n%s", argv[0],
+             simOptionsUsage);
+      return 1;
+    }
+  }
+  if ( cfg.flies < 1 || cfg.frames < 1 ) {
+    printf("Need at least one fly and one frame.\n");
+    return 1;
+  }
+  mkdir(cfg.dir.c_str(), 0755);
+  printf("%d flies x %d frames per camera, %.1f ms apart, %.1f fps "
+    "readout, settle %.1f ms, vane step %.1f ms.\n", cfg.flies, cfg.frames,
+    cfg.intervalUs / 1000.0, cfg.fps, cfg.settleUs / 1000.0,
+    setup.stepUs / 1000.0);
+
+  int status = 0;
+  const TriggerMode modes[] = { TriggerFree, TriggerSoftware, TriggerLine };
+  for ( TriggerMode mode : modes ) {
+    int r = runMode(mode, cfg, setup);
+    if ( r < 0 ) return 1;
+    if ( r != 0 ) status = 1;
+  }
+  printSerialCmdStats();
+  return status;
+}
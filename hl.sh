@@ -1,18 +1,9 @@
 #!/bin/bash
 
-if [ -f images/Upper000.png ]; then
-    LASTNUM=`ls images/Upper*.png | tail -n1 | cut -d'/' -f 2 | cut -d'r' -f 2 | cut -d'.' -f 1`
-
-    NP=`echo $LASTNUM + 1 | bc`
-
-    echo "Last image was $LASTNUM, starting at $NP"
-
-  else
-
-    echo "Starting at 0."
-
-    NP=0
-
-fi
-
-./HandLoad $NP
+# HandLoad picks up numbering from images/session.manifest, which it
+# keeps up to date after each fly; it rebuilds the manifest itself if
+# there isn't one (or run ./RebuildManifest).
+#
+# Extra arguments (e.g. -raw) are passed through to HandLoad; a trailing
+# number still overrides the first image number.
+./HandLoad "$@"